@@ -0,0 +1,156 @@
+/* Generated by aot from factorial, do not edit */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "common.h"
+
+static const Instr_t program[16] = {
+    0x3, 0xc, 0x3, 0x1, 0x6, 0x6, 0x10, 0xc,
+    0x6, 0xe, 0x7, 0x5, 0xfffffff8, 0x6, 0x4, 0x2,
+};
+#define PROGRAM_SIZE 16u
+
+#pragma GCC diagnostic ignored "-Wunused-label"
+static void run(cpu_t *pcpu, long long steplimit) {
+    if (pcpu->pc != 0 || pcpu->sp != -1 || PROGRAM_SIZE == 0) {
+        switched_run(pcpu, steplimit);
+        return;
+    }
+    long long steps = pcpu->steps;
+    uint32_t s0 = 0;
+    uint32_t s1 = 0;
+    uint32_t s2 = 0;
+L_0:
+    if (steplimit - steps < 3) {
+        pcpu->pc = 0;
+        pcpu->sp = -1;
+        pcpu->steps = steps - 0;
+        switched_run(pcpu, steplimit);
+        return;
+    }
+    steps += 3;
+    /* 0: Push 12 */
+    {
+        s0 = 0xcu;
+    }
+    /* 0x2: Push 1 */
+    {
+        s1 = 0x1u;
+    }
+    /* 0x4: Swap */
+    {
+        uint32_t a = s1;
+        uint32_t b = s0;
+        s0 = a;
+        s1 = b;
+    }
+L_5:
+    if (steplimit - steps < 7) {
+        pcpu->pc = 0x5;
+        pcpu->stack[0] = s0;
+        pcpu->stack[1] = s1;
+        pcpu->sp = 1;
+        pcpu->steps = steps - 0;
+        switched_run(pcpu, steplimit);
+        return;
+    }
+    steps += 7;
+    /* 0x5: Swap */
+    {
+        uint32_t a = s1;
+        uint32_t b = s0;
+        s0 = a;
+        s1 = b;
+    }
+    /* 0x6: Over */
+    {
+        uint32_t a = s1;
+        uint32_t b = s0;
+        s0 = b;
+        s1 = a;
+        s2 = b;
+    }
+    /* 0x7: Mul */
+    {
+        uint32_t a = s2;
+        uint32_t b = s1;
+        s1 = a * b;
+    }
+    /* 0x8: Swap */
+    {
+        uint32_t a = s1;
+        uint32_t b = s0;
+        s0 = a;
+        s1 = b;
+    }
+    /* 0x9: Dec */
+    {
+        uint32_t a = s1;
+        s1 = a - 1;
+    }
+    /* 0xa: Dup */
+    {
+        uint32_t a = s1;
+        s1 = a;
+        s2 = a;
+    }
+    /* 0xb: JNE -8 */
+    {
+        uint32_t a = s2;
+        if (a != 0) {
+        goto L_5;
+        }
+    }
+L_13:
+    if (steplimit - steps < 3) {
+        pcpu->pc = 0xd;
+        pcpu->stack[0] = s0;
+        pcpu->stack[1] = s1;
+        pcpu->sp = 1;
+        pcpu->steps = steps - 0;
+        switched_run(pcpu, steplimit);
+        return;
+    }
+    steps += 3;
+    /* 0xd: Swap */
+    {
+        uint32_t a = s1;
+        uint32_t b = s0;
+        s0 = a;
+        s1 = b;
+    }
+    /* 0xe: Print */
+    {
+        uint32_t a = s1;
+        output_value(a);
+    }
+    /* 0xf: Halt */
+    {
+        pcpu->pc = 0xf;
+        pcpu->stack[0] = s0;
+        pcpu->sp = 0;
+        pcpu->steps = steps - 1;
+        switched_run(pcpu, pcpu->steps + 1);
+        return;
+    }
+}
+
+int main(int argc, char **argv) {
+    long long steplimit = parse_args(argc, argv, 0);
+    if (LoadedProgram) {
+        fprintf(stderr, "This executable only runs the program it was"
+                " compiled from.\n");
+        return 2;
+    }
+    cpu_t cpu = make_cpu(program, PROGRAM_SIZE);
+    perf_counters_start();
+    timing_mark(Timing_Execute);
+    run(&cpu, steplimit);
+    timing_mark(Timing_Teardown);
+    perf_counters_stop(cpu.steps);
+    return report_cpu_state(&cpu, steplimit) ? 0 : 1;
+}
@@ -0,0 +1,319 @@
+/* Generated by aot from primes, do not edit */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "common.h"
+
+static const Instr_t program[33] = {
+    0x3, 0x186a0, 0x3, 0x2, 0x10, 0x10, 0xb, 0x8,
+    0x17, 0x3, 0x2, 0x10, 0x10, 0x6, 0xb, 0x8,
+    0x9, 0x10, 0x10, 0x6, 0x11, 0x8, 0x5, 0x9,
+    0x12, 0xfffffff1, 0x10, 0x4, 0xf, 0x9, 0x12, 0xffffffe4,
+    0x2,
+};
+#define PROGRAM_SIZE 33u
+
+#pragma GCC diagnostic ignored "-Wunused-label"
+static void run(cpu_t *pcpu, long long steplimit) {
+    if (pcpu->pc != 0 || pcpu->sp != -1 || PROGRAM_SIZE == 0) {
+        switched_run(pcpu, steplimit);
+        return;
+    }
+    long long steps = pcpu->steps;
+    uint32_t s0 = 0;
+    uint32_t s1 = 0;
+    uint32_t s2 = 0;
+    uint32_t s3 = 0;
+    uint32_t s4 = 0;
+L_0:
+    if (steplimit - steps < 2) {
+        pcpu->pc = 0;
+        pcpu->sp = -1;
+        pcpu->steps = steps - 0;
+        switched_run(pcpu, steplimit);
+        return;
+    }
+    steps += 2;
+    /* 0: Push 100000 */
+    {
+        s0 = 0x186a0u;
+    }
+    /* 0x2: Push 2 */
+    {
+        s1 = 0x2u;
+    }
+L_4:
+    if (steplimit - steps < 4) {
+        pcpu->pc = 0x4;
+        pcpu->stack[0] = s0;
+        pcpu->stack[1] = s1;
+        pcpu->sp = 1;
+        pcpu->steps = steps - 0;
+        switched_run(pcpu, steplimit);
+        return;
+    }
+    steps += 4;
+    /* 0x4: Over */
+    {
+        uint32_t a = s1;
+        uint32_t b = s0;
+        s0 = b;
+        s1 = a;
+        s2 = b;
+    }
+    /* 0x5: Over */
+    {
+        uint32_t a = s2;
+        uint32_t b = s1;
+        s1 = b;
+        s2 = a;
+        s3 = b;
+    }
+    /* 0x6: Sub */
+    {
+        uint32_t a = s3;
+        uint32_t b = s2;
+        s2 = a - b;
+    }
+    /* 0x7: JE 23 */
+    {
+        uint32_t a = s2;
+        if (a == 0) {
+        goto L_32;
+        }
+    }
+L_9:
+    if (steplimit - steps < 1) {
+        pcpu->pc = 0x9;
+        pcpu->stack[0] = s0;
+        pcpu->stack[1] = s1;
+        pcpu->sp = 1;
+        pcpu->steps = steps - 0;
+        switched_run(pcpu, steplimit);
+        return;
+    }
+    steps += 1;
+    /* 0x9: Push 2 */
+    {
+        s2 = 0x2u;
+    }
+L_11:
+    if (steplimit - steps < 5) {
+        pcpu->pc = 0xb;
+        pcpu->stack[0] = s0;
+        pcpu->stack[1] = s1;
+        pcpu->stack[2] = s2;
+        pcpu->sp = 2;
+        pcpu->steps = steps - 0;
+        switched_run(pcpu, steplimit);
+        return;
+    }
+    steps += 5;
+    /* 0xb: Over */
+    {
+        uint32_t a = s2;
+        uint32_t b = s1;
+        s1 = b;
+        s2 = a;
+        s3 = b;
+    }
+    /* 0xc: Over */
+    {
+        uint32_t a = s3;
+        uint32_t b = s2;
+        s2 = b;
+        s3 = a;
+        s4 = b;
+    }
+    /* 0xd: Swap */
+    {
+        uint32_t a = s4;
+        uint32_t b = s3;
+        s3 = a;
+        s4 = b;
+    }
+    /* 0xe: Sub */
+    {
+        uint32_t a = s4;
+        uint32_t b = s3;
+        s3 = a - b;
+    }
+    /* 0xf: JE 9 */
+    {
+        uint32_t a = s3;
+        if (a == 0) {
+        goto L_26;
+        }
+    }
+L_17:
+    if (steplimit - steps < 5) {
+        pcpu->pc = 0x11;
+        pcpu->stack[0] = s0;
+        pcpu->stack[1] = s1;
+        pcpu->stack[2] = s2;
+        pcpu->sp = 2;
+        pcpu->steps = steps - 0;
+        switched_run(pcpu, steplimit);
+        return;
+    }
+    steps += 5;
+    /* 0x11: Over */
+    {
+        uint32_t a = s2;
+        uint32_t b = s1;
+        s1 = b;
+        s2 = a;
+        s3 = b;
+    }
+    /* 0x12: Over */
+    {
+        uint32_t a = s3;
+        uint32_t b = s2;
+        s2 = b;
+        s3 = a;
+        s4 = b;
+    }
+    /* 0x13: Swap */
+    {
+        uint32_t a = s4;
+        uint32_t b = s3;
+        s3 = a;
+        s4 = b;
+    }
+    /* 0x14: Mod */
+    if (s3 == 0) {
+        pcpu->pc = 0x14;
+        pcpu->stack[0] = s0;
+        pcpu->stack[1] = s1;
+        pcpu->stack[2] = s2;
+        pcpu->stack[3] = s3;
+        pcpu->stack[4] = s4;
+        pcpu->sp = 4;
+        pcpu->steps = steps - 2;
+        switched_run(pcpu, pcpu->steps + 1);
+        return;
+    } else {
+        uint32_t a = s4;
+        uint32_t b = s3;
+        s3 = a % b;
+    }
+    /* 0x15: JE 5 */
+    {
+        uint32_t a = s3;
+        if (a == 0) {
+        goto L_28;
+        }
+    }
+L_23:
+    if (steplimit - steps < 2) {
+        pcpu->pc = 0x17;
+        pcpu->stack[0] = s0;
+        pcpu->stack[1] = s1;
+        pcpu->stack[2] = s2;
+        pcpu->sp = 2;
+        pcpu->steps = steps - 0;
+        switched_run(pcpu, steplimit);
+        return;
+    }
+    steps += 2;
+    /* 0x17: Inc */
+    {
+        uint32_t a = s2;
+        s2 = a + 1;
+    }
+    /* 0x18: Jump -15 */
+    {
+        goto L_11;
+    }
+L_26:
+    if (steplimit - steps < 2) {
+        pcpu->pc = 0x1a;
+        pcpu->stack[0] = s0;
+        pcpu->stack[1] = s1;
+        pcpu->stack[2] = s2;
+        pcpu->sp = 2;
+        pcpu->steps = steps - 0;
+        switched_run(pcpu, steplimit);
+        return;
+    }
+    steps += 2;
+    /* 0x1a: Over */
+    {
+        uint32_t a = s2;
+        uint32_t b = s1;
+        s1 = b;
+        s2 = a;
+        s3 = b;
+    }
+    /* 0x1b: Print */
+    {
+        uint32_t a = s3;
+        output_value(a);
+    }
+L_28:
+    if (steplimit - steps < 3) {
+        pcpu->pc = 0x1c;
+        pcpu->stack[0] = s0;
+        pcpu->stack[1] = s1;
+        pcpu->stack[2] = s2;
+        pcpu->sp = 2;
+        pcpu->steps = steps - 0;
+        switched_run(pcpu, steplimit);
+        return;
+    }
+    steps += 3;
+    /* 0x1c: Drop */
+    {
+        uint32_t a = s2;
+    }
+    /* 0x1d: Inc */
+    {
+        uint32_t a = s1;
+        s1 = a + 1;
+    }
+    /* 0x1e: Jump -28 */
+    {
+        goto L_4;
+    }
+L_32:
+    if (steplimit - steps < 1) {
+        pcpu->pc = 0x20;
+        pcpu->stack[0] = s0;
+        pcpu->stack[1] = s1;
+        pcpu->sp = 1;
+        pcpu->steps = steps - 0;
+        switched_run(pcpu, steplimit);
+        return;
+    }
+    steps += 1;
+    /* 0x20: Halt */
+    {
+        pcpu->pc = 0x20;
+        pcpu->stack[0] = s0;
+        pcpu->stack[1] = s1;
+        pcpu->sp = 1;
+        pcpu->steps = steps - 1;
+        switched_run(pcpu, pcpu->steps + 1);
+        return;
+    }
+}
+
+int main(int argc, char **argv) {
+    long long steplimit = parse_args(argc, argv, 0);
+    if (LoadedProgram) {
+        fprintf(stderr, "This executable only runs the program it was"
+                " compiled from.\n");
+        return 2;
+    }
+    cpu_t cpu = make_cpu(program, PROGRAM_SIZE);
+    perf_counters_start();
+    timing_mark(Timing_Execute);
+    run(&cpu, steplimit);
+    timing_mark(Timing_Teardown);
+    perf_counters_stop(cpu.steps);
+    return report_cpu_state(&cpu, steplimit) ? 0 : 1;
+}
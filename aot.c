@@ -0,0 +1,430 @@
+/*  aot.c - an ahead-of-time compiler of guest programs to C
+    Copyright (c) 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "common.h"
+#include "decode.h"
+
+/* A guest program becomes a C translation unit compiled against common.h
+   and linked with libvm.a. Basic blocks are labels and branches are
+   gotos. For programs passing verify_program(), stack items are locals
+   named by their fixed depths, otherwise they stay in cpu_t with checks
+   before every instruction. Anything rare or failing is left to
+   switched_run(), one instruction at a time, so that results do not
+   depend on how the program was run. So is the end of the program when
+   the step limit is close. */
+
+static const char *inp_prog_opt = "--inp-prog=";
+static const char *program_opt = "--program=";
+static const char *out_opt = "--out=";
+
+static void usage_and_exit(const char *exec_name, int ret_code) {
+    fprintf(stderr, "Usage: %s [%s<file> | %s<name>] [%s<file.c>]\n",
+            exec_name, inp_prog_opt, program_opt, out_opt);
+    fprintf(stderr, "Without a program, the default one is compiled.\n"
+            "Built-in programs:");
+    for (const builtin_program_t *p = BuiltinPrograms; p->name; p++)
+        fprintf(stderr, " %s", p->name);
+    fprintf(stderr, "\n");
+    exit(ret_code);
+}
+
+#define OPCODE_NAME(name, opcode, imm, pops, pushes, kind, guard, results) \
+    [Instr_##name] = #name,
+
+static const char *opcode_names[] = {
+    INSTRUCTIONS(OPCODE_NAME)
+};
+
+/* Stack items taken and left, C expressions of the new ones in the
+   order they are pushed, from the old ones a (top of stack), b and c,
+   and the condition of a branch being taken, all from INSTRUCTIONS() */
+#define RESULT_STRINGS(pushes, results) RESULT_STRINGS_##pushes results
+#define RESULT_STRINGS_0(x) NULL
+#define RESULT_STRINGS_1(x) #x
+#define RESULT_STRINGS_2(x, y) #x, #y
+#define RESULT_STRINGS_3(x, y, z) #x, #y, #z
+
+#define EFFECT(name, opcode, imm, pops, pushes, kind, guard, results) \
+    [Instr_##name] = {pops, pushes, {RESULT_STRINGS(pushes, results)}, #guard},
+
+static const struct {
+    int pops;
+    int pushes;
+    const char *results[3];
+    const char *guard;
+} effects[] = {
+    INSTRUCTIONS(EFFECT)
+};
+
+typedef struct {
+    FILE *out;
+    const Instr_t *prog;
+    uint32_t len;
+    const int32_t *depths; /* NULL if the program is not verified */
+    bool *starts;  /* instructions to compile */
+    bool *leaders; /* basic blocks begin there */
+    int32_t *rest; /* instructions after it in its basic block */
+} aot_t;
+
+static inline bool has_immediate(Instr_t opcode) {
+    return opcode < NUM_INSTRUCTIONS && (IMMEDIATE_OPCODES >> opcode & 1);
+}
+
+static inline bool is_branch(Instr_t opcode) {
+    return opcode == Instr_JNE || opcode == Instr_JE || opcode == Instr_Jump;
+}
+
+/* Executed by switched_run() only: rare, always stopping or not
+   decodable, see decode() of switched.c */
+static inline bool is_slow(const aot_t *a, uint32_t pc) {
+    Instr_t opcode = a->prog[pc];
+    return opcode == Instr_Pick || opcode == Instr_Halt
+        || opcode == Instr_Break || opcode >= NUM_INSTRUCTIONS
+        || (has_immediate(opcode) && !(pc + 1 < a->len));
+}
+
+static inline uint32_t length_at(const aot_t *a, uint32_t pc) {
+    return has_immediate(a->prog[pc]) && pc + 1 < a->len ? 2 : 1;
+}
+
+static inline uint32_t target_at(const aot_t *a, uint32_t pc) {
+    return pc + 2 + a->prog[pc+1];
+}
+
+static inline bool is_start(const aot_t *a, uint32_t pc) {
+    return pc < a->len && a->starts[pc];
+}
+
+static void find_blocks(aot_t *a) {
+    uint32_t len = a->len;
+    for (uint32_t pc = 0; pc < len; ) {
+        if (a->depths) {
+            a->starts[pc] = a->depths[pc] >= 0;
+            pc++;
+        } else {
+            /* The way interpreters see the program from its start */
+            a->starts[pc] = true;
+            pc += length_at(a, pc);
+        }
+    }
+    if (len > 0)
+        a->leaders[0] = true;
+    for (uint32_t pc = 0; pc < len; pc++) {
+        if (!a->starts[pc] || is_slow(a, pc) || !is_branch(a->prog[pc]))
+            continue;
+        if (is_start(a, pc + 2))
+            a->leaders[pc + 2] = true;
+        if (is_start(a, target_at(a, pc)))
+            a->leaders[target_at(a, pc)] = true;
+    }
+    for (uint32_t i = len; i-- > 0; ) {
+        if (!a->starts[i])
+            continue;
+        uint32_t next = i + length_at(a, i);
+        bool last = (is_slow(a, i) && a->prog[i] != Instr_Pick)
+                    || is_branch(a->prog[i])
+                    || !is_start(a, next) || a->leaders[next];
+        a->rest[i] = last ? 0 : a->rest[next] + 1;
+    }
+}
+
+/* Names of stack items: the k-th one from the top when depth items are
+   there, or -1 if it is not known statically */
+static void print_item(const aot_t *a, int32_t depth, int k) {
+    if (depth >= 0)
+        fprintf(a->out, "s%d", depth - 1 - k);
+    else if (k == 0)
+        fprintf(a->out, "st[sp]");
+    else
+        fprintf(a->out, "st[sp - %d]", k);
+}
+
+static void emit_spill(const aot_t *a, int32_t depth) {
+    if (depth < 0) {
+        fprintf(a->out, "        pcpu->sp = sp;\n");
+        return;
+    }
+    for (int32_t k = 0; k < depth; k++)
+        fprintf(a->out, "        pcpu->stack[%d] = s%d;\n", k, k);
+    fprintf(a->out, "        pcpu->sp = %d;\n", depth - 1);
+}
+
+/* Let the interpreter continue from pc to the end */
+static void emit_leave(const aot_t *a, uint32_t pc, int32_t depth,
+                       int32_t taken_back) {
+    fprintf(a->out, "        pcpu->pc = %#x;\n", pc);
+    emit_spill(a, depth);
+    fprintf(a->out, "        pcpu->steps = steps - %d;\n"
+                    "        switched_run(pcpu, steplimit);\n"
+                    "        return;\n", taken_back);
+}
+
+static void emit_goto(const aot_t *a, uint32_t target, int32_t depth) {
+    if (is_start(a, target)) {
+        fprintf(a->out, "        goto L_%u;\n", target);
+    } else {
+        /* Out of the program or into the middle of an instruction */
+        emit_leave(a, target, depth, 0);
+    }
+}
+
+/* Let the interpreter execute the instruction at pc. Only Pick may
+   succeed there, everything else stops simulation. */
+static void emit_slow(const aot_t *a, uint32_t pc, int32_t depth) {
+    fprintf(a->out, "        pcpu->pc = %#x;\n", pc);
+    emit_spill(a, depth);
+    fprintf(a->out, "        pcpu->steps = steps - %d;\n"
+                    "        switched_run(pcpu, pcpu->steps + 1);\n",
+            a->rest[pc] + 1);
+    if (a->prog[pc] != Instr_Pick) {
+        fprintf(a->out, "        return;\n");
+        return;
+    }
+    fprintf(a->out, "        if (pcpu->state != Cpu_Running)\n"
+                    "            return;\n"
+                    "        steps = pcpu->steps + %d;\n", a->rest[pc]);
+    if (depth >= 0) /* Only the top of stack is changed */
+        fprintf(a->out, "        s%d = pcpu->stack[%d];\n",
+                depth - 1, depth - 1);
+    else
+        fprintf(a->out, "        sp = pcpu->sp;\n");
+}
+
+/* Go on to the next instruction, unless it is compiled right after */
+static void emit_fall_through(const aot_t *a, uint32_t next, int32_t depth) {
+    uint32_t following = next;
+    while (following < a->len && !a->starts[following])
+        following++;
+    if (following != next || next >= a->len) {
+        fprintf(a->out, "    {\n");
+        emit_goto(a, next, depth);
+        fprintf(a->out, "    }\n");
+    }
+}
+
+static void emit_instruction(const aot_t *a, uint32_t pc) {
+    FILE *out = a->out;
+    Instr_t opcode = a->prog[pc];
+    int32_t depth = a->depths ? a->depths[pc] : -1;
+    uint32_t next = pc + length_at(a, pc);
+
+    if (a->leaders[pc]) {
+        int steps = a->rest[pc] + 1;
+        fprintf(out, "L_%u:\n", pc);
+        fprintf(out, "    if (steplimit - steps < %d) {\n", steps);
+        emit_leave(a, pc, depth, 0);
+        fprintf(out, "    }\n    steps += %d;\n", steps);
+    }
+    fprintf(out, "    /* %#x: %s", pc, opcode < NUM_INSTRUCTIONS
+                 ? opcode_names[opcode] : "undefined");
+    if (has_immediate(opcode) && next == pc + 2)
+        fprintf(out, " %d", (int32_t)a->prog[pc+1]);
+    fprintf(out, " */\n");
+    if (is_slow(a, pc)) {
+        fprintf(out, "    {\n");
+        emit_slow(a, pc, depth);
+        fprintf(out, "    }\n");
+        if (opcode == Instr_Pick)
+            emit_fall_through(a, next, depth);
+        return;
+    }
+
+    int pops = opcode == Instr_Push ? 0 : effects[opcode].pops;
+    int pushes = opcode == Instr_Push ? 1 : effects[opcode].pushes;
+    int32_t after = depth >= 0 ? depth - pops + pushes : -1;
+
+    /* Conditions the interpreter would stop on */
+    bool underflow = depth < 0 && pops > 0;
+    bool overflow = depth < 0 && pushes > pops;
+    bool by_zero = opcode == Instr_Mod;
+    if (underflow || overflow || by_zero) {
+        fprintf(out, "    if (");
+        if (underflow)
+            fprintf(out, "sp < %d%s", pops - 1,
+                    overflow || by_zero ? " || " : "");
+        if (overflow)
+            fprintf(out, "sp > %d%s", STACK_CAPACITY - 1 - pushes + pops,
+                    by_zero ? " || " : "");
+        if (by_zero) {
+            print_item(a, depth, 1);
+            fprintf(out, " == 0");
+        }
+        fprintf(out, ") {\n");
+        emit_slow(a, pc, depth);
+        fprintf(out, "    } else {\n");
+    } else
+        fprintf(out, "    {\n");
+
+    static const char *operands[] = {"a", "b", "c"};
+    for (int k = 0; k < pops; k++) {
+        fprintf(out, "        uint32_t %s = ", operands[k]);
+        print_item(a, depth, k);
+        fprintf(out, ";\n");
+    }
+    if (depth < 0 && pushes != pops)
+        fprintf(out, "        sp += %d;\n", pushes - pops);
+    for (int k = 0; k < pushes; k++) {
+        fprintf(out, "        ");
+        print_item(a, after, pushes - 1 - k);
+        if (opcode == Instr_Push)
+            fprintf(out, " = %#xu;\n", a->prog[pc+1]);
+        else
+            fprintf(out, " = %s;\n", effects[opcode].results[k]);
+    }
+    if (opcode == Instr_Print)
+        fprintf(out, "        output_value(a);\n");
+    if (opcode == Instr_JE || opcode == Instr_JNE) {
+        fprintf(out, "        if (%s) {\n", effects[opcode].guard);
+        emit_goto(a, target_at(a, pc), after);
+        fprintf(out, "        }\n");
+    }
+    if (opcode == Instr_Jump)
+        emit_goto(a, target_at(a, pc), after);
+    fprintf(out, "    }\n");
+    if (opcode != Instr_Jump)
+        emit_fall_through(a, next, after);
+}
+
+static void emit_program(const aot_t *a, const char *source) {
+    FILE *out = a->out;
+    fprintf(out, "/* Generated by aot from %s, do not edit */\n\n"
+                 "#include <stdio.h>\n#include <stdlib.h>\n"
+                 "#include <stdint.h>\n#include <stdbool.h>\n"
+                 "#include <math.h>\n\n#include \"common.h\"\n\n", source);
+    fprintf(out, "static const Instr_t program[%u] = {", a->len ? a->len : 1);
+    for (uint32_t pc = 0; pc < a->len; pc++)
+        fprintf(out, "%s%#x,", pc % 8 ? " " : "\n    ", a->prog[pc]);
+    fprintf(out, "\n};\n#define PROGRAM_SIZE %uu\n\n", a->len);
+
+    fprintf(out, "#pragma GCC diagnostic ignored \"-Wunused-label\"\n"
+                 "static void run(cpu_t *pcpu, long long steplimit) {\n"
+                 "    if (pcpu->pc != 0 || pcpu->sp != -1 || PROGRAM_SIZE == 0) {\n"
+                 "        switched_run(pcpu, steplimit);\n"
+                 "        return;\n"
+                 "    }\n"
+                 "    long long steps = pcpu->steps;\n");
+    if (a->depths) {
+        int32_t max_depth = 0;
+        for (uint32_t pc = 0; pc < a->len; pc++)
+            if (a->depths[pc] > max_depth)
+                max_depth = a->depths[pc];
+        for (int32_t k = 0; k < max_depth; k++)
+            fprintf(out, "    uint32_t s%d = 0;\n", k);
+    } else {
+        fprintf(out, "    uint32_t *st = pcpu->stack;\n"
+                     "    int32_t sp = pcpu->sp;\n");
+    }
+    for (uint32_t pc = 0; pc < a->len; pc++)
+        if (a->starts[pc])
+            emit_instruction(a, pc);
+    fprintf(out, "}\n\n");
+
+    fprintf(out,
+        "int main(int argc, char **argv) {\n"
+        "    long long steplimit = parse_args(argc, argv, 0);\n"
+        "    if (LoadedProgram) {\n"
+        "        fprintf(stderr, \"This executable only runs the program it was\"\n"
+        "                \" compiled from.\\n\");\n"
+        "        return 2;\n"
+        "    }\n"
+        "    cpu_t cpu = make_cpu(program, PROGRAM_SIZE);\n"
+        "    perf_counters_start();\n"
+        "    timing_mark(Timing_Execute);\n"
+        "    run(&cpu, steplimit);\n"
+        "    timing_mark(Timing_Teardown);\n"
+        "    perf_counters_stop(cpu.steps);\n"
+        "    return report_cpu_state(&cpu, steplimit) ? 0 : 1;\n"
+        "}\n");
+}
+
+int main(int argc, char **argv) {
+    const char *source = NULL, *out_name = NULL;
+    program_t prog = {DefProgram, DefProgramSize, 0};
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--help"))
+            usage_and_exit(argv[0], 0);
+        else if (!strncmp(argv[i], inp_prog_opt, strlen(inp_prog_opt))) {
+            source = argv[i] + strlen(inp_prog_opt);
+            if (!map_program(source, &prog)) {
+                fprintf(stderr, "Cannot open target program file: %s\n",
+                        source);
+                usage_and_exit(argv[0], 2);
+            }
+        } else if (!strncmp(argv[i], program_opt, strlen(program_opt))) {
+            source = argv[i] + strlen(program_opt);
+            const builtin_program_t *p = find_builtin_program(source);
+            if (!p) {
+                fprintf(stderr, "Unknown program: %s\n", source);
+                usage_and_exit(argv[0], 2);
+            }
+            prog = (program_t){p->code, p->len, 0};
+        } else if (!strncmp(argv[i], out_opt, strlen(out_opt)))
+            out_name = argv[i] + strlen(out_opt);
+        else {
+            fprintf(stderr, "Unrecognized option: %s\n", argv[i]);
+            usage_and_exit(argv[0], 2);
+        }
+    }
+
+    aot_t a = {stdout, prog.code, prog.len, NULL, NULL, NULL, NULL};
+    int32_t *depths = malloc((prog.len ? prog.len : 1) * sizeof(int32_t));
+    a.starts = calloc(prog.len + 1, sizeof(bool));
+    a.leaders = calloc(prog.len + 1, sizeof(bool));
+    a.rest = calloc(prog.len + 1, sizeof(int32_t));
+    if (!depths || !a.starts || !a.leaders || !a.rest) {
+        fprintf(stderr, "Failed to allocate memory.\n");
+        return 2;
+    }
+    if (verify_program(prog.code, prog.len, depths))
+        a.depths = depths;
+    find_blocks(&a);
+
+    if (out_name && !(a.out = fopen(out_name, "w"))) {
+        fprintf(stderr, "Cannot open output file: %s\n", out_name);
+        return 2;
+    }
+    emit_program(&a, source ? source : "the default program");
+    if (out_name && fclose(a.out)) {
+        perror(out_name);
+        return 2;
+    }
+
+    free(a.rest);
+    free(a.leaders);
+    free(a.starts);
+    free(depths);
+    unmap_program(&prog);
+    return 0;
+}
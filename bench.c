@@ -0,0 +1,374 @@
+/*  bench.c - a benchmark driver timing engines of libvm.a in-process
+    Copyright (c) 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#define _GNU_SOURCE /* for sched_setaffinity() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sched.h>
+
+#include "common.h"
+
+/* Each engine is run on each program, first warmup times without
+   measuring, then reps times, each of them timed separately. Results go
+   to stdout as CSV, one line per engine and program, so that runs of
+   different builds can be compared with usual text tools.
+   Before that, every engine runs every program once more with its output
+   collected, which must be the same as that of the reference engine,
+   together with the final CPU state. Otherwise the result is "mismatch"
+   and the exit code is 1; programs using Rand cannot match. */
+
+/* Names may repeat in --engines= */
+#define MAX_ENGINES 64
+/* The simplest engine, others are compared to it */
+#define REFERENCE_ENGINE "switched"
+
+static const char *engines_opt = "--engines=";
+static const char *reps_opt = "--reps=";
+static const char *warmup_opt = "--warmup=";
+static const char *cpu_opt = "--cpu=";
+static const char *steplimit_opt = "--steplimit=";
+static const char *program_opt = "--program=";
+static const char *corpus_opt = "--corpus";
+
+static void usage_and_exit(const char *exec_name, int ret_code) {
+    fprintf(stderr, "Usage: %s [%s<name,...>] [%s<num>] [%s<num>] [%s<num>]"
+            " [%s<num>] [%s<name>...] [%s] [<program file>...]\n",
+            exec_name, engines_opt, reps_opt, warmup_opt, cpu_opt,
+            steplimit_opt, program_opt, corpus_opt);
+    fprintf(stderr, "Without programs, the default one is used. %s runs"
+            " all of the workloads:", corpus_opt);
+    for (const builtin_program_t *p = BuiltinPrograms; p->name; p++)
+        if (p->workload)
+            fprintf(stderr, " %s", p->name);
+    fprintf(stderr, "\nBuilt-in programs:");
+    for (const builtin_program_t *p = BuiltinPrograms; p->name; p++)
+        fprintf(stderr, " %s", p->name);
+    fprintf(stderr, "\nEngines:");
+    for (const engine_t *e = Engines; e->name; e++)
+        fprintf(stderr, " %s", e->name);
+    fprintf(stderr, "\n");
+    exit(ret_code);
+}
+
+static long long parse_number(const char *arg, size_t prefix_len,
+                              long long min, const char *exec_name) {
+    char *endptr = NULL;
+    errno = 0;
+    long long n = strtoll(arg + prefix_len, &endptr, 10);
+    if (errno || *endptr != '\0' || endptr == arg + prefix_len || n < min) {
+        fprintf(stderr, "Invalid number: %s\n", arg);
+        usage_and_exit(exec_name, 2);
+    }
+    return n;
+}
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* Time stamp counter, zero where there is none */
+static inline uint64_t now_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+#else
+    return 0;
+#endif
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of sorted samples */
+static uint64_t percentile(const uint64_t *sorted, int count, int pct) {
+    int rank = (int)(((long long)pct * count + 99) / 100);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+typedef struct {
+    const char *name;
+    program_t prog;
+} bench_program_t;
+
+/* Diagnostics of engines are collected here and dropped, to keep them
+   out of results */
+static output_buffer_t engine_output;
+
+/* What a run of a program printed and where it stopped */
+typedef struct {
+    output_buffer_t output;
+    cpu_t cpu;
+} outcome_t;
+
+static void run_collected(const engine_t *engine, const bench_program_t *bp,
+                          long long steplimit, outcome_t *outcome) {
+    outcome->output.size = 0;
+    set_output_mode(Output_Text);
+    output_buffer_t *prev = set_output_buffer(&outcome->output);
+    vm_run(engine, bp->prog.code, bp->prog.len, steplimit, &outcome->cpu);
+    set_output_buffer(prev);
+    set_output_mode(Output_Null);
+}
+
+/* Report the first difference on stderr */
+static bool same_outcome(const outcome_t *a, const outcome_t *b,
+                         const char *engine, const char *program) {
+    const cpu_t *x = &a->cpu, *y = &b->cpu;
+    if (x->pc != y->pc || x->sp != y->sp || x->state != y->state
+        || x->steps != y->steps
+        || (x->sp >= 0 && memcmp(x->stack, y->stack,
+                                 (x->sp + 1) * sizeof(uint32_t)))) {
+        fprintf(stderr, "%s: %s stopped at PC %#x, SP %d, state %d after"
+                " %lld steps, %s at PC %#x, SP %d, state %d after %lld"
+                " steps, or the stacks differ\n", engine, program,
+                x->pc, x->sp, x->state, x->steps, REFERENCE_ENGINE,
+                y->pc, y->sp, y->state, y->steps);
+        return false;
+    }
+    size_t size = a->output.size < b->output.size ? a->output.size
+                                                   : b->output.size;
+    size_t i = 0;
+    while (i < size && a->output.data[i] == b->output.data[i])
+        i++;
+    if (i < size || a->output.size != b->output.size) {
+        fprintf(stderr, "%s: %s output differs from that of %s at byte"
+                " %zu\n", engine, program, REFERENCE_ENGINE, i);
+        return false;
+    }
+    return true;
+}
+
+/* Returns false if the engine does not match the expected outcome */
+static bool bench_one(const engine_t *engine, const bench_program_t *bp,
+                      int warmup, int reps, long long steplimit,
+                      const outcome_t *expected, outcome_t *actual,
+                      uint64_t *ns, uint64_t *cycles) {
+    bool same = true;
+    if (expected) {
+        run_collected(engine, bp, steplimit, actual);
+        same = same_outcome(actual, expected, engine->name, bp->name);
+    }
+
+    cpu_t cpu;
+    for (int i = 0; i < warmup; i++) {
+        vm_run(engine, bp->prog.code, bp->prog.len, steplimit, &cpu);
+        engine_output.size = 0;
+    }
+
+    long long steps = -1;
+    bool ok = true;
+    for (int i = 0; i < reps; i++) {
+        cpu = make_cpu(bp->prog.code, bp->prog.len);
+        uint64_t c0 = now_cycles();
+        uint64_t t0 = now_ns();
+        engine->run(&cpu, steplimit);
+        uint64_t t1 = now_ns();
+        uint64_t c1 = now_cycles();
+        engine_output.size = 0;
+        ns[i] = t1 - t0;
+        cycles[i] = c1 - c0;
+        if (steps != -1 && steps != cpu.steps)
+            fprintf(stderr, "%s: %s executed %lld steps, before %lld\n",
+                    engine->name, bp->name, cpu.steps, steps);
+        steps = cpu.steps;
+        ok = ok && (cpu.state == Cpu_Halted ||
+                    (cpu.state == Cpu_Running && cpu.steps == steplimit));
+    }
+
+    qsort(ns, reps, sizeof(uint64_t), &compare_u64);
+    qsort(cycles, reps, sizeof(uint64_t), &compare_u64);
+    uint64_t median = percentile(ns, reps, 50);
+    printf("%s,%s,%d,%lld,%s,%llu,%llu,%llu,%llu,%llu,%llu,%.3f\n",
+           engine->name, bp->name, reps, steps,
+           !same ? "mismatch" : ok ? "ok" : "error",
+           (unsigned long long)ns[0],
+           (unsigned long long)median,
+           (unsigned long long)percentile(ns, reps, 90),
+           (unsigned long long)percentile(ns, reps, 99),
+           (unsigned long long)ns[reps - 1],
+           (unsigned long long)percentile(cycles, reps, 50),
+           steps > 0 ? (double)median / steps : 0.0);
+    fflush(stdout);
+    return same;
+}
+
+static void add_builtin(bench_program_t *bp, const builtin_program_t *p) {
+    bp->name = p->name;
+    bp->prog = (program_t){p->code, p->len, 0};
+}
+
+int main(int argc, char **argv) {
+    const char *engine_list = NULL;
+    int reps = 10;
+    int warmup = 1;
+    int cpu = -1;
+    long long steplimit = LLONG_MAX;
+    int nbuiltin = 0;
+    for (const builtin_program_t *p = BuiltinPrograms; p->name; p++)
+        nbuiltin++;
+    bench_program_t *programs = calloc(argc + nbuiltin,
+                                       sizeof(bench_program_t));
+    int nprograms = 0;
+    if (!programs) {
+        fprintf(stderr, "Out of memory\n");
+        return 2;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--help"))
+            usage_and_exit(argv[0], 0);
+        else if (!strncmp(argv[i], engines_opt, strlen(engines_opt)))
+            engine_list = argv[i] + strlen(engines_opt);
+        else if (!strncmp(argv[i], reps_opt, strlen(reps_opt)))
+            reps = (int)parse_number(argv[i], strlen(reps_opt), 1, argv[0]);
+        else if (!strncmp(argv[i], warmup_opt, strlen(warmup_opt)))
+            warmup = (int)parse_number(argv[i], strlen(warmup_opt), 0, argv[0]);
+        else if (!strncmp(argv[i], cpu_opt, strlen(cpu_opt)))
+            cpu = (int)parse_number(argv[i], strlen(cpu_opt), 0, argv[0]);
+        else if (!strncmp(argv[i], steplimit_opt, strlen(steplimit_opt)))
+            steplimit = parse_number(argv[i], strlen(steplimit_opt), 0, argv[0]);
+        else if (!strncmp(argv[i], program_opt, strlen(program_opt))) {
+            const builtin_program_t *p =
+                find_builtin_program(argv[i] + strlen(program_opt));
+            if (!p) {
+                fprintf(stderr, "Unknown program: %s\n", argv[i]);
+                usage_and_exit(argv[0], 2);
+            }
+            add_builtin(&programs[nprograms++], p);
+        } else if (!strcmp(argv[i], corpus_opt)) {
+            for (const builtin_program_t *p = BuiltinPrograms; p->name; p++)
+                if (p->workload)
+                    add_builtin(&programs[nprograms++], p);
+        } else if (!strncmp(argv[i], "--", 2)) {
+            fprintf(stderr, "Unrecognized option: %s\n", argv[i]);
+            usage_and_exit(argv[0], 2);
+        } else {
+            bench_program_t *bp = &programs[nprograms++];
+            bp->name = argv[i];
+            if (!map_program(argv[i], &bp->prog)) {
+                fprintf(stderr, "Cannot open target program file: %s\n",
+                        argv[i]);
+                return 2;
+            }
+        }
+    }
+    /* Engines to run, in order of the list or all of them */
+    const engine_t *engines[MAX_ENGINES];
+    int nengines = 0;
+    if (engine_list) {
+        char *list = strdup(engine_list);
+        for (char *name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+            const engine_t *e = find_engine(name);
+            if (!e) {
+                fprintf(stderr, "Unknown engine: %s\n", name);
+                usage_and_exit(argv[0], 2);
+            }
+            if (nengines == MAX_ENGINES) {
+                fprintf(stderr, "Too many engines given\n");
+                usage_and_exit(argv[0], 2);
+            }
+            engines[nengines++] = e;
+        }
+        free(list);
+    } else {
+        for (const engine_t *e = Engines; e->name && nengines < MAX_ENGINES; e++)
+            engines[nengines++] = e;
+    }
+
+    if (nprograms == 0) {
+        programs[0].name = "default";
+        programs[0].prog.code = DefProgram;
+        programs[0].prog.len = DefProgramSize;
+        nprograms = 1;
+    }
+
+    if (cpu >= 0) {
+        /* Keep the scheduler from migrating measurements around */
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set)) {
+            perror("sched_setaffinity");
+            return 2;
+        }
+    }
+
+    /* Only execution is measured, not printing of results */
+    set_output_mode(Output_Null);
+    set_output_buffer(&engine_output);
+
+    uint64_t *ns = malloc(reps * sizeof(uint64_t));
+    uint64_t *cycles = malloc(reps * sizeof(uint64_t));
+    outcome_t *expected = calloc(nprograms, sizeof(outcome_t));
+    if (!ns || !cycles || !expected) {
+        fprintf(stderr, "Out of memory\n");
+        return 2;
+    }
+    const engine_t *reference = find_engine(REFERENCE_ENGINE);
+    for (int i = 0; i < nprograms; i++)
+        run_collected(reference, &programs[i], steplimit, &expected[i]);
+
+    printf("engine,program,reps,steps,result,min_ns,median_ns,p90_ns,p99_ns,"
+           "max_ns,median_cycles,ns_per_step\n");
+    bool all_same = true;
+    outcome_t actual = {0};
+    for (int e = 0; e < nengines; e++) {
+        for (int i = 0; i < nprograms; i++)
+            all_same &= bench_one(engines[e], &programs[i], warmup, reps,
+                                  steplimit, &expected[i], &actual,
+                                  ns, cycles);
+    }
+
+    for (int i = 0; i < nprograms; i++)
+        unmap_program(&programs[i].prog);
+    set_output_buffer(NULL);
+    free_output_buffer(&engine_output);
+    free_output_buffer(&actual.output);
+    for (int i = 0; i < nprograms; i++)
+        free_output_buffer(&expected[i].output);
+    free(expected);
+    free(programs);
+    free(ns);
+    free(cycles);
+    return all_same ? 0 : 1;
+}
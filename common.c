@@ -26,17 +26,40 @@ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
 OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+/* Program files are read as they are, without text mode translation */
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+#ifndef O_NONBLOCK
+#define O_NONBLOCK 0
+#endif
+#ifndef S_ISREG
+#define S_ISREG(mode) (((mode) & S_IFMT) == S_IFREG)
+#endif
 
 #include "common.h"
+#include "decode.h"
 
 /* Program to print all prime numbers < 10000 */
-const Instr_t Primes[PROGRAM_SIZE] = {
+const Instr_t Primes[] = {
     Instr_Push, 100000, // nmax (maximal number to test)
     Instr_Push, 2,      // nmax, c (minimal number to test)
     /* back: */
@@ -70,12 +93,18 @@ const Instr_t Primes[PROGRAM_SIZE] = {
 };
 
 /* Choose a default program we are about to simulate */
-const Instr_t* DefProgram = Primes;
+#define DEFAULT_PROGRAM Primes
+const Instr_t* DefProgram = DEFAULT_PROGRAM;
+const uint32_t DefProgramSize = sizeof(DEFAULT_PROGRAM) / sizeof(Instr_t);
 
 /* Pointer to a loaded program */
-Instr_t* LoadedProgram = NULL;
+const Instr_t* LoadedProgram = NULL;
+uint32_t LoadedProgramSize = 0;
+/* Bytes mapped for it and where, it may be replaced by --optimize */
+static size_t loaded_bytes = 0;
+static const Instr_t *mapped_program = NULL;
 
-const Instr_t Instr_Rot_Test[PROGRAM_SIZE] = {
+const Instr_t Instr_Rot_Test[] = {
     Instr_Push, 1,
     Instr_Push, 2,
     Instr_Push, 3,
@@ -84,7 +113,7 @@ const Instr_t Instr_Rot_Test[PROGRAM_SIZE] = {
     Instr_Halt
 };
 
-const Instr_t Instr_Logic_Test[PROGRAM_SIZE] = {
+const Instr_t Instr_Logic_Test[] = {
    Instr_Push, 1,
    Instr_Push, 2,
    Instr_Xor,
@@ -100,7 +129,7 @@ const Instr_t Instr_Logic_Test[PROGRAM_SIZE] = {
    Instr_Halt
 };
 
-const Instr_t Instr_SHx_Test[PROGRAM_SIZE] = {
+const Instr_t Instr_SHx_Test[] = {
    Instr_Push, 1,
    Instr_Push, 3,
    Instr_SHL,
@@ -112,13 +141,13 @@ const Instr_t Instr_SHx_Test[PROGRAM_SIZE] = {
    Instr_Halt
 };
 
-const Instr_t Instr_SQRT_Test[PROGRAM_SIZE] = {
+const Instr_t Instr_SQRT_Test[] = {
    Instr_Push, 9,
    Instr_SQRT,
    Instr_Halt
 };
 
-const Instr_t Instr_Pick_Test[PROGRAM_SIZE] = {
+const Instr_t Instr_Pick_Test[] = {
    Instr_Push, 1,
    Instr_Push, 2,
    Instr_Push, 3,
@@ -131,7 +160,7 @@ const Instr_t Instr_Pick_Test[PROGRAM_SIZE] = {
 };
 
 /* Other programs, kept here just for reference */
-const Instr_t OldProgram[PROGRAM_SIZE] = {
+const Instr_t OldProgram[] = {
     Instr_Nop,
     Instr_Push, 0x11112222,
     Instr_Push, 0xf00d,
@@ -154,7 +183,7 @@ const Instr_t OldProgram[PROGRAM_SIZE] = {
     Instr_Break
 };
 
-const Instr_t Factorial[PROGRAM_SIZE] = {
+const Instr_t Factorial[] = {
     Instr_Push, 12, // n,
     Instr_Push, 1,  // n, a
     Instr_Swap,     // a, n
@@ -171,25 +200,1004 @@ const Instr_t Factorial[PROGRAM_SIZE] = {
     Instr_Halt
 };
 
-cpu_t init_cpu () {
+/* Workloads of the benchmark corpus, each stressing a kind of
+   instructions. All of them are deterministic and halt. */
+
+/* Branch-heavy: print the number of Collatz steps for every n < 10000 */
+const Instr_t Collatz[] = {
+    Instr_Push, 10000,  // nmax
+    Instr_Push, 1,      // nmax, n
+    /* back: */
+    Instr_Over,         // nmax, n, nmax
+    Instr_Over,         // nmax, n, nmax, n
+    Instr_Sub,          // nmax, n, n-nmax
+    Instr_JE, +34, /* end */ // nmax, n
+    Instr_Push, 0,      // nmax, n, c
+    Instr_Over,         // nmax, n, c, x
+    /* loop: */
+    Instr_Dup,          // nmax, n, c, x, x
+    Instr_Dec,          // nmax, n, c, x, x-1
+    Instr_JE, +22, /* done */ // nmax, n, c, x
+    Instr_Swap,         // nmax, n, x, c
+    Instr_Inc,          // nmax, n, x, c+1
+    Instr_Swap,         // nmax, n, c, x
+    Instr_Dup,          // nmax, n, c, x, x
+    Instr_Push, 1,      // nmax, n, c, x, x, 1
+    Instr_And,          // nmax, n, c, x, x&1
+    Instr_JE, +7, /* even */ // nmax, n, c, x
+    Instr_Dup,          // nmax, n, c, x, x
+    Instr_Dup,          // nmax, n, c, x, x, x
+    Instr_Add,          // nmax, n, c, x, 2x
+    Instr_Add,          // nmax, n, c, 3x
+    Instr_Inc,          // nmax, n, c, 3x+1
+    Instr_Jump, -20, /* loop */
+    /* even: */
+    Instr_Push, 1,      // nmax, n, c, x, 1
+    Instr_Swap,         // nmax, n, c, 1, x
+    Instr_SHR,          // nmax, n, c, x/2
+    Instr_Jump, -26, /* loop */
+    /* done: */
+    Instr_Drop,         // nmax, n, c
+    Instr_Print,        // nmax, n
+    Instr_Inc,          // nmax, n+1
+    Instr_Jump, -39, /* back */
+    /* end: */
+    Instr_Halt          // nmax, n (== nmax)
+};
+
+/* Takes n from the stack, e.g. one of --inputs=, and prints the number
+   of its Collatz steps. Runs of different inputs branch differently. */
+const Instr_t CollatzSteps[] = {
+    Instr_Push, 0,      // x, c
+    Instr_Swap,         // c, x
+    Instr_Dup,          // c, x, x
+    Instr_JE, +26, /* done */ // c, x
+    /* loop: */
+    Instr_Dup,          // c, x, x
+    Instr_Dec,          // c, x, x-1
+    Instr_JE, +22, /* done */ // c, x
+    Instr_Swap,         // x, c
+    Instr_Inc,          // x, c+1
+    Instr_Swap,         // c, x
+    Instr_Dup,          // c, x, x
+    Instr_Push, 1,      // c, x, x, 1
+    Instr_And,          // c, x, x&1
+    Instr_JE, +7, /* even */ // c, x
+    Instr_Dup,          // c, x, x
+    Instr_Dup,          // c, x, x, x
+    Instr_Add,          // c, x, 2x
+    Instr_Add,          // c, 3x
+    Instr_Inc,          // c, 3x+1
+    Instr_Jump, -20, /* loop */
+    /* even: */
+    Instr_Push, 1,      // c, x, 1
+    Instr_Swap,         // c, 1, x
+    Instr_SHR,          // c, x/2
+    Instr_Jump, -26, /* loop */
+    /* done: */
+    Instr_Drop,         // c
+    Instr_Print,        //
+    Instr_Halt
+};
+
+/* Arithmetic-heavy: mix a number with xorshift, multiply-add and
+   modulo 500000 times, print the result */
+const Instr_t Hash[] = {
+    Instr_Push, 500000, // n
+    Instr_Push, 12345,  // n, x
+    /* loop: */
+    Instr_Dup,          // n, x, x
+    Instr_Push, 13,     // n, x, x, 13
+    Instr_Swap,         // n, x, 13, x
+    Instr_SHL,          // n, x, x<<13
+    Instr_Xor,          // n, x
+    Instr_Dup,          // n, x, x
+    Instr_Push, 17,     // n, x, x, 17
+    Instr_Swap,         // n, x, 17, x
+    Instr_SHR,          // n, x, x>>17
+    Instr_Xor,          // n, x
+    Instr_Dup,          // n, x, x
+    Instr_Push, 5,      // n, x, x, 5
+    Instr_Swap,         // n, x, 5, x
+    Instr_SHL,          // n, x, x<<5
+    Instr_Xor,          // n, x
+    Instr_Push, 1103515245, // n, x, a
+    Instr_Mul,          // n, x*a
+    Instr_Push, 12345,  // n, x*a, b
+    Instr_Add,          // n, x
+    Instr_Dup,          // n, x, x
+    Instr_Push, 0xffff, // n, x, x, 0xffff
+    Instr_And,          // n, x, lo
+    Instr_Push, 7,      // n, x, lo, 7
+    Instr_Swap,         // n, x, 7, lo
+    Instr_Mod,          // n, x, lo%7
+    Instr_Add,          // n, x
+    Instr_Swap,         // x, n
+    Instr_Dec,          // x, n-1
+    Instr_Dup,          // x, n, n
+    Instr_JE, +3, /* end */ // x, n
+    Instr_Swap,         // n, x
+    Instr_Jump, -41, /* loop */
+    /* end: */
+    Instr_Drop,         // x
+    Instr_Print,        //
+    Instr_Halt
+};
+
+/* Stack-shuffle-heavy: Fibonacci numbers modulo 2^32, swapped and
+   rotated around a counter, print the last two of 1500000 */
+const Instr_t Fibonacci[] = {
+    Instr_Push, 1500000, // n
+    Instr_Push, 0,      // n, a
+    Instr_Push, 1,      // n, a, b
+    /* loop: */
+    Instr_Swap,         // n, b, a
+    Instr_Over,         // n, b, a, b
+    Instr_Add,          // n, b, a+b
+    Instr_Rot,          // a+b, n, b
+    Instr_Rot,          // b, a+b, n
+    Instr_Dec,          // b, a+b, n-1
+    Instr_Dup,          // b, a+b, n, n
+    Instr_JE, +3, /* end */ // b, a+b, n
+    Instr_Rot,          // n, b, a+b
+    Instr_Jump, -12, /* loop */
+    /* end: */
+    Instr_Drop,         // a, b
+    Instr_Print,        // a
+    Instr_Print,        //
+    Instr_Halt
+};
+
+/* Print-heavy: print every n < 500000 and its square */
+const Instr_t Squares[] = {
+    Instr_Push, 500000, // nmax
+    Instr_Push, 0,      // nmax, n
+    /* loop: */
+    Instr_Over,         // nmax, n, nmax
+    Instr_Over,         // nmax, n, nmax, n
+    Instr_Sub,          // nmax, n, n-nmax
+    Instr_JE, +9, /* end */ // nmax, n
+    Instr_Dup,          // nmax, n, n
+    Instr_Dup,          // nmax, n, n, n
+    Instr_Mul,          // nmax, n, n*n
+    Instr_Print,        // nmax, n
+    Instr_Dup,          // nmax, n, n
+    Instr_Print,        // nmax, n
+    Instr_Inc,          // nmax, n+1
+    Instr_Jump, -14, /* loop */
+    /* end: */
+    Instr_Halt          // nmax, n (== nmax)
+};
+
+/* Pick- and Rot-heavy: look up deep entries of a table of 16 numbers
+   on the stack by bits of an accumulator 600000 times, print it.
+   Pick never reaches the bottom item, so the table lies above a zero. */
+const Instr_t Lookup[] = {
+    Instr_Push, 0,
+    Instr_Push, 2, Instr_Push, 3, Instr_Push, 5, Instr_Push, 7,
+    Instr_Push, 11, Instr_Push, 13, Instr_Push, 17, Instr_Push, 19,
+    Instr_Push, 23, Instr_Push, 29, Instr_Push, 31, Instr_Push, 37,
+    Instr_Push, 41, Instr_Push, 43, Instr_Push, 47, Instr_Push, 53, // T
+    Instr_Push, 600000, // T, n
+    Instr_Push, 1,      // T, n, acc
+    /* loop: */
+    Instr_Dup,          // T, n, acc, acc
+    Instr_Push, 15,     // T, n, acc, acc, 15
+    Instr_And,          // T, n, acc, k
+    Instr_Push, 2,      // T, n, acc, k, 2
+    Instr_Add,          // T, n, acc, k+2
+    Instr_Pick,         // T, n, acc, t (T[15-k])
+    Instr_Over,         // T, n, acc, t, acc
+    Instr_Push, 4,      // T, n, acc, t, acc, 4
+    Instr_Swap,         // T, n, acc, t, 4, acc
+    Instr_SHR,          // T, n, acc, t, acc>>4
+    Instr_Push, 15,     // T, n, acc, t, acc>>4, 15
+    Instr_And,          // T, n, acc, t, j
+    Instr_Push, 3,      // T, n, acc, t, j, 3
+    Instr_Add,          // T, n, acc, t, j+3
+    Instr_Pick,         // T, n, acc, t, u (T[15-j])
+    Instr_Rot,          // T, n, u, acc, t
+    Instr_Xor,          // T, n, u, acc^t
+    Instr_Add,          // T, n, acc
+    Instr_Push, 0x9e3779b1, // T, n, acc, c
+    Instr_Mul,          // T, n, acc*c
+    Instr_Swap,         // T, acc, n
+    Instr_Dec,          // T, acc, n-1
+    Instr_Dup,          // T, acc, n, n
+    Instr_JE, +3, /* end */ // T, acc, n
+    Instr_Swap,         // T, n, acc
+    Instr_Jump, -34, /* loop */
+    /* end: */
+    Instr_Drop,         // T, acc
+    Instr_Print,        // T
+    Instr_Halt
+};
+
+#define PROGRAM(name, code) {name, code, sizeof(code) / sizeof(Instr_t), false}
+#define WORKLOAD(name, code) {name, code, sizeof(code) / sizeof(Instr_t), true}
+const builtin_program_t BuiltinPrograms[] = {
+    PROGRAM("primes", Primes),
+    WORKLOAD("collatz", Collatz),
+    PROGRAM("collatz-steps", CollatzSteps),
+    WORKLOAD("hash", Hash),
+    WORKLOAD("fibonacci", Fibonacci),
+    WORKLOAD("squares", Squares),
+    WORKLOAD("lookup", Lookup),
+    PROGRAM("factorial", Factorial),
+    PROGRAM("old", OldProgram),
+    PROGRAM("rot-test", Instr_Rot_Test),
+    PROGRAM("logic-test", Instr_Logic_Test),
+    PROGRAM("shx-test", Instr_SHx_Test),
+    PROGRAM("sqrt-test", Instr_SQRT_Test),
+    PROGRAM("pick-test", Instr_Pick_Test),
+    {NULL, NULL, 0, false}
+};
+#undef PROGRAM
+#undef WORKLOAD
+
+const builtin_program_t* find_builtin_program(const char *name) {
+    for (const builtin_program_t *p = BuiltinPrograms; p->name; p++)
+        if (!strcmp(p->name, name))
+            return p;
+    return NULL;
+}
+
+/* Guest instruction sequences replaced with superinstructions.
+   Only the last instruction of a pattern may have an immediate. */
+#define MAX_PATTERN_LENGTH 5
+static const struct {
+    Instr_t opcode;
+    int count; /* Number of guest instructions */
+    Instr_t pattern[MAX_PATTERN_LENGTH];
+} superinstructions[] = {
+    {Super_OverOverSubJE, 4,
+        {Instr_Over, Instr_Over, Instr_Sub, Instr_JE}},
+    {Super_OverOverSwapSubJE, 5,
+        {Instr_Over, Instr_Over, Instr_Swap, Instr_Sub, Instr_JE}},
+    {Super_OverOverSwapModJE, 5,
+        {Instr_Over, Instr_Over, Instr_Swap, Instr_Mod, Instr_JE}},
+    {Super_DupJNE, 2, {Instr_Dup, Instr_JNE}},
+    {Super_IncJump, 2, {Instr_Inc, Instr_Jump}},
+    {Super_DropIncJump, 3, {Instr_Drop, Instr_Inc, Instr_Jump}},
+};
+
+static inline int has_immediate(Instr_t opcode) {
+    return opcode < NUM_INSTRUCTIONS && (IMMEDIATE_OPCODES >> opcode & 1);
+}
+
+/* Check if a superinstruction starts at addr of a program of len words.
+   Returns number of fused guest instructions and fills the decoded
+   superinstruction in. Returns zero and leaves result intact
+   if nothing matches. */
+int match_superinstruction(const Instr_t *prog, uint32_t addr, uint32_t len,
+                           decode_t *result) {
+    assert(prog);
+    assert(result);
+    const int npatterns = sizeof(superinstructions)/sizeof(superinstructions[0]);
+    for (int p = 0; p < npatterns; p++) {
+        uint32_t cur = addr;
+        int32_t immediate = 0;
+        int k = 0;
+        for (; k < superinstructions[p].count; k++) {
+            Instr_t opcode = superinstructions[p].pattern[k];
+            int length = has_immediate(opcode) ? 2 : 1;
+            if (!(cur + length <= len) || prog[cur] != opcode)
+                break;
+            if (length == 2)
+                immediate = (int32_t)prog[cur+1];
+            cur += length;
+        }
+        if (k == superinstructions[p].count) {
+            result->opcode = superinstructions[p].opcode;
+            result->length = cur - addr;
+            result->immediate = immediate;
+            return k;
+        }
+    }
+    return 0;
+}
+
+/* Number of stack items taken and left by each guest instruction */
+#define STACK_EFFECT(name, opcode, imm, pops, pushes, kind, guard, results) \
+    [Instr_##name] = {pops, pushes},
+static const struct {
+    int8_t pops;
+    int8_t pushes;
+} stack_effects[] = {
+    INSTRUCTIONS(STACK_EFFECT)
+};
+
+/* Follow all paths through a program of len words starting from address 0
+   and check that each reachable instruction sees the same stack depth on
+   all of them, that the stack neither underflows nor overflows, and that
+   control never leaves the program. Stack depth before every instruction
+   is stored to depths[], -1 for unreachable addresses. Picking and division
+   by zero depend on values and are not covered. */
+bool verify_program(const Instr_t *prog, uint32_t len, int32_t *depths) {
+    assert(prog);
+    assert(depths);
+    uint32_t *worklist = malloc(len * sizeof(uint32_t));
+    assert(worklist || len == 0);
+    for (uint32_t i = 0; i < len; i++)
+        depths[i] = -1;
+
+    bool ok = len > 0;
+    int nwork = 0;
+    if (ok) {
+        depths[0] = 0;
+        worklist[nwork++] = 0;
+    }
+    while (ok && nwork > 0) {
+        uint32_t pc = worklist[--nwork];
+        Instr_t opcode = prog[pc];
+        int32_t depth = depths[pc];
+        if (opcode == Instr_Break || opcode == Instr_Halt
+            || opcode >= NUM_INSTRUCTIONS) /* Undefined ones are Break too */
+            continue;
+        uint32_t next = pc + (has_immediate(opcode) ? 2 : 1);
+        if (depth < stack_effects[opcode].pops
+            || depth - stack_effects[opcode].pops
+                     + stack_effects[opcode].pushes > STACK_CAPACITY
+            || next > len) {
+            ok = false;
+            break;
+        }
+        depth += stack_effects[opcode].pushes - stack_effects[opcode].pops;
+
+        uint32_t succs[2];
+        int nsuccs = 0;
+        if (opcode != Instr_Jump)
+            succs[nsuccs++] = next;
+        if (opcode == Instr_JE || opcode == Instr_JNE || opcode == Instr_Jump)
+            succs[nsuccs++] = next + (int32_t)prog[pc+1];
+        for (int k = 0; k < nsuccs; k++) {
+            if (succs[k] >= len) {
+                ok = false;
+                break;
+            }
+            if (depths[succs[k]] == -1) {
+                depths[succs[k]] = depth;
+                worklist[nwork++] = succs[k];
+            } else if (depths[succs[k]] != depth) {
+                ok = false;
+                break;
+            }
+        }
+    }
+    free(worklist);
+    return ok;
+}
+
+/*** Load-time optimization ***/
+
+bool Optimize = false;
+optimized_t OptimizedProgram = {NULL, 0, NULL, NULL};
+
+/* An instruction of the program being optimized */
+typedef struct {
+    Instr_t opcode;
+    int32_t immediate;
+    uint32_t target; /* original address branched to */
+    uint32_t start;  /* original address of the group it replaces */
+    uint32_t weight; /* number of instructions in the group */
+    bool raw;        /* not an instruction to fold: an unreachable word
+                        copied as is or a Nop accounting for others */
+} peephole_t;
+
+/* Result of a binary operation on the top of stack a and the item
+   below it b, if it is the same for all engines */
+static bool fold_binary(Instr_t opcode, uint32_t a, uint32_t b,
+                        uint32_t *result) {
+    switch (opcode) {
+    case Instr_Add: *result = a + b; return true;
+    case Instr_Sub: *result = a - b; return true;
+    case Instr_Mul: *result = a * b; return true;
+    case Instr_And: *result = a & b; return true;
+    case Instr_Or:  *result = a | b; return true;
+    case Instr_Xor: *result = a ^ b; return true;
+    /* Wider shifts are up to hosts */
+    case Instr_SHL: if (b >= 32) return false; *result = a << b; return true;
+    case Instr_SHR: if (b >= 32) return false; *result = a >> b; return true;
+    /* Division by zero stops simulation */
+    case Instr_Mod: if (b == 0) return false; *result = a % b; return true;
+    default:
+        return false;
+    }
+}
+
+/* Instructions that may stop simulation, see verify_program() */
+static inline bool may_stop(Instr_t opcode) {
+    return opcode == Instr_Break || opcode == Instr_Halt
+        || opcode == Instr_Mod || opcode == Instr_Pick
+        || opcode >= NUM_INSTRUCTIONS;
+}
+
+static inline bool is_op(const peephole_t *p, Instr_t opcode) {
+    return p && !p->raw && p->opcode == opcode;
+}
+
+/* Find a pattern at the end of count instructions of a basic block.
+   Returns how many of them it covers, zero if nothing matches. They
+   are replaced with *replacement if *replaced is set, otherwise
+   they are removed. */
+static int match_peephole(const peephole_t *block, int count,
+                          peephole_t *replacement, bool *replaced) {
+    const peephole_t *x = count >= 1 ? &block[count - 1] : NULL;
+    const peephole_t *y = count >= 2 ? &block[count - 2] : NULL;
+    const peephole_t *z = count >= 3 ? &block[count - 3] : NULL;
+    uint32_t result;
+    *replaced = false;
+
+    if (is_op(x, Instr_Nop))
+        return 1;
+    if ((is_op(y, Instr_Swap) && is_op(x, Instr_Swap))
+        || (is_op(y, Instr_Dup) && is_op(x, Instr_Drop))
+        || (is_op(y, Instr_Over) && is_op(x, Instr_Drop))
+        || (is_op(y, Instr_Push) && is_op(x, Instr_Drop)))
+        return 2;
+    if (is_op(z, Instr_Rot) && is_op(y, Instr_Rot) && is_op(x, Instr_Rot))
+        return 3;
+    if (is_op(y, Instr_Push) && (is_op(x, Instr_Inc) || is_op(x, Instr_Dec))) {
+        *replacement = *y;
+        replacement->immediate += x->opcode == Instr_Inc ? 1 : -1;
+        *replaced = true;
+        return 2;
+    }
+    if (is_op(z, Instr_Push) && is_op(y, Instr_Push) && x && !x->raw
+        && fold_binary(x->opcode, y->immediate, z->immediate, &result)) {
+        *replacement = *z;
+        replacement->immediate = (int32_t)result;
+        *replaced = true;
+        return 3;
+    }
+    if (is_op(y, Instr_Push) && (is_op(x, Instr_JE) || is_op(x, Instr_JNE))) {
+        /* Branches known in advance, the next block is a leader anyway */
+        if ((y->immediate == 0) == (x->opcode == Instr_JE)) {
+            *replacement = *x;
+            replacement->opcode = Instr_Jump;
+            *replaced = true;
+        }
+        return 2;
+    }
+    return 0;
+}
+
+/* Rewrite a program into a shorter one doing the same for every engine.
+   Within basic blocks, a few patterns of constants, stack shuffles and
+   conditional branches are folded until nothing matches, and branch
+   offsets are fixed up afterwards. Only programs passing verify_program()
+   are optimized, so that no instruction removed could fail on stack
+   underflow or overflow. Returns false if the program is not optimized. */
+bool optimize_program(const Instr_t *prog, uint32_t len, optimized_t *result) {
+    assert(prog);
+    assert(result);
+    *result = (optimized_t){NULL, 0, NULL, NULL};
+    int32_t *depths = malloc((len ? len : 1) * sizeof(int32_t));
+    bool *leaders = calloc((size_t)len + 1, sizeof(bool));
+    /* Nops accounting for removed instructions may be added, one per
+       basic block at most */
+    peephole_t *out = malloc((2 * (size_t)len + 1) * sizeof(peephole_t));
+    uint32_t *new_address = malloc(((size_t)len + 1) * sizeof(uint32_t));
+    if (!depths || !leaders || !out || !new_address) {
+        fprintf(stderr, "Failed to allocate memory for optimization.\n");
+        exit(2);
+    }
+    bool ok = verify_program(prog, len, depths);
+
+    /* Basic blocks start at branch targets and after branches. Words
+       both executed and used as immediates cannot be rewritten. */
+    for (uint32_t pc = 0; ok && pc < len; pc++) {
+        if (depths[pc] < 0 || !has_immediate(prog[pc]))
+            continue;
+        ok = depths[pc+1] < 0;
+        if (prog[pc] != Instr_Push) {
+            leaders[pc + 2] = true;
+            leaders[pc + 2 + (int32_t)prog[pc+1]] = true;
+        }
+    }
+
+    int nout = 0;
+    int block = 0; /* where the current basic block starts in out */
+    uint32_t pending = 0; /* instructions removed and not accounted yet */
+    uint32_t pending_start = 0;
+    for (uint32_t pc = 0; ok && pc <= len; ) {
+        if (pc == len || leaders[pc] || depths[pc] < 0) {
+            if (pending) {
+                /* Something has to account for them */
+                out[nout++] = (peephole_t){Instr_Nop, 0, 0, pending_start,
+                                           pending, true};
+                pending = 0;
+            }
+            block = nout;
+        }
+        if (pc == len)
+            break;
+        if (depths[pc] < 0) {
+            out[nout++] = (peephole_t){prog[pc], 0, 0, pc, 0, true};
+            block = nout;
+            pc++;
+            continue;
+        }
+
+        peephole_t instr = {prog[pc], 0, 0, pc, 1, false};
+        if (has_immediate(prog[pc])) {
+            instr.immediate = (int32_t)prog[pc+1];
+            instr.target = pc + 2 + instr.immediate;
+            pc += 2;
+        } else
+            pc++;
+        if (pending) {
+            /* Engines differ in PC of stopped instructions, keep it */
+            if (may_stop(instr.opcode))
+                out[nout++] = (peephole_t){Instr_Nop, 0, 0, pending_start,
+                                           pending, true};
+            else {
+                instr.start = pending_start;
+                instr.weight += pending;
+            }
+            pending = 0;
+        }
+        out[nout++] = instr;
+
+        /* Fold the end of the block as long as possible */
+        peephole_t replacement;
+        bool replaced;
+        int matched;
+        while ((matched = match_peephole(&out[block], nout - block,
+                                         &replacement, &replaced)) > 0) {
+            uint32_t weight = 0;
+            for (int k = nout - matched; k < nout; k++)
+                weight += out[k].weight;
+            uint32_t start = out[nout - matched].start;
+            nout -= matched;
+            if (replaced) {
+                replacement.start = start;
+                replacement.weight = weight;
+                out[nout++] = replacement;
+            } else {
+                pending += weight;
+                pending_start = start;
+            }
+        }
+    }
+
+    if (ok) {
+        /* Lay the instructions out, then fix branches up */
+        uint32_t new_len = 0;
+        for (int k = 0; k < nout; k++)
+            new_len += !out[k].raw && has_immediate(out[k].opcode) ? 2 : 1;
+        result->len = new_len;
+        result->code = malloc((new_len ? new_len : 1) * sizeof(Instr_t));
+        result->origin = malloc(((size_t)new_len + 1) * sizeof(uint32_t));
+        result->steps_before = malloc(((size_t)new_len + 1) * sizeof(uint32_t));
+        if (!result->code || !result->origin || !result->steps_before) {
+            fprintf(stderr, "Failed to allocate memory for optimization.\n");
+            exit(2);
+        }
+        uint32_t addr = 0, steps = 0, old = 0;
+        for (int k = 0; k < nout; k++) {
+            /* Original instructions of a group start where it is now */
+            for (; old <= out[k].start; old++)
+                new_address[old] = addr;
+            int length = !out[k].raw && has_immediate(out[k].opcode) ? 2 : 1;
+            for (int w = 0; w < length; w++) {
+                result->origin[addr + w] = out[k].start;
+                result->steps_before[addr + w] = steps + (w ? out[k].weight : 0);
+            }
+            result->code[addr] = out[k].opcode;
+            if (length == 2)
+                result->code[addr + 1] = (Instr_t)out[k].immediate;
+            addr += length;
+            steps += out[k].weight;
+        }
+        for (; old <= len; old++)
+            new_address[old] = addr;
+        result->origin[new_len] = len;
+        result->steps_before[new_len] = steps;
+
+        addr = 0;
+        for (int k = 0; k < nout; k++) {
+            if (out[k].raw || !has_immediate(out[k].opcode)) {
+                addr++;
+                continue;
+            }
+            if (out[k].opcode != Instr_Push)
+                result->code[addr + 1] = (Instr_t)(new_address[out[k].target]
+                                                   - (addr + 2));
+            addr += 2;
+        }
+    }
+    free(new_address);
+    free(out);
+    free(leaders);
+    free(depths);
+    return ok;
+}
+
+void free_optimized(optimized_t *opt) {
+    free(opt->code);
+    free(opt->origin);
+    free(opt->steps_before);
+    *opt = (optimized_t){NULL, 0, NULL, NULL};
+}
+
+/* Output sink for Instr_Print. Values go to stdout through its own buffer,
+   so that they stay in order with other messages printed by engines,
+   but the buffer is large and written out in big chunks. */
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+static char output_buffer[OUTPUT_BUFFER_SIZE];
+static output_mode_t output_mode = Output_Text;
+
+/* Memory buffer collecting output of the calling thread instead of stdout */
+static _Thread_local output_buffer_t *current_output = NULL;
+
+static void init_output(output_mode_t mode) {
+    output_mode = mode;
+    setvbuf(stdout, output_buffer, _IOFBF, OUTPUT_BUFFER_SIZE);
+}
+
+/* For embedders that do not call parse_args() */
+void set_output_mode(output_mode_t mode) {
+    output_mode = mode;
+}
+
+/* Returns the previous sink */
+output_buffer_t* set_output_buffer(output_buffer_t *buf) {
+    output_buffer_t *previous = current_output;
+    current_output = buf;
+    return previous;
+}
+
+void free_output_buffer(output_buffer_t *buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->size = buf->capacity = 0;
+}
+
+/* Make room for at least size more bytes in buf */
+static char* reserve_output(output_buffer_t *buf, size_t size) {
+    if (buf->size + size > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity : 4096;
+        while (buf->size + size > capacity)
+            capacity *= 2;
+        char *data = realloc(buf->data, capacity);
+        if (data == NULL) {
+            fprintf(stderr, "Failed to allocate memory for output.\n");
+            exit(2);
+        }
+        buf->data = data;
+        buf->capacity = capacity;
+    }
+    return buf->data + buf->size;
+}
+
+/* Hand a full buffer to its flush hook */
+static void check_output_limit(output_buffer_t *buf) {
+    if (buf->flush && buf->size >= buf->limit) {
+        buf->flush(buf);
+        buf->size = 0;
+    }
+}
+
+static void write_output(const void *data, size_t size) {
+    if (current_output) {
+        memcpy(reserve_output(current_output, size), data, size);
+        current_output->size += size;
+        check_output_limit(current_output);
+    } else
+        fwrite(data, 1, size, stdout);
+}
+
+/* Copy output formatted elsewhere, e.g. collected in a buffer */
+void output_bytes(const void *data, size_t size) {
+    if (size > 0)
+        write_output(data, size);
+}
+
+void output_printf(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (current_output) {
+        va_list again;
+        va_copy(again, args);
+        int size = vsnprintf(NULL, 0, format, args);
+        if (size > 0) {
+            /* One more for the terminating zero */
+            vsnprintf(reserve_output(current_output, size + 1), size + 1,
+                      format, again);
+            current_output->size += size;
+            check_output_limit(current_output);
+        }
+        va_end(again);
+    } else
+        vprintf(format, args);
+    va_end(args);
+}
+
+void output_value(uint32_t value) {
+    switch (output_mode) {
+    case Output_Text: {
+        /* "[%d]\n" without the format string parsing of printf() */
+        char text[16];
+        char *p = text + sizeof(text);
+        int32_t v = (int32_t)value;
+        uint32_t magnitude = v < 0 ? 0u - value : value;
+        *--p = '\n';
+        *--p = ']';
+        do {
+            *--p = '0' + magnitude % 10;
+            magnitude /= 10;
+        } while (magnitude);
+        if (v < 0)
+            *--p = '-';
+        *--p = '[';
+        write_output(p, text + sizeof(text) - p);
+        break;
+    }
+    case Output_Binary:
+        /* 32-bit words in host byte order */
+        write_output(&value, sizeof(value));
+        break;
+    case Output_Null:
+        break;
+    }
+}
+
+cpu_t make_cpu(const Instr_t *prog, uint32_t len) {
     cpu_t cpu = {.pc = 0, .sp = -1, .state = Cpu_Running,
                  .steps = 0, .stack = {0},
-                 .pmem = LoadedProgram ? LoadedProgram : DefProgram};
+                 .pmem = prog, .plen = len};
     return cpu;
 }
 
+cpu_t init_cpu () {
+    return LoadedProgram ? make_cpu(LoadedProgram, LoadedProgramSize)
+                         : make_cpu(DefProgram, DefProgramSize);
+}
+
+/* Print final CPU state to the current sink. Returns true if the
+   simulation ended normally */
+bool report_cpu_state(const cpu_t *pcpu, long long steplimit) {
+    assert(pcpu->state != Cpu_Running || pcpu->steps == steplimit);
+    output_printf("CPU executed %lld steps. End state \"%s\".\n",
+            pcpu->steps, pcpu->state == Cpu_Halted? "Halted":
+                         pcpu->state == Cpu_Running? "Running": "Break");
+    /* An optimized program stops where the original one would */
+    uint32_t pc = pcpu->pc;
+    if (OptimizedProgram.code && pcpu->pmem == OptimizedProgram.code
+        && pc <= OptimizedProgram.len)
+        pc = OptimizedProgram.origin[pc];
+    output_printf("PC = %#x, SP = %d\n", pc, pcpu->sp);
+    output_printf("Stack: ");
+    for (int32_t i=pcpu->sp; i >= 0 ; i--) {
+        output_printf("%#10x ", pcpu->stack[i]);
+    }
+    output_printf("%s\n", pcpu->sp == -1? "(empty)": "");
+
+    return pcpu->state == Cpu_Halted ||
+           (pcpu->state == Cpu_Running && pcpu->steps == steplimit);
+}
+
 static const char *steplimit_opt = "--steplimit=";
 static const char *inp_prog_opt = "--inp-prog=";
+static const char *program_opt = "--program=";
+static const char *output_opt = "--output=";
+static const char *instances_opt = "--instances=";
+static const char *threads_opt = "--threads=";
+static const char *inputs_opt = "--inputs=";
+static const char *perf_counters_opt = "--perf-counters";
+static const char *timing_opt = "--timing";
+static const char *optimize_opt = "--optimize";
+static const char *translation_cache_opt = "--translation-cache=";
+static const char *trace_opt = "--trace=";
+
+/* Runner mode settings, see run_instances() */
+int RunInstances = 0;
+int RunThreads = 0;
+uint32_t *InstanceInputs = NULL;
+
+const char *TranslationCache = NULL;
+const char *TraceFile = NULL;
 
 static inline
 void report_usage_and_exit(char * exec_name, int ret_code) {
-    fprintf(stderr, "Usage: %s %s<num> %s<str>\n", exec_name, steplimit_opt, inp_prog_opt);
+    fprintf(stderr, "Usage: %s %s<num> [%s<str> | %s<name>]"
+            " %s<text|binary|null>"
+            " [%s<num> %s<num>] [%s<num,...>] [%s] [%s] [%s] [%s<dir>]"
+            " [%s<file>]\n",
+            exec_name, steplimit_opt, inp_prog_opt, program_opt, output_opt,
+            instances_opt, threads_opt, inputs_opt, perf_counters_opt,
+            timing_opt, optimize_opt, translation_cache_opt, trace_opt);
+    fprintf(stderr, "Built-in programs:");
+    for (const builtin_program_t *p = BuiltinPrograms; p->name; p++)
+        fprintf(stderr, " %s", p->name);
+    fprintf(stderr, "\n");
     exit (ret_code);
 }
 
-long long parse_args(int argc, char** argv) {
+/* A positive number following an option prefix of given length */
+static int parse_count(char *arg, size_t prefix_len, char *exec_name) {
+    char *endptr = NULL;
+    long n = strtol(arg + prefix_len, &endptr, 10);
+    if (errno || (*endptr != '\0') || n <= 0 || n > INT_MAX) {
+        fprintf(stderr, "Invalid number: %s\n", arg);
+        report_usage_and_exit(exec_name, 2);
+    }
+    return (int)n;
+}
+
+/* Comma separated 32-bit values, signed or not, following an option prefix
+   of given length. Returns their number, the array is allocated. */
+static int parse_inputs(char *arg, size_t prefix_len, char *exec_name,
+                        uint32_t **values) {
+    int count = 0;
+    uint32_t *result = NULL;
+    char *p = arg + prefix_len;
+    do {
+        char *endptr = NULL;
+        errno = 0;
+        long long v = strtoll(p, &endptr, 0);
+        if (errno || endptr == p || (*endptr != ',' && *endptr != '\0')
+            || v < INT32_MIN || v > UINT32_MAX || count == INT_MAX) {
+            fprintf(stderr, "Invalid inputs: %s\n", arg);
+            report_usage_and_exit(exec_name, 2);
+        }
+        result = realloc(result, (count + 1) * sizeof(uint32_t));
+        if (!result) {
+            fprintf(stderr, "Failed to allocate memory for inputs.\n");
+            exit(2);
+        }
+        result[count++] = (uint32_t)v;
+        p = *endptr ? endptr + 1 : endptr;
+    } while (*p);
+    *values = result;
+    return count;
+}
+
+#ifdef _WIN32
+/* Without mmap(), the file is read into memory. The buffer is zeroed
+   first to pad a trailing partial word alike. */
+static const char *map_call = "read";
+
+static void* map_file(int fd, size_t size) {
+    size_t padded = (size + sizeof(Instr_t) - 1) & ~(sizeof(Instr_t) - 1);
+    char *data = calloc(padded, 1);
+    for (size_t done = 0; data && done < size; ) {
+        size_t chunk = size - done < INT_MAX ? size - done : INT_MAX;
+        int n = read(fd, data + done, (unsigned)chunk);
+        if (n <= 0) {
+            if (n == 0)
+                errno = EIO;
+            free(data);
+            return NULL;
+        }
+        done += n;
+    }
+    return data;
+}
+
+static void unmap_file(const void *data, size_t size) {
+    (void)size;
+    free((void*)data);
+}
+#else
+static const char *map_call = "mmap";
+
+static void* map_file(int fd, size_t size) {
+    void *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    return mapped == MAP_FAILED ? NULL : mapped;
+}
+
+static void unmap_file(const void *data, size_t size) {
+    munmap((void*)data, size);
+}
+#endif
+
+/* Map an opened program file and close it. Returns false with a message
+   in error if it cannot be mapped. */
+static bool try_map_program_fd(int fd, program_t *prog,
+                               char *error, size_t error_size) {
+    *prog = (program_t){NULL, 0, 0};
+    struct stat st;
+    if (fstat(fd, &st)) {
+        snprintf(error, error_size, "fstat: %s", strerror(errno));
+        close(fd);
+        return false;
+    }
+    /* A trailing partial word is padded with zeroes */
+    unsigned long long words = ((unsigned long long)st.st_size
+                                + sizeof(Instr_t) - 1) / sizeof(Instr_t);
+    if (words > UINT32_MAX) {
+        snprintf(error, error_size,
+                 "Input program does not fit into 32-bit address space.");
+        close(fd);
+        return false;
+    }
+    if (words > 0) {
+        /* The file is used as program memory directly, without copying */
+        void *mapped = map_file(fd, st.st_size);
+        if (!mapped) {
+            snprintf(error, error_size, "%s: %s", map_call, strerror(errno));
+            close(fd);
+            return false;
+        }
+        prog->mapped_bytes = st.st_size;
+        prog->code = (const Instr_t*)mapped;
+    } else {
+        /* Nothing to map, any execution will run out of bounds */
+        static const Instr_t empty_program[1] = {Instr_Break};
+        prog->code = empty_program;
+    }
+    prog->len = (uint32_t)words;
+    close(fd);
+    return true;
+}
+
+/* Map an opened program file and close it. Exits on errors. */
+static program_t map_program_fd(int fd) {
+    program_t prog;
+    char error[128];
+    if (!try_map_program_fd(fd, &prog, error, sizeof(error))) {
+        fprintf(stderr, "%s\n", error);
+        exit(2);
+    }
+    return prog;
+}
+
+/* Returns false if the file cannot be opened */
+bool map_program(const char *path, program_t *prog) {
+    int fd = open(path, O_RDONLY | O_BINARY);
+    if (fd == -1)
+        return false;
+    *prog = map_program_fd(fd);
+    return true;
+}
+
+/* Only regular files are mapped, opening others such as FIFOs could
+   block. O_NONBLOCK does not matter for the rest. */
+bool try_map_program(const char *path, program_t *prog,
+                     char *error, size_t error_size) {
+    int fd = open(path, O_RDONLY | O_BINARY | O_NONBLOCK);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st)) {
+        snprintf(error, error_size, "%s: %s", path, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return false;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        snprintf(error, error_size, "%s: not a regular file", path);
+        close(fd);
+        return false;
+    }
+    return try_map_program_fd(fd, prog, error, error_size);
+}
+
+void unmap_program(program_t *prog) {
+    if (prog->mapped_bytes)
+        unmap_file(prog->code, prog->mapped_bytes);
+    prog->code = NULL;
+    prog->len = 0;
+    prog->mapped_bytes = 0;
+}
+
+/* Options of features the executable does not have are errors rather
+   than being ignored */
+static void require_feature(unsigned features, args_feature_t feature,
+                            char *arg, char *exec_name) {
+    if (!(features & feature)) {
+        fprintf(stderr, "Option %s is not supported by %s\n", arg, exec_name);
+        report_usage_and_exit(exec_name, 2);
+    }
+}
+
+/* Features are a mask of args_feature_t */
+long long parse_args(int argc, char** argv, unsigned features) {
     long long steplimit = LLONG_MAX;
-    FILE *prog_file = NULL;
+    int prog_fd = -1;
+    const builtin_program_t *builtin = NULL;
+    output_mode_t mode = Output_Text;
+    int ninputs = 0;
 
     for (int i = 1; i < argc; ++i) {
         if (!strcmp(argv[i], "--help"))
@@ -202,11 +1210,64 @@ long long parse_args(int argc, char** argv) {
                 report_usage_and_exit(argv[0], 2);
             }
         } else if (!strncmp(argv[i], inp_prog_opt, strlen(inp_prog_opt))) {
-            prog_file = fopen(argv[i] + strlen(inp_prog_opt), "rb");
-            if (errno || prog_file == NULL) {
+            if (prog_fd != -1)
+                close(prog_fd);
+            prog_fd = open(argv[i] + strlen(inp_prog_opt),
+                           O_RDONLY | O_BINARY);
+            if (prog_fd == -1) {
                 fprintf(stderr, "Cannot open target program file: %s\n", argv[i]);
                 report_usage_and_exit(argv[0], 2);
             }
+            builtin = NULL;
+        } else if (!strncmp(argv[i], program_opt, strlen(program_opt))) {
+            builtin = find_builtin_program(argv[i] + strlen(program_opt));
+            if (!builtin) {
+                fprintf(stderr, "Unknown program: %s\n", argv[i]);
+                report_usage_and_exit(argv[0], 2);
+            }
+            if (prog_fd != -1)
+                close(prog_fd);
+            prog_fd = -1;
+        } else if (!strncmp(argv[i], output_opt, strlen(output_opt))) {
+            const char *name = argv[i] + strlen(output_opt);
+            if (!strcmp(name, "text"))
+                mode = Output_Text;
+            else if (!strcmp(name, "binary"))
+                mode = Output_Binary;
+            else if (!strcmp(name, "null"))
+                mode = Output_Null;
+            else {
+                fprintf(stderr, "Invalid output mode: %s\n", argv[i]);
+                report_usage_and_exit(argv[0], 2);
+            }
+        } else if (!strncmp(argv[i], instances_opt, strlen(instances_opt))) {
+            require_feature(features, Args_Instances, argv[i], argv[0]);
+            RunInstances = parse_count(argv[i], strlen(instances_opt), argv[0]);
+        } else if (!strncmp(argv[i], threads_opt, strlen(threads_opt))) {
+            require_feature(features, Args_Instances, argv[i], argv[0]);
+            RunThreads = parse_count(argv[i], strlen(threads_opt), argv[0]);
+        } else if (!strncmp(argv[i], inputs_opt, strlen(inputs_opt))) {
+            require_feature(features, Args_Inputs, argv[i], argv[0]);
+            free(InstanceInputs);
+            ninputs = parse_inputs(argv[i], strlen(inputs_opt), argv[0],
+                                   &InstanceInputs);
+        } else if (!strcmp(argv[i], perf_counters_opt)) {
+            PerfCounters = true;
+        } else if (!strcmp(argv[i], timing_opt)) {
+            Timing = true;
+        } else if (!strcmp(argv[i], optimize_opt)) {
+            Optimize = true;
+        } else if (!strncmp(argv[i], translation_cache_opt,
+                            strlen(translation_cache_opt))) {
+            TranslationCache = argv[i] + strlen(translation_cache_opt);
+        } else if (!strncmp(argv[i], trace_opt, strlen(trace_opt))) {
+            if (!(features & Args_Trace)) {
+                fprintf(stderr, "Option %s is not supported by %s, traces"
+                        " are written by *-trace builds such as"
+                        " switched-trace\n", argv[i], argv[0]);
+                report_usage_and_exit(argv[0], 2);
+            }
+            TraceFile = argv[i] + strlen(trace_opt);
         } else {
             /* Handle positional arguments */
             /* For now, we only have steplimit */
@@ -219,28 +1280,58 @@ long long parse_args(int argc, char** argv) {
         }
     }
 
-    unsigned long long filelen = 0;
-    if (prog_file != NULL) {
-        fseek(prog_file, 0, SEEK_END);  // Jump to the end of the file
-        filelen = ftell(prog_file);     // Get the current byte offset in the file
-        rewind(prog_file);              // Jump back to the beginning of the file
-        if (filelen > PROGRAM_SIZE * sizeof(Instr_t)) {
-            fprintf(stderr, "Input program size exceeds allocated memory.\n");
-            exit(2);
+    /* Every input starts an instance */
+    if (InstanceInputs) {
+        if (RunInstances && RunInstances != ninputs) {
+            fprintf(stderr, "There are %d inputs for %d instances.\n",
+                    ninputs, RunInstances);
+            report_usage_and_exit(argv[0], 2);
         }
-        LoadedProgram = (Instr_t*) calloc(filelen, sizeof(Instr_t)); // Enough memory for file
-        if (LoadedProgram == NULL) {
-            fprintf(stderr, "Failed to allocate memory for input program.\n");
-            exit(2);
-        }
-        size_t act_read = fread(LoadedProgram, 1, filelen, prog_file); // Read in the entire file
-        assert(filelen == act_read);
-        fclose(prog_file);
+        RunInstances = ninputs;
+    }
+
+    if (prog_fd != -1) {
+        program_t prog = map_program_fd(prog_fd);
+        LoadedProgram = prog.code;
+        LoadedProgramSize = prog.len;
+        loaded_bytes = prog.mapped_bytes;
+        mapped_program = prog.code;
+    } else if (builtin) {
+        LoadedProgram = builtin->code;
+        LoadedProgramSize = builtin->len;
+    }
+
+    if (Timing) {
+        timing_mark(Timing_Prepare);
+        atexit(&timing_report);
     }
 
+    if (Optimize) {
+        const Instr_t *prog = LoadedProgram ? LoadedProgram : DefProgram;
+        uint32_t len = LoadedProgram ? LoadedProgramSize : DefProgramSize;
+        if (optimize_program(prog, len, &OptimizedProgram)) {
+            LoadedProgram = OptimizedProgram.code;
+            LoadedProgramSize = OptimizedProgram.len;
+        } else
+            fprintf(stderr, "The program does not pass verification"
+                    " and is not optimized.\n");
+    }
+
+    init_output(mode);
+
     return steplimit;
 }
 
+void unload_program(void) {
+    if (loaded_bytes)
+        unmap_file(mapped_program, loaded_bytes);
+    free_optimized(&OptimizedProgram);
+    LoadedProgram = NULL;
+    LoadedProgramSize = 0;
+    loaded_bytes = 0;
+    mapped_program = NULL;
+}
+
 void write_program (Instr_t* program, size_t program_size, const char* out_file) {
     FILE *prog_file = fopen(out_file, "wb");
     if (errno || prog_file == NULL) {
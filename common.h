@@ -29,45 +29,87 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #ifndef COMMON_H_
 #define COMMON_H_
 
-/* Instruction Set Architecture:
-   opcodes and arguments for individual instructions.
-   Those marked with "imm" use the next machine word
-   in program memory as a signed immediate operand.
+/* The C compiler of Visual Studio spells some things its own way */
+#ifdef _MSC_VER
+#define _Thread_local __declspec(thread)
+#define PRINTF_LIKE(fmt, args)
+#else
+#define PRINTF_LIKE(fmt, args) __attribute__ ((format (printf, fmt, args)))
+#endif
+
+/* Instruction Set Architecture: every guest instruction is defined once
+   here, and engines generate their handlers from the table with semantics.h.
+   Columns are:
+   - name, giving Instr_<name> and the mnemonic;
+   - opcode;
+   - imm: 1 if the next machine word in program memory is a signed
+     immediate operand, available as IMM to the semantics;
+   - pops and pushes: stack items taken and left;
+   - kind: how the instruction is executed, one of
+     Stack  - pops a = top, b and c below it and pushes the results,
+              provided that guard holds, otherwise stops with Break,
+     Branch - pops a and jumps by IMM if guard holds,
+     or one of Break, Halt, Print and Pick, which have their own semantics;
+   - guard: a condition on a, b, c and IMM, 1 when there is none;
+   - results: values pushed by a Stack instruction, in order.
  */
+#define INSTRUCTIONS(X) \
+/*  name   opcode imm pops pushes kind    guard   results */ \
+  X(Break, 0x0000, 0, 0, 0, Break,  1,      ()) /* Abnormal end */ \
+  X(Nop,   0x0001, 0, 0, 0, Stack,  1,      ()) \
+  X(Halt,  0x0002, 0, 0, 0, Halt,   1,      ()) /* Normal program end */ \
+  X(Push,  0x0003, 1, 0, 1, Stack,  1,      (IMM)) \
+  X(Print, 0x0004, 0, 1, 0, Print,  1,      ()) \
+  X(JNE,   0x0005, 1, 1, 0, Branch, a != 0, ()) \
+  X(Swap,  0x0006, 0, 2, 2, Stack,  1,      (a, b)) \
+  X(Dup,   0x0007, 0, 1, 2, Stack,  1,      (a, a)) \
+  X(JE,    0x0008, 1, 1, 0, Branch, a == 0, ()) \
+  X(Inc,   0x0009, 0, 1, 1, Stack,  1,      (a + 1)) \
+  X(Add,   0x000a, 0, 2, 1, Stack,  1,      (a + b)) \
+  X(Sub,   0x000b, 0, 2, 1, Stack,  1,      (a - b)) \
+  X(Mul,   0x000c, 0, 2, 1, Stack,  1,      (a * b)) \
+  X(Rand,  0x000d, 0, 0, 1, Stack,  1,      ((uint32_t)rand())) \
+  X(Dec,   0x000e, 0, 1, 1, Stack,  1,      (a - 1)) \
+  X(Drop,  0x000f, 0, 1, 0, Stack,  1,      ()) \
+  X(Over,  0x0010, 0, 2, 3, Stack,  1,      (b, a, b)) \
+  X(Mod,   0x0011, 0, 2, 1, Stack,  b != 0, (a % b)) \
+  X(Jump,  0x0012, 1, 0, 0, Branch, 1,      ()) \
+  X(And,   0x0013, 0, 2, 1, Stack,  1,      (a & b)) \
+  X(Or,    0x0014, 0, 2, 1, Stack,  1,      (a | b)) \
+  X(Xor,   0x0015, 0, 2, 1, Stack,  1,      (a ^ b)) \
+  X(SHL,   0x0016, 0, 2, 1, Stack,  1,      (a << (b & 31))) \
+  X(SHR,   0x0017, 0, 2, 1, Stack,  1,      (a >> (b & 31))) \
+  X(SQRT,  0x0018, 0, 1, 1, Stack,  1,      ((uint32_t)sqrt(a))) \
+  X(Rot,   0x0019, 0, 3, 3, Stack,  1,      (a, c, b)) \
+  X(Pick,  0x001a, 0, 1, 1, Pick,   1,      ())
+
+#define INSTR_ENUM(name, opcode, imm, pops, pushes, kind, guard, results) \
+    Instr_##name = opcode,
+
 enum {
-Instr_Break  = 0x0000,/* Abnormal end;
-                         all unitialized memory will trigger a stop */
-Instr_Nop    = 0x0001,
-Instr_Halt   = 0x0002, /* Normal program end */
-Instr_Push   = 0x0003, /* imm */
-Instr_Print  = 0x0004,
-Instr_JNE    = 0x0005, /* imm */
-Instr_Swap   = 0x0006,
-Instr_Dup    = 0x0007,
-Instr_JE     = 0x0008, /* imm */
-Instr_Inc    = 0x0009,
-Instr_Add    = 0x000a,
-Instr_Sub    = 0x000b,
-Instr_Mul    = 0x000c,
-Instr_Rand   = 0x000d,
-Instr_Dec    = 0x000e,
-Instr_Drop   = 0x000f,
-Instr_Over   = 0x0010,
-Instr_Mod    = 0x0011,
-Instr_Jump   = 0x0012, /* imm */
-Instr_And    = 0x0013,
-Instr_Or     = 0x0014,
-Instr_Xor    = 0x0015,
-Instr_SHL    = 0x0016,
-Instr_SHR    = 0x0017,
-Instr_SQRT   = 0x0018,
-Instr_Rot    = 0x0019,
-Instr_Pick   = 0x001a,
+INSTRUCTIONS(INSTR_ENUM)
+};
+
+/* Opcodes are dense: those from zero to NUM_INSTRUCTIONS-1 are defined,
+   the rest of them are Break, so all unitialized memory triggers a stop */
+#define INSTR_COUNT(name, opcode, imm, pops, pushes, kind, guard, results) +1
+#define NUM_INSTRUCTIONS (0 INSTRUCTIONS(INSTR_COUNT))
 
+/* Superinstructions: opcodes for frequent sequences of guest instructions
+   that predecoding interpreters fuse into one handler.
+   They are not a part of the ISA. */
+enum {
+Super_OverOverSubJE = NUM_INSTRUCTIONS, /* imm */
+Super_OverOverSwapSubJE,              /* imm */
+Super_OverOverSwapModJE,              /* imm */
+Super_DupJNE,                         /* imm */
+Super_IncJump,                        /* imm */
+Super_DropIncJump,                    /* imm */
 };
 
 typedef enum {
@@ -79,11 +121,55 @@ typedef enum {
 typedef uint32_t Instr_t;
 
 /* The code for target program for an interpreter to simulate */
-#define PROGRAM_SIZE 512
-
 extern const Instr_t* DefProgram;
+extern const uint32_t DefProgramSize; /* in words */
+
+/* A program mapped from --inp-prog file, NULL if none */
+extern const Instr_t* LoadedProgram;
+extern uint32_t LoadedProgramSize; /* in words */
+
+/* Programs compiled in, see common.c */
+typedef struct {
+    const char *name;
+    const Instr_t *code;
+    uint32_t len; /* in words */
+    bool workload; /* part of the benchmark corpus */
+} builtin_program_t;
 
-extern Instr_t* LoadedProgram;
+/* Terminated by an entry with NULL name */
+extern const builtin_program_t BuiltinPrograms[];
+
+/* A program file mapped into memory, see map_program() */
+typedef struct {
+    const Instr_t *code;
+    uint32_t len; /* in words */
+    size_t mapped_bytes; /* zero if nothing is mapped */
+} program_t;
+
+/* A program rewritten by optimize_program() */
+typedef struct {
+    Instr_t *code;
+    uint32_t len; /* in words */
+    /* len + 1 entries, one for each word and one for the end: original
+       address of the instructions replaced by the one the word belongs to,
+       and how many original instructions the optimized ones placed before
+       the word replace */
+    uint32_t *origin;
+    uint32_t *steps_before;
+} optimized_t;
+
+/* Set by --optimize: run the program rewritten by optimize_program() */
+extern bool Optimize;
+/* What it was rewritten to, code is NULL if nothing */
+extern optimized_t OptimizedProgram;
+
+/* Directory for translations saved between runs, set by
+   --translation-cache=, NULL if they are not saved */
+extern const char *TranslationCache;
+
+/* File for records of engines built with tracing, set by --trace=,
+   see trace.h */
+extern const char *TraceFile;
 
 #define STACK_CAPACITY 32
 /* A struct to store information about a decoded instruction */
@@ -95,8 +181,8 @@ typedef struct {
     const void *sr; /* label to a service routine */
 } decode_t;
 
-/* Use up to 16 host bytes for one guest instruction in JIT variants */
-#define JIT_CODE_SIZE (PROGRAM_SIZE * 16)
+/* Use up to 128 host bytes for one guest instruction in JIT variants */
+#define JIT_CODE_PER_INSTR 128
 
 /* Simulated processor state */
 typedef struct {
@@ -106,10 +192,158 @@ typedef struct {
     long long steps; /* Statistics - total number of instructions */
     uint32_t stack[STACK_CAPACITY]; /* Data Stack */
     const Instr_t *pmem; /* Program Memory */
+    uint32_t plen; /* Size of program memory in words */
 } cpu_t;
 
+/* Where values of Instr_Print go, see --output= */
+typedef enum {
+    Output_Text = 0, /* "[%d]\n" lines */
+    Output_Binary,   /* raw 32-bit words */
+    Output_Null      /* nowhere, for benchmarking */
+} output_mode_t;
+
+/* Output collected in memory, e.g. for one of many VM instances.
+   If flush is set, it takes the data out once there are limit bytes
+   or more, and the buffer is emptied then instead of growing. */
+typedef struct output_buffer_s {
+    char *data;
+    size_t size;
+    size_t capacity;
+    size_t limit;
+    void (*flush)(struct output_buffer_s *buf);
+    void *flush_ctx; /* for flush */
+} output_buffer_t;
+
+/* Number of VM instances to run and size of the thread pool for them,
+   set by --instances= and --threads=, zero if not given */
+extern int RunInstances;
+extern int RunThreads;
+/* Values put on the data stack of instances before they start, one for each
+   of RunInstances of them, set by --inputs=. NULL if not given. */
+extern uint32_t *InstanceInputs;
+
+/* Measure hardware events around execution, set by --perf-counters */
+extern bool PerfCounters;
+
+/* Phases of a run timed by --timing, in the order they follow */
+typedef enum {
+    Timing_Load,     /* from process start to parsed options and program */
+    Timing_Prepare,  /* verification, predecoding, translation */
+    Timing_Execute,  /* from the first guest instruction */
+    Timing_Teardown, /* from the end of execution to exit */
+    Timing_Phases
+} timing_phase_t;
+
+/* Report durations of phases to stderr at exit, set by --timing */
+extern bool Timing;
+
+/* Options handled only by some executables, given to parse_args(),
+   which rejects the others */
+typedef enum {
+    Args_Instances = 1 << 0, /* --instances= and --threads=, runner mode */
+    Args_Inputs = 1 << 1,    /* --inputs=, initial stacks of instances */
+    Args_Trace = 1 << 2      /* --trace=, builds with TRACE, see trace.h */
+} args_feature_t;
+
+/* Run one VM instance, index is from 0 to count-1. Returns true
+   if the instance succeeded. Output goes to the current sink. */
+typedef bool (*instance_fn_t)(int index, void *ctx);
+
 cpu_t init_cpu ();
-long long parse_args(int argc, char** argv);
+cpu_t make_cpu(const Instr_t *prog, uint32_t len);
+bool report_cpu_state(const cpu_t *pcpu, long long steplimit);
+int match_superinstruction(const Instr_t *prog, uint32_t addr, uint32_t len,
+                           decode_t *result);
+bool verify_program(const Instr_t *prog, uint32_t len, int32_t *depths);
+bool optimize_program(const Instr_t *prog, uint32_t len, optimized_t *result);
+void free_optimized(optimized_t *opt);
+long long parse_args(int argc, char** argv, unsigned features);
+void output_value(uint32_t value);
+void output_printf(const char *format, ...) PRINTF_LIKE(1, 2);
+void output_bytes(const void *data, size_t size);
+void set_output_mode(output_mode_t mode);
+output_buffer_t* set_output_buffer(output_buffer_t *buf);
+void free_output_buffer(output_buffer_t *buf);
+int run_instances(int count, int nthreads, instance_fn_t fn, void *ctx);
+void perf_counters_start(void);
+void perf_counters_stop(long long steps);
+void timing_mark(timing_phase_t phase);
+void timing_report(void);
+void unload_program(void);
+bool map_program(const char *path, program_t *prog);
+/* Like map_program(), but only for regular files and it never exits:
+   returns false with a message in error, e.g. for long-running servers */
+bool try_map_program(const char *path, program_t *prog,
+                     char *error, size_t error_size);
+void unmap_program(program_t *prog);
 void write_program (Instr_t* program, size_t program_size, const char* out_file);
+const builtin_program_t* find_builtin_program(const char *name);
+
+/*** Engine library, see libvm.a ***/
+
+/* Simulate *pcpu until it stops or executes steplimit instructions
+   in total. Output goes to the current sink of the calling thread. */
+typedef void (*engine_fn_t)(cpu_t *pcpu, long long steplimit);
+
+void switched_run(cpu_t *pcpu, long long steplimit);
+void threaded_run(cpu_t *pcpu, long long steplimit);
+void predecoded_run(cpu_t *pcpu, long long steplimit);
+void subroutined_run(cpu_t *pcpu, long long steplimit);
+void threaded_cached_run(cpu_t *pcpu, long long steplimit);
+void tailrecursive_run(cpu_t *pcpu, long long steplimit);
+void tailcalled_run(cpu_t *pcpu, long long steplimit);
+void treaded_subroutined_run(cpu_t *pcpu, long long steplimit);
+void translated_run(cpu_t *pcpu, long long steplimit);
+void tiered_run(cpu_t *pcpu, long long steplimit);
+
+/* Engines that decode or translate programs in advance may do it once
+   for many runs, by several threads at once. What prepare_fn_t returns
+   is passed to the others, the program must stay in place until it is
+   released. */
+typedef void* (*prepare_fn_t)(const Instr_t *prog, uint32_t len);
+typedef void (*run_prepared_fn_t)(const void *prepared, cpu_t *pcpu,
+                                  long long steplimit);
+typedef void (*release_fn_t)(void *prepared);
+
+void* predecoded_prepare(const Instr_t *prog, uint32_t len);
+void predecoded_run_prepared(const void *prepared, cpu_t *pcpu,
+                             long long steplimit);
+void predecoded_release(void *prepared);
+void* translated_prepare(const Instr_t *prog, uint32_t len);
+void translated_run_prepared(const void *prepared, cpu_t *pcpu,
+                             long long steplimit);
+void translated_release(void *prepared);
+
+typedef struct {
+    const char *name; /* same as of the standalone executable */
+    engine_fn_t run;
+    /* NULL if the engine has nothing to keep between runs */
+    prepare_fn_t prepare;
+    run_prepared_fn_t run_prepared;
+    release_fn_t release;
+} engine_t;
+
+/* All engines of the library, terminated by an entry with NULL name */
+extern const engine_t Engines[];
+
+/* A program kept with what its engine prepared for running it,
+   see vm_prepare() */
+typedef struct {
+    const engine_t *engine;
+    const Instr_t *prog;
+    uint32_t len;
+    void *prepared;
+} vm_program_t;
+
+const engine_t* find_engine(const char *name);
+bool vm_run(const engine_t *engine, const Instr_t *prog, uint32_t len,
+            long long steplimit, cpu_t *pcpu);
+void vm_prepare(const engine_t *engine, const Instr_t *prog, uint32_t len,
+                vm_program_t *program);
+bool vm_run_prepared(const vm_program_t *program, const uint32_t *inputs,
+                     int ninputs, long long steplimit, cpu_t *pcpu);
+bool vm_continue(const vm_program_t *program, long long steplimit,
+                 cpu_t *pcpu);
+void vm_release(vm_program_t *program);
 
 #endif /* COMMON_H_ */
@@ -0,0 +1,229 @@
+/*  decode.c - bulk classification of program words into instructions
+    Copyright (c) 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include "common.h"
+#include "decode.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_AVX2 1
+#endif
+
+/* Words are classified in blocks of 64, one bit of a mask each */
+#define BLOCK 64
+
+/* Opcode of a word as an instruction, sets *immediate if it takes one */
+static inline uint8_t classify_word(Instr_t word, bool *immediate) {
+    uint8_t opcode = word < NUM_INSTRUCTIONS ? (uint8_t)word : Instr_Break;
+    *immediate = IMMEDIATE_OPCODES >> opcode & 1;
+    return opcode;
+}
+
+/* Classify count words, return the mask of those taking an immediate */
+static uint64_t classify_scalar(const Instr_t *prog, uint8_t *opcodes,
+                                uint32_t count) {
+    uint64_t immediates = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        bool immediate;
+        opcodes[i] = classify_word(prog[i], &immediate);
+        immediates |= (uint64_t)immediate << i;
+    }
+    return immediates;
+}
+
+#ifdef HAVE_SSE2
+/* Four words per vector. Undefined opcodes become zero, which is Break.
+   SSE2 has no unsigned compare, the sign bit is flipped for it. Nor does
+   it shift lanes by different counts, opcodes taking an immediate
+   are compared with one by one. */
+#define IMMEDIATE_SSE2(name, opcode, imm, pops, pushes, kind, guard, results) \
+    if (imm) \
+        takes = _mm_or_si128(takes, \
+            _mm_cmpeq_epi32(opcodes, _mm_set1_epi32(opcode)));
+
+static inline __m128i classify_sse2(const Instr_t *prog, int *immediates) {
+    const __m128i bias = _mm_set1_epi32((int)0x80000000u);
+    const __m128i limit =
+        _mm_set1_epi32((int)(0x80000000u + NUM_INSTRUCTIONS));
+    __m128i words = _mm_loadu_si128((const __m128i*)prog);
+    __m128i valid = _mm_cmplt_epi32(_mm_xor_si128(words, bias), limit);
+    __m128i opcodes = _mm_and_si128(words, valid);
+    __m128i takes = _mm_setzero_si128();
+    INSTRUCTIONS(IMMEDIATE_SSE2)
+    *immediates = _mm_movemask_ps(_mm_castsi128_ps(takes));
+    return opcodes;
+}
+
+static uint64_t classify_block_sse2(const Instr_t *prog, uint8_t *opcodes) {
+    uint64_t immediates = 0;
+    for (int i = 0; i < BLOCK; i += 16) {
+        int m0, m1, m2, m3;
+        __m128i a = classify_sse2(prog + i, &m0);
+        __m128i b = classify_sse2(prog + i + 4, &m1);
+        __m128i c = classify_sse2(prog + i + 8, &m2);
+        __m128i d = classify_sse2(prog + i + 12, &m3);
+        /* Opcodes fit in a byte, no saturation happens */
+        __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(a, b),
+                                         _mm_packs_epi32(c, d));
+        _mm_storeu_si128((__m128i*)(opcodes + i), bytes);
+        uint64_t mask = (uint64_t)(m0 | m1 << 4 | m2 << 8 | m3 << 12);
+        immediates |= mask << i;
+    }
+    return immediates;
+}
+#endif /* HAVE_SSE2 */
+
+#ifdef HAVE_AVX2
+/* Eight words per vector. Whether an opcode takes an immediate is looked
+   up as a bit of IMMEDIATE_OPCODES shifted by it. */
+__attribute__((target("avx2")))
+static inline __m256i classify_avx2(const Instr_t *prog, int *immediates) {
+    __m256i words = _mm256_loadu_si256((const __m256i*)prog);
+    __m256i valid = _mm256_cmpeq_epi32(
+        _mm256_min_epu32(words, _mm256_set1_epi32(NUM_INSTRUCTIONS - 1)),
+        words);
+    __m256i opcode = _mm256_and_si256(words, valid);
+    __m256i imm = _mm256_slli_epi32(
+        _mm256_srlv_epi32(_mm256_set1_epi32(IMMEDIATE_OPCODES), opcode), 31);
+    *immediates = _mm256_movemask_ps(_mm256_castsi256_ps(imm));
+    return opcode;
+}
+
+__attribute__((target("avx2")))
+static uint64_t classify_block_avx2(const Instr_t *prog, uint8_t *opcodes) {
+    /* Packing works within 128-bit lanes, this restores the word order */
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    uint64_t immediates = 0;
+    for (int i = 0; i < BLOCK; i += 32) {
+        int m0, m1, m2, m3;
+        __m256i a = classify_avx2(prog + i, &m0);
+        __m256i b = classify_avx2(prog + i + 8, &m1);
+        __m256i c = classify_avx2(prog + i + 16, &m2);
+        __m256i d = classify_avx2(prog + i + 24, &m3);
+        __m256i bytes = _mm256_packus_epi16(_mm256_packs_epi32(a, b),
+                                            _mm256_packs_epi32(c, d));
+        bytes = _mm256_permutevar8x32_epi32(bytes, order);
+        _mm256_storeu_si256((__m256i*)(opcodes + i), bytes);
+        uint64_t mask = (uint32_t)m0 | (uint32_t)m1 << 8
+                      | (uint32_t)m2 << 16 | (uint32_t)m3 << 24;
+        immediates |= mask << i;
+    }
+    return immediates;
+}
+#endif /* HAVE_AVX2 */
+
+static uint64_t classify_block_scalar(const Instr_t *prog, uint8_t *opcodes) {
+    return classify_scalar(prog, opcodes, BLOCK);
+}
+
+typedef uint64_t (*classify_block_t)(const Instr_t *prog, uint8_t *opcodes);
+
+static const struct {
+    const char *name;
+    classify_block_t classify;
+} implementation[] = {
+#ifdef HAVE_AVX2
+    {"avx2", classify_block_avx2},
+#endif
+#ifdef HAVE_SSE2
+    {"sse2", classify_block_sse2},
+#endif
+    {"scalar", classify_block_scalar},
+};
+
+/* Index of the best implementation the host supports */
+static int choose_implementation(void) {
+#ifdef HAVE_AVX2
+    if (!__builtin_cpu_supports("avx2"))
+        return 1;
+#endif
+    return 0;
+}
+
+const char *decode_program_isa(void) {
+    return implementation[choose_implementation()].name;
+}
+
+/* Given a mask of words taking an immediate, find words that are
+   immediates when instructions are decoded one after another: in a run of
+   such words, every second one starting from the second is an immediate,
+   and so is the word after a run of odd length. The run may continue from
+   the previous block, *carry tells if the first word is an immediate
+   of the last word of that block. This is the same problem as finding
+   escaped characters after runs of backslashes, solved without a loop
+   over the bits with a carrying addition. */
+static inline uint64_t find_immediates(uint64_t takes, uint64_t *carry) {
+    const uint64_t even_bits = 0x5555555555555555ull;
+    /* The first word is not an instruction if it is an immediate */
+    takes &= ~*carry;
+    uint64_t follows = takes << 1 | *carry;
+    /* Runs of instructions taking immediates starting at odd bits */
+    uint64_t odd_starts = takes & ~even_bits & ~follows;
+    uint64_t even_runs = odd_starts + takes;
+    /* The last word of the block takes the first word of the next one */
+    *carry = even_runs < odd_starts;
+    uint64_t invert = even_runs << 1;
+    return (even_bits ^ invert) & follows;
+}
+
+void decode_program(const Instr_t *prog, uint32_t len,
+                    uint8_t *opcodes, uint64_t *starts) {
+    assert(prog || len == 0);
+    assert(opcodes || len == 0);
+    classify_block_t classify
+        = implementation[choose_implementation()].classify;
+    uint64_t carry = 0;
+    uint32_t addr = 0;
+    for (; addr + BLOCK <= len; addr += BLOCK) {
+        uint64_t takes = classify(prog + addr, opcodes + addr);
+        if (starts)
+            starts[addr / BLOCK] = ~find_immediates(takes, &carry);
+    }
+    if (addr < len) { /* The tail is classified word by word */
+        uint32_t rest = len - addr;
+        uint64_t takes = classify_scalar(prog + addr, opcodes + addr, rest);
+        if (starts) {
+            uint64_t valid = ~0ull >> (BLOCK - rest);
+            starts[addr / BLOCK] = ~find_immediates(takes, &carry) & valid;
+        }
+    }
+    /* There is no immediate for the last word */
+    if (len > 0 && instruction_length(opcodes[len - 1]) == 2)
+        opcodes[len - 1] = Instr_Break;
+}
@@ -0,0 +1,86 @@
+/*  decode.h - bulk classification of program words into instructions
+    Copyright (c) 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#ifndef DECODE_H_
+#define DECODE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "common.h"
+
+/* Guest instructions followed by an immediate word, a bit for each */
+#define IMMEDIATE_BIT(name, opcode, imm, pops, pushes, kind, guard, results) \
+    | (uint32_t)(imm) << (opcode)
+#define IMMEDIATE_OPCODES (0u INSTRUCTIONS(IMMEDIATE_BIT))
+_Static_assert(NUM_INSTRUCTIONS <= 32, "IMMEDIATE_OPCODES is a 32-bit mask");
+
+/* Words of the instruction starts bitmap for a program of len words */
+#define STARTS_WORDS(len) (((size_t)(len) + 63) / 64)
+
+/* Classify all words of a program of len words at once, as if each of them
+   were decoded as an instruction. opcodes[i] receives the opcode of
+   the instruction at address i, with undefined opcodes and instructions
+   whose immediate does not fit into the program replaced by Break,
+   so instruction_length() of it is valid.
+
+   If starts is not NULL, bit i of it is set when an instruction begins at
+   address i in the program decoded one instruction after another from
+   address 0, that is, when word i is not an immediate of the instruction
+   before it. Bits at and after len are cleared.
+
+   Words are classified with SIMD instructions where the host has them. */
+void decode_program(const Instr_t *prog, uint32_t len,
+                    uint8_t *opcodes, uint64_t *starts);
+
+/* Name of the implementation of decode_program() used on this host */
+const char *decode_program_isa(void);
+
+static inline int instruction_length(uint8_t opcode) {
+    return opcode < 32 && (IMMEDIATE_OPCODES >> opcode & 1) ? 2 : 1;
+}
+
+static inline bool is_instruction_start(const uint64_t *starts,
+                                        uint32_t addr) {
+    return starts[addr / 64] >> (addr % 64) & 1;
+}
+
+/* Instruction at addr of a program classified by decode_program() */
+static inline decode_t decoded_at(const Instr_t *prog, const uint8_t *opcodes,
+                                  uint32_t addr) {
+    decode_t result = {0};
+    result.opcode = opcodes[addr];
+    result.length = instruction_length(opcodes[addr]);
+    if (result.length == 2)
+        result.immediate = (int32_t)prog[addr + 1];
+    return result;
+}
+
+#endif /* DECODE_H_ */
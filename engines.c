@@ -0,0 +1,114 @@
+/*  engines.c - a registry of all engines for embedding them into other
+    programs through libvm.a
+    Copyright (c) 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+
+#include "common.h"
+
+/* Hooks of engines doing nothing in advance, and of those that can */
+#define RUN_ONLY(engine) &engine##_run, NULL, NULL, NULL
+#define PREPARED(engine) &engine##_run, &engine##_prepare, \
+                         &engine##_run_prepared, &engine##_release
+
+const engine_t Engines[] = {
+    {"switched", RUN_ONLY(switched)},
+    {"threaded", RUN_ONLY(threaded)},
+    {"predecoded", PREPARED(predecoded)},
+    {"subroutined", RUN_ONLY(subroutined)},
+    {"threaded-cached", RUN_ONLY(threaded_cached)},
+    {"tailrecursive", RUN_ONLY(tailrecursive)},
+    {"tailcalled", RUN_ONLY(tailcalled)},
+    {"treaded-subroutined", RUN_ONLY(treaded_subroutined)},
+    {"translated", PREPARED(translated)},
+    {"tiered", RUN_ONLY(tiered)},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+/* Returns NULL if there is no engine with such name */
+const engine_t* find_engine(const char *name) {
+    for (const engine_t *e = Engines; e->name; e++) {
+        if (!strcmp(e->name, name))
+            return e;
+    }
+    return NULL;
+}
+
+/* Run prog from its beginning on a fresh CPU, whose final state is
+   stored to *pcpu. Returns true if the simulation ended normally, i.e. by
+   Halt or by reaching steplimit. The program is not verified or decoded
+   in advance, engines do whatever they need themselves. */
+bool vm_run(const engine_t *engine, const Instr_t *prog, uint32_t len,
+            long long steplimit, cpu_t *pcpu) {
+    *pcpu = make_cpu(prog, len);
+    engine->run(pcpu, steplimit);
+    return pcpu->state == Cpu_Halted ||
+           (pcpu->state == Cpu_Running && pcpu->steps == steplimit);
+}
+
+/* Let the engine decode or translate prog once for many calls of
+   vm_run_prepared(), which may come from several threads at once */
+void vm_prepare(const engine_t *engine, const Instr_t *prog, uint32_t len,
+                vm_program_t *program) {
+    program->engine = engine;
+    program->prog = prog;
+    program->len = len;
+    program->prepared = engine->prepare ? engine->prepare(prog, len) : NULL;
+}
+
+/* The same as vm_run(), but prepared in advance, and the data stack
+   starts with ninputs values, the last of them on top */
+bool vm_run_prepared(const vm_program_t *program, const uint32_t *inputs,
+                     int ninputs, long long steplimit, cpu_t *pcpu) {
+    assert(ninputs >= 0 && ninputs <= STACK_CAPACITY);
+    *pcpu = make_cpu(program->prog, program->len);
+    for (int i = 0; i < ninputs; i++)
+        pcpu->stack[++pcpu->sp] = inputs[i];
+    return vm_continue(program, steplimit, pcpu);
+}
+
+/* Run further from where a run stopped at its steplimit, until pcpu has
+   made steplimit steps in total. Runs may be split this way to do
+   something in between, with the same outcome. */
+bool vm_continue(const vm_program_t *program, long long steplimit,
+                 cpu_t *pcpu) {
+    if (program->engine->run_prepared)
+        program->engine->run_prepared(program->prepared, pcpu, steplimit);
+    else
+        program->engine->run(pcpu, steplimit);
+    return pcpu->state == Cpu_Halted ||
+           (pcpu->state == Cpu_Running && pcpu->steps == steplimit);
+}
+
+void vm_release(vm_program_t *program) {
+    if (program->engine->release)
+        program->engine->release(program->prepared);
+    program->prepared = NULL;
+}
@@ -0,0 +1,278 @@
+/*  ir.c - building and optimization of register-based IR of basic blocks
+    Copyright (c) 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include "common.h"
+#include "ir.h"
+
+static inline ir_value_t slot(int32_t pos) {
+    return (ir_value_t){Ir_Slot, pos};
+}
+
+static inline ir_value_t constant(uint32_t value) {
+    return (ir_value_t){Ir_Const, (int32_t)value};
+}
+
+static inline bool same_value(ir_value_t v, ir_value_t w) {
+    return v.kind == w.kind && v.x == w.x;
+}
+
+void ir_begin(ir_segment_t *seg, int32_t depth) {
+    seg->depth = depth;
+    seg->stack.delta = 0;
+    for (int32_t pos = -IR_POSITION_BASE; pos < IR_POSITION_BASE; pos++)
+        IR_AT(&seg->stack, pos) = slot(pos);
+    seg->nnodes = 0;
+    seg->nsnapshots = 0;
+}
+
+/* Nothing to generate code for */
+bool ir_is_empty(const ir_segment_t *seg) {
+    if (seg->nnodes > 0 || seg->stack.delta != 0)
+        return false;
+    for (int32_t pos = 1 - seg->depth; pos <= 0; pos++)
+        if (!same_value(IR_AT(&seg->stack, pos), slot(pos)))
+            return false;
+    return true;
+}
+
+/* Instructions that ir_add() takes */
+bool ir_accepts(Instr_t opcode) {
+    switch (opcode) {
+    case Instr_Nop:
+    case Instr_Push:
+    case Instr_Dup:
+    case Instr_Over:
+    case Instr_Swap:
+    case Instr_Rot:
+    case Instr_Drop:
+    case Instr_Inc:
+    case Instr_Dec:
+    case Instr_Add:
+    case Instr_Sub:
+    case Instr_Mul:
+    case Instr_And:
+    case Instr_Or:
+    case Instr_Xor:
+    case Instr_SHL:
+    case Instr_SHR:
+    case Instr_Mod:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static inline void push_value(ir_stack_t *stack, ir_value_t v) {
+    stack->delta++;
+    assert(stack->delta <= IR_POSITION_BASE);
+    IR_AT(stack, stack->delta) = v;
+}
+
+static inline ir_value_t pop_value(ir_stack_t *stack) {
+    assert(stack->delta > -IR_POSITION_BASE);
+    return IR_AT(stack, stack->delta--);
+}
+
+/* Registers and scratch registers needed to keep stack in this state,
+   see IR_MAX_LIVE and IR_MAX_MOVED */
+static bool fits(const ir_segment_t *seg, const ir_stack_t *stack) {
+    bool node_seen[IR_MAX_NODES] = {false};
+    bool slot_seen[2 * IR_POSITION_BASE] = {false};
+    int nodes = 0, moved = 0;
+    for (int32_t pos = 1 - seg->depth; pos <= stack->delta; pos++) {
+        ir_value_t v = IR_AT(stack, pos);
+        if (v.kind == Ir_Node && !node_seen[v.x]) {
+            node_seen[v.x] = true;
+            nodes++;
+        }
+        /* An original item stays in place if it is in memory and
+           is not the new top of stack, or it is the top of stack */
+        bool in_place = v.kind == Ir_Slot && v.x == pos
+                        && (pos < 0 ? pos < stack->delta : stack->delta == 0);
+        if (v.kind == Ir_Slot && !in_place
+            && !slot_seen[v.x + IR_POSITION_BASE]) {
+            slot_seen[v.x + IR_POSITION_BASE] = true;
+            moved++;
+        }
+    }
+    return nodes <= IR_MAX_LIVE && moved <= IR_MAX_MOVED;
+}
+
+/* Result of a binary operation known at translation time */
+static bool fold(Instr_t opcode, uint32_t a, uint32_t b, uint32_t *result) {
+    switch (opcode) {
+    case Instr_Add: *result = a + b; return true;
+    case Instr_Sub: *result = a - b; return true;
+    case Instr_Mul: *result = a * b; return true;
+    case Instr_And: *result = a & b; return true;
+    case Instr_Or:  *result = a | b; return true;
+    case Instr_Xor: *result = a ^ b; return true;
+    /* As host shifts generated for them do */
+    case Instr_SHL: *result = a << (b & 31); return true;
+    case Instr_SHR: *result = a >> (b & 31); return true;
+    case Instr_Mod:
+        if (b == 0)
+            return false; /* fails at run time */
+        *result = a % b;
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Add a guest instruction accepted by ir_accepts() to the segment.
+   Returns false if it does not fit into it, then the segment should
+   be finished and the instruction be added to a new one. */
+bool ir_add(ir_segment_t *seg, decode_t decoded, uint32_t pc, int ahead) {
+    assert(ir_accepts(decoded.opcode));
+    ir_stack_t stack = seg->stack;
+    ir_value_t a, b, c;
+    Instr_t opcode = decoded.opcode;
+    switch (opcode) {
+    case Instr_Nop:
+        return true;
+    case Instr_Push:
+        push_value(&stack, constant(decoded.immediate));
+        break;
+    case Instr_Dup:
+        a = pop_value(&stack);
+        push_value(&stack, a);
+        push_value(&stack, a);
+        break;
+    case Instr_Over:
+        a = pop_value(&stack);
+        b = pop_value(&stack);
+        push_value(&stack, b);
+        push_value(&stack, a);
+        push_value(&stack, b);
+        break;
+    case Instr_Swap:
+        a = pop_value(&stack);
+        b = pop_value(&stack);
+        push_value(&stack, a);
+        push_value(&stack, b);
+        break;
+    case Instr_Rot:
+        a = pop_value(&stack);
+        b = pop_value(&stack);
+        c = pop_value(&stack);
+        push_value(&stack, a);
+        push_value(&stack, c);
+        push_value(&stack, b);
+        break;
+    case Instr_Drop:
+        (void)pop_value(&stack);
+        break;
+    default: {
+        /* Computations, increment and decrement are Add and Sub of one */
+        a = pop_value(&stack);
+        if (opcode == Instr_Inc || opcode == Instr_Dec) {
+            b = constant(1);
+            opcode = opcode == Instr_Inc ? Instr_Add : Instr_Sub;
+        } else
+            b = pop_value(&stack);
+        uint32_t result;
+        if (a.kind == Ir_Const && b.kind == Ir_Const
+            && fold(opcode, a.x, b.x, &result)) {
+            push_value(&stack, constant(result));
+            break;
+        }
+        if (seg->nnodes == IR_MAX_NODES)
+            return false;
+        ir_node_t *node = &seg->nodes[seg->nnodes];
+        node->opcode = opcode;
+        node->a = a;
+        node->b = b;
+        node->pc = pc;
+        node->ahead = ahead;
+        node->before = -1;
+        push_value(&stack, (ir_value_t){Ir_Node, seg->nnodes});
+        if (!fits(seg, &stack))
+            return false;
+        if (opcode == Instr_Mod) {
+            node->before = seg->nsnapshots;
+            seg->snapshots[seg->nsnapshots++] = seg->stack;
+        }
+        seg->nnodes++;
+        seg->stack = stack;
+        return true;
+    }
+    }
+    if (!fits(seg, &stack))
+        return false;
+    seg->stack = stack;
+    return true;
+}
+
+/* Take the condition of a branch ending the segment */
+ir_value_t ir_pop(ir_segment_t *seg) {
+    return pop_value(&seg->stack);
+}
+
+static void use(ir_segment_t *seg, ir_value_t v, int user) {
+    if (v.kind != Ir_Node)
+        return;
+    ir_node_t *node = &seg->nodes[v.x];
+    node->live = true;
+    if (node->last_use < user)
+        node->last_use = user;
+}
+
+/* Find out which nodes are needed for the final stack, for cond,
+   if it is not NULL, and for stopping at Mod by zero. The rest of them
+   are dead and generate no code. */
+void ir_finish(ir_segment_t *seg, const ir_value_t *cond) {
+    for (int n = 0; n < seg->nnodes; n++) {
+        seg->nodes[n].live = seg->nodes[n].opcode == Instr_Mod;
+        seg->nodes[n].last_use = -1;
+    }
+    const ir_stack_t *stack = &seg->stack;
+    for (int32_t pos = 1 - seg->depth; pos <= stack->delta; pos++)
+        use(seg, IR_AT(stack, pos), seg->nnodes);
+    if (cond)
+        use(seg, *cond, seg->nnodes);
+    /* Users follow their operands */
+    for (int n = seg->nnodes - 1; n >= 0; n--) {
+        ir_node_t *node = &seg->nodes[n];
+        if (!node->live)
+            continue;
+        use(seg, node->a, n);
+        use(seg, node->b, n);
+        if (node->before >= 0) {
+            const ir_stack_t *before = &seg->snapshots[node->before];
+            for (int32_t pos = 1 - seg->depth; pos <= before->delta; pos++)
+                use(seg, IR_AT(before, pos), n);
+        }
+    }
+}
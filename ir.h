@@ -0,0 +1,110 @@
+/*  ir.h - register-based intermediate representation of basic blocks
+    Copyright (c) 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#ifndef IR_H_
+#define IR_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "common.h"
+
+/* A segment is a part of a basic block of a verified program made of
+   instructions that cannot fail on the data stack. It is executed
+   symbolically at translation time: shuffling instructions only move
+   references to values around, and computations become nodes of
+   a register-based SSA form, whose operands are those references.
+   This gives copy propagation and elimination of stack shuffles for
+   free. Constants are folded, and nodes whose values are not used
+   by anything are dead.
+
+   Stack positions are counted from the stack pointer at the start of
+   the segment: 0 is the top of stack then, -1 is the item below it,
+   1 is the first item pushed above it. A position not modified holds
+   its original value, referred to as an Ir_Slot. */
+
+/* Instructions in a segment and superinstructions of them are limited
+   by these, the segment ends before they are exceeded */
+#define IR_MAX_NODES 64
+/* Positions -IR_POSITION_BASE to IR_POSITION_BASE */
+#define IR_POSITION_BASE STACK_CAPACITY
+/* Values in registers at once, see ir_add() */
+#define IR_MAX_LIVE 5
+/* Original stack items moved to other positions at once. Writing the
+   stack back may need a scratch register for each of them. */
+#define IR_MAX_MOVED 3
+
+typedef enum {
+    Ir_Slot = 0, /* original value at position x */
+    Ir_Const,    /* x itself */
+    Ir_Node,     /* result of node x */
+} ir_kind_t;
+
+typedef struct {
+    ir_kind_t kind;
+    int32_t x;
+} ir_value_t;
+
+/* Symbolic state of the data stack */
+typedef struct {
+    int32_t delta; /* change of the stack pointer */
+    ir_value_t val[2 * IR_POSITION_BASE + 1];
+} ir_stack_t;
+
+#define IR_AT(stack, pos) ((stack)->val[(pos) + IR_POSITION_BASE])
+
+typedef struct {
+    Instr_t opcode; /* Add, Sub, Mul, And, Or, Xor, SHL, SHR or Mod */
+    ir_value_t a; /* the top of stack operand */
+    ir_value_t b; /* the one below it */
+    uint32_t pc; /* of the guest instruction */
+    int ahead; /* steps accounted for up to the end of its block */
+    int before; /* Mod only: index of ir_segment_t.snapshots[] */
+    bool live;
+    int last_use; /* index of the last node using it, nnodes if later */
+} ir_node_t;
+
+typedef struct {
+    int32_t depth; /* number of stack items at the start */
+    ir_stack_t stack;
+    ir_node_t nodes[IR_MAX_NODES];
+    int nnodes;
+    /* Stack before every Mod, to be written back if it divides by zero */
+    ir_stack_t snapshots[IR_MAX_NODES];
+    int nsnapshots;
+} ir_segment_t;
+
+void ir_begin(ir_segment_t *seg, int32_t depth);
+bool ir_is_empty(const ir_segment_t *seg);
+bool ir_accepts(Instr_t opcode);
+bool ir_add(ir_segment_t *seg, decode_t decoded, uint32_t pc, int ahead);
+ir_value_t ir_pop(ir_segment_t *seg);
+void ir_finish(ir_segment_t *seg, const ir_value_t *cond);
+
+#endif /* IR_H_ */
@@ -27,7 +27,7 @@ if [ -n $1 ]
 then
     VARIANTS=$@
 else
-    VARIANTS="threaded-cached threaded switched predecoded subroutined"
+    VARIANTS="threaded-cached threaded switched predecoded subroutined treaded-subroutined"
 fi
 
 # Generate a comment for data file header 
@@ -56,7 +56,7 @@ int main() {
             }
         }
         if (is_prime)
-            printf("[%d]\n", i);
+            output_value(i);
     }
     return 0;
 }
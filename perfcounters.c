@@ -0,0 +1,153 @@
+/*  perfcounters.c - hardware performance counters around execution of engines
+    Copyright (c) 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#define _GNU_SOURCE /* for syscall() */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "common.h"
+
+/* Set by --perf-counters */
+bool PerfCounters = false;
+
+#ifdef __linux__
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define CACHE_EVENT(cache, op, result) \
+    ((cache) | ((op) << 8) | ((result) << 16))
+
+typedef struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} perf_event_desc_t;
+
+static const perf_event_desc_t events[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"L1i-misses", PERF_TYPE_HW_CACHE,
+     CACHE_EVENT(PERF_COUNT_HW_CACHE_L1I, PERF_COUNT_HW_CACHE_OP_READ,
+                 PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {"iTLB-misses", PERF_TYPE_HW_CACHE,
+     CACHE_EVENT(PERF_COUNT_HW_CACHE_ITLB, PERF_COUNT_HW_CACHE_OP_READ,
+                 PERF_COUNT_HW_CACHE_RESULT_MISS)},
+};
+#define NEVENTS (sizeof(events) / sizeof(events[0]))
+/* Indices in events[] used for IPC */
+enum { Event_Cycles = 0, Event_Instructions = 1 };
+
+/* Descriptors of opened counters, -1 for those not supported */
+static int fds[NEVENTS];
+
+void perf_counters_start(void) {
+    if (!PerfCounters)
+        return;
+    for (unsigned i = 0; i < NEVENTS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        attr.inherit = 1; /* count threads of runner mode too */
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        /* Counters are multiplexed if there are not enough of them */
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+                         | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    /* Enable them last to not count opening of the rest */
+    for (unsigned i = 0; i < NEVENTS; i++) {
+        if (fds[i] != -1)
+            ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+void perf_counters_stop(long long steps) {
+    if (!PerfCounters)
+        return;
+    for (unsigned i = 0; i < NEVENTS; i++) {
+        if (fds[i] != -1)
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+
+    double values[NEVENTS];
+    bool valid[NEVENTS];
+    for (unsigned i = 0; i < NEVENTS; i++) {
+        uint64_t data[3]; /* value, time enabled, time running */
+        valid[i] = fds[i] != -1
+                   && read(fds[i], data, sizeof(data)) == sizeof(data)
+                   && data[2] > 0;
+        /* Scale for the time the counter was not scheduled */
+        values[i] = valid[i] ? (double)data[0] * data[1] / data[2] : 0;
+        if (fds[i] != -1)
+            close(fds[i]);
+        fds[i] = -1;
+    }
+
+    /* Guest output may be on stdout, keep them apart */
+    fprintf(stderr, "Performance counters for %lld steps:\n", steps);
+    for (unsigned i = 0; i < NEVENTS; i++) {
+        if (!valid[i]) {
+            fprintf(stderr, "%16s %20s\n", events[i].name, "<not supported>");
+            continue;
+        }
+        fprintf(stderr, "%16s %20.0f", events[i].name, values[i]);
+        if (steps > 0)
+            fprintf(stderr, " %12.3f per step", values[i] / steps);
+        fprintf(stderr, "\n");
+    }
+    if (valid[Event_Cycles] && valid[Event_Instructions]
+        && values[Event_Cycles] > 0)
+        fprintf(stderr, "%16s %20.3f\n", "IPC",
+                values[Event_Instructions] / values[Event_Cycles]);
+}
+
+#else /* !__linux__ */
+
+void perf_counters_start(void) {
+    if (PerfCounters)
+        fprintf(stderr, "Performance counters are only supported on Linux\n");
+}
+
+void perf_counters_stop(long long steps) {
+    (void)steps;
+}
+
+#endif
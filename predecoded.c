@@ -36,264 +36,146 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <math.h>
 
 #include "common.h"
+#include "decode.h"
+#include "trace.h"
+#include "semantics.h"
 
-static inline decode_t decode_at_address(const Instr_t* prog, uint32_t addr) {
-    assert(addr < PROGRAM_SIZE);
-    decode_t result = {0};
-    Instr_t raw_instr = prog[addr];
-    result.opcode = raw_instr;
-    switch (raw_instr) {
-    case Instr_Nop:
-    case Instr_Halt:
-    case Instr_Print:
-    case Instr_Swap:
-    case Instr_Dup:
-    case Instr_Inc:
-    case Instr_Add:
-    case Instr_Sub:
-    case Instr_Mul:
-    case Instr_Rand:
-    case Instr_Dec:
-    case Instr_Drop:
-    case Instr_Over:
-    case Instr_Mod:
-    case Instr_And:
-    case Instr_Or:
-    case Instr_Xor:
-    case Instr_SHL:
-    case Instr_SHR:
-    case Instr_Rot:
-    case Instr_SQRT:
-    case Instr_Pick:
-        result.length = 1;
-        break;
-    case Instr_Push:
-    case Instr_JNE:
-    case Instr_JE:
-    case Instr_Jump:
-        result.length = 2;
-        if (!(addr+1 < PROGRAM_SIZE)) {
-            result.length = 1;
-            result.opcode = Instr_Break;
-            break;
-        }
-        result.immediate = (int32_t)prog[addr+1];
-        break;
-    case Instr_Break:
-    default: /* Undefined instructions equal to Break */
-        result.length = 1;
-        result.opcode = Instr_Break;
-        break;
-    }
+/* Decoded instruction as it is kept in the cache,
+   8 bytes per program word */
+typedef struct {
+    uint16_t opcode;
+    uint16_t length; /* zero if not decoded yet */
+    int32_t immediate;
+} cached_t;
+
+static inline cached_t pack_decoded(decode_t decoded) {
+    cached_t result = {
+        .opcode = (uint16_t)decoded.opcode,
+        .length = (uint16_t)decoded.length,
+        .immediate = decoded.immediate,
+    };
     return result;
 }
 
 /*** Service routines ***/
-#define BAIL_ON_ERROR() if (cpu.state != Cpu_Running) break;
+#define SEM_CPU (&cpu)
+#define SEM_LEAVE() break
+#define SEM_IMM decoded.immediate
+#define SEM_BRANCH() cpu.pc += decoded.immediate
 
-static inline void push(cpu_t *pcpu, uint32_t v) {
-    assert(pcpu);
-    if (pcpu->sp >= STACK_CAPACITY-1) {
-        printf("Stack overflow\n");
-        pcpu->state = Cpu_Break;
-        return;
-    }
-    pcpu->stack[++pcpu->sp] = v;
-}
+#define CHECKED_CASE(name, opcode, imm, pops, pushes, kind, guard, results) \
+        case Instr_##name: \
+            SEM_CHECKED(kind, pops, pushes, guard, results); \
+            break;
 
-static inline uint32_t pop(cpu_t *pcpu) {
-    assert(pcpu);
-    if (pcpu->sp < 0) {
-        printf("Stack underflow\n");
-        pcpu->state = Cpu_Break;
-        return 0;
-    }
-    return pcpu->stack[pcpu->sp--];
-}
+/* A superinstruction is executed as a whole only if all of its guest
+   instructions fit into steplimit and cannot fail on the data stack:
+   there are at least depth items on it and room for growth more. */
+#define SUPER_FITS(count, depth, growth) \
+    (steplimit - cpu.steps >= (count) && cpu.sp >= (depth) - 1 \
+     && cpu.sp + (growth) < STACK_CAPACITY)
 
-static inline uint32_t pick(cpu_t *pcpu, int32_t pos) {
-    assert(pcpu);
-    if (pcpu->sp - 1 < pos) {
-        printf("Out of bound picking\n");
-        pcpu->state = Cpu_Break;
-        return 0;
-    }
-    return pcpu->stack[pcpu->sp - pos];
-}
+/* Otherwise, its first guest instruction is executed alone */
+#define SUPER_FALLBACK() \
+    decoded = pack_decoded(decode_at_address(cpu.pmem, cpu.pc, cpu.plen)); \
+    goto execute;
+
+/* All guest instructions of a superinstruction but the last one,
+   which is counted as usual */
+#define SUPER_STEPS(count) cpu.steps += (count) - 1;
 
-static void predecode_program(const Instr_t *prog,
-                           decode_t *dec, int len) {
+/* Programs may be large, so instructions are decoded lazily,
+   when they are reached for the first time */
+static void predecode_at(const Instr_t *prog, cached_t *dec,
+                         uint32_t addr, uint32_t len) {
     assert(prog);
     assert(dec);
-    /* The program is short, so we can decode it as a whole.
-       Otherwise, some sort of lazy decoding will be required */
-    for (int i=0; i < len; i++) {
-        dec[i] = decode_at_address(prog, i);
-    }
+    decode_t decoded = decode_at_address(prog, addr, len);
+    /* Frequent sequences starting here are replaced with a single
+       superinstruction. Entries for the rest of the sequence stay
+       intact to be used by branches into the middle of it. */
+    match_superinstruction(prog, addr, len, &decoded);
+    dec[addr] = pack_decoded(decoded);
 }
 
-int main(int argc, char **argv) {
-    long long steplimit = parse_args(argc, argv);
-    cpu_t cpu = init_cpu();
-
-    decode_t decoded_cache[PROGRAM_SIZE];
-    predecode_program(cpu.pmem, decoded_cache, PROGRAM_SIZE);
+/* Decode all of the program in advance, so that the cache is only read
+   when it is shared by many instances. Opcodes are classified in bulk. */
+static void predecode_program(const Instr_t *prog, cached_t *dec,
+                              uint32_t len) {
+    uint8_t *opcodes = malloc((size_t)len + 1);
+    if (!opcodes) {
+        fprintf(stderr, "Failed to allocate memory for decoded program.\n");
+        exit(2);
+    }
+    decode_program(prog, len, opcodes, NULL);
+    for (uint32_t i = 0; i < len; i++) {
+        decode_t decoded = decoded_at(prog, opcodes, i);
+        match_superinstruction(prog, i, len, &decoded);
+        dec[i] = pack_decoded(decoded);
+    }
+    free(opcodes);
+}
 
+/* Simulate the CPU until it stops or runs steplimit instructions */
+static void run(cpu_t *pcpu, cached_t *decoded_cache, long long steplimit) {
+    cpu_t cpu = *pcpu;
+#ifdef TRACE
+    trace_ring_t *ring = trace_ring();
+#endif
+    timing_mark(Timing_Execute);
     while (cpu.state == Cpu_Running && cpu.steps < steplimit) {
-        if (!(cpu.pc < PROGRAM_SIZE)) {
-            printf("PC out of bounds\n");
+        if (!(cpu.pc < cpu.plen)) {
+            output_printf("PC out of bounds\n");
             cpu.state = Cpu_Break;
             break;
         }
-        decode_t decoded = decoded_cache[cpu.pc];
-        uint32_t tmp1 = 0, tmp2 = 0, tmp3 = 0;
+        if (decoded_cache[cpu.pc].length == 0)
+            predecode_at(cpu.pmem, decoded_cache, cpu.pc, cpu.plen);
+        cached_t decoded = decoded_cache[cpu.pc];
+        TRACE_DISPATCH(ring, cpu.pc, decoded.opcode, cpu.sp,
+                       cpu.sp >= 0 ? cpu.stack[cpu.sp] : 0);
+execute:
         /* Execute - a big switch */
         switch(decoded.opcode) {
-        case Instr_Nop:
-            /* Do nothing */
-            break;
-        case Instr_Halt:
-            cpu.state = Cpu_Halted;
-            break;
-        case Instr_Push:
-            push(&cpu, decoded.immediate);
-            break;
-        case Instr_Print:
-            tmp1 = pop(&cpu); BAIL_ON_ERROR();
-            printf("[%d]\n", tmp1);
-            break;
-        case Instr_Swap:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp2);
-            break;
-        case Instr_Dup:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp1);
-            break;
-        case Instr_Over:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp2);
-            push(&cpu, tmp1);
-            push(&cpu, tmp2);
-            break;
-        case Instr_Inc:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1+1);
-            break;
-        case Instr_Add:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 + tmp2);
-            break;
-        case Instr_Sub:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 - tmp2);
-            break;
-        case Instr_Mod:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            if (tmp2 == 0) {
-                cpu.state = Cpu_Break;
-                break;
-            }
-            push(&cpu, tmp1 % tmp2);
-            break;
-        case Instr_Mul:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 * tmp2);
-            break;
-        case Instr_Rand:
-            tmp1 = rand();
-            push(&cpu, tmp1);
-            break;
-        case Instr_Dec:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1-1);
+        INSTRUCTIONS(CHECKED_CASE)
+        /* Superinstructions operate on the stack directly,
+           as SUPER_FITS() guarantees there will be no errors */
+        case Super_OverOverSubJE:
+            if (!SUPER_FITS(4, 2, 2)) {SUPER_FALLBACK();}
+            if (cpu.stack[cpu.sp] == cpu.stack[cpu.sp-1])
+                cpu.pc += decoded.immediate;
+            SUPER_STEPS(4);
             break;
-        case Instr_Drop:
-            (void)pop(&cpu);
+        case Super_OverOverSwapSubJE:
+            if (!SUPER_FITS(5, 2, 2)) {SUPER_FALLBACK();}
+            if (cpu.stack[cpu.sp-1] == cpu.stack[cpu.sp])
+                cpu.pc += decoded.immediate;
+            SUPER_STEPS(5);
             break;
-        case Instr_JE:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            if (tmp1 == 0)
+        case Super_OverOverSwapModJE:
+            if (!SUPER_FITS(5, 2, 2) || cpu.stack[cpu.sp] == 0) {SUPER_FALLBACK();}
+            if (cpu.stack[cpu.sp-1] % cpu.stack[cpu.sp] == 0)
                 cpu.pc += decoded.immediate;
+            SUPER_STEPS(5);
             break;
-        case Instr_JNE:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            if (tmp1 != 0)
+        case Super_DupJNE:
+            if (!SUPER_FITS(2, 1, 1)) {SUPER_FALLBACK();}
+            if (cpu.stack[cpu.sp] != 0)
                 cpu.pc += decoded.immediate;
+            SUPER_STEPS(2);
             break;
-        case Instr_Jump:
+        case Super_IncJump:
+            if (!SUPER_FITS(2, 1, 0)) {SUPER_FALLBACK();}
+            cpu.stack[cpu.sp]++;
             cpu.pc += decoded.immediate;
+            SUPER_STEPS(2);
             break;
-        case Instr_And:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 & tmp2);
-            break;
-        case Instr_Or:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 | tmp2);
-            break;
-        case Instr_Xor:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 ^ tmp2);
-            break;
-        case Instr_SHL:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 << tmp2);
-            break;
-        case Instr_SHR:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 >> tmp2);
-            break;
-        case Instr_Rot:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            tmp3 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp3);
-            push(&cpu, tmp2);
-            break;
-        case Instr_SQRT:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, sqrt(tmp1));
-            break;
-        case Instr_Pick:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, pick(&cpu, tmp1));
-            break;
-        case Instr_Break:
-            cpu.state = Cpu_Break;
+        case Super_DropIncJump:
+            if (!SUPER_FITS(3, 2, 0)) {SUPER_FALLBACK();}
+            cpu.sp--;
+            cpu.stack[cpu.sp]++;
+            cpu.pc += decoded.immediate;
+            SUPER_STEPS(3);
             break;
         default:
             assert("Unreachable" && false);
@@ -302,22 +184,101 @@ int main(int argc, char **argv) {
         cpu.pc += decoded.length; /* Advance PC */
         cpu.steps++;
     }
+    *pcpu = cpu;
+}
+
+/* State shared by all instances in runner mode */
+typedef struct {
+    cached_t *decoded_cache; /* read-only */
+    long long steplimit;
+    long long *steps; /* of every instance, for --perf-counters */
+} shared_t;
+
+static bool run_instance(int index, void *ctx) {
+    shared_t *shared = ctx;
+    cpu_t cpu = init_cpu();
+    if (InstanceInputs)
+        cpu.stack[++cpu.sp] = InstanceInputs[index];
+    run(&cpu, shared->decoded_cache, shared->steplimit);
+    shared->steps[index] = cpu.steps;
+    return report_cpu_state(&cpu, shared->steplimit);
+}
+
+static cached_t* allocate_cache(uint32_t len) {
+    /* Entries not decoded yet have zero length */
+    cached_t *decoded_cache = calloc(len, sizeof(cached_t));
+    if (decoded_cache == NULL && len > 0) {
+        fprintf(stderr, "Failed to allocate memory for decoded program.\n");
+        exit(2);
+    }
+    return decoded_cache;
+}
+
+void predecoded_run(cpu_t *pcpu, long long steplimit) {
+    cached_t *decoded_cache = allocate_cache(pcpu->plen);
+    run(pcpu, decoded_cache, steplimit);
+    timing_mark(Timing_Teardown);
+    free(decoded_cache);
+}
+
+/* Programs decoded once to be run many times, see engine_t */
+void* predecoded_prepare(const Instr_t *prog, uint32_t len) {
+    cached_t *decoded_cache = allocate_cache(len);
+    predecode_program(prog, decoded_cache, len);
+    return decoded_cache;
+}
 
-    assert(cpu.state != Cpu_Running || cpu.steps == steplimit);
-    /* Print CPU state */
-    printf("CPU executed %lld steps. End state \"%s\".\n",
-            cpu.steps, cpu.state == Cpu_Halted? "Halted":
-                       cpu.state == Cpu_Running? "Running": "Break");
-    printf("PC = %#x, SP = %d\n", cpu.pc, cpu.sp);
-    printf("Stack: ");
-    for (int32_t i=cpu.sp; i >= 0 ; i--) {
-        printf("%#10x ", cpu.stack[i]);
+void predecoded_run_prepared(const void *prepared, cpu_t *pcpu,
+                             long long steplimit) {
+    run(pcpu, (cached_t*)prepared, steplimit);
+}
+
+void predecoded_release(void *prepared) {
+    free(prepared);
+}
+
+#ifndef ENGINE_LIBRARY
+int main(int argc, char **argv) {
+    long long steplimit = parse_args(argc, argv,
+                                     Args_Instances | Args_Inputs | TRACE_ARGS);
+    cpu_t cpu = init_cpu();
+
+#ifdef TRACE
+    trace_start();
+#endif
+    bool ok;
+    if (RunInstances) {
+        cached_t *decoded_cache = allocate_cache(cpu.plen);
+        predecode_program(cpu.pmem, decoded_cache, cpu.plen);
+        shared_t shared = {.decoded_cache = decoded_cache,
+                           .steplimit = steplimit,
+                           .steps = calloc(RunInstances, sizeof(long long))};
+        if (!shared.steps) {
+            fprintf(stderr, "Failed to allocate memory for instances.\n");
+            exit(2);
+        }
+        perf_counters_start();
+        ok = run_instances(RunInstances, RunThreads,
+                           run_instance, &shared) == 0;
+        timing_mark(Timing_Teardown);
+        long long total_steps = 0;
+        for (int i = 0; i < RunInstances; i++)
+            total_steps += shared.steps[i];
+        perf_counters_stop(total_steps);
+        free(shared.steps);
+        free(decoded_cache);
+    } else {
+        perf_counters_start();
+        predecoded_run(&cpu, steplimit);
+        perf_counters_stop(cpu.steps);
+        ok = report_cpu_state(&cpu, steplimit);
     }
-    printf("%s\n", cpu.sp == -1? "(empty)": "");
+#ifdef TRACE
+    trace_stop();
+#endif
 
-    free(LoadedProgram);
+    unload_program();
 
-    return cpu.state == Cpu_Halted ||
-           (cpu.state == Cpu_Running &&
-            cpu.steps == steplimit)?0:1;
+    return ok ? 0 : 1;
 }
+#endif
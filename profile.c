@@ -0,0 +1,174 @@
+/*  profile.c - reports of executed guest instructions for -prof variants
+    Copyright (c) 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "profile.h"
+
+/* How many of the hottest PCs and opcode pairs to print */
+#define PROFILE_TOP 20
+
+profile_t Profile;
+
+#define OPCODE_NAME(name, opcode, imm, pops, pushes, kind, guard, results) \
+    [Instr_##name] = #name,
+
+static const char *opcode_names[PROFILE_OPCODES] = {
+    INSTRUCTIONS(OPCODE_NAME)
+    [Super_OverOverSubJE] = "OverOverSubJE",
+    [Super_OverOverSwapSubJE] = "OverOverSwapSubJE",
+    [Super_OverOverSwapModJE] = "OverOverSwapModJE",
+    [Super_DupJNE] = "DupJNE",
+    [Super_IncJump] = "IncJump",
+    [Super_DropIncJump] = "DropIncJump",
+};
+
+const char* opcode_name(unsigned opcode) {
+    return opcode < PROFILE_OPCODES && opcode_names[opcode]
+           ? opcode_names[opcode] : "Break";
+}
+
+void profile_start(const Instr_t *prog, uint32_t plen) {
+    memset(&Profile, 0, sizeof(Profile));
+    Profile.pc_counts = calloc(plen, sizeof(uint64_t));
+    if (!Profile.pc_counts && plen > 0) {
+        fprintf(stderr, "Failed to allocate memory for profile.\n");
+        exit(2);
+    }
+    Profile.plen = plen;
+    Profile.countdown = PROFILE_SAMPLE_PERIOD;
+    Profile.prog = prog;
+    if (OptimizedProgram.code && prog == OptimizedProgram.code)
+        Profile.steps_before = OptimizedProgram.steps_before;
+}
+
+/* Add original instructions replaced by the one dispatched at pc */
+void profile_count_original(uint32_t pc, unsigned opcode) {
+    uint32_t next = pc + 1;
+    decode_t decoded;
+    if (opcode >= NUM_INSTRUCTIONS
+        && match_superinstruction(Profile.prog, pc, Profile.plen, &decoded))
+        next = pc + decoded.length;
+    Profile.original_steps += Profile.steps_before[next]
+                              - Profile.steps_before[pc];
+}
+
+typedef struct {
+    uint32_t key; /* PC or pair of opcodes */
+    uint64_t count;
+} profile_entry_t;
+
+static int compare_entries(const void *a, const void *b) {
+    const profile_entry_t *x = a, *y = b;
+    if (x->count != y->count)
+        return x->count < y->count ? 1 : -1; /* descending */
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+static double percent(uint64_t part, uint64_t total) {
+    return total ? 100.0 * part / total : 0.0;
+}
+
+/* Non-zero entries of counts sorted from the hottest */
+static profile_entry_t* sort_counts(const uint64_t *counts, uint32_t n,
+                                    uint32_t *found) {
+    profile_entry_t *entries = malloc((n ? n : 1) * sizeof(profile_entry_t));
+    if (!entries) {
+        fprintf(stderr, "Failed to allocate memory for profile.\n");
+        exit(2);
+    }
+    uint32_t k = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (counts[i])
+            entries[k++] = (profile_entry_t){i, counts[i]};
+    }
+    qsort(entries, k, sizeof(profile_entry_t), &compare_entries);
+    *found = k;
+    return entries;
+}
+
+/* Print the profile to stderr and free it. Prog is used to name
+   opcodes at hot PCs. */
+void profile_report(const Instr_t *prog) {
+    uint64_t total = 0;
+    for (unsigned i = 0; i < PROFILE_OPCODES; i++)
+        total += Profile.opcode_counts[i];
+
+    fprintf(stderr, "Profile of %llu dispatches\n", (unsigned long long)total);
+    if (Profile.steps_before)
+        fprintf(stderr, "Dispatches of the original program: %llu\n",
+                (unsigned long long)Profile.original_steps);
+    fprintf(stderr, "%-18s %16s %7s %14s\n",
+            "Opcode", "Count", "%", "Cycles/sample");
+    uint32_t n = 0;
+    profile_entry_t *entries = sort_counts(Profile.opcode_counts,
+                                           PROFILE_OPCODES, &n);
+    for (uint32_t i = 0; i < n; i++) {
+        unsigned op = entries[i].key;
+        fprintf(stderr, "%-18s %16llu %7.3f", opcode_name(op),
+                (unsigned long long)entries[i].count,
+                percent(entries[i].count, total));
+        if (Profile.samples[op])
+            fprintf(stderr, " %14.1f",
+                    (double)Profile.sampled_cycles[op] / Profile.samples[op]);
+        fprintf(stderr, "\n");
+    }
+    free(entries);
+
+    fprintf(stderr, "\nHot PCs\n%-10s %-18s %16s %7s\n",
+            "PC", "Opcode", "Count", "%");
+    entries = sort_counts(Profile.pc_counts, Profile.plen, &n);
+    for (uint32_t i = 0; i < n && i < PROFILE_TOP; i++) {
+        fprintf(stderr, "%#-10x %-18s %16llu %7.3f\n", entries[i].key,
+                opcode_name(prog[entries[i].key]),
+                (unsigned long long)entries[i].count,
+                percent(entries[i].count, total));
+    }
+    free(entries);
+
+    fprintf(stderr, "\nOpcode pairs\n%-18s %-18s %16s %7s\n",
+            "First", "Second", "Count", "%");
+    entries = sort_counts(&Profile.pair_counts[0][0],
+                          PROFILE_OPCODES * PROFILE_OPCODES, &n);
+    for (uint32_t i = 0; i < n && i < PROFILE_TOP; i++) {
+        fprintf(stderr, "%-18s %-18s %16llu %7.3f\n",
+                opcode_name(entries[i].key / PROFILE_OPCODES),
+                opcode_name(entries[i].key % PROFILE_OPCODES),
+                (unsigned long long)entries[i].count,
+                percent(entries[i].count, total));
+    }
+    free(entries);
+
+    free(Profile.pc_counts);
+    Profile.pc_counts = NULL;
+    Profile.plen = 0;
+}
@@ -0,0 +1,118 @@
+/*  profile.h - counting of executed guest instructions for -prof variants
+    Copyright (c) 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "common.h"
+
+/* Engines built with PROFILE defined count every dispatch: per opcode,
+   per guest PC and per pair of consecutive opcodes. Once in a sampling
+   period, time stamp counter is read at a dispatch and at the next one
+   to estimate cost of the opcode. Without PROFILE, nothing is compiled
+   in. Superinstructions are counted under their own opcodes. For
+   a program rewritten by --optimize, instructions of the original
+   program are counted too. */
+
+/* Instructions and superinstructions fit here */
+#define PROFILE_OPCODES 64
+/* Prime, so that it does not resonate with guest loops */
+#define PROFILE_SAMPLE_PERIOD 1021
+
+typedef struct {
+    uint64_t *pc_counts; /* plen entries */
+    uint32_t plen;
+    uint64_t opcode_counts[PROFILE_OPCODES];
+    uint64_t pair_counts[PROFILE_OPCODES][PROFILE_OPCODES];
+    uint64_t sampled_cycles[PROFILE_OPCODES];
+    uint64_t samples[PROFILE_OPCODES];
+    unsigned prev; /* opcode of the previous dispatch */
+    bool started; /* there was a previous dispatch */
+    bool sampling; /* previous dispatch is being timed */
+    unsigned countdown; /* dispatches to the next sample */
+    uint64_t sample_start;
+    const Instr_t *prog;
+    const uint32_t *steps_before; /* of OptimizedProgram, or NULL */
+    uint64_t original_steps;
+} profile_t;
+
+extern profile_t Profile;
+
+void profile_start(const Instr_t *prog, uint32_t plen);
+void profile_count_original(uint32_t pc, unsigned opcode);
+void profile_report(const Instr_t *prog);
+/* Mnemonic of an instruction or superinstruction */
+const char* opcode_name(unsigned opcode);
+
+static inline uint64_t profile_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+#else
+    return 0; /* no cycle estimates */
+#endif
+}
+
+static inline void profile_dispatch(uint32_t pc, unsigned opcode) {
+    profile_t *p = &Profile;
+    if (p->sampling) {
+        p->sampled_cycles[p->prev] += profile_clock() - p->sample_start;
+        p->samples[p->prev]++;
+        p->sampling = false;
+    }
+    if (opcode >= PROFILE_OPCODES)
+        opcode = Instr_Break; /* as decoded */
+    if (pc < p->plen) {
+        p->pc_counts[pc]++;
+        if (p->steps_before)
+            profile_count_original(pc, opcode);
+    }
+    p->opcode_counts[opcode]++;
+    if (p->started)
+        p->pair_counts[p->prev][opcode]++;
+    p->prev = opcode;
+    p->started = true;
+    if (--p->countdown == 0) {
+        p->countdown = PROFILE_SAMPLE_PERIOD;
+        p->sampling = true;
+        p->sample_start = profile_clock();
+    }
+}
+
+#ifdef PROFILE
+#define PROFILE_DISPATCH(pc, opcode) profile_dispatch((pc), (opcode))
+#else
+#define PROFILE_DISPATCH(pc, opcode)
+#endif
+
+#endif /* PROFILE_H_ */
@@ -0,0 +1,248 @@
+/*  runner.c - running many instances of a virtual machine on a thread pool
+    Copyright (c) 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "common.h"
+
+/* The little of pthreads used here, on top of Win32 threads */
+#ifdef _WIN32
+typedef CRITICAL_SECTION pthread_mutex_t;
+typedef HANDLE pthread_t;
+#define pthread_mutex_init(m, attr) InitializeCriticalSection(m)
+#define pthread_mutex_lock(m) EnterCriticalSection(m)
+#define pthread_mutex_unlock(m) LeaveCriticalSection(m)
+#define pthread_mutex_destroy(m) DeleteCriticalSection(m)
+
+typedef struct {
+    void* (*start)(void*);
+    void *arg;
+} win32_start_t;
+
+static unsigned __stdcall win32_thread_main(void *arg) {
+    win32_start_t s = *(win32_start_t*)arg;
+    free(arg);
+    s.start(s.arg);
+    return 0;
+}
+
+static int pthread_create(pthread_t *thread, void *attr,
+                          void* (*start)(void*), void *arg) {
+    (void)attr;
+    win32_start_t *s = malloc(sizeof(win32_start_t));
+    if (!s)
+        return -1;
+    s->start = start;
+    s->arg = arg;
+    *thread = (HANDLE)_beginthreadex(NULL, 0, win32_thread_main, s, 0, NULL);
+    if (!*thread) {
+        free(s);
+        return -1;
+    }
+    return 0;
+}
+
+static int pthread_join(pthread_t thread, void **result) {
+    (void)result;
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    return 0;
+}
+
+static long online_processors(void) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+}
+#else
+static long online_processors(void) {
+    return sysconf(_SC_NPROCESSORS_ONLN);
+}
+#endif
+
+/* Instances not started yet by a worker, [next, end). The owner takes
+   them from the front, other workers steal the back half when they have
+   nothing left. */
+typedef struct {
+    pthread_mutex_t lock;
+    int next;
+    int end;
+} job_queue_t;
+
+typedef struct {
+    int count;
+    int nthreads;
+    instance_fn_t fn;
+    void *ctx;
+    job_queue_t *queues;
+    /* Output is written in instance order as soon as possible */
+    output_buffer_t *outputs;
+    bool *done;
+    int next_to_write;
+    int failed;
+    pthread_mutex_t output_lock;
+} pool_t;
+
+typedef struct {
+    pool_t *pool;
+    int id;
+} worker_t;
+
+/* Take an instance from own queue or steal some from the others,
+   -1 if all of them are started */
+static int take_job(pool_t *pool, int id) {
+    job_queue_t *own = &pool->queues[id];
+    pthread_mutex_lock(&own->lock);
+    if (own->next < own->end) {
+        int job = own->next++;
+        pthread_mutex_unlock(&own->lock);
+        return job;
+    }
+    pthread_mutex_unlock(&own->lock);
+
+    for (int k = 1; k < pool->nthreads; k++) {
+        job_queue_t *victim = &pool->queues[(id + k) % pool->nthreads];
+        pthread_mutex_lock(&victim->lock);
+        int left = victim->end - victim->next;
+        if (left == 0) {
+            pthread_mutex_unlock(&victim->lock);
+            continue;
+        }
+        /* Steal the back half, run its first instance right away */
+        int from = victim->end - (left + 1) / 2;
+        int to = victim->end;
+        victim->end = from;
+        pthread_mutex_unlock(&victim->lock);
+
+        pthread_mutex_lock(&own->lock);
+        own->next = from + 1;
+        own->end = to;
+        pthread_mutex_unlock(&own->lock);
+        return from;
+    }
+    return -1;
+}
+
+static void finish_job(pool_t *pool, int job, bool ok) {
+    pthread_mutex_lock(&pool->output_lock);
+    pool->done[job] = true;
+    if (!ok)
+        pool->failed++;
+    while (pool->next_to_write < pool->count
+           && pool->done[pool->next_to_write]) {
+        output_buffer_t *out = &pool->outputs[pool->next_to_write];
+        fwrite(out->data, 1, out->size, stdout);
+        free_output_buffer(out);
+        pool->next_to_write++;
+    }
+    pthread_mutex_unlock(&pool->output_lock);
+}
+
+static void* worker_main(void *arg) {
+    worker_t *worker = arg;
+    pool_t *pool = worker->pool;
+    int job;
+    while ((job = take_job(pool, worker->id)) != -1) {
+        set_output_buffer(&pool->outputs[job]);
+        bool ok = pool->fn(job, pool->ctx);
+        set_output_buffer(NULL);
+        finish_job(pool, job, ok);
+    }
+    return NULL;
+}
+
+/* Run count instances with fn on nthreads threads, or as many as there
+   are processors if nthreads is zero. Output of every instance is
+   collected separately and printed as a whole, in instance order.
+   Returns the number of instances that failed. */
+int run_instances(int count, int nthreads, instance_fn_t fn, void *ctx) {
+    assert(count >= 0);
+    assert(fn);
+    if (nthreads <= 0) {
+        long online = online_processors();
+        nthreads = online > 0 ? (int)online : 1;
+    }
+    if (nthreads > count)
+        nthreads = count > 0 ? count : 1;
+
+    pool_t pool = {.count = count, .nthreads = nthreads, .fn = fn, .ctx = ctx};
+    pool.queues = calloc(nthreads, sizeof(job_queue_t));
+    pool.outputs = calloc(count, sizeof(output_buffer_t));
+    pool.done = calloc(count, sizeof(bool));
+    worker_t *workers = calloc(nthreads, sizeof(worker_t));
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    if (!pool.queues || !workers || !threads
+        || ((!pool.outputs || !pool.done) && count > 0)) {
+        fprintf(stderr, "Failed to allocate memory for instances.\n");
+        exit(2);
+    }
+    pthread_mutex_init(&pool.output_lock, NULL);
+
+    /* Instances are dealt out evenly, stealing takes care of the rest */
+    for (int t = 0; t < nthreads; t++) {
+        pthread_mutex_init(&pool.queues[t].lock, NULL);
+        pool.queues[t].next = (int)((long long)count * t / nthreads);
+        pool.queues[t].end = (int)((long long)count * (t + 1) / nthreads);
+        workers[t].pool = &pool;
+        workers[t].id = t;
+    }
+    /* The calling thread is a worker too */
+    for (int t = 1; t < nthreads; t++) {
+        if (pthread_create(&threads[t], NULL, worker_main, &workers[t])) {
+            perror("pthread_create");
+            exit(2);
+        }
+    }
+    worker_main(&workers[0]);
+    for (int t = 1; t < nthreads; t++)
+        pthread_join(threads[t], NULL);
+    assert(pool.next_to_write == count);
+
+    for (int t = 0; t < nthreads; t++)
+        pthread_mutex_destroy(&pool.queues[t].lock);
+    pthread_mutex_destroy(&pool.output_lock);
+    free(threads);
+    free(workers);
+    free(pool.done);
+    free(pool.outputs);
+    free(pool.queues);
+    return pool.failed;
+}
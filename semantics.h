@@ -0,0 +1,359 @@
+/*  semantics.h - handlers of guest instructions generated from INSTRUCTIONS()
+    Copyright (c) 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#ifndef SEMANTICS_H_
+#define SEMANTICS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+
+#include "common.h"
+#include "decode.h"
+
+/* Engines expand the table of common.h with their own X macros and
+   get the semantics of each instruction from one of these, given its kind,
+   pops, pushes, guard and results:
+
+   SEM_CHECKED() - with all of the checks, on the stack in SEM_CPU->stack[]
+       through push(), pop() and pick() below. SEM_BAIL() leaves with
+       SEM_LEAVE() if popping failed, as instructions do before they push.
+   SEM_CACHED() - on the top of stack cached in SEM_TOS, the rest of it in
+       SEM_STACK[] up to SEM_SP, whose slot is stale. Whenever the
+       instruction would fail, or needs the top of stack in memory,
+       the statement slow is done instead with nothing changed. It has
+       to leave the handler, e.g. for one made with SEM_CHECKED().
+   SEM_UNCHECKED() - on the stack in memory, for programs that passed
+       verify_program(). Only value dependent errors are checked, those
+       go to slow.
+
+   Engines define the hooks used: SEM_CPU, SEM_LEAVE(), SEM_SP, SEM_STACK,
+   SEM_TOS, SEM_IMM - the immediate operand - and SEM_BRANCH(), which adds
+   it to PC or does whatever the engine takes a branch with.
+   The macros expand to a block, break and goto in hooks go past it. */
+
+/* What push() and pop() do after reporting an error. For engines running
+   generated code it is to leave the code. */
+#ifndef STACK_FAULT
+#define STACK_FAULT(result) return result
+#endif
+
+static inline void push(cpu_t *pcpu, uint32_t v) {
+    assert(pcpu);
+    if (pcpu->sp >= STACK_CAPACITY-1) {
+        output_printf("Stack overflow\n");
+        pcpu->state = Cpu_Break;
+        STACK_FAULT();
+    }
+    pcpu->stack[++pcpu->sp] = v;
+}
+
+static inline uint32_t pop(cpu_t *pcpu) {
+    assert(pcpu);
+    if (pcpu->sp < 0) {
+        output_printf("Stack underflow\n");
+        pcpu->state = Cpu_Break;
+        STACK_FAULT(0);
+    }
+    return pcpu->stack[pcpu->sp--];
+}
+
+/* Negative positions would read above SP or outside the stack */
+static inline uint32_t pick(cpu_t *pcpu, int32_t pos) {
+    assert(pcpu);
+    if (pos < 0 || pcpu->sp - 1 < pos) {
+        output_printf("Out of bound picking\n");
+        pcpu->state = Cpu_Break;
+        return 0;
+    }
+    return pcpu->stack[pcpu->sp - pos];
+}
+
+/* Case labels of instructions without an immediate and with one.
+   Break is decoded together with undefined instructions. */
+#define SHORT_CASE(name, opcode, imm, pops, pushes, kind, guard, results) \
+    SHORT_CASE_##imm(name, kind)
+#define SHORT_CASE_0(name, kind) SHORT_CASE_##kind(name)
+#define SHORT_CASE_1(name, kind)
+#define SHORT_CASE_Stack(name) case Instr_##name:
+#define SHORT_CASE_Branch(name) case Instr_##name:
+#define SHORT_CASE_Print(name) case Instr_##name:
+#define SHORT_CASE_Pick(name) case Instr_##name:
+#define SHORT_CASE_Halt(name) case Instr_##name:
+#define SHORT_CASE_Break(name)
+#define LONG_CASE(name, opcode, imm, pops, pushes, kind, guard, results) \
+    LONG_CASE_##imm(name)
+#define LONG_CASE_0(name)
+#define LONG_CASE_1(name) case Instr_##name:
+
+/* Decode raw_instr found at addr of a program of len words. Undefined
+   instructions equal to Break, and so do those whose immediate does not
+   fit into the program, which is reported if report is set. */
+static inline decode_t decode_instruction(Instr_t raw_instr,
+                                          const Instr_t *prog, uint32_t addr,
+                                          uint32_t len, bool report) {
+    decode_t result = {0};
+    result.opcode = raw_instr;
+    switch (raw_instr) {
+    INSTRUCTIONS(SHORT_CASE)
+        result.length = 1;
+        break;
+    INSTRUCTIONS(LONG_CASE)
+        result.length = 2;
+        if (!(addr+1 < len)) {
+            if (report)
+                output_printf("PC+1 out of bounds\n");
+            result.length = 1;
+            result.opcode = Instr_Break;
+            break;
+        }
+        result.immediate = (int32_t)prog[addr+1];
+        break;
+    case Instr_Break:
+    default: /* Undefined instructions equal to Break */
+        result.length = 1;
+        result.opcode = Instr_Break;
+        break;
+    }
+    return result;
+}
+
+/* Decode raw_instr fetched at PC of *pcpu */
+static inline decode_t decode(Instr_t raw_instr, const cpu_t *pcpu) {
+    assert(pcpu);
+    return decode_instruction(raw_instr, pcpu->pmem, pcpu->pc, pcpu->plen,
+                              true);
+}
+
+static inline decode_t decode_at_address(const Instr_t* prog, uint32_t addr,
+                                         uint32_t len) {
+    assert(addr < len);
+    return decode_instruction(prog[addr], prog, addr, len, false);
+}
+
+/*** Generated semantics ***/
+
+/* Operands of the table */
+#define IMM SEM_IMM
+
+#define SEM_CHECKED(kind, pops, pushes, guard, results) \
+    SEM_CHECKED_##kind(pops, pushes, guard, results)
+#define SEM_CACHED(kind, pops, pushes, guard, results, slow) \
+    SEM_CACHED_##kind(pops, pushes, guard, results, slow)
+#define SEM_UNCHECKED(kind, pops, pushes, guard, results, slow) \
+    SEM_UNCHECKED_##kind(pops, pushes, guard, results, slow)
+
+/* Result i of pushes ones, zero if there is no such */
+#define SEM_RESULT(pushes, i, results) SEM_RESULT_##pushes##_##i results
+#define SEM_RESULT_0_1(x) 0
+#define SEM_RESULT_0_2(x) 0
+#define SEM_RESULT_0_3(x) 0
+#define SEM_RESULT_1_1(x) x
+#define SEM_RESULT_1_2(x) 0
+#define SEM_RESULT_1_3(x) 0
+#define SEM_RESULT_2_1(x, y) x
+#define SEM_RESULT_2_2(x, y) y
+#define SEM_RESULT_2_3(x, y) 0
+#define SEM_RESULT_3_1(x, y, z) x
+#define SEM_RESULT_3_2(x, y, z) y
+#define SEM_RESULT_3_3(x, y, z) z
+
+#define SEM_RESULTS(pushes, results) \
+    uint32_t r1 = SEM_RESULT(pushes, 1, results); \
+    uint32_t r2 = SEM_RESULT(pushes, 2, results); \
+    uint32_t r3 = SEM_RESULT(pushes, 3, results); \
+    (void)r1; (void)r2; (void)r3;
+
+#define SEM_LAST_RESULT(pushes) \
+    ((pushes) == 3 ? r3 : (pushes) == 2 ? r2 : r1)
+
+#define SEM_UNUSED_OPERANDS() (void)a; (void)b; (void)c;
+
+#define SEM_BAIL() if (SEM_CPU->state != Cpu_Running) SEM_LEAVE();
+
+/* Checked */
+#define SEM_CHECKED_Stack(pops, pushes, guard, results) { \
+    uint32_t a = (pops) >= 1 ? pop(SEM_CPU) : 0; \
+    uint32_t b = (pops) >= 2 ? pop(SEM_CPU) : 0; \
+    uint32_t c = (pops) >= 3 ? pop(SEM_CPU) : 0; \
+    SEM_UNUSED_OPERANDS(); \
+    if ((pops) > 0 && (pushes) > 0) \
+        SEM_BAIL(); \
+    if (!(guard)) { \
+        SEM_CPU->state = Cpu_Break; \
+        SEM_LEAVE(); \
+    } \
+    SEM_RESULTS(pushes, results); \
+    if ((pushes) >= 1) push(SEM_CPU, r1); \
+    if ((pushes) >= 2) push(SEM_CPU, r2); \
+    if ((pushes) >= 3) push(SEM_CPU, r3); \
+}
+
+#define SEM_CHECKED_Branch(pops, pushes, guard, results) { \
+    uint32_t a = (pops) >= 1 ? pop(SEM_CPU) : 0; \
+    (void)a; \
+    if ((pops) > 0) \
+        SEM_BAIL(); \
+    if (guard) \
+        SEM_BRANCH(); \
+}
+
+#define SEM_CHECKED_Print(pops, pushes, guard, results) { \
+    uint32_t a = pop(SEM_CPU); \
+    SEM_BAIL(); \
+    output_value(a); \
+}
+
+#define SEM_CHECKED_Pick(pops, pushes, guard, results) { \
+    uint32_t a = pop(SEM_CPU); \
+    SEM_BAIL(); \
+    push(SEM_CPU, pick(SEM_CPU, a)); \
+}
+
+#define SEM_CHECKED_Halt(pops, pushes, guard, results) { \
+    SEM_CPU->state = Cpu_Halted; \
+}
+
+#define SEM_CHECKED_Break(pops, pushes, guard, results) { \
+    SEM_CPU->state = Cpu_Break; \
+}
+
+/* Top of stack cached. There have to be items for the cached one to be
+   spilled if nothing is popped, and to be reloaded if nothing is pushed. */
+#define SEM_MIN_SP(pops, pushes) \
+    ((pops) == 0 ? ((pushes) > 0 ? 0 : -1) \
+                 : (pushes) == 0 ? (pops) : (pops) - 1)
+
+#define SEM_FITS(pops, pushes) \
+    (SEM_SP >= SEM_MIN_SP(pops, pushes) \
+     && ((pushes) <= (pops) \
+         || SEM_SP + (pushes) - (pops) < STACK_CAPACITY))
+
+#define SEM_CACHED_Stack(pops, pushes, guard, results, slow) { \
+    if (!SEM_FITS(pops, pushes)) \
+        slow; \
+    uint32_t a = SEM_TOS; \
+    uint32_t b = (pops) >= 2 ? SEM_STACK[SEM_SP-1] : 0; \
+    uint32_t c = (pops) >= 3 ? SEM_STACK[SEM_SP-2] : 0; \
+    SEM_UNUSED_OPERANDS(); \
+    if (!(guard)) \
+        slow; \
+    SEM_RESULTS(pushes, results); \
+    if ((pops) == 0 && (pushes) > 0) \
+        SEM_STACK[SEM_SP] = SEM_TOS; \
+    if ((pushes) >= 2) SEM_STACK[SEM_SP - (pops) + 1] = r1; \
+    if ((pushes) >= 3) SEM_STACK[SEM_SP - (pops) + 2] = r2; \
+    SEM_SP += (pushes) - (pops); \
+    if ((pushes) > 0) \
+        SEM_TOS = SEM_LAST_RESULT(pushes); \
+    else if ((pops) > 0) \
+        SEM_TOS = SEM_STACK[SEM_SP]; \
+}
+
+#define SEM_CACHED_Branch(pops, pushes, guard, results, slow) { \
+    if (!SEM_FITS(pops, 0)) \
+        slow; \
+    uint32_t a = SEM_TOS; \
+    (void)a; \
+    if ((pops) > 0) { \
+        SEM_SP -= (pops); \
+        SEM_TOS = SEM_STACK[SEM_SP]; \
+    } \
+    if (guard) \
+        SEM_BRANCH(); \
+}
+
+#define SEM_CACHED_Print(pops, pushes, guard, results, slow) { \
+    if (!SEM_FITS(1, 0)) \
+        slow; \
+    output_value(SEM_TOS); \
+    SEM_TOS = SEM_STACK[--SEM_SP]; \
+}
+
+/* The position is replaced by the item it points to under it */
+#define SEM_CACHED_Pick(pops, pushes, guard, results, slow) { \
+    if (!((int32_t)SEM_TOS >= 0 && (int32_t)SEM_TOS <= SEM_SP - 2)) \
+        slow; \
+    SEM_TOS = SEM_STACK[SEM_SP - 1 - (int32_t)SEM_TOS]; \
+}
+
+#define SEM_CACHED_Halt(pops, pushes, guard, results, slow) {slow;}
+#define SEM_CACHED_Break(pops, pushes, guard, results, slow) {slow;}
+
+/* Unchecked */
+#define SEM_UNCHECKED_Stack(pops, pushes, guard, results, slow) { \
+    uint32_t a = (pops) >= 1 ? SEM_STACK[SEM_SP] : 0; \
+    uint32_t b = (pops) >= 2 ? SEM_STACK[SEM_SP-1] : 0; \
+    uint32_t c = (pops) >= 3 ? SEM_STACK[SEM_SP-2] : 0; \
+    SEM_UNUSED_OPERANDS(); \
+    if (!(guard)) \
+        slow; \
+    SEM_RESULTS(pushes, results); \
+    if ((pushes) >= 1) SEM_STACK[SEM_SP - (pops) + 1] = r1; \
+    if ((pushes) >= 2) SEM_STACK[SEM_SP - (pops) + 2] = r2; \
+    if ((pushes) >= 3) SEM_STACK[SEM_SP - (pops) + 3] = r3; \
+    SEM_SP += (pushes) - (pops); \
+}
+
+#define SEM_UNCHECKED_Branch(pops, pushes, guard, results, slow) { \
+    uint32_t a = (pops) >= 1 ? SEM_STACK[SEM_SP] : 0; \
+    (void)a; \
+    SEM_SP -= (pops); \
+    if (guard) \
+        SEM_BRANCH(); \
+}
+
+#define SEM_UNCHECKED_Print(pops, pushes, guard, results, slow) { \
+    output_value(SEM_STACK[SEM_SP--]); \
+}
+
+#define SEM_UNCHECKED_Pick(pops, pushes, guard, results, slow) { \
+    if (!((int32_t)SEM_STACK[SEM_SP] >= 0 \
+          && (int32_t)SEM_STACK[SEM_SP] <= SEM_SP - 2)) \
+        slow; \
+    SEM_STACK[SEM_SP] = SEM_STACK[SEM_SP - 1 - (int32_t)SEM_STACK[SEM_SP]]; \
+}
+
+#define SEM_UNCHECKED_Halt(pops, pushes, guard, results, slow) {slow;}
+#define SEM_UNCHECKED_Break(pops, pushes, guard, results, slow) {slow;}
+
+/* Choose macro m for instructions of some kinds only, for example,
+   INSTRUCTIONS(X) with X(...) being SEM_NON_BRANCH(kind, M)(...) */
+#define SEM_NON_BRANCH(kind, m) SEM_NON_BRANCH_##kind(m)
+#define SEM_NON_BRANCH_Stack(m) m
+#define SEM_NON_BRANCH_Branch(m) SEM_NOTHING
+#define SEM_NON_BRANCH_Print(m) m
+#define SEM_NON_BRANCH_Pick(m) m
+#define SEM_NON_BRANCH_Halt(m) m
+#define SEM_NON_BRANCH_Break(m) m
+#define SEM_NOTHING(...)
+
+#endif /* SEMANTICS_H_ */
@@ -0,0 +1,513 @@
+/*  spmd.c - an interpreter running many instances of a program together,
+    one per lane of host vector registers, for a stack virtual machine.
+    Copyright (c) 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <math.h>
+#include <stdatomic.h>
+
+#include "common.h"
+#include "decode.h"
+
+/* Instances of a group share the program counter and the stack pointer
+   while their paths agree, and every instruction is simulated for all of
+   them at once. Stack items are vectors with an element per instance. */
+#define LANES 8
+
+/* Aligned for the widest instruction set, not the one compiled for */
+typedef uint32_t lanes_t __attribute__((vector_size(LANES * sizeof(uint32_t)),
+                                        aligned(LANES * sizeof(uint32_t))));
+typedef unsigned lane_set_t; /* bit i is lane i */
+
+static const lanes_t lane_bits = {1, 2, 4, 8, 16, 32, 64, 128};
+_Static_assert(LANES == 8, "lane_bits do not match LANES");
+
+/* The simulation loop is compiled for AVX2 as well where the host can
+   choose an implementation at load time. Without it, vectors are lowered
+   to SSE2 or to scalar code. */
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
+#define LANE_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define LANE_TARGETS
+#endif
+
+/* Instances simulated together */
+typedef struct {
+    lanes_t rows[STACK_CAPACITY + 1]; /* see ROW() */
+    uint32_t pc[LANES];
+    int32_t sp[LANES];
+    cpu_state_t state[LANES];
+    long long steps[LANES];
+    output_buffer_t output[LANES]; /* collected until the group ends */
+    lane_set_t running;
+    int count; /* lanes in use */
+} group_t;
+
+/* Stack item i of all lanes. Row -1 is scratch for the top of stack
+   of an empty stack. */
+#define ROW(pg, i) ((pg)->rows[(i) + 1])
+
+/* Lanes of set as a vector mask. Vectors are not passed to functions,
+   as their ABI depends on the instruction set. */
+#define LANE_MASK(set) ((lanes_t)((((lanes_t){0} + (set)) & lane_bits) != 0))
+
+/* Lanes among those for which all bits of *mask are set */
+static inline lane_set_t lane_set(const lanes_t *mask, lane_set_t among) {
+    lane_set_t set = 0;
+    for (int i = 0; i < LANES; i++)
+        set |= ((*mask)[i] & 1u) << i;
+    return set & among;
+}
+
+/* Lanes to run next. Lanes at the lowest PC go first, so that those
+   left behind by a branch catch up and the group reconverges where the
+   paths join. A verified program has the same stack depth at the same PC
+   on all paths, in others lanes arriving with another SP wait. */
+static lane_set_t next_lanes(const group_t *pg) {
+    int first = -1;
+    for (int i = 0; i < pg->count; i++)
+        if (pg->running >> i & 1 && (first == -1 || pg->pc[i] < pg->pc[first]))
+            first = i;
+    lane_set_t set = 0;
+    for (int i = 0; i < pg->count; i++)
+        if (pg->running >> i & 1 && pg->pc[i] == pg->pc[first]
+            && pg->sp[i] == pg->sp[first])
+            set |= 1u << i;
+    return set;
+}
+
+static void lanes_printf(group_t *pg, lane_set_t set, const char *message) {
+    for (int i = 0; i < pg->count; i++) {
+        if (set >> i & 1) {
+            set_output_buffer(&pg->output[i]);
+            output_printf("%s", message);
+        }
+    }
+}
+
+/* The top of stack is kept in a vector variable, rows of the items below
+   it are in memory. Every row has all lanes, including inactive ones,
+   and is written back as a whole. Depths count from the current SP. */
+#define ITEM(depth) (ROW(pg, sp - (depth)))
+#define BLEND(old, value) (((value) & mask) | ((old) & ~mask))
+#define SET_TOS(value) (tos = BLEND(tos, (value)))
+#define SET_ITEM(depth, value) (ITEM(depth) = BLEND(ITEM(depth), (value)))
+#define FLUSH_TOS() (ITEM(0) = tos)
+/* Stack pointer moves, the new top of stack gets value */
+#define PUSH(value) do { \
+        lanes_t value_ = (value); \
+        FLUSH_TOS(); \
+        sp++; \
+        tos = BLEND(ITEM(0), value_); \
+    } while (0)
+#define POP() do { \
+        FLUSH_TOS(); \
+        sp--; \
+        tos = ITEM(0); \
+    } while (0)
+#define POP_SET(value) do { \
+        lanes_t value_ = (value); \
+        FLUSH_TOS(); \
+        sp--; \
+        tos = BLEND(ITEM(0), value_); \
+    } while (0)
+
+/* The data stack is the same in all active lanes, so an instruction
+   failing on it fails in all of them. Errors are reported as pop() and
+   push() of other interpreters do: one message for every missing item,
+   and for the only item that does not fit. */
+#define NEED(pops, pushes) \
+    if (sp + 1 < (pops)) { \
+        for (int k = sp + 1; k < (pops); k++) \
+            lanes_printf(pg, active, "Stack underflow\n"); \
+        FLUSH_TOS(); \
+        sp = -1; \
+        tos = ITEM(0); \
+        goto stop; \
+    } \
+    if (sp - (pops) + (pushes) >= STACK_CAPACITY) { \
+        lanes_printf(pg, active, "Stack overflow\n"); \
+        FLUSH_TOS(); \
+        sp = STACK_CAPACITY - 1; \
+        tos = ITEM(0); \
+        goto stop; \
+    }
+
+/* Lanes of failed leave the group after the current instruction with
+   their stack pointer at failed_sp */
+static void stop_lanes(group_t *pg, lane_set_t failed, uint32_t next_pc,
+                       int32_t failed_sp, long long steps) {
+    for (int i = 0; i < pg->count; i++) {
+        if (failed >> i & 1) {
+            pg->state[i] = Cpu_Break;
+            pg->pc[i] = next_pc;
+            pg->sp[i] = failed_sp;
+            pg->steps[i] += steps;
+        }
+    }
+    pg->running &= ~failed;
+}
+
+/* Simulate the lanes of active from their common PC and SP until their
+   paths split, they stop or run out of steplimit */
+LANE_TARGETS
+static void run_lanes(group_t *pg, lane_set_t active, const Instr_t *prog,
+                      const uint8_t *opcodes, uint32_t len,
+                      long long steplimit) {
+    int first = __builtin_ctz(active);
+    uint32_t pc = pg->pc[first];
+    int32_t sp = pg->sp[first];
+    long long budget = LLONG_MAX;
+    for (int i = 0; i < pg->count; i++)
+        if (active >> i & 1 && steplimit - pg->steps[i] < budget)
+            budget = steplimit - pg->steps[i];
+    lanes_t mask = LANE_MASK(active);
+    lanes_t tos = ITEM(0);
+    cpu_state_t state = Cpu_Running;
+    bool split = false;
+    long long steps = 0;
+
+    while (steps < budget) {
+        if (!(pc < len)) {
+            lanes_printf(pg, active, "PC out of bounds\n");
+            pg->running &= ~active;
+            for (int i = 0; i < pg->count; i++)
+                if (active >> i & 1)
+                    pg->state[i] = Cpu_Break;
+            break;
+        }
+        uint8_t opcode = opcodes[pc];
+        int32_t immediate = instruction_length(opcode) == 2
+                            ? (int32_t)prog[pc + 1] : 0;
+        uint32_t next_pc = pc + instruction_length(opcode);
+        lane_set_t failed = 0;
+        switch (opcode) {
+        case Instr_Nop:
+            break;
+        case Instr_Halt:
+            state = Cpu_Halted;
+            goto stop;
+        case Instr_Push:
+            NEED(0, 1);
+            PUSH((lanes_t){0} + (uint32_t)immediate);
+            break;
+        case Instr_Print:
+            NEED(1, 0);
+            for (int i = 0; i < pg->count; i++) {
+                if (active >> i & 1) {
+                    set_output_buffer(&pg->output[i]);
+                    output_value(tos[i]);
+                }
+            }
+            POP();
+            break;
+        case Instr_Swap: {
+            NEED(2, 2);
+            lanes_t second = ITEM(1);
+            SET_ITEM(1, tos);
+            SET_TOS(second);
+            break;
+        }
+        case Instr_Dup:
+            NEED(1, 2);
+            PUSH(tos);
+            break;
+        case Instr_Over:
+            NEED(2, 3);
+            PUSH(ITEM(1));
+            break;
+        case Instr_Rot: {
+            NEED(3, 3);
+            lanes_t second = ITEM(1), third = ITEM(2);
+            SET_ITEM(2, tos);
+            SET_ITEM(1, third);
+            SET_TOS(second);
+            break;
+        }
+        case Instr_Inc:
+            NEED(1, 1);
+            SET_TOS(tos + 1);
+            break;
+        case Instr_Dec:
+            NEED(1, 1);
+            SET_TOS(tos - 1);
+            break;
+        case Instr_Drop:
+            NEED(1, 0);
+            POP();
+            break;
+        /* Binary operations take the top of stack as their left operand */
+        case Instr_Add:
+            NEED(2, 1);
+            POP_SET(tos + ITEM(1));
+            break;
+        case Instr_Sub:
+            NEED(2, 1);
+            POP_SET(tos - ITEM(1));
+            break;
+        case Instr_Mul:
+            NEED(2, 1);
+            POP_SET(tos * ITEM(1));
+            break;
+        case Instr_And:
+            NEED(2, 1);
+            POP_SET(tos & ITEM(1));
+            break;
+        case Instr_Or:
+            NEED(2, 1);
+            POP_SET(tos | ITEM(1));
+            break;
+        case Instr_Xor:
+            NEED(2, 1);
+            POP_SET(tos ^ ITEM(1));
+            break;
+        /* Shift counts are taken modulo 32 as by the host shifts
+           of the scalar interpreters */
+        case Instr_SHL:
+            NEED(2, 1);
+            POP_SET(tos << (ITEM(1) & 31));
+            break;
+        case Instr_SHR:
+            NEED(2, 1);
+            POP_SET(tos >> (ITEM(1) & 31));
+            break;
+        case Instr_Mod: {
+            NEED(2, 1);
+            /* Lanes dividing by zero stop, the rest divide by one */
+            lanes_t divisor = ITEM(1);
+            lanes_t zero = (lanes_t)(divisor == 0);
+            failed = lane_set(&zero, active);
+            if (failed) {
+                stop_lanes(pg, failed, next_pc, sp - 2, steps + 1);
+                active &= ~failed;
+                mask = LANE_MASK(active);
+            }
+            POP_SET(tos % (divisor | (zero & 1)));
+            break;
+        }
+        case Instr_Rand:
+            NEED(0, 1);
+            PUSH(tos);
+            for (int i = 0; i < pg->count; i++)
+                if (active >> i & 1)
+                    tos[i] = rand();
+            break;
+        case Instr_SQRT:
+            NEED(1, 1);
+            for (int i = 0; i < pg->count; i++)
+                if (active >> i & 1)
+                    tos[i] = sqrt(tos[i]);
+            break;
+        case Instr_Pick:
+            /* Done in memory, items are picked at any depth */
+            NEED(1, 1);
+            FLUSH_TOS();
+            sp--;
+            for (int i = 0; i < pg->count; i++) {
+                if (!(active >> i & 1))
+                    continue;
+                int32_t pos = (int32_t)ITEM(-1)[i];
+                uint32_t value = 0;
+                if (pos < 0 || sp - 1 < pos) {
+                    set_output_buffer(&pg->output[i]);
+                    output_printf("Out of bound picking\n");
+                    failed |= 1u << i;
+                } else if (sp - pos < STACK_CAPACITY)
+                    value = ITEM(pos)[i];
+                ITEM(-1)[i] = value;
+            }
+            sp++;
+            tos = ITEM(0);
+            if (failed) {
+                stop_lanes(pg, failed, next_pc, sp, steps + 1);
+                active &= ~failed;
+                mask = LANE_MASK(active);
+            }
+            break;
+        case Instr_JE:
+        case Instr_JNE:
+        case Instr_Jump: {
+            lane_set_t taken = active;
+            if (opcode != Instr_Jump) {
+                NEED(1, 0);
+                lanes_t cond = (lanes_t)(tos == 0);
+                if (opcode == Instr_JNE)
+                    cond = ~cond;
+                POP();
+                taken = lane_set(&cond, active);
+            }
+            uint32_t target = next_pc + immediate;
+            if (taken == active)
+                next_pc = target;
+            else if (taken) {
+                /* Paths split, lanes are regrouped */
+                for (int i = 0; i < pg->count; i++)
+                    if (active >> i & 1)
+                        pg->pc[i] = taken >> i & 1 ? target : next_pc;
+                split = true;
+            }
+            break;
+        }
+        case Instr_Break:
+        default:
+            goto stop;
+        }
+        pc = next_pc;
+        steps++;
+        if (split || !active)
+            break;
+        continue;
+stop:
+        /* Stops are counted as steps and advance PC */
+        pc = next_pc;
+        steps++;
+        if (state == Cpu_Running)
+            state = Cpu_Break;
+        pg->running &= ~active;
+        for (int i = 0; i < pg->count; i++)
+            if (active >> i & 1)
+                pg->state[i] = state;
+        break;
+    }
+    FLUSH_TOS();
+    for (int i = 0; i < pg->count; i++) {
+        if (active >> i & 1) {
+            if (!split)
+                pg->pc[i] = pc;
+            pg->sp[i] = sp;
+            pg->steps[i] += steps;
+            if (pg->steps[i] == steplimit)
+                pg->running &= ~(1u << i);
+        }
+    }
+}
+
+/* Simulate all lanes of a group until they stop or run steplimit
+   instructions each */
+static void run_group(group_t *pg, const Instr_t *prog, const uint8_t *opcodes,
+                      uint32_t len, long long steplimit) {
+    lane_set_t active;
+    while ((active = next_lanes(pg)) != 0)
+        run_lanes(pg, active, prog, opcodes, len, steplimit);
+}
+
+/* State shared by all groups */
+typedef struct {
+    const Instr_t *prog;
+    const uint8_t *opcodes; /* see decode_program() */
+    uint32_t len;
+    int count; /* instances */
+    long long steplimit;
+    _Atomic long long total_steps; /* for --perf-counters */
+} shared_t;
+
+/* Simulate the instances of group index, then print output and final
+   state of each of them in turn. Returns true if all of them succeeded. */
+static bool run_group_instance(int index, void *ctx) {
+    shared_t *shared = ctx;
+    /* Vectors are aligned to their size */
+    group_t *pg = aligned_alloc(_Alignof(group_t), sizeof(group_t));
+    if (!pg) {
+        fprintf(stderr, "Failed to allocate memory for instances.\n");
+        exit(2);
+    }
+    memset(pg, 0, sizeof(group_t));
+    int base = index * LANES;
+    pg->count = shared->count - base < LANES ? shared->count - base : LANES;
+    for (int i = 0; i < pg->count; i++) {
+        pg->sp[i] = -1;
+        pg->state[i] = Cpu_Running;
+        if (InstanceInputs) {
+            ROW(pg, 0)[i] = InstanceInputs[base + i];
+            pg->sp[i] = 0;
+        }
+        if (shared->steplimit > 0)
+            pg->running |= 1u << i;
+    }
+
+    /* Lanes write to their own buffers */
+    output_buffer_t *sink = set_output_buffer(NULL);
+    timing_mark(Timing_Execute);
+    run_group(pg, shared->prog, shared->opcodes, shared->len,
+              shared->steplimit);
+    set_output_buffer(sink);
+
+    bool ok = true;
+    for (int i = 0; i < pg->count; i++) {
+        output_bytes(pg->output[i].data, pg->output[i].size);
+        free_output_buffer(&pg->output[i]);
+        cpu_t cpu = make_cpu(shared->prog, shared->len);
+        cpu.pc = pg->pc[i];
+        cpu.sp = pg->sp[i];
+        cpu.state = pg->state[i];
+        cpu.steps = pg->steps[i];
+        for (int32_t k = 0; k <= cpu.sp; k++)
+            cpu.stack[k] = ROW(pg, k)[i];
+        atomic_fetch_add(&shared->total_steps, cpu.steps);
+        ok = report_cpu_state(&cpu, shared->steplimit) && ok;
+    }
+    free(pg);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    long long steplimit = parse_args(argc, argv, Args_Instances | Args_Inputs);
+    cpu_t cpu = init_cpu();
+    uint8_t *opcodes = malloc((size_t)cpu.plen + 1);
+    if (!opcodes) {
+        fprintf(stderr, "Failed to allocate memory for decoded program.\n");
+        exit(2);
+    }
+    decode_program(cpu.pmem, cpu.plen, opcodes, NULL);
+
+    /* Without --instances= or --inputs=, there is one instance */
+    shared_t shared = {.prog = cpu.pmem, .opcodes = opcodes, .len = cpu.plen,
+                       .count = RunInstances ? RunInstances : 1,
+                       .steplimit = steplimit};
+    int ngroups = (shared.count + LANES - 1) / LANES;
+    bool ok;
+    perf_counters_start();
+    if (RunInstances)
+        ok = run_instances(ngroups, RunThreads,
+                           run_group_instance, &shared) == 0;
+    else
+        ok = run_group_instance(0, &shared);
+    timing_mark(Timing_Teardown);
+    perf_counters_stop(shared.total_steps);
+
+    free(opcodes);
+    unload_program();
+    return ok ? 0 : 1;
+}
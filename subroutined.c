@@ -36,327 +36,123 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <math.h>
 
 #include "common.h"
+#include "semantics.h"
 
 static inline Instr_t fetch(const cpu_t *pcpu) {
     assert(pcpu);
-    assert(pcpu->pc < PROGRAM_SIZE);
+    assert(pcpu->pc < pcpu->plen);
     return pcpu->pmem[pcpu->pc];
 };
 
 static inline Instr_t fetch_checked(cpu_t *pcpu) {
-    if (!(pcpu->pc < PROGRAM_SIZE)) {
-        printf("PC out of bounds\n");
+    if (!(pcpu->pc < pcpu->plen)) {
+        output_printf("PC out of bounds\n");
         pcpu->state = Cpu_Break;
         return Instr_Break;
     }
     return fetch(pcpu);
 }
 
-static inline decode_t decode(Instr_t raw_instr, const cpu_t *pcpu) {
-    assert(pcpu);
-    decode_t result = {0};
-    result.opcode = raw_instr;
-    switch (raw_instr) {
-    case Instr_Nop:
-    case Instr_Halt:
-    case Instr_Print:
-    case Instr_Swap:
-    case Instr_Dup:
-    case Instr_Inc:
-    case Instr_Add:
-    case Instr_Sub:
-    case Instr_Mul:
-    case Instr_Rand:
-    case Instr_Dec:
-    case Instr_Drop:
-    case Instr_Over:
-    case Instr_Mod:
-    case Instr_And:
-    case Instr_Or:
-    case Instr_Xor:
-    case Instr_SHL:
-    case Instr_SHR:
-    case Instr_Rot:
-    case Instr_SQRT:
-    case Instr_Pick:
-        result.length = 1;
-        break;
-    case Instr_Push:
-    case Instr_JNE:
-    case Instr_JE:
-    case Instr_Jump:
-        if (!(pcpu->pc+1 < PROGRAM_SIZE)) {
-            printf("PC+1 out of bounds\n");
-            result.length = 1;
-            result.opcode = Instr_Break;
-            break;
-        }
-        result.length = 2;
-        result.immediate = (int32_t)pcpu->pmem[pcpu->pc+1];
-        break;
-    case Instr_Break:
-    default: /* Undefined instructions equal to Break */
-        result.length = 1;
-        result.opcode = Instr_Break;
-        break;
-    }
-    return result;
-}
-
 static inline decode_t fetch_decode(cpu_t *pcpu) {
     return decode(fetch_checked(pcpu), pcpu);
 }
 
 /*** Service routines ***/
-#define BAIL_ON_ERROR() if (pcpu->state != Cpu_Running) return;
-
-static inline void push(cpu_t *pcpu, uint32_t v) {
-    assert(pcpu);
-    if (pcpu->sp >= STACK_CAPACITY-1) {
-        printf("Stack overflow\n");
-        pcpu->state = Cpu_Break;
-        return;
-    }
-    pcpu->stack[++pcpu->sp] = v;
-}
-
-static inline uint32_t pop(cpu_t *pcpu) {
-    assert(pcpu);
-    if (pcpu->sp < 0) {
-        printf("Stack underflow\n");
-        pcpu->state = Cpu_Break;
-        return 0;
-    }
-    return pcpu->stack[pcpu->sp--];
-}
-
-static inline uint32_t pick(cpu_t *pcpu, int32_t pos) {
-    assert(pcpu);
-    if (pcpu->sp - 1 < pos) {
-        printf("Out of bound picking\n");
-        pcpu->state = Cpu_Break;
-        return 0;
-    }
-    return pcpu->stack[pcpu->sp - pos];
-}
+#define SEM_CPU pcpu
+#define SEM_LEAVE() return
+#define SEM_IMM pdecoded->immediate
+#define SEM_BRANCH() pcpu->pc += pdecoded->immediate
+#define SEM_SP pcpu->sp
+#define SEM_STACK pcpu->stack
+#define SEM_TOS tos
 
 typedef void (*service_routine_t)(cpu_t *pcpu, decode_t* pdecode);
 
-void sr_Nop(cpu_t *pcpu, decode_t *pdecoded) {
-    /* Do nothing */
-}
-
-void sr_Halt(cpu_t *pcpu, decode_t *pdecoded) {
-    pcpu->state = Cpu_Halted;
-    return;
-}
-
-void sr_Push(cpu_t *pcpu, decode_t *pdecoded) {
-    push(pcpu, pdecoded->immediate);
-}
-
-void sr_Print(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    printf("[%d]\n", tmp1);
-}
-
-void sr_Swap(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1);
-    push(pcpu, tmp2);
+#define SERVICE_ROUTINE(name, opcode, imm, pops, pushes, kind, guard, results) \
+static void sr_##name(cpu_t *pcpu, decode_t *pdecoded) { \
+    SEM_CHECKED(kind, pops, pushes, guard, results); \
 }
 
-void sr_Dup(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1);
-    push(pcpu, tmp1);
-}
+INSTRUCTIONS(SERVICE_ROUTINE)
 
-void sr_Over(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp2);
-    push(pcpu, tmp1);
-    push(pcpu, tmp2);
-}
+#define SR_ENTRY(name, opcode, imm, pops, pushes, kind, guard, results) \
+        [Instr_##name] = &sr_##name,
 
-void sr_Inc(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1+1);
-}
-
-void sr_Add(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 + tmp2);
-}
-
-void sr_Sub(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 - tmp2);
-}
-
-void sr_Mod(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    if (tmp2 == 0) {
-        pcpu->state = Cpu_Break;
-        return;
-    }
-    push(pcpu, tmp1 % tmp2);
-}
-
-void sr_Mul(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 * tmp2);
-}
-
-void sr_Rand(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = rand();
-    push(pcpu, tmp1);
-}
-
-void sr_Dec(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1-1);
-}
-
-void sr_Drop(cpu_t *pcpu, decode_t *pdecoded) {
-    (void)pop(pcpu);
-}
-
-void sr_Je(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    if (tmp1 == 0)
-        pcpu->pc += pdecoded->immediate;
-}
-
-void sr_Jne(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    if (tmp1 != 0)
-        pcpu->pc += pdecoded->immediate;
-}
-
-void sr_And(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 & tmp2);
-}
-
-void sr_Or(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 | tmp2);
-}
+static const service_routine_t service_routines[] = {
+        INSTRUCTIONS(SR_ENTRY)
+    };
 
-void sr_Xor(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 ^ tmp2);
-}
+#ifdef TOS_CACHE
+/* Top of stack is passed between service routines in a register. Its slot
+   in pcpu->stack[] is kept up to date only while the usual routines above
+   run: frequent instructions are done on the cached value, and the rest
+   of them, as well as those that would fail, go to the usual ones. */
+typedef uint32_t (*tos_routine_t)(cpu_t *pcpu, decode_t* pdecode,
+                                  uint32_t tos);
 
-void sr_SHL(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 << tmp2);
+static uint32_t slow_path(service_routine_t sr, cpu_t *pcpu,
+                          decode_t *pdecoded, uint32_t tos) {
+    if (pcpu->sp >= 0)
+        pcpu->stack[pcpu->sp] = tos;
+    sr(pcpu, pdecoded);
+    return pcpu->sp >= 0? pcpu->stack[pcpu->sp]: tos;
 }
 
-void sr_SHR(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 >> tmp2);
-}
+#define SLOW_PATH(name) return slow_path(&sr_##name, pcpu, pdecoded, tos)
 
-void sr_Rot(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    uint32_t tmp3 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1);
-    push(pcpu, tmp3);
-    push(pcpu, tmp2);
+#define TOS_ROUTINE(name, opcode, imm, pops, pushes, kind, guard, results) \
+static uint32_t tos_##name(cpu_t *pcpu, decode_t *pdecoded, uint32_t tos) { \
+    SEM_CACHED(kind, pops, pushes, guard, results, SLOW_PATH(name)); \
+    return tos; \
 }
 
-void sr_Jump(cpu_t *pcpu, decode_t *pdecoded) {
-    pcpu->pc += pdecoded->immediate;
-}
+INSTRUCTIONS(TOS_ROUTINE)
 
-void sr_SQRT(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, sqrt(tmp1));
-}
-
-void sr_Pick(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, pick(pcpu, tmp1));
-}
-
-void sr_Break(cpu_t *pcpu, decode_t *pdecoded) {
-    pcpu->state = Cpu_Break;
-    /* No need to dispatch after Break */
-    return;
-}
+#define TOS_ENTRY(name, opcode, imm, pops, pushes, kind, guard, results) \
+        [Instr_##name] = &tos_##name,
 
-service_routine_t service_routines[] = {
-        &sr_Break, &sr_Nop, &sr_Halt, &sr_Push, &sr_Print,
-        &sr_Jne, &sr_Swap, &sr_Dup, &sr_Je, &sr_Inc,
-        &sr_Add, &sr_Sub, &sr_Mul, &sr_Rand, &sr_Dec,
-        &sr_Drop, &sr_Over, &sr_Mod, &sr_Jump,
-        &sr_And, &sr_Or, &sr_Xor,
-        &sr_SHL, &sr_SHR,
-        &sr_SQRT,
-        &sr_Rot, &sr_Pick
+static const tos_routine_t tos_routines[] = {
+        INSTRUCTIONS(TOS_ENTRY)
     };
+#endif
 
-int main(int argc, char **argv) {
-    long long steplimit = parse_args(argc, argv);
-    cpu_t cpu = init_cpu();
+/* Simulate the CPU until it stops or runs steplimit instructions */
+void subroutined_run(cpu_t *pcpu, long long steplimit) {
+    cpu_t cpu = *pcpu;
+#ifdef TOS_CACHE
+    uint32_t tos = 0;
+#endif
 
+    timing_mark(Timing_Execute);
     while (cpu.state == Cpu_Running && cpu.steps < steplimit) {
         decode_t decoded = fetch_decode(&cpu);
         if (cpu.state != Cpu_Running) break;
+#ifdef TOS_CACHE
+        tos = tos_routines[decoded.opcode](&cpu, &decoded, tos);
+#else
         service_routines[decoded.opcode](&cpu, &decoded); /* Call the SR */
+#endif
         cpu.pc += decoded.length; /* Advance PC */
         cpu.steps++;
     }
+#ifdef TOS_CACHE
+    if (cpu.sp >= 0)
+        cpu.stack[cpu.sp] = tos;
+#endif
 
-    assert(cpu.state != Cpu_Running || cpu.steps == steplimit);
-    /* Print CPU state */
-    printf("CPU executed %lld steps. End state \"%s\".\n",
-            cpu.steps, cpu.state == Cpu_Halted? "Halted":
-                       cpu.state == Cpu_Running? "Running": "Break");
-    printf("PC = %#x, SP = %d\n", cpu.pc, cpu.sp);
-    printf("Stack: ");
-    for (int32_t i=cpu.sp; i >= 0 ; i--) {
-        printf("%#10x ", cpu.stack[i]);
-    }
-    printf("%s\n", cpu.sp == -1? "(empty)": "");
-
-    free(LoadedProgram);
-
-    return cpu.state == Cpu_Halted ||
-           (cpu.state == Cpu_Running &&
-            cpu.steps == steplimit)?0:1;
+    *pcpu = cpu;
+    timing_mark(Timing_Teardown);
 }
+
+#ifndef ENGINE_LIBRARY
+int main(int argc, char **argv) {
+    long long steplimit = parse_args(argc, argv, 0);
+    cpu_t cpu = init_cpu();
+    perf_counters_start();
+    subroutined_run(&cpu, steplimit);
+    perf_counters_stop(cpu.steps);
+    bool ok = report_cpu_state(&cpu, steplimit);
+    unload_program();
+    return ok ? 0 : 1;
+}
+#endif
@@ -36,288 +36,127 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <math.h>
 
 #include "common.h"
+#include "profile.h"
+#include "trace.h"
+#include "semantics.h"
 
 static inline Instr_t fetch(const cpu_t *pcpu) {
     assert(pcpu);
-    assert(pcpu->pc < PROGRAM_SIZE);
+    assert(pcpu->pc < pcpu->plen);
     return pcpu->pmem[pcpu->pc];
 };
 
 static inline Instr_t fetch_checked(cpu_t *pcpu) {
-    if (!(pcpu->pc < PROGRAM_SIZE)) {
-        printf("PC out of bounds\n");
+    if (!(pcpu->pc < pcpu->plen)) {
+        output_printf("PC out of bounds\n");
         pcpu->state = Cpu_Break;
         return Instr_Break;
     }
     return fetch(pcpu);
 }
 
-static inline decode_t decode(Instr_t raw_instr, const cpu_t *pcpu) {
-    assert(pcpu);
-    decode_t result = {0};
-    result.opcode = raw_instr;
-    switch (raw_instr) {
-    case Instr_Nop:
-    case Instr_Halt:
-    case Instr_Print:
-    case Instr_Swap:
-    case Instr_Dup:
-    case Instr_Inc:
-    case Instr_Add:
-    case Instr_Sub:
-    case Instr_Mul:
-    case Instr_Rand:
-    case Instr_Dec:
-    case Instr_Drop:
-    case Instr_Over:
-    case Instr_Mod:
-    /* Added instructions */
-    case Instr_And:
-    case Instr_Or:
-    case Instr_Xor:
-    case Instr_SHL:
-    case Instr_SHR:
-    case Instr_Rot:
-    case Instr_SQRT:
-    case Instr_Pick:
-        result.length = 1;
-        break;
-    case Instr_Push:
-    case Instr_JNE:
-    case Instr_JE:
-    case Instr_Jump:
-        result.length = 2;
-        if (!(pcpu->pc+1 < PROGRAM_SIZE)) {
-            printf("PC+1 out of bounds\n");
-            result.length = 1;
-            result.opcode = Instr_Break;
-            break;
-        }
-        result.immediate = (int32_t)pcpu->pmem[pcpu->pc+1];
-        break;
-    case Instr_Break:
-    default: /* Undefined instructions equal to Break */
-        result.length = 1;
-        result.opcode = Instr_Break;
-        break;
-    }
-    return result;
-}
-
 /*** Service routines ***/
 #define BAIL_ON_ERROR() if (cpu.state != Cpu_Running) break;
 
-static inline void push(cpu_t *pcpu, uint32_t v) {
-    assert(pcpu);
-    if (pcpu->sp >= STACK_CAPACITY-1) {
-        printf("Stack overflow\n");
-        pcpu->state = Cpu_Break;
-        return;
-    }
-    pcpu->stack[++pcpu->sp] = v;
-}
-
-static inline uint32_t pop(cpu_t *pcpu) {
-    assert(pcpu);
-    if (pcpu->sp < 0) {
-        printf("Stack underflow\n");
-        pcpu->state = Cpu_Break;
-        return 0;
-    }
-    return pcpu->stack[pcpu->sp--];
-}
-
-static inline uint32_t pick(cpu_t *pcpu, int32_t pos) {
-    assert(pcpu);
-    if (pcpu->sp - 1 < pos) {
-        printf("Out of bound picking\n");
-        pcpu->state = Cpu_Break;
-        return 0;
-    }
-    return pcpu->stack[pcpu->sp - pos];
-}
-
-int main(int argc, char **argv) {
-    long long steplimit = parse_args(argc, argv);
-    cpu_t cpu = init_cpu();
-
+#define SEM_CPU (&cpu)
+#define SEM_LEAVE() break
+#define SEM_IMM decoded.immediate
+#define SEM_BRANCH() cpu.pc += decoded.immediate
+
+/* Execute - a big switch */
+#define CHECKED_CASE(name, opcode, imm, pops, pushes, kind, guard, results) \
+        case Instr_##name: \
+            SEM_CHECKED(kind, pops, pushes, guard, results); \
+            break;
+
+#ifdef TOS_CACHE
+/* Top of stack is cached in a local variable, its slot in cpu.stack[]
+   is only written to when the other instructions need it there */
+#define SPILL_TOS() if (cpu.sp >= 0) cpu.stack[cpu.sp] = tos;
+#define FILL_TOS() if (cpu.sp >= 0) tos = cpu.stack[cpu.sp];
+
+#define SEM_SP cpu.sp
+#define SEM_STACK cpu.stack
+#define SEM_TOS tos
+
+/* Instructions are executed on the cached top of stack, provided that
+   they cannot fail. Everything else is then executed in the usual way
+   after the top of stack is spilled. */
+#define CACHED_CASE(name, opcode, imm, pops, pushes, kind, guard, results) \
+        case Instr_##name: \
+            SEM_CACHED(kind, pops, pushes, guard, results, goto checked); \
+            cpu.pc += decoded.length; /* Advance PC */ \
+            cpu.steps++; \
+            continue;
+#endif
+
+/* Simulate the CPU until it stops or runs steplimit instructions */
+void switched_run(cpu_t *pcpu, long long steplimit) {
+    cpu_t cpu = *pcpu;
+#ifdef TOS_CACHE
+    uint32_t tos = 0;
+#endif
+#ifdef TRACE
+    trace_ring_t *ring = trace_ring();
+#endif
+
+    timing_mark(Timing_Execute);
     while (cpu.state == Cpu_Running && cpu.steps < steplimit) {
         Instr_t raw_instr = fetch_checked(&cpu);
         BAIL_ON_ERROR();
         decode_t decoded = decode(raw_instr, &cpu);
+        PROFILE_DISPATCH(cpu.pc, decoded.opcode);
+        TRACE_DISPATCH(ring, cpu.pc, decoded.opcode, cpu.sp,
+                       cpu.sp >= 0 ? cpu.stack[cpu.sp] : 0);
 
-        uint32_t tmp1 = 0, tmp2 = 0, tmp3 = 0;
-        /* Execute - a big switch */
+#ifdef TOS_CACHE
         switch(decoded.opcode) {
-        case Instr_Nop:
-            /* Do nothing */
-            break;
-        case Instr_Halt:
-            cpu.state = Cpu_Halted;
-            break;
-        case Instr_Push:
-            push(&cpu, decoded.immediate);
-            break;
-        case Instr_Print:
-            tmp1 = pop(&cpu); BAIL_ON_ERROR();
-            printf("[%d]\n", tmp1);
-            break;
-        case Instr_Swap:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp2);
-            break;
-        case Instr_Dup:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp1);
-            break;
-        case Instr_Over:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp2);
-            push(&cpu, tmp1);
-            push(&cpu, tmp2);
-            break;
-        case Instr_Inc:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1+1);
-            break;
-        case Instr_Add:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 + tmp2);
-            break;
-        case Instr_Sub:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 - tmp2);
-            break;
-        case Instr_Mod:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            if (tmp2 == 0) {
-                cpu.state = Cpu_Break;
-                break;
-            }
-            push(&cpu, tmp1 % tmp2);
-            break;
-        case Instr_Mul:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 * tmp2);
-            break;
-        case Instr_Rand:
-            tmp1 = rand();
-            push(&cpu, tmp1);
-            break;
-        case Instr_Dec:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1-1);
-            break;
-        case Instr_Drop:
-            (void)pop(&cpu);
-            break;
-        case Instr_JE:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            if (tmp1 == 0)
-                cpu.pc += decoded.immediate;
-            break;
-        case Instr_JNE:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            if (tmp1 != 0)
-                cpu.pc += decoded.immediate;
-            break;
-        case Instr_Jump:
-            cpu.pc += decoded.immediate;
-            break;
-        case Instr_And:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 & tmp2);
-            break;
-        case Instr_Or:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 | tmp2);
-            break;
-        case Instr_Xor:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 ^ tmp2);
-            break;
-        case Instr_SHL:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 << tmp2);
-            break;
-        case Instr_SHR:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 >> tmp2);
-            break;
-        case Instr_Rot:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            tmp3 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp3);
-            push(&cpu, tmp2);
-            break;
-        case Instr_SQRT:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, sqrt(tmp1));
-            break;
-        case Instr_Pick:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, pick(&cpu, tmp1));
-            break;
-        case Instr_Break:
-            cpu.state = Cpu_Break;
-            break;
+        INSTRUCTIONS(CACHED_CASE)
+        }
+checked:
+        SPILL_TOS();
+#endif
+        switch(decoded.opcode) {
+        INSTRUCTIONS(CHECKED_CASE)
         default:
             assert("Unreachable" && false);
             break;
         }
+#ifdef TOS_CACHE
+        FILL_TOS();
+#endif
         cpu.pc += decoded.length; /* Advance PC */
         cpu.steps++;
     }
+#ifdef TOS_CACHE
+    SPILL_TOS();
+#endif
 
-    assert(cpu.state != Cpu_Running || cpu.steps == steplimit);
-    /* Print CPU state */
-    printf("CPU executed %lld steps. End state \"%s\".\n",
-            cpu.steps, cpu.state == Cpu_Halted? "Halted":
-                       cpu.state == Cpu_Running? "Running": "Break");
-    printf("PC = %#x, SP = %d\n", cpu.pc, cpu.sp);
-    printf("Stack: ");
-    for (int32_t i=cpu.sp; i >= 0 ; i--) {
-        printf("%#10x ", cpu.stack[i]);
-    }
-    printf("%s\n", cpu.sp == -1? "(empty)": "");
-
-    free(LoadedProgram);
+    *pcpu = cpu;
+    timing_mark(Timing_Teardown);
+}
 
-    return cpu.state == Cpu_Halted ||
-           (cpu.state == Cpu_Running &&
-            cpu.steps == steplimit)?0:1;
+#ifndef ENGINE_LIBRARY
+int main(int argc, char **argv) {
+    long long steplimit = parse_args(argc, argv, TRACE_ARGS);
+    cpu_t cpu = init_cpu();
+#ifdef PROFILE
+    profile_start(cpu.pmem, cpu.plen);
+#endif
+#ifdef TRACE
+    trace_start();
+#endif
+    perf_counters_start();
+    switched_run(&cpu, steplimit);
+    perf_counters_stop(cpu.steps);
+#ifdef TRACE
+    trace_stop();
+#endif
+#ifdef PROFILE
+    profile_report(cpu.pmem);
+#endif
+    bool ok = report_cpu_state(&cpu, steplimit);
+    unload_program();
+    return ok ? 0 : 1;
 }
+#endif
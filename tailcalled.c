@@ -0,0 +1,355 @@
+/*  tailcalled.c - a tail-call interpreter passing guest registers
+    to its handlers as arguments, for a stack virtual machine.
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+
+#include "common.h"
+#include "decode.h"
+#include "semantics.h"
+
+/* Unlike tailrecursive.c, handlers do not rely on the compiler to turn
+   their calls into jumps where it can guarantee it. Without musttail,
+   it is left to -foptimize-sibling-calls, as there. Clang can also pass
+   more arguments in registers and save fewer of them with preserve_none. */
+#if defined(__has_attribute)
+#if __has_attribute(musttail)
+#define MUSTTAIL __attribute__((musttail))
+#endif
+#if __has_attribute(preserve_none)
+#define HANDLER_CC __attribute__((preserve_none))
+#endif
+#endif
+#ifndef MUSTTAIL
+#define MUSTTAIL
+#endif
+#ifndef HANDLER_CC
+#define HANDLER_CC
+#endif
+
+/* Guest registers are arguments of handlers: address of the current
+   instruction in the predecoded stream, SP and top of stack, which is
+   not stored to pcpu->stack[] while handlers run. The rest of the CPU
+   state is in *pcpu, steps are counted down in budget. */
+typedef struct op op_t;
+#define PARAMS const op_t *ip, int32_t sp, uint32_t tos, long long budget, \
+               cpu_t *pcpu
+#define ARGS ip, sp, tos, budget, pcpu
+
+typedef HANDLER_CC cpu_state_t handler_t(PARAMS);
+
+/* Predecoded instruction, one per program word. Branches point to
+   their targets directly, or to NULL if these are outside of the program. */
+struct op {
+    handler_t *handler;
+    union {
+        int32_t immediate;
+        const op_t *target;
+    };
+};
+
+/* Not passed to handlers as they are rarely needed,
+   one per thread for engines running concurrently */
+static _Thread_local long long steplimit = LLONG_MAX;
+static _Thread_local const op_t *code_base;
+
+#define SEM_CPU pcpu
+#define SEM_LEAVE() break
+#define SEM_IMM decoded.immediate
+#define SEM_BRANCH() pcpu->pc += decoded.immediate
+
+#define CHECKED_CASE(name, opcode, imm, pops, pushes, kind, guard, results) \
+    case Instr_##name: \
+        SEM_CHECKED(kind, pops, pushes, guard, results); \
+        break;
+
+/* Simulate one instruction on *pcpu the usual way, with all of the checks.
+   Steps are not counted here. */
+static void execute(cpu_t *pcpu, decode_t decoded) {
+    switch (decoded.opcode) {
+    INSTRUCTIONS(CHECKED_CASE)
+    default: /* Undefined instructions equal to Break */
+        pcpu->state = Cpu_Break;
+        break;
+    }
+    pcpu->pc += decoded.length; /* Advance PC */
+}
+
+/*** Handlers ***/
+
+/* Store guest registers back to *pcpu when simulation stops */
+static cpu_state_t leave(PARAMS) {
+    pcpu->pc = (uint32_t)(ip - code_base);
+    pcpu->sp = sp;
+    if (sp >= 0)
+        pcpu->stack[sp] = tos;
+    pcpu->steps = steplimit - budget;
+    return pcpu->state;
+}
+
+#define HANDLER static HANDLER_CC cpu_state_t
+
+#define DISPATCH() MUSTTAIL return ip->handler(ARGS)
+
+/* Count the step of the instruction just simulated */
+#define NEXT(length) \
+    ip += (length); \
+    if (--budget == 0) \
+        return leave(ARGS); \
+    DISPATCH();
+
+/* Handlers below only simulate instructions that cannot fail.
+   Anything else, including stack underflow or overflow, is left
+   to slow_path(). */
+#define SLOW_PATH() MUSTTAIL return slow_path(ARGS)
+
+/* Simulate the instruction at ip with all of the checks */
+HANDLER slow_path(PARAMS) {
+    pcpu->pc = (uint32_t)(ip - code_base);
+    pcpu->sp = sp;
+    if (sp >= 0)
+        pcpu->stack[sp] = tos;
+    execute(pcpu, decode_at_address(pcpu->pmem, pcpu->pc, pcpu->plen));
+    pcpu->steps = steplimit - --budget;
+    if (pcpu->state != Cpu_Running || budget == 0)
+        return pcpu->state;
+    if (!(pcpu->pc < pcpu->plen)) {
+        output_printf("PC out of bounds\n");
+        pcpu->state = Cpu_Break;
+        return pcpu->state;
+    }
+    ip = code_base + pcpu->pc;
+    sp = pcpu->sp;
+    tos = sp >= 0 ? pcpu->stack[sp] : 0;
+    DISPATCH();
+}
+
+/* Follows the last instruction of the program in the stream */
+HANDLER h_End(PARAMS) {
+    output_printf("PC out of bounds\n");
+    pcpu->state = Cpu_Break;
+    return leave(ARGS);
+}
+
+/* Handlers on the guest registers are generated for all instructions
+   but branches, see below */
+#undef SEM_IMM
+#define SEM_IMM ip->immediate
+#define SEM_SP sp
+#define SEM_STACK pcpu->stack
+#define SEM_TOS tos
+
+#define FAST_HANDLER(name, opcode, imm, pops, pushes, kind, guard, results) \
+HANDLER h_##name(PARAMS) { \
+    SEM_CACHED(kind, pops, pushes, guard, results, SLOW_PATH()); \
+    NEXT(1 + (imm)); \
+}
+
+#define NON_BRANCH_HANDLER(name, opcode, imm, pops, pushes, kind, guard, \
+                           results) \
+    SEM_NON_BRANCH(kind, FAST_HANDLER)(name, opcode, imm, pops, pushes, \
+                                       kind, guard, results)
+
+INSTRUCTIONS(NON_BRANCH_HANDLER)
+
+/* Branches out of the program are taken by slow_path() */
+#define CONDITIONAL(name, cond) \
+HANDLER h_##name(PARAMS) { \
+    if (!(sp >= 1)) SLOW_PATH(); \
+    bool taken = (cond); \
+    if (taken && !ip->target) SLOW_PATH(); \
+    tos = pcpu->stack[--sp]; \
+    if (taken) { \
+        ip = ip->target; \
+        NEXT(0); \
+    } \
+    NEXT(2); \
+}
+
+CONDITIONAL(JE, tos == 0)
+CONDITIONAL(JNE, tos != 0)
+
+HANDLER h_Jump(PARAMS) {
+    if (!ip->target) SLOW_PATH();
+    ip = ip->target;
+    NEXT(0);
+}
+
+/* Superinstructions, see match_superinstruction(), are simulated as
+   a whole only if all of their guest instructions fit into the budget and
+   cannot fail on the data stack: there are at least depth items on it and
+   room for growth more. Otherwise, their first guest instruction is
+   simulated alone. */
+#define SUPER_FITS(count, depth, growth) \
+    (budget >= (count) && sp >= (depth) - 1 && sp + (growth) < STACK_CAPACITY)
+
+#define SUPER_FALLBACK(first) MUSTTAIL return h_##first(ARGS)
+
+/* All guest instructions of a superinstruction but the last one,
+   which is counted by NEXT() */
+#define SUPER_STEPS(count) budget -= (count) - 1;
+
+/* End a superinstruction of count guest instructions and length words
+   with a branch */
+#define SUPER_BRANCH(first, taken, count, length) \
+    if ((taken) && !ip->target) SUPER_FALLBACK(first); \
+    SUPER_STEPS(count); \
+    ip = (taken) ? ip->target : ip + (length); \
+    NEXT(0);
+
+HANDLER h_OverOverSubJE(PARAMS) {
+    if (!SUPER_FITS(4, 2, 2)) SUPER_FALLBACK(Over);
+    bool taken = pcpu->stack[sp-1] == tos;
+    SUPER_BRANCH(Over, taken, 4, 5);
+}
+
+HANDLER h_OverOverSwapSubJE(PARAMS) {
+    if (!SUPER_FITS(5, 2, 2)) SUPER_FALLBACK(Over);
+    bool taken = pcpu->stack[sp-1] == tos;
+    SUPER_BRANCH(Over, taken, 5, 6);
+}
+
+HANDLER h_OverOverSwapModJE(PARAMS) {
+    if (!SUPER_FITS(5, 2, 2) || tos == 0) SUPER_FALLBACK(Over);
+    bool taken = pcpu->stack[sp-1] % tos == 0;
+    SUPER_BRANCH(Over, taken, 5, 6);
+}
+
+HANDLER h_DupJNE(PARAMS) {
+    if (!SUPER_FITS(2, 1, 1)) SUPER_FALLBACK(Dup);
+    bool taken = tos != 0;
+    SUPER_BRANCH(Dup, taken, 2, 3);
+}
+
+HANDLER h_IncJump(PARAMS) {
+    if (!SUPER_FITS(2, 1, 0) || !ip->target) SUPER_FALLBACK(Inc);
+    tos++;
+    SUPER_STEPS(2);
+    ip = ip->target;
+    NEXT(0);
+}
+
+HANDLER h_DropIncJump(PARAMS) {
+    if (!SUPER_FITS(3, 2, 0) || !ip->target) SUPER_FALLBACK(Drop);
+    tos = pcpu->stack[--sp] + 1;
+    SUPER_STEPS(3);
+    ip = ip->target;
+    NEXT(0);
+}
+
+#define HANDLER_ENTRY(name, opcode, imm, pops, pushes, kind, guard, results) \
+        [Instr_##name] = &h_##name,
+
+static handler_t * const handlers[] = {
+        INSTRUCTIONS(HANDLER_ENTRY)
+        /* Superinstructions */
+        [Super_OverOverSubJE] = &h_OverOverSubJE,
+        [Super_OverOverSwapSubJE] = &h_OverOverSwapSubJE,
+        [Super_OverOverSwapModJE] = &h_OverOverSwapModJE,
+        [Super_DupJNE] = &h_DupJNE,
+        [Super_IncJump] = &h_IncJump,
+        [Super_DropIncJump] = &h_DropIncJump,
+    };
+
+/* Decode all of the program in advance, with superinstructions.
+   One more entry after it catches execution running past its end. */
+static op_t* predecode_program(const Instr_t *prog, uint32_t len) {
+    op_t *code = malloc(((size_t)len + 1) * sizeof(op_t));
+    if (!code) {
+        fprintf(stderr, "Failed to allocate memory for decoded program.\n");
+        exit(2);
+    }
+    /* Opcodes are classified in bulk, superinstructions are matched here */
+    uint8_t *opcodes = malloc((size_t)len + 1);
+    if (!opcodes) {
+        fprintf(stderr, "Failed to allocate memory for decoded program.\n");
+        exit(2);
+    }
+    decode_program(prog, len, opcodes, NULL);
+    for (uint32_t i = 0; i < len; i++) {
+        decode_t decoded = decoded_at(prog, opcodes, i);
+        /* Entries for the rest of a superinstruction are decoded as well
+           to be used by branches into the middle of it */
+        match_superinstruction(prog, i, len, &decoded);
+        code[i].handler = handlers[decoded.opcode];
+        /* All superinstructions end with a branch */
+        if (decoded.opcode == Instr_JE || decoded.opcode == Instr_JNE
+            || decoded.opcode == Instr_Jump
+            || decoded.opcode >= NUM_INSTRUCTIONS) {
+            uint32_t target = i + decoded.length + decoded.immediate;
+            code[i].target = target < len ? &code[target] : NULL;
+        } else
+            code[i].immediate = decoded.immediate;
+    }
+    free(opcodes);
+    code[len].handler = &h_End;
+    code[len].immediate = 0;
+    return code;
+}
+
+/* Simulate the CPU until it stops or runs limit instructions */
+void tailcalled_run(cpu_t *pcpu, long long limit) {
+    if (pcpu->state != Cpu_Running || pcpu->steps >= limit)
+        return;
+    if (!(pcpu->pc < pcpu->plen)) {
+        output_printf("PC out of bounds\n");
+        pcpu->state = Cpu_Break;
+        return;
+    }
+    op_t *code = predecode_program(pcpu->pmem, pcpu->plen);
+    steplimit = limit;
+    code_base = code;
+    const op_t *ip = &code[pcpu->pc];
+    int32_t sp = pcpu->sp;
+    uint32_t tos = sp >= 0 ? pcpu->stack[sp] : 0;
+    timing_mark(Timing_Execute);
+    ip->handler(ip, sp, tos, limit - pcpu->steps, pcpu);
+    timing_mark(Timing_Teardown);
+    free(code);
+}
+
+#ifndef ENGINE_LIBRARY
+int main(int argc, char **argv) {
+    long long steplimit = parse_args(argc, argv, 0);
+    cpu_t cpu = init_cpu();
+    perf_counters_start();
+    tailcalled_run(&cpu, steplimit);
+    perf_counters_stop(cpu.steps);
+    bool ok = report_cpu_state(&cpu, steplimit);
+    unload_program();
+    return ok ? 0 : 1;
+}
+#endif
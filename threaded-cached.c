@@ -37,329 +37,404 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <math.h>
 
 #include "common.h"
+#include "semantics.h"
+#include "profile.h"
 
-static inline decode_t decode_at_address(const Instr_t* prog, uint32_t addr) {
-    assert(addr < PROGRAM_SIZE);
-    decode_t result = {0};
-    Instr_t raw_instr = prog[addr];
-    result.opcode = raw_instr;
-    switch (raw_instr) {
-    case Instr_Nop:
-    case Instr_Halt:
-    case Instr_Print:
-    case Instr_Swap:
-    case Instr_Dup:
-    case Instr_Inc:
-    case Instr_Add:
-    case Instr_Sub:
-    case Instr_Mul:
-    case Instr_Rand:
-    case Instr_Dec:
-    case Instr_Drop:
-    case Instr_Over:
-    case Instr_Mod:
-    case Instr_And:
-    case Instr_Or:
-    case Instr_Xor:
-    case Instr_SHL:
-    case Instr_SHR:
-    case Instr_Rot:
-    case Instr_SQRT:
-    case Instr_Pick:
-        result.length = 1;
-        break;
-    case Instr_Push:
-    case Instr_JNE:
-    case Instr_JE:
-    case Instr_Jump:
-        if (!(addr+1 < PROGRAM_SIZE)) {
-            printf("PC+1 out of bounds\n");
-            result.length = 1;
-            result.opcode = Instr_Break;
-            break;
-        }
-        result.length = 2;
-        result.immediate = (int32_t)prog[addr+1];
-        break;
-    case Instr_Break:
-    default: /* Undefined instructions equal to Break */
-        result.length = 1;
-        result.opcode = Instr_Break;
-        break;
-    }
-    return result;
+/* Decoded instruction as it is kept in the cache, 8 bytes per program
+   word so that decoded streams of large programs stay in caches.
+   The handler is an offset from sr_Decode, see HANDLER(). Instruction
+   lengths are known to handlers, and block steps are rarely needed,
+   so they are kept aside in block_steps[]. */
+typedef struct {
+    int32_t sr;
+    int32_t immediate;
+#ifdef PROFILE
+    int32_t opcode; /* whatever is decoded, for profile_dispatch() */
+#endif
+} cached_t;
+
+#define HANDLER(offset) ((char*)&&sr_Decode + (offset))
+
+/* Truncated instructions are reported as they are decoded */
+static inline decode_t decode_reported(const Instr_t* prog, uint32_t addr,
+                                       uint32_t len) {
+    assert(addr < len);
+    return decode_instruction(prog[addr], prog, addr, len, true);
 }
 
 /*** Service routines ***/
-#define BAIL_ON_ERROR() if (cpu.state != Cpu_Running) break;
+#ifdef TOS_CACHE
+/* Top of stack is cached in a local variable tos, its slot in cpu.stack[]
+   is kept up to date only while the usual handlers below run */
+#define SPILL_TOS() if (cpu.sp >= 0) cpu.stack[cpu.sp] = tos;
+#define FILL_TOS() if (cpu.sp >= 0) tos = cpu.stack[cpu.sp];
+#define SLOW_PATH(name) {SPILL_TOS(); goto sr_##name;}
+#define TOS tos
+#else
+#define FILL_TOS()
+#define TOS cpu.stack[cpu.sp]
+#endif
+
+/* Steps are accounted for a whole basic block when it is entered, see
+   DISPATCH_BLOCK(). Leaving the block early takes back the steps of the
+   instructions not executed: the failed one and the ones following it. */
+#define SEM_LEAVE() {\
+        FILL_TOS(); \
+        cpu.steps -= block_steps[cpu.pc] - stop_steps; \
+        break; \
+    }
+
+/* Entries not decoded yet are counted when they are */
+#ifdef PROFILE
+#define PROFILE_CACHED() \
+    if (decoded.sr) profile_dispatch(cpu.pc, decoded.opcode);
+#else
+#define PROFILE_CACHED()
+#endif
 
 #define DISPATCH()\
-    if (!(cpu.pc < PROGRAM_SIZE)) {cpu.state = Cpu_Break; break;};\
+    if (!(cpu.pc < cpu.plen)) {\
+        if (cpu.steps < steplimit) cpu.state = Cpu_Break; \
+        break; \
+    }\
     decoded = decoded_cache[cpu.pc]; \
-    goto *decoded.sr;
-
-#define ADVANCE_PC() \
-    cpu.pc += decoded.length;\
-    cpu.steps++; \
-    if (cpu.state != Cpu_Running || cpu.steps >= steplimit) break;
-
-static inline void push(cpu_t *pcpu, uint32_t v) {
-    assert(pcpu);
-    if (pcpu->sp >= STACK_CAPACITY-1) {
-        printf("Stack overflow\n");
-        pcpu->state = Cpu_Break;
-        return;
-    }
-    pcpu->stack[++pcpu->sp] = v;
-}
+    PROFILE_CACHED(); \
+    goto *HANDLER(decoded.sr);
 
-static inline uint32_t pop(cpu_t *pcpu) {
-    assert(pcpu);
-    if (pcpu->sp < 0) {
-        printf("Stack underflow\n");
-        pcpu->state = Cpu_Break;
-        return 0;
-    }
-    return pcpu->stack[pcpu->sp--];
+/* Verified programs cannot leave program memory */
+#define DISPATCH_UNCHECKED()\
+    decoded = decoded_cache[cpu.pc]; \
+    PROFILE_CACHED(); \
+    goto *HANDLER(decoded.sr);
+
+/* Enter a new basic block after a branch. A block reached for the first
+   time has no steps yet and goes to sr_Decode. */
+#define DISPATCH_BLOCK()\
+    if (!(cpu.pc < cpu.plen)) {\
+        if (cpu.steps < steplimit) cpu.state = Cpu_Break; \
+        break; \
+    }\
+    decoded = decoded_cache[cpu.pc]; \
+    if (steplimit - cpu.steps < block_steps[cpu.pc]) {\
+        if (cpu.steps >= steplimit) break; \
+        uint32_t stop = stop_within_block(cpu.pmem, service_routines, \
+                            &&sr_Decode, decoded_cache, block_steps, \
+                            cpu.pc, cpu.plen, steplimit - cpu.steps); \
+        decoded_cache[stop].sr = (char*)&&sr_Stop - (char*)&&sr_Decode; \
+        stop_steps = block_steps[stop]; \
+        decoded = decoded_cache[cpu.pc]; \
+        cpu.steps -= stop_steps; \
+    }\
+    cpu.steps += block_steps[cpu.pc]; \
+    PROFILE_CACHED(); \
+    goto *HANDLER(decoded.sr);
+
+/* Handlers know the length of their instructions */
+#define ADVANCE_PC(length) \
+    FILL_TOS(); \
+    ADVANCE_PC_CACHED(length)
+
+#define ADVANCE_PC_CACHED(length) \
+    if (cpu.state != Cpu_Running) {\
+        cpu.steps -= block_steps[cpu.pc] - 1 - stop_steps; \
+        cpu.pc += (length); \
+        break; \
+    }\
+    cpu.pc += (length);
+
+/* A superinstruction is executed as a whole only if all of its guest
+   instructions cannot fail on the data stack: there are at least depth
+   items on it and room for growth more. Steplimit is taken care of by
+   stop_within_block(). */
+#define SUPER_FITS(depth, growth) \
+    (cpu.sp >= (depth) - 1 && cpu.sp + (growth) < STACK_CAPACITY)
+
+/* Otherwise, its first guest instruction is executed alone */
+#define SUPER_FALLBACK() \
+    full = decode_reported(cpu.pmem, cpu.pc, cpu.plen); \
+    decoded.immediate = full.immediate; \
+    goto *service_routines[full.opcode];
+
+#define ADVANCE_PC_SUPER(length) \
+    cpu.pc += (length);
+
+#define SEM_CPU (&cpu)
+#define SEM_IMM decoded.immediate
+#define SEM_BRANCH() cpu.pc += decoded.immediate
+#define SEM_SP cpu.sp
+#define SEM_STACK cpu.stack
+#define SEM_TOS tos
+
+/* Branches enter a new block, Halt and Break need no dispatch after them
+   as ADVANCE_PC() leaves */
+#define NEXT(kind, dispatch) NEXT_##kind(dispatch)
+#define NEXT_Stack(dispatch) dispatch();
+#define NEXT_Branch(dispatch) DISPATCH_BLOCK();
+#define NEXT_Print(dispatch) dispatch();
+#define NEXT_Pick(dispatch) dispatch();
+#define NEXT_Halt(dispatch)
+#define NEXT_Break(dispatch)
+
+#define SERVICE_ROUTINE(name, opcode, imm, pops, pushes, kind, guard, results) \
+        sr_##name: \
+            SEM_CHECKED(kind, pops, pushes, guard, results); \
+            ADVANCE_PC(1 + (imm)); \
+            NEXT(kind, DISPATCH)
+
+/* Frequent instructions on the cached top of stack. They go to the usual
+   handlers in case they would fail. */
+#define TOS_ROUTINE(name, opcode, imm, pops, pushes, kind, guard, results) \
+        tos_##name: \
+            SEM_CACHED(kind, pops, pushes, guard, results, SLOW_PATH(name)); \
+            ADVANCE_PC_CACHED(1 + (imm)); \
+            NEXT(kind, DISPATCH)
+
+/* The stack is known to hold enough items and to have room for new ones.
+   Only value dependent errors are checked, those go to the usual
+   handlers. */
+#define UNCHECKED_ROUTINE(name, opcode, imm, pops, pushes, kind, guard, \
+                          results) \
+        un_##name: \
+            SEM_UNCHECKED(kind, pops, pushes, guard, results, \
+                          goto sr_##name); \
+            cpu.pc += 1 + (imm); \
+            NEXT(kind, DISPATCH_UNCHECKED)
+
+#define SR_LABEL(name, opcode, imm, pops, pushes, kind, guard, results) \
+        [Instr_##name] = &&sr_##name,
+#define TOS_LABEL(name, opcode, imm, pops, pushes, kind, guard, results) \
+        [Instr_##name] = &&tos_##name,
+#define UNCHECKED_LABEL(name, opcode, imm, pops, pushes, kind, guard, results) \
+        [Instr_##name] = &&un_##name,
+
+#define SUPER_LABELS \
+        [Super_OverOverSubJE] = &&sr_OverOverSubJE, \
+        [Super_OverOverSwapSubJE] = &&sr_OverOverSwapSubJE, \
+        [Super_OverOverSwapModJE] = &&sr_OverOverSwapModJE, \
+        [Super_DupJNE] = &&sr_DupJNE, \
+        [Super_IncJump] = &&sr_IncJump, \
+        [Super_DropIncJump] = &&sr_DropIncJump,
+
+static inline bool ends_block(Instr_t opcode) {
+    /* All superinstructions end with a branch */
+    return opcode == Instr_JE || opcode == Instr_JNE || opcode == Instr_Jump
+        || opcode >= NUM_INSTRUCTIONS;
 }
 
-static inline uint32_t pick(cpu_t *pcpu, int32_t pos) {
-    assert(pcpu);
-    if (pcpu->sp - 1 < pos) {
-        printf("Out of bound picking\n");
-        pcpu->state = Cpu_Break;
-        return 0;
-    }
-    return pcpu->stack[pcpu->sp - pos];
+static inline cached_t pack_decoded(decode_t decoded, const void* *in_sr,
+                                    const void *base) {
+    cached_t result = {
+        .sr = (int32_t)((const char*)in_sr[decoded.opcode] - (const char*)base),
+        .immediate = decoded.immediate,
+#ifdef PROFILE
+        .opcode = decoded.opcode,
+#endif
+    };
+    return result;
 }
 
-static void predecode_program(const Instr_t *prog, const void* *in_sr,
-                           decode_t *dec, int len) {
+/* Programs may be large, so they are decoded lazily, a basic block at
+   a time, when the block is entered for the first time. Entries not
+   decoded yet are zero and go to the base handler. Chain is a scratch
+   buffer of len words for addresses of instructions in the block. */
+static void predecode_block(const Instr_t *prog, const void* *in_sr,
+                            const void *base, cached_t *dec,
+                            int32_t *block_steps, uint32_t *chain,
+                            uint32_t pc, uint32_t len) {
     assert(prog);
     assert(in_sr);
     assert(dec);
-    /* The program is short, so we can decode it as a whole.
-       Otherwise, some sort of lazy decoding will be required */
-    for (int i=0; i < len; i++) {
-        decode_t decoded = decode_at_address(prog, i);
-        decoded.sr = in_sr[decoded.opcode];
-        dec[i] = decoded;
+    assert(block_steps);
+    assert(chain);
+    /* Guest instructions in the rest of the block decoded before */
+    int32_t tail_steps = 0;
+    uint32_t n = 0;
+    uint32_t i = pc;
+    while (i < len) {
+        if (dec[i].sr) {
+            tail_steps = block_steps[i];
+            break;
+        }
+        decode_t decoded = decode_reported(prog, i, len);
+        Instr_t opcode = decoded.opcode;
+        int length = decoded.length;
+        /* Frequent sequences starting here are replaced with a single
+           handler. Entries for the rest of the sequence are decoded as
+           well to be used by branches into the middle of it. */
+        int count = match_superinstruction(prog, i, len, &decoded);
+        dec[i] = pack_decoded(decoded, in_sr, base);
+        block_steps[i] = count;
+        chain[n++] = i;
+        if (ends_block(opcode))
+            break;
+        i += length;
     }
+    /* Count guest instructions from every address up to the end of its
+       basic block. Any address may be a branch target, so blocks
+       overlap and are not split at branch targets. */
+    int32_t steps = tail_steps;
+    while (n-- > 0) {
+        int32_t *b = &block_steps[chain[n]];
+        steps = *b ? *b : steps + 1;
+        *b = steps;
+    }
+}
+
+/* Steplimit is reached before the end of the block starting at pc,
+   find the instruction to stop at. Superinstructions that would go past
+   it are replaced with their first guest instructions. */
+static uint32_t stop_within_block(const Instr_t *prog, const void* *in_sr,
+                                  const void *base, cached_t *dec,
+                                  const int32_t *block_steps,
+                                  uint32_t pc, uint32_t len,
+                                  long long budget) {
+    while (budget > 0) {
+        decode_t decoded = decode_reported(prog, pc, len);
+        long long count = match_superinstruction(prog, pc, len, &decoded)
+                          ? block_steps[pc] : 1;
+        if (count > budget) {
+            decoded = decode_reported(prog, pc, len);
+            dec[pc] = pack_decoded(decoded, in_sr, base);
+            count = 1;
+        }
+        budget -= count;
+        pc += decoded.length;
+    }
+    return pc;
 }
 
 
-int main(int argc, char **argv) {
+/* Simulate the CPU until it stops or runs steplimit instructions */
+void threaded_cached_run(cpu_t *pcpu, long long steplimit) {
 
     const void* service_routines[] = {
-        &&sr_Break, &&sr_Nop, &&sr_Halt, &&sr_Push, &&sr_Print,
-        &&sr_Jne, &&sr_Swap, &&sr_Dup, &&sr_Je, &&sr_Inc,
-        &&sr_Add, &&sr_Sub, &&sr_Mul, &&sr_Rand, &&sr_Dec,
-        &&sr_Drop, &&sr_Over, &&sr_Mod, &&sr_Jump,
-        &&sr_And, &&sr_Or, &&sr_Xor,
-        &&sr_SHL, &&sr_SHR,
-        &&sr_SQRT, &&sr_Rot, &&sr_Pick, NULL /* This NULL seems to be essential to keep GCC from over-optimizing? */
+#ifdef TOS_CACHE
+        INSTRUCTIONS(TOS_LABEL)
+#else
+        INSTRUCTIONS(SR_LABEL)
+#endif
+        SUPER_LABELS
+        NULL /* This NULL seems to be essential to keep GCC from over-optimizing? */
     };
 
-    long long steplimit = parse_args(argc, argv);
-    cpu_t cpu = init_cpu();
+#ifndef TOS_CACHE
+    /* Handlers for programs that passed verify_program(),
+       without stack checks and state tests */
+    const void* unchecked_routines[] = {
+        INSTRUCTIONS(UNCHECKED_LABEL)
+        SUPER_LABELS
+        NULL
+    };
+#endif
 
-    decode_t decoded_cache[PROGRAM_SIZE];
-    predecode_program(cpu.pmem, service_routines, decoded_cache, PROGRAM_SIZE);
+    cpu_t cpu = *pcpu;
+#ifdef TOS_CACHE
+    uint32_t tos = 0;
+#endif
+
+    cached_t *decoded_cache = calloc(cpu.plen, sizeof(cached_t));
+    int32_t *block_steps = calloc(cpu.plen, sizeof(int32_t));
+    uint32_t *chain = malloc(cpu.plen * sizeof(uint32_t));
+    if ((!decoded_cache || !block_steps || !chain) && cpu.plen > 0) {
+        fprintf(stderr, "Failed to allocate memory for decoded program.\n");
+        exit(2);
+    }
+    const void* *routines = service_routines;
+#ifndef TOS_CACHE
+    /* Verification assumes the program starts with an empty stack */
+    int32_t *depths = malloc(cpu.plen * sizeof(int32_t));
+    if (depths && cpu.sp == -1 && verify_program(cpu.pmem, cpu.plen, depths))
+        routines = unchecked_routines;
+    free(depths);
+#endif
+    /* Steps left in the current block after the stop, if there is one */
+    int32_t stop_steps = 0;
 
-    uint32_t tmp1 = 0, tmp2 = 0, tmp3 = 0;
-    decode_t decoded = {0};
+    cached_t decoded = {0};
+    decode_t full = {0};
+    timing_mark(Timing_Execute);
     do {
-        DISPATCH();
-        sr_Nop:
-            /* Do nothing */
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Halt:
-            cpu.state = Cpu_Halted;
-            ADVANCE_PC();
-            /* No need to dispatch after Halt */
-        sr_Push:
-            push(&cpu, decoded.immediate);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Print:
-            tmp1 = pop(&cpu); BAIL_ON_ERROR();
-            printf("[%d]\n", tmp1);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Swap:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp2);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Dup:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp1);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Over:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp2);
-            push(&cpu, tmp1);
-            push(&cpu, tmp2);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Inc:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1+1);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Add:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 + tmp2);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Sub:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 - tmp2);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Mod:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            if (tmp2 == 0) {
-                cpu.state = Cpu_Break;
-                break;
-            }
-            push(&cpu, tmp1 % tmp2);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Mul:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 * tmp2);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Rand:
-            tmp1 = rand();
-            push(&cpu, tmp1);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Dec:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1-1);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Drop:
-            (void)pop(&cpu);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Je:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            if (tmp1 == 0)
+        DISPATCH_BLOCK();
+        sr_Decode:
+            predecode_block(cpu.pmem, routines, &&sr_Decode, decoded_cache,
+                            block_steps, chain, cpu.pc, cpu.plen);
+            DISPATCH_BLOCK();
+#ifdef TOS_CACHE
+        INSTRUCTIONS(TOS_ROUTINE)
+#else
+        INSTRUCTIONS(UNCHECKED_ROUTINE)
+#endif
+        INSTRUCTIONS(SERVICE_ROUTINE)
+        /* Superinstructions operate on the stack directly, including
+           the cached top of stack, as SUPER_FITS() guarantees there
+           will be no errors */
+        sr_OverOverSubJE:
+            if (!SUPER_FITS(2, 2)) {SUPER_FALLBACK();}
+            if (TOS == cpu.stack[cpu.sp-1])
                 cpu.pc += decoded.immediate;
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Jne:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            if (tmp1 != 0)
+            ADVANCE_PC_SUPER(5);
+            DISPATCH_BLOCK();
+        sr_OverOverSwapSubJE:
+            if (!SUPER_FITS(2, 2)) {SUPER_FALLBACK();}
+            if (cpu.stack[cpu.sp-1] == TOS)
                 cpu.pc += decoded.immediate;
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Jump:
+            ADVANCE_PC_SUPER(6);
+            DISPATCH_BLOCK();
+        sr_OverOverSwapModJE:
+            if (!SUPER_FITS(2, 2) || TOS == 0) {SUPER_FALLBACK();}
+            if (cpu.stack[cpu.sp-1] % TOS == 0)
+                cpu.pc += decoded.immediate;
+            ADVANCE_PC_SUPER(6);
+            DISPATCH_BLOCK();
+        sr_DupJNE:
+            if (!SUPER_FITS(1, 1)) {SUPER_FALLBACK();}
+            if (TOS != 0)
+                cpu.pc += decoded.immediate;
+            ADVANCE_PC_SUPER(3);
+            DISPATCH_BLOCK();
+        sr_IncJump:
+            if (!SUPER_FITS(1, 0)) {SUPER_FALLBACK();}
+            TOS++;
+            cpu.pc += decoded.immediate;
+            ADVANCE_PC_SUPER(3);
+            DISPATCH_BLOCK();
+        sr_DropIncJump:
+            if (!SUPER_FITS(2, 0)) {SUPER_FALLBACK();}
+            cpu.sp--;
+            TOS = cpu.stack[cpu.sp] + 1;
             cpu.pc += decoded.immediate;
-            ADVANCE_PC();
-            DISPATCH();
-        sr_And:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 & tmp2);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Or:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 | tmp2);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Xor:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 ^ tmp2);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_SHL:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 << tmp2);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_SHR:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 >> tmp2);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Rot:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            tmp3 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp3);
-            push(&cpu, tmp2);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_SQRT:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, sqrt(tmp1));
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Pick:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, pick(&cpu, tmp1));
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Break:
-            cpu.state = Cpu_Break;
-            ADVANCE_PC();
-            /* No need to dispatch after Break */
+            ADVANCE_PC_SUPER(4);
+            DISPATCH_BLOCK();
+        sr_Stop:
+            /* Steplimit is reached */
+            break;
     } while(cpu.state == Cpu_Running);
+#ifdef TOS_CACHE
+    SPILL_TOS();
+#endif
 
-    assert(cpu.state != Cpu_Running || cpu.steps == steplimit);
-    /* Print CPU state */
-    printf("CPU executed %lld steps. End state \"%s\".\n",
-            cpu.steps, cpu.state == Cpu_Halted? "Halted":
-                       cpu.state == Cpu_Running? "Running": "Break");
-    printf("PC = %#x, SP = %d\n", cpu.pc, cpu.sp);
-    printf("Stack: ");
-    for (int32_t i=cpu.sp; i >= 0 ; i--) {
-        printf("%#10x ", cpu.stack[i]);
-    }
-    printf("%s\n", cpu.sp == -1? "(empty)": "");
-
-    free(LoadedProgram);
+    timing_mark(Timing_Teardown);
+    free(chain);
+    free(block_steps);
+    free(decoded_cache);
+    *pcpu = cpu;
+}
 
-    return cpu.state == Cpu_Halted ||
-           (cpu.state == Cpu_Running &&
-            cpu.steps == steplimit)?0:1;
+#ifndef ENGINE_LIBRARY
+int main(int argc, char **argv) {
+    long long steplimit = parse_args(argc, argv, 0);
+    cpu_t cpu = init_cpu();
+#ifdef PROFILE
+    profile_start(cpu.pmem, cpu.plen);
+#endif
+    perf_counters_start();
+    threaded_cached_run(&cpu, steplimit);
+    perf_counters_stop(cpu.steps);
+#ifdef PROFILE
+    profile_report(cpu.pmem);
+#endif
+    bool ok = report_cpu_state(&cpu, steplimit);
+    unload_program();
+    return ok ? 0 : 1;
 }
+#endif
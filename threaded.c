@@ -36,79 +36,37 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <math.h>
 
 #include "common.h"
+#include "semantics.h"
 
 static inline Instr_t fetch(const cpu_t *pcpu) {
     assert(pcpu);
-    assert(pcpu->pc < PROGRAM_SIZE);
+    assert(pcpu->pc < pcpu->plen);
     return pcpu->pmem[pcpu->pc];
 };
 
 static inline Instr_t fetch_checked(cpu_t *pcpu) {
-    if (!(pcpu->pc < PROGRAM_SIZE)) {
-        printf("PC out of bounds\n");
+    if (!(pcpu->pc < pcpu->plen)) {
+        output_printf("PC out of bounds\n");
         pcpu->state = Cpu_Break;
         return Instr_Break;
     }
     return fetch(pcpu);
 }
 
-static inline decode_t decode(Instr_t raw_instr, const cpu_t *pcpu) {
-    assert(pcpu);
-    decode_t result = {0};
-    result.opcode = raw_instr;
-    switch (raw_instr) {
-    case Instr_Nop:
-    case Instr_Halt:
-    case Instr_Print:
-    case Instr_Swap:
-    case Instr_Dup:
-    case Instr_Inc:
-    case Instr_Add:
-    case Instr_Sub:
-    case Instr_Mul:
-    case Instr_Rand:
-    case Instr_Dec:
-    case Instr_Drop:
-    case Instr_Over:
-    case Instr_Mod:
-    case Instr_And:
-    case Instr_Or:
-    case Instr_Xor:
-    case Instr_SHL:
-    case Instr_SHR:
-    case Instr_Rot:
-    case Instr_SQRT:
-    case Instr_Pick:
-        result.length = 1;
-        break;
-    case Instr_Push:
-    case Instr_JNE:
-    case Instr_JE:
-    case Instr_Jump:
-        result.length = 2;
-        if (!(pcpu->pc+1 < PROGRAM_SIZE)) {
-            printf("PC+1 out of bounds\n");
-            result.length = 1;
-            result.opcode = Instr_Break;
-            break;
-        }
-        result.immediate = (int32_t)pcpu->pmem[pcpu->pc+1];
-        break;
-    case Instr_Break:
-    default: /* Undefined instructions equal to Break */
-        result.length = 1;
-        result.opcode = Instr_Break;
-        break;
-    }
-    return result;
-}
-
 static inline decode_t fetch_decode(cpu_t *pcpu) {
     return decode(fetch_checked(pcpu), pcpu);
 }
 
 /*** Service routines ***/
-#define BAIL_ON_ERROR() if (cpu.state != Cpu_Running) break;
+#ifdef TOS_CACHE
+/* Top of stack is cached in a local variable tos, its slot in cpu.stack[]
+   is kept up to date only while the usual handlers below run */
+#define SPILL_TOS() if (cpu.sp >= 0) cpu.stack[cpu.sp] = tos;
+#define FILL_TOS() if (cpu.sp >= 0) tos = cpu.stack[cpu.sp];
+#define SLOW_PATH(name) {SPILL_TOS(); goto sr_##name;}
+#else
+#define FILL_TOS()
+#endif
 
 #define DISPATCH() do {\
     goto *service_routines[decoded.opcode];   \
@@ -123,276 +81,88 @@ __asm__ __volatile__("nopl 0x55667788(%%rax)":::"memory");
 */
 
 #define ADVANCE_PC() \
+    FILL_TOS(); \
+    ADVANCE_PC_CACHED()
+
+#define ADVANCE_PC_CACHED() \
     cpu.pc += decoded.length;\
     cpu.steps++; \
     if (cpu.state != Cpu_Running || cpu.steps >= steplimit) break;
 
-static inline void push(cpu_t *pcpu, uint32_t v) {
-    assert(pcpu);
-    if (pcpu->sp >= STACK_CAPACITY-1) {
-        printf("Stack overflow\n");
-        pcpu->state = Cpu_Break;
-        return;
-    }
-    pcpu->stack[++pcpu->sp] = v;
-}
+#define SEM_CPU (&cpu)
+#define SEM_LEAVE() {FILL_TOS(); break;}
+#define SEM_IMM decoded.immediate
+#define SEM_BRANCH() cpu.pc += decoded.immediate
+#define SEM_SP cpu.sp
+#define SEM_STACK cpu.stack
+#define SEM_TOS tos
 
-static inline uint32_t pop(cpu_t *pcpu) {
-    assert(pcpu);
-    if (pcpu->sp < 0) {
-        printf("Stack underflow\n");
-        pcpu->state = Cpu_Break;
-        return 0;
-    }
-    return pcpu->stack[pcpu->sp--];
-}
+/* Halt and Break need no dispatch after them, ADVANCE_PC() leaves */
+#define SERVICE_ROUTINE(name, opcode, imm, pops, pushes, kind, guard, results) \
+        sr_##name: \
+            SEM_CHECKED(kind, pops, pushes, guard, results); \
+            ADVANCE_PC(); \
+            decoded = fetch_decode(&cpu); \
+            DISPATCH();
 
-static inline uint32_t pick(cpu_t *pcpu, int32_t pos) {
-    assert(pcpu);
-    if (pcpu->sp - 1 < pos) {
-        printf("Out of bound picking\n");
-        pcpu->state = Cpu_Break;
-        return 0;
-    }
-    return pcpu->stack[pcpu->sp - pos];
-}
+/* Instructions on the cached top of stack. They go to the usual handlers
+   in case they would fail. */
+#define TOS_ROUTINE(name, opcode, imm, pops, pushes, kind, guard, results) \
+        tos_##name: \
+            SEM_CACHED(kind, pops, pushes, guard, results, SLOW_PATH(name)); \
+            ADVANCE_PC_CACHED(); \
+            decoded = fetch_decode(&cpu); \
+            DISPATCH();
 
+#define SR_LABEL(name, opcode, imm, pops, pushes, kind, guard, results) \
+        [Instr_##name] = &&sr_##name,
+#define TOS_LABEL(name, opcode, imm, pops, pushes, kind, guard, results) \
+        [Instr_##name] = &&tos_##name,
 
-int main(int argc, char **argv) {
+/* Simulate the CPU until it stops or runs steplimit instructions */
+void threaded_run(cpu_t *pcpu, long long steplimit) {
 
     static void* service_routines[] = {
-        &&sr_Break, &&sr_Nop, &&sr_Halt, &&sr_Push, &&sr_Print,
-        &&sr_Jne, &&sr_Swap, &&sr_Dup, &&sr_Je, &&sr_Inc,
-        &&sr_Add, &&sr_Sub, &&sr_Mul, &&sr_Rand, &&sr_Dec,
-        &&sr_Drop, &&sr_Over, &&sr_Mod, &&sr_Jump, 
-        &&sr_And, &&sr_Or, &&sr_Xor,
-        &&sr_SHL, &&sr_SHR,
-        &&sr_SQRT, &&sr_Rot, &&sr_Pick, NULL /* This NULL seems to be essential to keep GCC from over-optimizing? */
+#ifdef TOS_CACHE
+        INSTRUCTIONS(TOS_LABEL)
+#else
+        INSTRUCTIONS(SR_LABEL)
+#endif
+        NULL /* This NULL seems to be essential to keep GCC from over-optimizing? */
     };
 
-    long long steplimit = parse_args(argc, argv);
-    cpu_t cpu = init_cpu();
+    cpu_t cpu = *pcpu;
+#ifdef TOS_CACHE
+    uint32_t tos = 0;
+#endif
 
-    uint32_t tmp1 = 0, tmp2 = 0, tmp3 = 0;
+    timing_mark(Timing_Execute);
     decode_t decoded = fetch_decode(&cpu);
     DISPATCH();
     do {
 
-        sr_Nop:
-            /* Do nothing */
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Halt:
-            cpu.state = Cpu_Halted;
-            ADVANCE_PC();
-            /* No need to dispatch after Halt */
-        sr_Push:
-            push(&cpu, decoded.immediate);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Print:
-            tmp1 = pop(&cpu); BAIL_ON_ERROR();
-            printf("[%d]\n", tmp1);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Swap:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp2);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Dup:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp1);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Over:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp2);
-            push(&cpu, tmp1);
-            push(&cpu, tmp2);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Inc:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1+1);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Add:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 + tmp2);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Sub:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 - tmp2);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Mod:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            if (tmp2 == 0) {
-                cpu.state = Cpu_Break;
-                break;
-            }
-            push(&cpu, tmp1 % tmp2);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Mul:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 * tmp2);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Rand:
-            tmp1 = rand();
-            push(&cpu, tmp1);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Dec:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1-1);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Drop:
-            (void)pop(&cpu);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Je:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            if (tmp1 == 0)
-                cpu.pc += decoded.immediate;
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Jne:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            if (tmp1 != 0)
-                cpu.pc += decoded.immediate;
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Jump:
-            cpu.pc += decoded.immediate;
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_And:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 & tmp2);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Or:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 | tmp2);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Xor:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 ^ tmp2);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_SHL:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 << tmp2);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_SHR:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 >> tmp2);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Rot:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            tmp3 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp3);
-            push(&cpu, tmp2);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_SQRT:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, sqrt(tmp1));
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Pick:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, pick(&cpu, tmp1));
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Break:
-            cpu.state = Cpu_Break;
-            ADVANCE_PC();
-            /* No need to dispatch after Break */
+#ifdef TOS_CACHE
+        INSTRUCTIONS(TOS_ROUTINE)
+#endif
+        INSTRUCTIONS(SERVICE_ROUTINE)
     } while(cpu.state == Cpu_Running);
+#ifdef TOS_CACHE
+    SPILL_TOS();
+#endif
 
-    assert(cpu.state != Cpu_Running || cpu.steps == steplimit);
-    /* Print CPU state */
-    printf("CPU executed %lld steps. End state \"%s\".\n",
-            cpu.steps, cpu.state == Cpu_Halted? "Halted":
-                       cpu.state == Cpu_Running? "Running": "Break");
-    printf("PC = %#x, SP = %d\n", cpu.pc, cpu.sp);
-    printf("Stack: ");
-    for (int32_t i=cpu.sp; i >= 0 ; i--) {
-        printf("%#10x ", cpu.stack[i]);
-    }
-    printf("%s\n", cpu.sp == -1? "(empty)": "");
-
-    free(LoadedProgram);
+    *pcpu = cpu;
+    timing_mark(Timing_Teardown);
+}
 
-    return cpu.state == Cpu_Halted ||
-           (cpu.state == Cpu_Running &&
-            cpu.steps == steplimit)?0:1;
+#ifndef ENGINE_LIBRARY
+int main(int argc, char **argv) {
+    long long steplimit = parse_args(argc, argv, 0);
+    cpu_t cpu = init_cpu();
+    perf_counters_start();
+    threaded_run(&cpu, steplimit);
+    perf_counters_stop(cpu.steps);
+    bool ok = report_cpu_state(&cpu, steplimit);
+    unload_program();
+    return ok ? 0 : 1;
 }
+#endif
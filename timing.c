@@ -0,0 +1,105 @@
+/*  timing.c - durations of phases of a run, for --timing.
+    Copyright (c) 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "common.h"
+
+/* Set by --timing */
+bool Timing = false;
+
+static const char *phase_names[Timing_Phases] = {
+    [Timing_Load] = "load", [Timing_Prepare] = "prepare",
+    [Timing_Execute] = "execute", [Timing_Teardown] = "teardown",
+};
+
+/* Start of every phase in ns, zero if it has not been entered */
+static uint64_t starts[Timing_Phases];
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+#ifdef _WIN32
+    timespec_get(&ts, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* Loading starts with the process, as near to it as a program can see.
+   Without constructors, it starts at the first mark. */
+#ifdef __GNUC__
+__attribute__((constructor))
+static void timing_init(void) {
+    starts[Timing_Load] = now_ns();
+}
+#endif
+
+/* Only the first mark of a phase counts, so that engines may mark
+   every entry to their execution loop or every instance they run */
+void timing_mark(timing_phase_t phase) {
+    if (Timing && !starts[Timing_Load])
+        starts[Timing_Load] = now_ns();
+    if (Timing && !starts[phase])
+        starts[phase] = now_ns();
+}
+
+/* Each phase lasts until the next one entered, the last one until exit */
+void timing_report(void) {
+    fflush(stdout);
+    uint64_t end = now_ns();
+    fprintf(stderr, "Timing in ns:\n");
+    for (int i = 0; i < Timing_Phases; i++) {
+        if (!starts[i]) {
+            fprintf(stderr, "%16s %20s\n", phase_names[i], "<not entered>");
+            continue;
+        }
+        uint64_t next = end;
+        for (int k = i + 1; k < Timing_Phases; k++) {
+            if (starts[k]) {
+                next = starts[k];
+                break;
+            }
+        }
+        fprintf(stderr, "%16s %20llu\n", phase_names[i],
+                (unsigned long long)(next - starts[i]));
+    }
+    if (starts[Timing_Execute])
+        fprintf(stderr, "%16s %20llu\n", "first-step",
+                (unsigned long long)(starts[Timing_Execute]
+                                     - starts[Timing_Load]));
+    fprintf(stderr, "%16s %20llu\n", "total",
+            (unsigned long long)(end - starts[Timing_Load]));
+}
@@ -0,0 +1,204 @@
+/*  trace.c - recording of traces into a file in the background.
+    Copyright (c) 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define TRACE_WRITER
+#include "trace.h"
+
+/* The file is mapped this much at a time, a multiple of the page size
+   larger than a whole ring */
+#define TRACE_WINDOW (16u << 20)
+/* How long the writer sleeps when all rings are empty */
+#define TRACE_IDLE_NS 100000
+
+bool TraceActive = false;
+_Thread_local trace_ring_t *TraceRing = NULL;
+
+static _Atomic(trace_ring_t*) rings[TRACE_MAX_THREADS];
+static _Atomic uint32_t nrings;
+static atomic_bool stopping;
+static pthread_t writer;
+
+/* Output file, written through a window mapped at window_start */
+static int fd = -1;
+static char *window = NULL;
+static uint64_t window_start;
+static uint64_t file_size; /* bytes written */
+
+static void fail(const char *what) {
+    perror(what);
+    exit(2);
+}
+
+/* Room for size bytes at the end of the file, moving the window
+   forward if they do not fit */
+static char* reserve(size_t size) {
+    assert(size <= TRACE_WINDOW / 2);
+    if (!window || file_size + size > window_start + TRACE_WINDOW) {
+        if (window)
+            munmap(window, TRACE_WINDOW);
+        window_start = file_size & ~(uint64_t)(TRACE_WINDOW / 2 - 1);
+        if (ftruncate(fd, (off_t)(window_start + TRACE_WINDOW)))
+            fail("Failed to extend trace file");
+        window = mmap(NULL, TRACE_WINDOW, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, (off_t)window_start);
+        if (window == MAP_FAILED)
+            fail("Failed to map trace file");
+    }
+    char *p = window + (file_size - window_start);
+    file_size += size;
+    return p;
+}
+
+static void put32(char **p, uint32_t value) {
+    memcpy(*p, &value, sizeof(value));
+    *p += sizeof(value);
+}
+
+/* Move all published records of the ring to the file as one chunk,
+   return how many there were */
+static uint64_t drain(trace_ring_t *ring) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t count = head - tail;
+    if (count == 0)
+        return 0;
+    char *p = reserve(2 * sizeof(uint32_t) + count * TRACE_PACKED_SIZE);
+    put32(&p, ring->thread);
+    put32(&p, (uint32_t)count);
+    for (uint64_t i = tail; i != head; i++) {
+        const trace_record_t *r = &ring->records[i % TRACE_RING_SIZE];
+        put32(&p, r->pc);
+        put32(&p, r->tos);
+        *p++ = (char)r->opcode;
+        *p++ = (char)r->sp;
+    }
+    atomic_store_explicit(&ring->tail, head, memory_order_release);
+    return count;
+}
+
+static void* writer_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        /* Everything recorded before stopping is drained by this pass */
+        bool stop = atomic_load(&stopping);
+        uint64_t moved = 0;
+        uint32_t n = atomic_load(&nrings);
+        for (uint32_t i = 0; i < n && i < TRACE_MAX_THREADS; i++) {
+            trace_ring_t *ring = atomic_load(&rings[i]);
+            if (ring)
+                moved += drain(ring);
+        }
+        if (stop)
+            break;
+        if (!moved) {
+            struct timespec idle = {0, TRACE_IDLE_NS};
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+/* Give the calling thread a ring of its own */
+trace_ring_t* trace_attach(void) {
+    uint32_t thread = atomic_fetch_add(&nrings, 1);
+    if (thread >= TRACE_MAX_THREADS) {
+        fprintf(stderr, "Too many threads to trace, at most %d.\n",
+                TRACE_MAX_THREADS);
+        exit(2);
+    }
+    trace_ring_t *ring = calloc(1, sizeof(trace_ring_t));
+    if (!ring) {
+        fprintf(stderr, "Failed to allocate memory for trace.\n");
+        exit(2);
+    }
+    ring->thread = thread;
+    atomic_store(&rings[thread], ring);
+    TraceRing = ring;
+    return ring;
+}
+
+/* The ring is full, wait for the writer to drain it */
+void trace_wait(trace_ring_t *ring) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    for (;;) {
+        ring->cached_tail = atomic_load_explicit(&ring->tail,
+                                                 memory_order_acquire);
+        if (head - ring->cached_tail < TRACE_RING_SIZE)
+            return;
+        sched_yield();
+    }
+}
+
+/* Open TraceFile and start the writer, nothing if it is not set */
+void trace_start(void) {
+    if (!TraceFile)
+        return;
+    fd = open(TraceFile, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        fail("Failed to open trace file");
+    char *p = reserve(sizeof(uint32_t));
+    put32(&p, TRACE_MAGIC);
+    atomic_store(&stopping, false);
+    if (pthread_create(&writer, NULL, writer_main, NULL)) {
+        fprintf(stderr, "Failed to start trace writer.\n");
+        exit(2);
+    }
+    TraceActive = true;
+}
+
+/* Write out what is left once all recording threads are done */
+void trace_stop(void) {
+    if (!TraceActive)
+        return;
+    TraceActive = false;
+    atomic_store(&stopping, true);
+    pthread_join(writer, NULL);
+    munmap(window, TRACE_WINDOW);
+    window = NULL;
+    if (ftruncate(fd, (off_t)file_size))
+        fail("Failed to truncate trace file");
+    close(fd);
+    fd = -1;
+    uint32_t n = atomic_exchange(&nrings, 0);
+    for (uint32_t i = 0; i < n && i < TRACE_MAX_THREADS; i++)
+        free(atomic_exchange(&rings[i], NULL));
+    TraceRing = NULL;
+}
@@ -0,0 +1,124 @@
+/*  trace.h - recording of executed guest instructions for -trace variants
+    Copyright (c) 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "common.h"
+
+/* Engines built with TRACE defined record PC, opcode, SP and top of stack
+   of every dispatch if --trace=<file> is given; translated records them at
+   entries of basic blocks. Records are put into a ring buffer of the
+   recording thread without locks, and a background thread moves them
+   from all rings to the file. A full ring waits for it, nothing is lost.
+   Without TRACE, nothing is compiled in and only the file format below is
+   declared, for tracedump that reads the file. */
+
+/* Records per ring, a power of two */
+#define TRACE_RING_SIZE (1u << 16)
+/* Threads recording at once */
+#define TRACE_MAX_THREADS 256
+
+/* The file starts with TRACE_MAGIC and is followed by chunks of records
+   of one thread: a uint32_t thread number, a uint32_t count of records,
+   then the records packed into TRACE_PACKED_SIZE bytes each, fields
+   in the order of trace_record_t. All values are in host byte order. */
+#define TRACE_MAGIC 0x31525456u /* "VTR1" */
+#define TRACE_PACKED_SIZE 10
+
+typedef struct {
+    uint32_t pc;
+    uint32_t tos; /* zero if the stack is empty */
+    uint8_t opcode;
+    int8_t sp;
+} trace_record_t;
+
+/* The rings are only seen by the trace writer and the engines it records,
+   so that other builds do not need C11 atomics */
+#if defined(TRACE) || defined(TRACE_WRITER)
+#include <stdatomic.h>
+
+/* Written by the recording thread at head, read by the writer at tail */
+typedef struct {
+    _Atomic uint64_t head;
+    _Atomic uint64_t tail;
+    uint64_t cached_tail; /* last tail seen by the recording thread */
+    uint32_t thread;
+    trace_record_t records[TRACE_RING_SIZE];
+} trace_ring_t;
+
+/* The file is open and the writer thread runs */
+extern bool TraceActive;
+extern _Thread_local trace_ring_t *TraceRing;
+
+void trace_start(void);
+void trace_stop(void);
+trace_ring_t* trace_attach(void);
+void trace_wait(trace_ring_t *ring);
+
+/* Ring of the calling thread, NULL if not tracing. Engines look it up
+   once per run to keep the check at every dispatch cheap. */
+static inline trace_ring_t* trace_ring(void) {
+    trace_ring_t *ring = TraceRing;
+    if (!ring && TraceActive)
+        ring = trace_attach();
+    return ring;
+}
+
+static inline void trace_record(trace_ring_t *ring, uint32_t pc,
+                                unsigned opcode, int32_t sp, uint32_t tos) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - ring->cached_tail >= TRACE_RING_SIZE)
+        trace_wait(ring);
+    trace_record_t *r = &ring->records[head % TRACE_RING_SIZE];
+    r->pc = pc;
+    r->tos = tos;
+    r->opcode = (uint8_t)opcode;
+    r->sp = (int8_t)sp;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+#endif
+
+#ifdef TRACE
+#define TRACE_DISPATCH(ring, pc, opcode, sp, tos) \
+    do { \
+        if (__builtin_expect((ring) != NULL, 0)) \
+            trace_record((ring), (pc), (opcode), (sp), (tos)); \
+    } while (0)
+/* --trace= is only accepted by builds that can write the trace */
+#define TRACE_ARGS Args_Trace
+#else
+#define TRACE_DISPATCH(ring, pc, opcode, sp, tos)
+#define TRACE_ARGS 0
+#endif
+
+#endif /* TRACE_H_ */
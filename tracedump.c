@@ -0,0 +1,109 @@
+/*  tracedump.c - prints records of trace files written with --trace.
+    Copyright (c) 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+#include "profile.h"
+
+static uint32_t get32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/* Print one line per record: thread, PC, opcode, SP and top of stack */
+static int dump(const unsigned char *data, size_t size) {
+    if (size < sizeof(uint32_t) || get32(data) != TRACE_MAGIC) {
+        fprintf(stderr, "Not a trace file.\n");
+        return 1;
+    }
+    size_t pos = sizeof(uint32_t);
+    unsigned long long total = 0;
+    while (pos < size) {
+        if (size - pos < 2 * sizeof(uint32_t)) {
+            fprintf(stderr, "Truncated chunk at offset %zu.\n", pos);
+            return 1;
+        }
+        uint32_t thread = get32(data + pos);
+        uint32_t count = get32(data + pos + sizeof(uint32_t));
+        pos += 2 * sizeof(uint32_t);
+        if ((size - pos) / TRACE_PACKED_SIZE < count) {
+            fprintf(stderr, "Truncated chunk at offset %zu.\n", pos);
+            return 1;
+        }
+        for (uint32_t i = 0; i < count; i++, pos += TRACE_PACKED_SIZE) {
+            const unsigned char *r = data + pos;
+            printf("%u %#10x %-18s %3d %#10x\n", thread, get32(r),
+                   opcode_name(r[8]), (int8_t)r[9], get32(r + 4));
+        }
+        total += count;
+    }
+    fprintf(stderr, "%llu records\n", total);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <trace file>\n", argv[0]);
+        return 2;
+    }
+    int fd = open(argv[1], O_RDONLY);
+    if (fd == -1) {
+        perror(argv[1]);
+        return 2;
+    }
+    struct stat st;
+    if (fstat(fd, &st)) {
+        perror("fstat");
+        return 2;
+    }
+    size_t size = (size_t)st.st_size;
+    const unsigned char *data = NULL;
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            perror("mmap");
+            return 2;
+        }
+    }
+    int ret = dump(data, size);
+    if (data)
+        munmap((void*)data, size);
+    close(fd);
+    return ret;
+}
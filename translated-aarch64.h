@@ -0,0 +1,490 @@
+/*  translated-aarch64.h - AArch64 code generation of the binary translator
+    Copyright (c) 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#ifndef TRANSLATED_AARCH64_H_
+#define TRANSLATED_AARCH64_H_
+
+/* Only to be included by translated.c, see the interface of emitters
+   described there */
+
+/* While inside generated code, guest state is cached in host registers,
+   all of them callee-saved, so that calls to service routines keep them:
+     X28 - pcpu, see translated.c;
+     X27 - executed steps minus steplimit, accounted for a whole basic
+           block when it is entered, as on x86-64;
+     X26 - guest SP;
+     W25 - guest top of stack, its copy in pcpu->stack[] is stale;
+     X24 - steplimit;
+     X23 - address of pcpu->stack[].
+   W0-W2, W9-W11, X16 and X17 are scratch registers, W3-W8 hold values
+   of IR nodes. None of them are kept across calls.
+   Spill stub writes registers back to *pcpu, reload stub reads them,
+   this is done around every call to a service routine. */
+
+/* Fixed size instructions take more room than on x86 */
+#define HOST_CODE_PER_INSTR (2 * JIT_CODE_PER_INSTR)
+/* BL reaches 128 MB, the rest is for the buffer itself */
+#define HOST_CALL_RANGE ((intptr_t)1 << 25)
+/* Zeroes are UDF #0 */
+#define CODE_FILL 0x00
+
+enum {
+    Reg_W0 = 0, Reg_W1 = 1, Reg_W2 = 2,
+    Reg_Cond = 9,   /* value tested by emit_test_zero() */
+    Reg_W10 = 10, Reg_W11 = 11,
+    Reg_IP0 = 16, Reg_IP1 = 17,
+    Reg_Stack = 23, Reg_Limit = 24, Reg_TOS = 25, Reg_SP = 26,
+    Reg_Steps = 27, Reg_CPU = 28,
+    Reg_ZR = 31,
+};
+
+/* Condition field of B.cond */
+enum {
+    Cond_EQ = 0x0,
+    Cond_NE = 0x1,
+    Cond_HS = 0x2, /* unsigned >= */
+    Cond_LT = 0xb, /* signed < */
+    Cond_GT = 0xc, /* signed > */
+};
+
+/* Fields of cpu_t are addressed with scaled unsigned offsets from X28,
+   stack slots with signed offsets of LDUR and STUR */
+_Static_assert(offsetof(cpu_t, pc) % 4 == 0 && offsetof(cpu_t, sp) % 4 == 0
+               && offsetof(cpu_t, state) % 4 == 0
+               && offsetof(cpu_t, steps) % 8 == 0
+               && sizeof(cpu_state_t) == 4, "Unaligned fields of cpu_t");
+_Static_assert(offsetof(cpu_t, stack) < 4096, "Stack out of reach of ADD");
+_Static_assert(4 * IR_POSITION_BASE < 256, "Slots out of reach of LDUR");
+
+static char* emit_insn(code_area_t *area, uint32_t insn) {
+    return emit(area, (const char*)&insn, sizeof(insn));
+}
+
+/* Fill in the offset of a B or BL instruction to target */
+static void patch_branch(char *branch, const void *target) {
+    intptr_t offset = (intptr_t)target - (intptr_t)branch;
+    if (offset < -((intptr_t)1 << 27) || offset >= ((intptr_t)1 << 27)) {
+        fprintf(stderr, "Offset to %p does not fit in 28 bits."
+        " Cannot generate code for it, sorry", target);
+        exit(2);
+    }
+    uint32_t insn;
+    memcpy(&insn, branch, sizeof(insn));
+    insn = (insn & 0xfc000000) | ((uint32_t)(offset >> 2) & 0x03ffffff);
+    memcpy(branch, &insn, sizeof(insn));
+}
+
+/* Instruction fetch does not see stores to code until the data cache
+   is cleaned and the instruction cache is invalidated for it */
+static void flush_code(char *code, size_t size) {
+    __builtin___clear_cache(code, code + size);
+}
+
+/* Emit a B or BL, return its address so that it can be patched later
+   if target is not known yet */
+static char* emit_branch(code_area_t *area, uint32_t opcode,
+                         const void *target) {
+    char *branch = emit_insn(area, opcode);
+    if (target)
+        patch_branch(branch, target);
+    return branch;
+}
+
+static char* emit_call(code_area_t *area, const void *target) {
+    char *branch = emit_branch(area, 0x94000000, target); /* bl */
+    if (relocs)
+        record_reloc(branch, target);
+    return branch;
+}
+
+static char* emit_jmp(code_area_t *area, const void *target) {
+    return emit_branch(area, 0x14000000, target); /* b */
+}
+
+/* B.cond and CBZ only reach 1 MB, so the opposite condition skips a B */
+static char* emit_jcc(code_area_t *area, int cond, const void *target) {
+    emit_insn(area, 0x54000040 | (cond ^ 1)); /* b.<!cond> .+8 */
+    return emit_jmp(area, target);
+}
+
+static char* emit_branch_zero(code_area_t *area, int reg, bool if_zero,
+                              const void *target) {
+    /* cbnz/cbz wreg, .+8 */
+    emit_insn(area, (if_zero ? 0x35000040 : 0x34000040) | reg);
+    return emit_jmp(area, target);
+}
+
+/* MOVZ/MOVK wreg, imm */
+static void emit_mov_imm32(code_area_t *area, int reg, uint32_t imm) {
+    emit_insn(area, 0x52800000 | (imm & 0xffff) << 5 | reg);
+    if (imm >> 16)
+        emit_insn(area, 0x72a00000 | (imm >> 16) << 5 | reg);
+}
+
+/* MOV wd, wm */
+static void emit_mov(code_area_t *area, int d, int m) {
+    emit_insn(area, 0x2a0003e0 | m << 16 | d);
+}
+
+/* LDR or STR of wreg at stack[SP + i] */
+static void emit_slot(code_area_t *area, bool store, int reg, int32_t i) {
+    if (i == 0) {
+        /* ldr/str wreg, [x23, x26, lsl #2] */
+        emit_insn(area, (store ? 0xb8207800 : 0xb8607800)
+                        | Reg_SP << 16 | Reg_Stack << 5 | reg);
+        return;
+    }
+    /* add x17, x23, x26, lsl #2; ldur/stur wreg, [x17, #4*i] */
+    emit_insn(area, 0x8b000800 | Reg_SP << 16 | Reg_Stack << 5 | Reg_IP1);
+    emit_insn(area, (store ? 0xb8000000 : 0xb8400000)
+                    | ((uint32_t)(4 * i) & 0x1ff) << 12 | Reg_IP1 << 5 | reg);
+}
+
+/* ADD or SUB x26, x26, #|delta|, not changing flags */
+static void emit_move_sp(code_area_t *area, int32_t delta) {
+    if (delta > 0)
+        emit_insn(area, 0x91000000 | delta << 10 | Reg_SP << 5 | Reg_SP);
+    else if (delta < 0)
+        emit_insn(area, 0xd1000000 | -delta << 10 | Reg_SP << 5 | Reg_SP);
+}
+
+/* STR of imm to a 32-bit field of *pcpu */
+static void emit_set_field(code_area_t *area, size_t offset, uint32_t imm) {
+    emit_mov_imm32(area, Reg_IP0, imm);
+    emit_insn(area, 0xb9000000 | (uint32_t)(offset / 4) << 10
+                    | Reg_CPU << 5 | Reg_IP0);
+}
+
+static void emit_set_pc(code_area_t *area, uint32_t pc) {
+    emit_set_field(area, offsetof(cpu_t, pc), pc);
+}
+
+static void emit_set_state(code_area_t *area, cpu_state_t state) {
+    emit_set_field(area, offsetof(cpu_t, state), state);
+}
+
+/* ADDS x27, x27, steps, setting flags for emit_enter_block() */
+static void emit_add_steps(code_area_t *area, int32_t steps) {
+    if (steps == 0)
+        return;
+    if (steps > -4096 && steps < 4096) {
+        /* adds/subs x27, x27, #imm12 */
+        uint32_t op = steps > 0 ? 0xb1000000 : 0xf1000000;
+        emit_insn(area, op | (uint32_t)(steps > 0 ? steps : -steps) << 10
+                        | Reg_Steps << 5 | Reg_Steps);
+        return;
+    }
+    /* movz/movn x16, #lo; movk x16, #hi, lsl #16 sign-extend steps */
+    uint32_t imm = (uint32_t)steps;
+    if (steps >= 0)
+        emit_insn(area, 0xd2800000 | (imm & 0xffff) << 5 | Reg_IP0);
+    else
+        emit_insn(area, 0x92800000 | (~imm & 0xffff) << 5 | Reg_IP0);
+    emit_insn(area, 0xf2a00000 | (imm >> 16) << 5 | Reg_IP0);
+    /* adds x27, x27, x16 */
+    emit_insn(area, 0xab000000 | Reg_IP0 << 16 | Reg_Steps << 5 | Reg_Steps);
+}
+
+/* Let a service routine simulate the instruction at pc, the slow way.
+   The routine counts the step itself, so ahead, the number of steps
+   accounted in advance for this and later instructions of the block,
+   is taken back around it. The routine will not return if the instruction
+   stops simulation. */
+static void emit_sr_call(code_area_t *area, uint32_t pc, decode_t decoded,
+                         int ahead) {
+    emit_add_steps(area, -ahead);
+    emit_set_pc(area, pc);
+    emit_call(area, spill_code);
+    emit_mov_imm32(area, Reg_W0, decoded.immediate);
+    emit_call(area, (const void*)service_routines[decoded.opcode]);
+    emit_call(area, reload_code);
+    emit_add_steps(area, ahead - 1);
+}
+
+/* Account for all steps of the basic block at pc at once, or leave
+   generated code if they do not fit into steplimit. */
+static void emit_enter_block(code_area_t *hot, code_area_t *cold,
+                             uint32_t pc, int block_steps) {
+    const char *stub = cold->cur;
+    emit_add_steps(cold, -block_steps);
+    emit_set_pc(cold, pc);
+    emit_jmp(cold, exit_code);
+    emit_add_steps(hot, block_steps);
+    emit_jcc(hot, Cond_GT, stub);
+#ifdef TRACE
+    if (TraceActive) {
+        emit_set_pc(hot, pc);
+        emit_call(hot, spill_code);
+        emit_call(hot, (const void*)sr_Trace);
+        emit_call(hot, reload_code);
+    }
+#endif
+}
+
+/* Guards: branch to a fallback if the stack does not hold at least
+   (min_sp + 1) items. Return the branch to fallback. Nothing is needed
+   if depth, the number of stack items proven by verify_program() to be
+   there before the instruction, is enough. */
+static char* emit_guard_depth(code_area_t *area, int min_sp, int32_t depth) {
+    if (depth > min_sp)
+        return NULL;
+    /* cmp x26, #min_sp */
+    emit_insn(area, 0xf100001f | (uint32_t)min_sp << 10 | Reg_SP << 5);
+    return emit_jcc(area, Cond_LT, NULL);
+}
+
+/* Same as above, but also ensure that there is room to push one item.
+   An empty stack goes to the fallback too, because
+   there is no stack slot to store the old top of stack to. */
+static char* emit_guard_room(code_area_t *area, int min_sp, int32_t depth) {
+    if (depth > min_sp && depth > 0 && depth < STACK_CAPACITY)
+        return NULL;
+    int reg = Reg_SP;
+    if (min_sp > 0) {
+        /* sub w16, w26, #min_sp */
+        emit_insn(area, 0x51000000 | (uint32_t)min_sp << 10
+                        | Reg_SP << 5 | Reg_IP0);
+        reg = Reg_IP0;
+    }
+    /* cmp wreg, #(STACK_CAPACITY - 1 - min_sp) */
+    emit_insn(area, 0x7100001f | (uint32_t)(STACK_CAPACITY - 1 - min_sp) << 10
+                    | reg << 5);
+    return emit_jcc(area, Cond_HS, NULL);
+}
+
+static void generate_stubs(code_area_t *area) {
+    /* Write cached guest state back to *pcpu */
+    spill_code = area->cur;
+    emit_insn(area, 0xb7f80040 | Reg_SP);           /* tbnz x26, #63, .+8 */
+    emit_slot(area, true, Reg_TOS, 0);              /* str w25, [stack + sp] */
+    emit_insn(area, 0xb9000000 | (offsetof(cpu_t, sp) / 4) << 10
+                    | Reg_CPU << 5 | Reg_SP);       /* str w26, [x28 + sp] */
+    emit_insn(area, 0x8b000000 | Reg_Limit << 16
+                    | Reg_Steps << 5 | Reg_IP0);    /* add x16, x27, x24 */
+    emit_insn(area, 0xf9000000 | (offsetof(cpu_t, steps) / 8) << 10
+                    | Reg_CPU << 5 | Reg_IP0);      /* str x16, [x28 + steps] */
+    emit_insn(area, 0xd65f03c0);                    /* ret */
+
+    /* Load guest state from *pcpu to registers */
+    reload_code = area->cur;
+    emit_insn(area, 0xb9800000 | (offsetof(cpu_t, sp) / 4) << 10
+                    | Reg_CPU << 5 | Reg_SP);       /* ldrsw x26, [x28 + sp] */
+    emit_insn(area, 0x91000000 | offsetof(cpu_t, stack) << 10
+                    | Reg_CPU << 5 | Reg_Stack);    /* add x23, x28, #stack */
+    emit_slot(area, false, Reg_TOS, 0);             /* ldr w25, [stack + sp] */
+    emit_insn(area, 0xf9400000 | (offsetof(cpu_t, steps) / 8) << 10
+                    | Reg_CPU << 5 | Reg_Steps);    /* ldr x27, [x28 + steps] */
+    emit_insn(area, 0xcb000000 | Reg_Limit << 16
+                    | Reg_Steps << 5 | Reg_Steps);  /* sub x27, x27, x24 */
+    emit_insn(area, 0xd65f03c0);                    /* ret */
+
+    /* Leave generated code, guest PC should be already stored */
+    exit_code = area->cur;
+    emit_call(area, spill_code);
+    emit_call(area, (const void*)exit_generated_code);
+
+    /* Enter generated code, the target in X0 and the limit in X1.
+       The host stack is aligned already. There is no return from it,
+       exit_generated_code() will restore host stack pointer. */
+    enter_code = (enter_code_t)emit_insn(area, 0xaa0003e0 | 1 << 16
+                                               | Reg_Limit); /* mov x24, x1 */
+    emit_call(area, reload_code);
+    emit_insn(area, 0xd61f0000);                    /* br x0 */
+}
+
+/*** Guest instructions ***/
+
+/* Pop the top of stack into W9 for emit_branch_cond() */
+static void emit_pop_test(code_area_t *area) {
+    emit_mov(area, Reg_Cond, Reg_TOS);
+    emit_move_sp(area, -1);
+    emit_slot(area, false, Reg_TOS, 0);
+}
+
+/* Branch to target if the value last tested was zero, or if it was not */
+static char* emit_branch_cond(code_area_t *area, bool if_zero,
+                              const void *target) {
+    return emit_branch_zero(area, Reg_Cond, if_zero, target);
+}
+
+/* <op> wd, wn, wm of an instruction from Add to Mod, but Mod only
+   divides into W2 */
+static uint32_t alu_insn(Instr_t opcode, int d, int n, int m) {
+    uint32_t op;
+    switch (opcode) {
+    case Instr_Add: op = 0x0b000000; break;
+    case Instr_Sub: op = 0x4b000000; break;
+    case Instr_And: op = 0x0a000000; break;
+    case Instr_Or:  op = 0x2a000000; break;
+    case Instr_Xor: op = 0x4a000000; break;
+    case Instr_Mul: op = 0x1b007c00; break; /* madd with wzr */
+    case Instr_SHL: op = 0x1ac02000; break; /* lslv */
+    case Instr_SHR: op = 0x1ac02400; break; /* lsrv */
+    case Instr_Mod: op = 0x1ac00800; d = Reg_W2; break; /* udiv */
+    default:
+        assert("Unreachable" && false);
+        op = 0;
+        break;
+    }
+    return op | m << 16 | n << 5 | d;
+}
+
+/* The remainder of Mod: msub wd, w2, wm, wn */
+static uint32_t msub_insn(int d, int n, int m) {
+    return 0x1b008000 | m << 16 | n << 10 | Reg_W2 << 5 | d;
+}
+
+/* Code of stack and arithmetic instructions from Push to Mod, with
+   branches to fallback for stack errors and division by zero */
+static void emit_operation(code_area_t *area, decode_t decoded, int32_t depth,
+                           char *fallback[2]) {
+    switch (decoded.opcode) {
+    case Instr_Push:
+    case Instr_Dup:
+        fallback[0] = emit_guard_room(area, 0, depth);
+        emit_slot(area, true, Reg_TOS, 0);
+        emit_move_sp(area, 1);
+        if (decoded.opcode == Instr_Push)
+            emit_mov_imm32(area, Reg_TOS, decoded.immediate);
+        break;
+    case Instr_Over:
+        fallback[0] = emit_guard_room(area, 1, depth);
+        emit_slot(area, false, Reg_W0, -1);
+        emit_slot(area, true, Reg_TOS, 0);
+        emit_move_sp(area, 1);
+        emit_mov(area, Reg_TOS, Reg_W0);
+        break;
+    case Instr_Swap:
+        fallback[0] = emit_guard_depth(area, 1, depth);
+        emit_slot(area, false, Reg_W0, -1);
+        emit_slot(area, true, Reg_TOS, -1);
+        emit_mov(area, Reg_TOS, Reg_W0);
+        break;
+    case Instr_Rot:
+        fallback[0] = emit_guard_depth(area, 2, depth);
+        emit_slot(area, false, Reg_W0, -2);
+        emit_slot(area, false, Reg_W1, -1);
+        emit_slot(area, true, Reg_TOS, -2);
+        emit_slot(area, true, Reg_W0, -1);
+        emit_mov(area, Reg_TOS, Reg_W1);
+        break;
+    case Instr_Drop:
+        fallback[0] = emit_guard_depth(area, 0, depth);
+        emit_move_sp(area, -1);
+        emit_slot(area, false, Reg_TOS, 0);
+        break;
+    case Instr_Inc:
+    case Instr_Dec:
+        fallback[0] = emit_guard_depth(area, 0, depth);
+        /* add/sub w25, w25, #1 */
+        emit_insn(area, (decoded.opcode == Instr_Inc ? 0x11000400 : 0x51000400)
+                        | Reg_TOS << 5 | Reg_TOS);
+        break;
+    case Instr_Add:
+    case Instr_Sub:
+    case Instr_And:
+    case Instr_Or:
+    case Instr_Xor:
+    case Instr_Mul:
+    case Instr_SHL:
+    case Instr_SHR:
+        fallback[0] = emit_guard_depth(area, 1, depth);
+        emit_slot(area, false, Reg_W0, -1);
+        emit_insn(area, alu_insn(decoded.opcode, Reg_TOS, Reg_TOS, Reg_W0));
+        emit_move_sp(area, -1);
+        break;
+    case Instr_Mod:
+        fallback[0] = emit_guard_depth(area, 1, depth);
+        emit_slot(area, false, Reg_W1, -1);
+        /* Division by zero is handled by the service routine */
+        fallback[1] = emit_branch_zero(area, Reg_W1, true, NULL);
+        emit_insn(area, alu_insn(Instr_Mod, Reg_TOS, Reg_TOS, Reg_W1));
+        emit_insn(area, msub_insn(Reg_TOS, Reg_TOS, Reg_W1));
+        emit_move_sp(area, -1);
+        break;
+    default:
+        assert("Unreachable" && false);
+        break;
+    }
+}
+
+/*** IR segments ***/
+
+static const int value_regs[] = {3, 4, 5, 6, 7, 8};
+/* For breaking cycles of moves, along with free value registers */
+static const int scratch_regs[] = {Reg_W10, Reg_W11};
+
+/* MOV reg, src */
+static void emit_load(code_area_t *area, int reg, opnd_t src) {
+    if (src.kind == Opnd_Imm)
+        emit_mov_imm32(area, reg, src.x);
+    else if (src.kind == Opnd_Mem)
+        emit_slot(area, false, reg, src.x);
+    else if (src.x != reg)
+        emit_mov(area, reg, src.x);
+}
+
+/* MOV dst, src for a memory slot dst */
+static void emit_store(code_area_t *area, int32_t pos, opnd_t src) {
+    if (src.kind == Opnd_Reg) {
+        emit_slot(area, true, src.x, pos);
+    } else if (src.kind == Opnd_Imm && src.x == 0) {
+        emit_slot(area, true, Reg_ZR, pos);
+    } else {
+        emit_load(area, Reg_IP0, src);
+        emit_slot(area, true, Reg_IP0, pos);
+    }
+}
+
+/* Keep src in W9 for emit_branch_cond(), nothing else uses it */
+static void emit_test_zero(code_area_t *area, opnd_t src) {
+    assert(src.kind != Opnd_Imm);
+    emit_load(area, Reg_Cond, src);
+}
+
+/* Register holding an operand, scratch if it has to be loaded */
+static int operand_reg(code_area_t *area, opnd_t v, int scratch) {
+    if (v.kind == Opnd_Reg)
+        return v.x;
+    emit_load(area, scratch, v);
+    return scratch;
+}
+
+/* Compute register d from operands a and b of a node. D may be
+   the register of a. */
+static void emit_node_op(code_area_t *area, Instr_t opcode, int d,
+                         opnd_t a, opnd_t b) {
+    int n = operand_reg(area, a, Reg_W0);
+    int m = operand_reg(area, b, Reg_W1);
+    emit_insn(area, alu_insn(opcode, d, n, m));
+    if (opcode == Instr_Mod)
+        emit_insn(area, msub_insn(d, n, m));
+}
+
+#endif /* TRANSLATED_AARCH64_H_ */
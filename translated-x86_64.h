@@ -0,0 +1,634 @@
+/*  translated-x86_64.h - Intel 64 code generation of the binary translator
+    Copyright (c) 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#ifndef TRANSLATED_X86_64_H_
+#define TRANSLATED_X86_64_H_
+
+/* Only to be included by translated.c, see the interface of emitters
+   described there */
+
+/* While inside generated code, guest state is cached in host registers,
+   all of them callee-saved, so that calls to service routines keep them:
+     R15  - pcpu, see translated.c;
+     R14  - executed steps minus steplimit. Steps are accounted for
+            a whole basic block when it is entered, so that R14 is not
+            above zero while the block runs;
+     R13  - guest SP;
+     R12D - guest top of stack, its copy in pcpu->stack[] is stale;
+     RBX  - steplimit.
+   Guest PC is known at translation time and is only stored on exits.
+   Spill stub writes registers back to *pcpu, reload stub reads them,
+   this is done around every call to a service routine. */
+
+#define HOST_CODE_PER_INSTR JIT_CODE_PER_INSTR
+/* Calls to service routines are rel32 */
+#define HOST_CALL_RANGE ((intptr_t)INT32_MAX / 2)
+/* INT3 */
+#define CODE_FILL 0xcc
+
+/* Displacements for fields of cpu_t addressed relative to R15 */
+#define PC_DISP    ((char)offsetof(cpu_t, pc))
+#define SP_DISP    ((char)offsetof(cpu_t, sp))
+#define STATE_DISP ((char)offsetof(cpu_t, state))
+#define STEPS_DISP ((char)offsetof(cpu_t, steps))
+/* Displacement of stack[SP + i] addressed as [R15 + R13*4 + disp8] */
+#define SLOT_DISP(i) ((char)(offsetof(cpu_t, stack) + 4 * (i)))
+
+/* Second byte of "Jcc rel32" instructions */
+enum {
+    Cond_AE = 0x83, /* unsigned >= */
+    Cond_E  = 0x84,
+    Cond_NE = 0x85,
+    Cond_S  = 0x88, /* negative */
+    Cond_L  = 0x8c, /* signed < */
+    Cond_G  = 0x8f, /* signed > */
+};
+
+/* An IA-32 instruction "MOV RDI, imm32" is used to pass a parameter
+   to a function invoked by a following CALL. */
+#ifdef __CYGWIN__ /* Win64 ABI, use RCX instead of RDI */
+static const char mov_template_code[]= {0x48, 0xc7, 0xc1, 0x00, 0x00, 0x00, 0x00};
+#else
+static const char mov_template_code[]= {0x48, 0xc7, 0xc7, 0x00, 0x00, 0x00, 0x00};
+#endif
+
+static void patch_imm32(char *field, int32_t imm) {
+    memcpy(field, &imm, 4);
+}
+
+/* Fill in the rel32 field of a relative branch or call to target */
+static void patch_branch(char *field, const void *target) {
+    intptr_t offset = (intptr_t)target - (intptr_t)field - 4;
+    if (offset != (intptr_t)(int32_t)offset) {
+        fprintf(stderr, "Offset to %p does not fit in 32 bits."
+        " Cannot generate code for it, sorry", target);
+        exit(2);
+    }
+    patch_imm32(field, (int32_t)offset);
+}
+
+/* Stores to code are seen by instruction fetch on x86 */
+static void flush_code(char *code, size_t size) {
+    (void)code;
+    (void)size;
+}
+
+/* Emit a branch with rel32 operand, return address of the operand field
+   so that it can be patched later if target is not known yet */
+static char* emit_rel32(code_area_t *area, const char *opcode, int size,
+                        const void *target) {
+    static const char zero_rel32[] = {0x00, 0x00, 0x00, 0x00};
+    emit(area, opcode, size);
+    char *field = emit(area, zero_rel32, sizeof(zero_rel32));
+    if (target)
+        patch_branch(field, target);
+    return field;
+}
+
+static char* emit_call(code_area_t *area, const void *target) {
+    static const char call_code[] = {0xe8};
+    char *field = emit_rel32(area, call_code, sizeof(call_code), target);
+    if (relocs)
+        record_reloc(field, target);
+    return field;
+}
+
+static char* emit_jmp(code_area_t *area, const void *target) {
+    static const char jmp_code[] = {0xe9};
+    return emit_rel32(area, jmp_code, sizeof(jmp_code), target);
+}
+
+static char* emit_jcc(code_area_t *area, char cond, const void *target) {
+    const char jcc_code[] = {0x0f, cond};
+    return emit_rel32(area, jcc_code, sizeof(jcc_code), target);
+}
+
+static void emit_set_pc(code_area_t *area, uint32_t pc) {
+    /* mov dword [r15 + pc], imm32 */
+    const char set_pc_code[] = {0x41, 0xc7, 0x47, PC_DISP, 0x00, 0x00, 0x00, 0x00};
+    char *code = emit(area, set_pc_code, sizeof(set_pc_code));
+    patch_imm32(code + 4, pc);
+}
+
+static void emit_set_state(code_area_t *area, cpu_state_t state) {
+    /* mov dword [r15 + state], imm32 */
+    const char set_state_code[] = {0x41, 0xc7, 0x47, STATE_DISP, 0x00, 0x00, 0x00, 0x00};
+    char *code = emit(area, set_state_code, sizeof(set_state_code));
+    patch_imm32(code + 4, state);
+}
+
+static void emit_add_steps(code_area_t *area, int32_t steps) {
+    const char add_steps_code[] = {0x49, 0x81, 0xc6, 0x00, 0x00, 0x00, 0x00}; /* add r14, imm32 */
+    if (steps == 0)
+        return;
+    char *code = emit(area, add_steps_code, sizeof(add_steps_code));
+    patch_imm32(code + 3, steps);
+}
+
+/* Let a service routine simulate the instruction at pc, the slow way.
+   The routine counts the step itself, so ahead, the number of steps
+   accounted in advance for this and later instructions of the block,
+   is taken back around it. The routine will not return if the instruction
+   stops simulation. */
+static void emit_sr_call(code_area_t *area, uint32_t pc, decode_t decoded,
+                         int ahead) {
+    emit_add_steps(area, -ahead);
+    emit_set_pc(area, pc);
+    emit_call(area, spill_code);
+    char *code = emit(area, mov_template_code, sizeof(mov_template_code));
+    patch_imm32(code + 3, decoded.immediate);
+    emit_call(area, (const void*)service_routines[decoded.opcode]);
+    emit_call(area, reload_code);
+    emit_add_steps(area, ahead - 1);
+}
+
+/* Account for all steps of the basic block at pc at once, or leave
+   generated code if they do not fit into steplimit. */
+static void emit_enter_block(code_area_t *hot, code_area_t *cold,
+                             uint32_t pc, int block_steps) {
+    const char *stub = cold->cur;
+    emit_add_steps(cold, -block_steps);
+    emit_set_pc(cold, pc);
+    emit_jmp(cold, exit_code);
+    emit_add_steps(hot, block_steps);
+    emit_jcc(hot, Cond_G, stub);
+#ifdef TRACE
+    if (TraceActive) {
+        emit_set_pc(hot, pc);
+        emit_call(hot, spill_code);
+        emit_call(hot, (const void*)sr_Trace);
+        emit_call(hot, reload_code);
+    }
+#endif
+}
+
+/* Guards: jump to a fallback if the stack does not hold at least
+   (min_sp + 1) items. Return offset field for the branch to fallback.
+   Nothing is needed if depth, the number of stack items proven by
+   verify_program() to be there before the instruction, is enough. */
+static char* emit_guard_depth(code_area_t *area, int min_sp, int32_t depth) {
+    if (depth > min_sp)
+        return NULL;
+    if (min_sp == 0) {
+        static const char test_sp_code[] = {0x4d, 0x85, 0xed}; /* test r13, r13 */
+        emit(area, test_sp_code, sizeof(test_sp_code));
+        return emit_jcc(area, Cond_S, NULL);
+    }
+    const char cmp_sp_code[] = {0x49, 0x83, 0xfd, (char)min_sp}; /* cmp r13, imm8 */
+    emit(area, cmp_sp_code, sizeof(cmp_sp_code));
+    return emit_jcc(area, Cond_L, NULL);
+}
+
+/* Same as above, but also ensure that there is room to push one item.
+   An empty stack goes to the fallback too, because
+   there is no stack slot to store the old top of stack to. */
+static char* emit_guard_room(code_area_t *area, int min_sp, int32_t depth) {
+    if (depth > min_sp && depth > 0 && depth < STACK_CAPACITY)
+        return NULL;
+    if (min_sp == 0) {
+        const char cmp_sp_code[] = {0x41, 0x83, 0xfd,
+                                    STACK_CAPACITY - 1}; /* cmp r13d, imm8 */
+        emit(area, cmp_sp_code, sizeof(cmp_sp_code));
+        return emit_jcc(area, Cond_AE, NULL);
+    }
+    const char guard_code[] = {
+        0x41, 0x8d, 0x45, (char)-min_sp,           /* lea eax, [r13 - min_sp] */
+        0x83, 0xf8, STACK_CAPACITY - 1 - min_sp    /* cmp eax, imm8 */
+    };
+    emit(area, guard_code, sizeof(guard_code));
+    return emit_jcc(area, Cond_AE, NULL);
+}
+
+static void generate_stubs(code_area_t *area) {
+    /* Write cached guest state back to *pcpu */
+    const char spill_template_code[] = {
+        0x4d, 0x85, 0xed,                     /* test r13, r13 */
+        0x78, 0x05,                           /* js .+5 */
+        0x47, 0x89, 0x64, 0xaf, SLOT_DISP(0), /* mov [r15 + r13*4 + stack], r12d */
+        0x45, 0x89, 0x6f, SP_DISP,            /* mov [r15 + sp], r13d */
+        0x49, 0x8d, 0x04, 0x1e,               /* lea rax, [r14 + rbx] */
+        0x49, 0x89, 0x47, STEPS_DISP,         /* mov [r15 + steps], rax */
+        0xc3                                  /* ret */
+    };
+    spill_code = emit(area, spill_template_code, sizeof(spill_template_code));
+
+    /* Load guest state from *pcpu to registers */
+    const char reload_template_code[] = {
+        0x4d, 0x63, 0x6f, SP_DISP,            /* movsxd r13, [r15 + sp] */
+        0x47, 0x8b, 0x64, 0xaf, SLOT_DISP(0), /* mov r12d, [r15 + r13*4 + stack] */
+        0x4d, 0x8b, 0x77, STEPS_DISP,         /* mov r14, [r15 + steps] */
+        0x49, 0x29, 0xde,                     /* sub r14, rbx */
+        0xc3                                  /* ret */
+    };
+    reload_code = emit(area, reload_template_code, sizeof(reload_template_code));
+
+    /* Leave generated code, guest PC should be already stored */
+    exit_code = area->cur;
+    emit_call(area, spill_code);
+    emit_call(area, (const void*)exit_generated_code);
+
+    /* Enter generated code with realigned host stack. There is no return
+       from it, exit_generated_code() will restore host stack pointer. */
+#ifdef __CYGWIN__ /* Win64 ABI, arguments in RCX and RDX, shadow space */
+    const char enter_template_code[] = {
+        0x48, 0x83, 0xe4, 0xf0,               /* and rsp, -16 */
+        0x48, 0x83, 0xec, 0x20,               /* sub rsp, 32 */
+        0x48, 0x89, 0xd3,                     /* mov rbx, rdx */
+    };
+    const char jmp_target_code[] = {0xff, 0xe1}; /* jmp rcx */
+#else
+    const char enter_template_code[] = {
+        0x48, 0x83, 0xe4, 0xf0,               /* and rsp, -16 */
+        0x48, 0x89, 0xf3,                     /* mov rbx, rsi */
+    };
+    const char jmp_target_code[] = {0xff, 0xe7}; /* jmp rdi */
+#endif
+    enter_code = (enter_code_t)emit(area, enter_template_code,
+                                    sizeof(enter_template_code));
+    emit_call(area, reload_code);
+    emit(area, jmp_target_code, sizeof(jmp_target_code));
+}
+
+/*** Guest instructions ***/
+
+/* Pop the top of stack into EAX and set flags by comparing it with zero
+   for emit_branch_cond() */
+static void emit_pop_test(code_area_t *area) {
+    const char pop_flag_code[] = {
+        0x44, 0x89, 0xe0,                      /* mov eax, r12d */
+        0x49, 0xff, 0xcd,                      /* dec r13 */
+        0x47, 0x8b, 0x64, 0xaf, SLOT_DISP(0),  /* mov r12d, [stack + sp] */
+        0x85, 0xc0,                            /* test eax, eax */
+    };
+    emit(area, pop_flag_code, sizeof(pop_flag_code));
+}
+
+/* Branch to target if the value last tested was zero, or if it was not */
+static char* emit_branch_cond(code_area_t *area, bool if_zero,
+                              const void *target) {
+    return emit_jcc(area, if_zero ? Cond_E: Cond_NE, target);
+}
+
+/* Code of stack and arithmetic instructions from Push to Mod, with
+   branches to fallback for stack errors and division by zero */
+static void emit_operation(code_area_t *area, decode_t decoded, int32_t depth,
+                           char *fallback[2]) {
+    switch (decoded.opcode) {
+    case Instr_Push: {
+        const char push_code[] = {
+            0x47, 0x89, 0x64, 0xaf, SLOT_DISP(0), /* mov [stack + sp], r12d */
+            0x49, 0xff, 0xc5,                     /* inc r13 */
+            0x41, 0xbc, 0x00, 0x00, 0x00, 0x00,   /* mov r12d, imm32 */
+        };
+        fallback[0] = emit_guard_room(area, 0, depth);
+        char *code = emit(area, push_code, sizeof(push_code));
+        patch_imm32(code + 10, decoded.immediate);
+        break;
+    }
+    case Instr_Dup: {
+        const char dup_code[] = {
+            0x47, 0x89, 0x64, 0xaf, SLOT_DISP(0), /* mov [stack + sp], r12d */
+            0x49, 0xff, 0xc5,                     /* inc r13 */
+        };
+        fallback[0] = emit_guard_room(area, 0, depth);
+        emit(area, dup_code, sizeof(dup_code));
+        break;
+    }
+    case Instr_Over: {
+        const char over_code[] = {
+            0x43, 0x8b, 0x44, 0xaf, SLOT_DISP(-1), /* mov eax, [stack + sp - 1] */
+            0x47, 0x89, 0x64, 0xaf, SLOT_DISP(0),  /* mov [stack + sp], r12d */
+            0x49, 0xff, 0xc5,                      /* inc r13 */
+            0x41, 0x89, 0xc4,                      /* mov r12d, eax */
+        };
+        fallback[0] = emit_guard_room(area, 1, depth);
+        emit(area, over_code, sizeof(over_code));
+        break;
+    }
+    case Instr_Swap: {
+        const char swap_code[] = {
+            0x43, 0x8b, 0x44, 0xaf, SLOT_DISP(-1), /* mov eax, [stack + sp - 1] */
+            0x47, 0x89, 0x64, 0xaf, SLOT_DISP(-1), /* mov [stack + sp - 1], r12d */
+            0x41, 0x89, 0xc4,                      /* mov r12d, eax */
+        };
+        fallback[0] = emit_guard_depth(area, 1, depth);
+        emit(area, swap_code, sizeof(swap_code));
+        break;
+    }
+    case Instr_Rot: {
+        const char rot_code[] = {
+            0x43, 0x8b, 0x44, 0xaf, SLOT_DISP(-2), /* mov eax, [stack + sp - 2] */
+            0x43, 0x8b, 0x4c, 0xaf, SLOT_DISP(-1), /* mov ecx, [stack + sp - 1] */
+            0x47, 0x89, 0x64, 0xaf, SLOT_DISP(-2), /* mov [stack + sp - 2], r12d */
+            0x43, 0x89, 0x44, 0xaf, SLOT_DISP(-1), /* mov [stack + sp - 1], eax */
+            0x41, 0x89, 0xcc,                      /* mov r12d, ecx */
+        };
+        fallback[0] = emit_guard_depth(area, 2, depth);
+        emit(area, rot_code, sizeof(rot_code));
+        break;
+    }
+    case Instr_Drop: {
+        const char drop_code[] = {
+            0x49, 0xff, 0xcd,                      /* dec r13 */
+            0x47, 0x8b, 0x64, 0xaf, SLOT_DISP(0),  /* mov r12d, [stack + sp] */
+        };
+        fallback[0] = emit_guard_depth(area, 0, depth);
+        emit(area, drop_code, sizeof(drop_code));
+        break;
+    }
+    case Instr_Inc:
+    case Instr_Dec: {
+        static const char inc_code[] = {0x41, 0xff, 0xc4}; /* inc r12d */
+        static const char dec_code[] = {0x41, 0xff, 0xcc}; /* dec r12d */
+        fallback[0] = emit_guard_depth(area, 0, depth);
+        if (decoded.opcode == Instr_Inc)
+            emit(area, inc_code, sizeof(inc_code));
+        else
+            emit(area, dec_code, sizeof(dec_code));
+        break;
+    }
+    case Instr_Add:
+    case Instr_Sub:
+    case Instr_And:
+    case Instr_Or:
+    case Instr_Xor: {
+        /* <op> r12d, [stack + sp - 1]; dec r13 */
+        char alu_code[] = {
+            0x47, 0x00, 0x64, 0xaf, SLOT_DISP(-1),
+            0x49, 0xff, 0xcd,
+        };
+        alu_code[1] = decoded.opcode == Instr_Add ? 0x03:
+                      decoded.opcode == Instr_Sub ? 0x2b:
+                      decoded.opcode == Instr_And ? 0x23:
+                      decoded.opcode == Instr_Or  ? 0x0b: 0x33;
+        fallback[0] = emit_guard_depth(area, 1, depth);
+        emit(area, alu_code, sizeof(alu_code));
+        break;
+    }
+    case Instr_Mul: {
+        const char mul_code[] = {
+            0x47, 0x0f, 0xaf, 0x64, 0xaf, SLOT_DISP(-1), /* imul r12d, [stack + sp - 1] */
+            0x49, 0xff, 0xcd,                            /* dec r13 */
+        };
+        fallback[0] = emit_guard_depth(area, 1, depth);
+        emit(area, mul_code, sizeof(mul_code));
+        break;
+    }
+    case Instr_SHL:
+    case Instr_SHR: {
+        char shift_code[] = {
+            0x43, 0x8b, 0x4c, 0xaf, SLOT_DISP(-1), /* mov ecx, [stack + sp - 1] */
+            0x41, 0xd3, 0x00,                      /* shl/shr r12d, cl */
+            0x49, 0xff, 0xcd,                      /* dec r13 */
+        };
+        shift_code[7] = decoded.opcode == Instr_SHL ? 0xe4: 0xec;
+        fallback[0] = emit_guard_depth(area, 1, depth);
+        emit(area, shift_code, sizeof(shift_code));
+        break;
+    }
+    case Instr_Mod: {
+        const char load_divisor_code[] = {
+            0x43, 0x8b, 0x4c, 0xaf, SLOT_DISP(-1), /* mov ecx, [stack + sp - 1] */
+            0x85, 0xc9,                            /* test ecx, ecx */
+        };
+        const char mod_code[] = {
+            0x44, 0x89, 0xe0,                      /* mov eax, r12d */
+            0x31, 0xd2,                            /* xor edx, edx */
+            0xf7, 0xf1,                            /* div ecx */
+            0x41, 0x89, 0xd4,                      /* mov r12d, edx */
+            0x49, 0xff, 0xcd,                      /* dec r13 */
+        };
+        fallback[0] = emit_guard_depth(area, 1, depth);
+        emit(area, load_divisor_code, sizeof(load_divisor_code));
+        /* Division by zero is handled by the service routine */
+        fallback[1] = emit_jcc(area, Cond_E, NULL);
+        emit(area, mod_code, sizeof(mod_code));
+        break;
+    }
+    default:
+        assert("Unreachable" && false);
+        break;
+    }
+}
+
+/*** IR segments ***/
+
+/* Numbers of host registers in instruction encodings. EAX, ECX and EDX
+   are scratch registers, the rest of the caller-saved ones hold values
+   of IR nodes. None of them are kept across calls. */
+enum {
+    Reg_EAX = 0, Reg_ECX = 1, Reg_EDX = 2, Reg_ESI = 6, Reg_EDI = 7,
+    Reg_R8D = 8, Reg_R9D, Reg_R10D, Reg_R11D, Reg_R12D,
+    Reg_TOS = Reg_R12D,
+};
+
+static const int value_regs[] = {
+    Reg_ESI, Reg_EDI, Reg_R8D, Reg_R9D, Reg_R10D, Reg_R11D
+};
+/* For breaking cycles of moves, along with free value registers */
+static const int scratch_regs[] = {Reg_ECX, Reg_EDX};
+
+/* An instruction with register reg and a ModRM operand rm, which is
+   a register or [R15 + R13*4 + disp] for a memory slot */
+static void emit_modrm(code_area_t *area, const char *opcode, int size,
+                       int reg, opnd_t rm) {
+    assert(rm.kind != Opnd_Imm);
+    char code[16];
+    int n = 0;
+    char rex = 0x40 | ((reg & 8) ? 0x04 : 0);
+    if (rm.kind == Opnd_Reg)
+        rex |= (rm.x & 8) ? 0x01 : 0;
+    else
+        rex |= 0x03; /* R13 as index and R15 as base */
+    if (rex != 0x40)
+        code[n++] = rex;
+    memcpy(code + n, opcode, size);
+    n += size;
+    if (rm.kind == Opnd_Reg) {
+        code[n++] = 0xc0 | (reg & 7) << 3 | (rm.x & 7);
+    } else {
+        int32_t disp = offsetof(cpu_t, stack) + 4 * rm.x;
+        bool short_disp = disp >= -128 && disp <= 127;
+        code[n++] = (short_disp ? 0x44 : 0x84) | (reg & 7) << 3;
+        code[n++] = 0xaf; /* scale 4 */
+        if (short_disp)
+            code[n++] = (char)disp;
+        else {
+            patch_imm32(code + n, disp);
+            n += 4;
+        }
+    }
+    emit(area, code, n);
+}
+
+static void emit_imm32(code_area_t *area, int32_t imm) {
+    char code[4];
+    patch_imm32(code, imm);
+    emit(area, code, sizeof(code));
+}
+
+/* MOV reg, src */
+static void emit_load(code_area_t *area, int reg, opnd_t src) {
+    static const char mov_load_code[] = {0x8b};
+    if (src.kind == Opnd_Imm) {
+        char code[2];
+        int n = 0;
+        if (reg & 8)
+            code[n++] = 0x41;
+        code[n++] = 0xb8 | (reg & 7); /* mov r32, imm32 */
+        emit(area, code, n);
+        emit_imm32(area, src.x);
+    } else if (!(src.kind == Opnd_Reg && src.x == reg)) {
+        emit_modrm(area, mov_load_code, sizeof(mov_load_code), reg, src);
+    }
+}
+
+/* MOV dst, src for a memory slot dst */
+static void emit_store(code_area_t *area, int32_t pos, opnd_t src) {
+    static const char mov_store_code[] = {0x89};
+    static const char mov_imm_code[] = {0xc7};
+    opnd_t dst = {Opnd_Mem, pos};
+    if (src.kind == Opnd_Imm) {
+        emit_modrm(area, mov_imm_code, sizeof(mov_imm_code), 0, dst);
+        emit_imm32(area, src.x);
+    } else if (src.kind == Opnd_Reg) {
+        emit_modrm(area, mov_store_code, sizeof(mov_store_code), src.x, dst);
+    } else {
+        emit_load(area, Reg_EAX, src);
+        emit_modrm(area, mov_store_code, sizeof(mov_store_code), Reg_EAX, dst);
+    }
+}
+
+/* Set flags by comparing src with zero for emit_branch_cond() */
+static void emit_test_zero(code_area_t *area, opnd_t src) {
+    static const char test_code[] = {0x85};
+    static const char cmp_imm8_code[] = {0x83};
+    assert(src.kind != Opnd_Imm);
+    if (src.kind == Opnd_Reg) {
+        emit_modrm(area, test_code, sizeof(test_code), src.x, src);
+    } else {
+        const char zero = 0;
+        emit_modrm(area, cmp_imm8_code, sizeof(cmp_imm8_code), 7, src);
+        emit(area, &zero, 1);
+    }
+}
+
+/* LEA R13, [R13 + delta], not changing flags */
+static void emit_move_sp(code_area_t *area, int32_t delta) {
+    const char lea_code[] = {0x4d, 0x8d, 0x6d, (char)delta};
+    if (delta != 0)
+        emit(area, lea_code, sizeof(lea_code));
+}
+
+/* Compute register d from operands a and b of a node. D may be
+   the register of a. */
+static void emit_node_op(code_area_t *area, Instr_t opcode, int d,
+                         opnd_t a, opnd_t b) {
+    opnd_t dst = {Opnd_Reg, d};
+    switch (opcode) {
+    case Instr_Add:
+    case Instr_Sub:
+    case Instr_And:
+    case Instr_Or:
+    case Instr_Xor: {
+        /* <op> d, b or <op> d, imm32 */
+        char alu_code[] = {
+            opcode == Instr_Add ? 0x03:
+            opcode == Instr_Sub ? 0x2b:
+            opcode == Instr_And ? 0x23:
+            opcode == Instr_Or  ? 0x0b: 0x33
+        };
+        char alu_imm_code[] = {0x81};
+        int digit = opcode == Instr_Add ? 0:
+                    opcode == Instr_Sub ? 5:
+                    opcode == Instr_And ? 4:
+                    opcode == Instr_Or  ? 1: 6;
+        emit_load(area, d, a);
+        if (b.kind == Opnd_Imm) {
+            emit_modrm(area, alu_imm_code, sizeof(alu_imm_code), digit, dst);
+            emit_imm32(area, b.x);
+        } else
+            emit_modrm(area, alu_code, sizeof(alu_code), d, b);
+        break;
+    }
+    case Instr_Mul: {
+        static const char imul_code[] = {0x0f, 0xaf};
+        static const char imul_imm_code[] = {0x69};
+        if (b.kind == Opnd_Imm) {
+            /* imul d, a, imm32 */
+            if (a.kind == Opnd_Imm) {
+                emit_load(area, d, a);
+                a = dst;
+            }
+            emit_modrm(area, imul_imm_code, sizeof(imul_imm_code), d, a);
+            emit_imm32(area, b.x);
+        } else {
+            emit_load(area, d, a);
+            emit_modrm(area, imul_code, sizeof(imul_code), d, b);
+        }
+        break;
+    }
+    case Instr_SHL:
+    case Instr_SHR: {
+        int digit = opcode == Instr_SHL ? 4: 5;
+        if (b.kind == Opnd_Imm) {
+            static const char shift_imm_code[] = {0xc1};
+            const char count = b.x & 31;
+            emit_load(area, d, a);
+            emit_modrm(area, shift_imm_code, sizeof(shift_imm_code),
+                       digit, dst);
+            emit(area, &count, 1);
+        } else {
+            static const char shift_code[] = {0xd3}; /* by CL */
+            emit_load(area, Reg_ECX, b);
+            emit_load(area, d, a);
+            emit_modrm(area, shift_code, sizeof(shift_code), digit, dst);
+        }
+        break;
+    }
+    case Instr_Mod: {
+        static const char xor_edx_code[] = {0x31, 0xd2};
+        static const char div_code[] = {0xf7};
+        emit_load(area, Reg_EAX, a);
+        if (b.kind == Opnd_Imm) {
+            emit_load(area, Reg_ECX, b);
+            b = (opnd_t){Opnd_Reg, Reg_ECX};
+        }
+        emit(area, xor_edx_code, sizeof(xor_edx_code));
+        emit_modrm(area, div_code, sizeof(div_code), 6, b);
+        emit_load(area, d, (opnd_t){Opnd_Reg, Reg_EDX});
+        break;
+    }
+    default:
+        assert("Unreachable" && false);
+        break;
+    }
+}
+
+#endif /* TRANSLATED_X86_64_H_ */
@@ -27,12 +27,14 @@ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
 OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
-#ifndef __x86_64__
-/* The program generates machine code, only specific platforms are supported */
-#error This program is designed to compile only on Intel64/AMD64 platform.
+#if !defined(__x86_64__) && !defined(__aarch64__)
+/* The program generates machine code, only specific platforms are supported,
+   see the emitters included below */
+#error This program is designed to compile only on Intel64/AMD64 and AArch64 platforms.
 #error Sorry.
 #endif
 
+#define _GNU_SOURCE /* for dl_iterate_phdr() */
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -41,84 +43,45 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <errno.h>
 #include <limits.h>
 #include <string.h>
+#include <stddef.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <setjmp.h>
 #include <math.h>
+#ifndef __CYGWIN__
+#include <link.h>
+#endif
 
 #include "common.h"
+#include "ir.h"
+#include "trace.h"
 
-/* setjmp/longjmp context buffer to be reachable from within generated code */
-static jmp_buf return_buf;
+/* setjmp/longjmp context buffer to be reachable from within generated code.
+   State of translation is per thread so that several of them can run
+   translated code at once. */
+static _Thread_local jmp_buf return_buf;
 
 /* Global pointer to be accessible from generated code.
-   Uses GNU extension to statically occupy host R15 register. */
+   Uses GNU extension to statically occupy a callee-saved host register. */
+#ifdef __x86_64__
 register cpu_t * pcpu asm("r15");
+#else
+register cpu_t * pcpu asm("x28");
+#endif
 
-/* Area for generated code. It is put into the .text section to be reachable
-   from the rest of the code (relative branch to fit in 32 bits) */
-/* For explanation of '#' character,
-   see https://gcc.gnu.org/ml/gcc-help/2010-09/msg00088.html */
-char gen_code[JIT_CODE_SIZE] __attribute__ ((section (".text#")))
-                             __attribute__ ((aligned(4096)));
-
-/* TODO:a global - not good. Should be moved into cpu state or somewhere else */
-static long long steplimit = LLONG_MAX;
-
-static inline decode_t decode_at_address(const Instr_t* prog, uint32_t addr) {
-    assert(addr < PROGRAM_SIZE);
-    decode_t result = {0};
-    Instr_t raw_instr = prog[addr];
-    result.opcode = raw_instr;
-    switch (raw_instr) {
-    case Instr_Nop:
-    case Instr_Halt:
-    case Instr_Print:
-    case Instr_Swap:
-    case Instr_Dup:
-    case Instr_Inc:
-    case Instr_Add:
-    case Instr_Sub:
-    case Instr_Mul:
-    case Instr_Rand:
-    case Instr_Dec:
-    case Instr_Drop:
-    case Instr_Over:
-    case Instr_Mod:
-    case Instr_And:
-    case Instr_Or:
-    case Instr_Xor:
-    case Instr_SHL:
-    case Instr_SHR:
-    case Instr_Rot:
-    case Instr_SQRT:
-    case Instr_Pick:
-        result.length = 1;
-        break;
-    case Instr_Push:
-    case Instr_JNE:
-    case Instr_JE:
-    case Instr_Jump:
-        result.length = 2;
-        assert(addr+1 < PROGRAM_SIZE);
-        result.immediate = (int32_t)prog[addr+1];
-        break;
-    case Instr_Break:
-    default: /* Undefined instructions equal to Break */
-        result.length = 1;
-        result.opcode = Instr_Break;
-        break;
-    }
-    return result;
-}
-
-static void enter_generated_code(void* addr) {
-    __asm__ __volatile__ ( "jmp *%0"::"r"(addr):);
-}
+/* Not passed to service routines to keep their signatures short */
+static _Thread_local long long steplimit = LLONG_MAX;
 
 static void exit_generated_code() {
     longjmp(return_buf, 1);
 }
 
+/* Errors found by push() and pop() leave generated code */
+#define STACK_FAULT(result) exit_generated_code()
+#include "semantics.h"
+
 /*** Service routines ***/
 
 #define ADVANCE_PC(length) do {\
@@ -128,337 +91,1368 @@ static void exit_generated_code() {
         exit_generated_code(); \
 } while(0);
 
-static inline void push(cpu_t *pcpu, uint32_t v) {
-    assert(pcpu);
-    if (pcpu->sp >= STACK_CAPACITY-1) {
-        printf("Stack overflow\n");
-        pcpu->state = Cpu_Break;
-        exit_generated_code();
-    }
-    pcpu->stack[++pcpu->sp] = v;
+typedef void (*service_routine_t)();
+
+#define SEM_CPU pcpu
+#define SEM_LEAVE() exit_generated_code()
+#define SEM_IMM immediate
+#define SEM_BRANCH() {pcpu->pc += immediate; taken = true;}
+
+/* Halt and Break leave generated code from ADVANCE_PC(), taken branches
+   leave it after it as PC changes non-sequentially */
+#define SERVICE_ROUTINE(name, opcode, imm, pops, pushes, kind, guard, results) \
+static void sr_##name(__attribute__((unused)) int32_t immediate) { \
+    bool taken = false; \
+    SEM_CHECKED(kind, pops, pushes, guard, results); \
+    ADVANCE_PC(1 + (imm)); \
+    if (taken) \
+        exit_generated_code(); \
 }
 
-static inline uint32_t pop(cpu_t *pcpu) {
-    assert(pcpu);
-    if (pcpu->sp < 0) {
-        printf("Stack underflow\n");
-        pcpu->state = Cpu_Break;
-        exit_generated_code();
-    }
-    return pcpu->stack[pcpu->sp--];
+INSTRUCTIONS(SERVICE_ROUTINE)
+
+#define SR_ENTRY(name, opcode, imm, pops, pushes, kind, guard, results) \
+        [Instr_##name] = &sr_##name,
+
+static const service_routine_t service_routines[] = {
+        INSTRUCTIONS(SR_ENTRY)
+    };
+#define NSERVICE_ROUTINES \
+    ((uint32_t)(sizeof(service_routines) / sizeof(service_routines[0])))
+
+#ifdef TRACE
+/* Record entry of the basic block at the spilled guest PC. Calls to it
+   are only generated while tracing. */
+static void sr_Trace() {
+    uint32_t pc = pcpu->pc;
+    trace_record(trace_ring(), pc, decode_at_address(pcpu->pmem, pc, pcpu->plen).opcode,
+                 pcpu->sp, pcpu->sp >= 0 ? pcpu->stack[pcpu->sp] : 0);
 }
+#define NTRACE_TARGETS 1
+#else
+#define NTRACE_TARGETS 0
+#endif
 
-static inline uint32_t pick(cpu_t *pcpu, int32_t pos) {
-    assert(pcpu);
-    if (pcpu->sp - 1 < pos) {
-        printf("Out of bound picking\n");
-        pcpu->state = Cpu_Break;
-        return 0;
+/* Host functions called from generated code, numbered for relocations:
+   service routines by opcode, then exit_generated_code() and sr_Trace() */
+static const void* host_target(uint32_t index) {
+    if (index < NSERVICE_ROUTINES)
+        return (const void*)service_routines[index];
+#ifdef TRACE
+    if (index == NSERVICE_ROUTINES + 1)
+        return (const void*)sr_Trace;
+#endif
+    return (const void*)exit_generated_code;
+}
+#define NHOST_TARGETS (NSERVICE_ROUTINES + 1 + NTRACE_TARGETS)
+
+/*** Code generation ***/
+
+/* A part of code buffer being filled with generated code */
+typedef struct {
+    char *cur; /* Where to put new code */
+    char *end;
+} code_area_t;
+
+/* A mapping holding basic blocks translated in tiered execution,
+   see reserve_code() */
+typedef struct {
+    char *base;
+    size_t size;
+    uint32_t serial; /* in the order of allocation */
+    bool writable;
+} code_region_t;
+
+/* A call from generated code to a host function, see host_target() */
+typedef struct {
+    uint32_t offset; /* of the call to patch from the start of code buffer */
+    uint32_t target;
+} reloc_t;
+
+/* Relocations of code to be saved to the translation cache */
+typedef struct {
+    const char *base; /* start of code buffer */
+    reloc_t *items;
+    uint32_t count;
+    uint32_t capacity;
+} reloc_list_t;
+
+/* Where emit_call() records relocations, NULL if they are not needed */
+static _Thread_local reloc_list_t *relocs;
+
+/* Shared stubs, generated once before guest code */
+static _Thread_local const char *spill_code;
+static _Thread_local const char *reload_code;
+static _Thread_local const char *exit_code;
+
+/* A stub to jump into generated code, see enter_generated_code() */
+typedef void (*enter_code_t)(void *target, long long limit);
+static _Thread_local enter_code_t enter_code;
+
+static char* emit(code_area_t *area, const char *code, int size) {
+    assert(area->cur + size <= area->end);
+    char *start = area->cur;
+    memcpy(start, code, size);
+    area->cur += size;
+    return start;
+}
+
+static void record_reloc(const char *field, const void *target) {
+    uint32_t index = 0;
+    while (index < NHOST_TARGETS && host_target(index) != target)
+        index++;
+    if (index == NHOST_TARGETS)
+        return; /* a stub inside of the buffer */
+    if (relocs->count == relocs->capacity) {
+        relocs->capacity = relocs->capacity ? 2 * relocs->capacity : 256;
+        relocs->items = realloc(relocs->items,
+                                relocs->capacity * sizeof(reloc_t));
+        assert(relocs->items);
     }
-    return pcpu->stack[pcpu->sp - pos];
+    relocs->items[relocs->count++] =
+        (reloc_t){(uint32_t)(field - relocs->base), index};
 }
 
-typedef void (*service_routine_t)();
+/* Where an IR value is: a register, a stack slot at a position relative
+   to guest SP at the start of the segment, or an immediate */
+typedef enum { Opnd_Reg, Opnd_Mem, Opnd_Imm } opnd_kind_t;
+
+typedef struct {
+    opnd_kind_t kind;
+    int32_t x;
+} opnd_t;
+
+/* Machine code is generated by an emitter for the host. It keeps guest
+   state in host registers while inside generated code, and defines:
+     HOST_CODE_PER_INSTR - room for code of one guest instruction;
+     HOST_CALL_RANGE - how far from host code the buffer may be mapped
+         for direct calls to service routines;
+     CODE_FILL - a byte trapping if executed, for unused parts of buffers;
+     patch_branch() - point a branch or a call emitted earlier to target;
+     flush_code() - make stores to code visible to instruction fetch;
+     generate_stubs() - the shared stubs above;
+     emit_jmp(), emit_set_pc(), emit_set_state(), emit_add_steps(),
+     emit_sr_call(), emit_enter_block(), emit_guard_depth() - pieces of
+         basic blocks;
+     emit_operation() - stack and arithmetic instructions, Push to Mod;
+     emit_pop_test(), emit_test_zero(), emit_branch_cond() - popping or
+         testing a value, and branching on whether it was zero;
+     emit_load(), emit_store(), emit_move_sp(), emit_node_op(),
+     value_regs[], scratch_regs[], Reg_TOS - IR segments, see
+         emit_write_back().
+   Branches are returned as pointers to give to patch_branch(). */
+#ifdef __x86_64__
+#include "translated-x86_64.h"
+#else
+#include "translated-aarch64.h"
+#endif
+
+static inline bool is_branch(Instr_t opcode) {
+    return opcode == Instr_JE || opcode == Instr_JNE || opcode == Instr_Jump;
+}
 
-void sr_Nop() {
-    /* Do nothing */
-    ADVANCE_PC(1);
+/* Basic blocks start at branch targets and after branches */
+static void find_leaders(const Instr_t *prog, bool *leaders, int len) {
+    leaders[0] = true;
+    for (int i = 0; i < len; ) {
+        decode_t decoded = decode_at_address(prog, i, len);
+        i += decoded.length;
+        if (is_branch(decoded.opcode)) {
+            int target_pc = i + decoded.immediate;
+            if (i < len)
+                leaders[i] = true;
+            if (target_pc >= 0 && target_pc < len)
+                leaders[target_pc] = true;
+        }
+    }
 }
 
-void sr_Halt() {
-    pcpu->state = Cpu_Halted;
-    ADVANCE_PC(1);
-    exit_generated_code();
+/* Number of guest instructions in the basic block starting at pc */
+static int count_block_steps(const Instr_t *prog, const bool *leaders,
+                             int pc, int len) {
+    int steps = 0;
+    do {
+        pc += decode_at_address(prog, pc, len).length;
+        steps++;
+    } while (pc < len && !leaders[pc]);
+    return steps;
 }
 
-void sr_Push(int32_t immediate) {
-    push(pcpu, immediate);
-    ADVANCE_PC(2);
+/* Block entries calling sr_Trace() need more room */
+#ifdef TRACE
+#define CODE_PER_INSTR (2 * HOST_CODE_PER_INSTR)
+#else
+#define CODE_PER_INSTR HOST_CODE_PER_INSTR
+#endif
+
+/* Tiered execution translates blocks into regions of at least this size,
+   allocated as needed, until all of them would take more than
+   CODE_CACHE_SIZE. Then the oldest regions are evicted. */
+#ifndef CODE_REGION_SIZE
+#define CODE_REGION_SIZE ((size_t)256 << 10)
+#endif
+#ifndef CODE_CACHE_SIZE
+#define CODE_CACHE_SIZE ((size_t)16 << 20)
+#endif
+
+/* A direct branch to guest code, waiting for its target to be translated */
+typedef struct {
+    char *field; /* branch to patch, see patch_branch() */
+    uint32_t target_pc;
+    /* In tiered execution, branches stay linked to their targets,
+       and go back to their exit stubs if the targets are evicted */
+    char *stub;
+    uint32_t region; /* serial of the region holding the branch */
+} branch_fixup_t;
+
+/* State of translation of a program, kept between calls to
+   translate_block() when blocks are translated one by one */
+typedef struct {
+    const Instr_t *prog;
+    int len;
+    const int32_t *depths; /* NULL if the program is not verified */
+    bool *leaders;
+    void **entrypoints;
+    int32_t *block_steps;
+    /* Frequently executed code goes to the first half of the buffer,
+       stubs for exits and rare cases go to the second half. */
+    code_area_t hot;
+    code_area_t cold;
+    /* Branches waiting for their targets to be translated */
+    branch_fixup_t *fixups;
+    int nfixups;
+    /* Instructions of verified programs collected for optimization,
+       NULL if the program is not verified */
+    ir_segment_t *seg;
+    bool seg_open; /* there are instructions in seg */
+    /* Code cache of tiered execution, oldest regions first. Hot and cold
+       areas belong to the last one. */
+    code_region_t *regions;
+    int nregions;
+    size_t cache_size; /* of all regions */
+    uint32_t next_serial;
+    uint32_t *counters; /* of entries to blocks, reset on eviction */
+} translator_t;
+
+static void init_translator(translator_t *t, const Instr_t *prog,
+                            char *out_code, size_t code_size,
+                            void **entrypoints, int32_t *block_steps,
+                            const int32_t *depths, int len) {
+    assert(prog);
+    assert(out_code);
+    assert(entrypoints);
+    assert(block_steps);
+    t->prog = prog;
+    t->len = len;
+    t->depths = depths;
+    t->entrypoints = entrypoints;
+    t->block_steps = block_steps;
+    t->hot = (code_area_t){.cur = out_code, .end = out_code + code_size / 2};
+    t->cold = (code_area_t){.cur = t->hot.end, .end = out_code + code_size};
+
+    generate_stubs(&t->cold);
+
+    /* Every branch and every end of a block has at most one */
+    t->fixups = calloc(2 * (size_t)len + 1, sizeof(branch_fixup_t));
+    t->nfixups = 0;
+    assert(t->fixups);
+
+    t->leaders = calloc(len, sizeof(bool));
+    assert(t->leaders || len == 0);
+    if (len > 0)
+        find_leaders(prog, t->leaders, len);
+
+    t->seg = depths ? malloc(sizeof(ir_segment_t)) : NULL;
+    t->seg_open = false;
+
+    /* Every region but maybe one is at least CODE_REGION_SIZE */
+    t->regions = calloc(CODE_CACHE_SIZE / CODE_REGION_SIZE + 1,
+                        sizeof(code_region_t));
+    t->nregions = 0;
+    t->cache_size = 0;
+    t->next_serial = 0;
+    t->counters = NULL;
+    assert(t->regions);
 }
 
-void sr_Print() {
-    uint32_t tmp1 = pop(pcpu);
-    printf("[%d]\n", tmp1);
-    ADVANCE_PC(1);
+static void free_translator(translator_t *t) {
+    for (int r = 0; r < t->nregions; r++)
+        munmap(t->regions[r].base, t->regions[r].size);
+    free(t->regions);
+    free(t->fixups);
+    free(t->leaders);
+    free(t->seg);
 }
 
-void sr_Swap() {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    push(pcpu, tmp1);
-    push(pcpu, tmp2);
-    ADVANCE_PC(1);
+/*** Code generation for IR segments, see ir.h ***/
+
+#define NVALUE_REGS ((int)(sizeof(value_regs) / sizeof(value_regs[0])))
+#define NSCRATCH_REGS ((int)(sizeof(scratch_regs) / sizeof(scratch_regs[0])))
+/* One more than at most live at once, for a result */
+_Static_assert(NVALUE_REGS >= IR_MAX_LIVE + 1, "Too few registers for IR");
+/* Each moved item may need one, with at least one free value register */
+_Static_assert(NSCRATCH_REGS + 1 >= IR_MAX_MOVED,
+               "Too few scratch registers for IR");
+
+typedef struct {
+    int node_reg[IR_MAX_NODES];
+    bool busy[32];
+} reg_state_t;
+
+static opnd_t operand(const reg_state_t *rs, ir_value_t v) {
+    switch (v.kind) {
+    case Ir_Slot:
+        assert(v.x <= 0);
+        /* The top of stack is cached in Reg_TOS, its slot is stale */
+        return v.x == 0 ? (opnd_t){Opnd_Reg, Reg_TOS}
+                        : (opnd_t){Opnd_Mem, v.x};
+    case Ir_Const:
+        return (opnd_t){Opnd_Imm, v.x};
+    case Ir_Node:
+    default:
+        assert(rs->node_reg[v.x] >= 0);
+        return (opnd_t){Opnd_Reg, rs->node_reg[v.x]};
+    }
 }
 
-void sr_Dup() {
-    uint32_t tmp1 = pop(pcpu);
-    push(pcpu, tmp1);
-    push(pcpu, tmp1);
-    ADVANCE_PC(1);
+/* Destination for moves of emit_write_back() */
+#define POS_TOP INT32_MAX
+
+typedef struct {
+    int32_t dst; /* position of a memory slot or POS_TOP for Reg_TOS */
+    opnd_t src;
+} move_t;
+
+static inline bool is_dst_of(opnd_t src, int32_t dst) {
+    return dst == POS_TOP ? src.kind == Opnd_Reg && src.x == Reg_TOS
+                          : src.kind == Opnd_Mem && src.x == dst;
 }
 
-void sr_Over() {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    push(pcpu, tmp2);
-    push(pcpu, tmp1);
-    push(pcpu, tmp2);
-    ADVANCE_PC(1);
+/* Store the symbolic stack to its usual place: items below the top to
+   memory slots, the top to Reg_TOS and the stack pointer to its register.
+   Moves are ordered so that no original item is overwritten before it is
+   read, scratch registers break cycles. A value tested by
+   emit_test_zero() is kept. */
+static void emit_write_back(code_area_t *area, const ir_segment_t *seg,
+                            const ir_stack_t *stack, const reg_state_t *rs) {
+    move_t moves[2 * IR_POSITION_BASE];
+    int nmoves = 0;
+    for (int32_t pos = 1 - seg->depth; pos <= stack->delta; pos++) {
+        move_t m = {pos < stack->delta ? pos : POS_TOP,
+                    operand(rs, IR_AT(stack, pos))};
+        if (!is_dst_of(m.src, m.dst))
+            moves[nmoves++] = m;
+    }
+
+    int temps[NSCRATCH_REGS + NVALUE_REGS];
+    int ntemps = 0;
+    for (int r = 0; r < NSCRATCH_REGS; r++)
+        temps[ntemps++] = scratch_regs[r];
+    for (int r = 0; r < NVALUE_REGS; r++)
+        if (!rs->busy[value_regs[r]])
+            temps[ntemps++] = value_regs[r];
+    int used_temps = 0;
+
+    while (nmoves > 0) {
+        int ready = -1;
+        for (int m = 0; m < nmoves && ready < 0; m++) {
+            bool blocked = false;
+            for (int k = 0; k < nmoves && !blocked; k++)
+                blocked = k != m && is_dst_of(moves[k].src, moves[m].dst);
+            if (!blocked)
+                ready = m;
+        }
+        if (ready < 0) {
+            /* A cycle, keep one of its original items aside */
+            assert(used_temps < ntemps);
+            opnd_t temp = {Opnd_Reg, temps[used_temps++]};
+            int32_t dst = moves[0].dst;
+            opnd_t old = dst == POS_TOP ? (opnd_t){Opnd_Reg, Reg_TOS}
+                                        : (opnd_t){Opnd_Mem, dst};
+            emit_load(area, temp.x, old);
+            for (int k = 0; k < nmoves; k++)
+                if (is_dst_of(moves[k].src, dst))
+                    moves[k].src = temp;
+            continue;
+        }
+        if (moves[ready].dst == POS_TOP)
+            emit_load(area, Reg_TOS, moves[ready].src);
+        else
+            emit_store(area, moves[ready].dst, moves[ready].src);
+        moves[ready] = moves[--nmoves];
+    }
+    emit_move_sp(area, stack->delta);
 }
 
-void sr_Inc() {
-    uint32_t tmp1 = pop(pcpu);
-    push(pcpu, tmp1+1);
-    ADVANCE_PC(1);
+static int allocate_reg(reg_state_t *rs) {
+    for (int r = 0; r < NVALUE_REGS; r++) {
+        if (!rs->busy[value_regs[r]]) {
+            rs->busy[value_regs[r]] = true;
+            return value_regs[r];
+        }
+    }
+    assert("Out of registers for IR" && false);
+    return value_regs[0];
 }
 
-void sr_Add() {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    push(pcpu, tmp1 + tmp2);
-    ADVANCE_PC(1);
+static void release(const ir_segment_t *seg, reg_state_t *rs, ir_value_t v,
+                    int user) {
+    if (v.kind == Ir_Node && seg->nodes[v.x].last_use == user)
+        rs->busy[rs->node_reg[v.x]] = false;
 }
 
-void sr_Sub() {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    push(pcpu, tmp1 - tmp2);
-    ADVANCE_PC(1);
+/* Division by zero stops simulation at the Mod. The service routine
+   does it after the stack is written back as it was before. */
+static void emit_mod_stub(translator_t *t, const ir_node_t *node,
+                          const reg_state_t *rs, char *field) {
+    patch_branch(field, t->cold.cur);
+    emit_write_back(&t->cold, t->seg, &t->seg->snapshots[node->before], rs);
+    decode_t decoded = {.opcode = Instr_Mod, .length = 1};
+    emit_sr_call(&t->cold, node->pc, decoded, node->ahead);
+    emit_jmp(&t->cold, exit_code); /* Not reached */
 }
 
-void sr_Mod() {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    if (tmp2 == 0) {
-        pcpu->state = Cpu_Break;
-        exit_generated_code();
+/* Generate code for live nodes of a finished segment */
+static void emit_nodes(translator_t *t, reg_state_t *rs) {
+    const ir_segment_t *seg = t->seg;
+    for (int n = 0; n < seg->nnodes; n++) {
+        const ir_node_t *node = &seg->nodes[n];
+        rs->node_reg[n] = -1;
+        if (!node->live)
+            continue;
+        opnd_t a = operand(rs, node->a);
+        opnd_t b = operand(rs, node->b);
+
+        if (node->opcode == Instr_Mod) {
+            if (b.kind == Opnd_Imm) {
+                if (b.x == 0)
+                    emit_mod_stub(t, node, rs, emit_jmp(&t->hot, NULL));
+            } else {
+                emit_test_zero(&t->hot, b);
+                emit_mod_stub(t, node, rs,
+                              emit_branch_cond(&t->hot, true, NULL));
+            }
+        }
+
+        /* The result replaces the top of stack operand if it is not
+           needed anymore */
+        int d;
+        if (node->a.kind == Ir_Node && seg->nodes[node->a.x].last_use == n)
+            d = a.x;
+        else
+            d = allocate_reg(rs);
+        emit_node_op(&t->hot, node->opcode, d, a, b);
+
+        /* An operand register now holding the result stays busy */
+        if (!(node->a.kind == Ir_Node && rs->node_reg[node->a.x] == d))
+            release(seg, rs, node->a, n);
+        if (!(node->b.kind == Ir_Node && rs->node_reg[node->b.x] == d))
+            release(seg, rs, node->b, n);
+        rs->node_reg[n] = d;
+        rs->busy[d] = true;
+        if (node->last_use < 0)
+            rs->busy[d] = false; /* a Mod not used by anything */
     }
-    push(pcpu, tmp1 % tmp2);
-    ADVANCE_PC(1);
 }
 
-void sr_Mul() {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    push(pcpu, tmp1 * tmp2);
-    ADVANCE_PC(1);
+static void init_reg_state(reg_state_t *rs) {
+    memset(rs, 0, sizeof(*rs));
+    for (int n = 0; n < IR_MAX_NODES; n++)
+        rs->node_reg[n] = -1;
 }
 
-void sr_Rand() {
-    uint32_t tmp1 = rand();
-    push(pcpu, tmp1);
-    ADVANCE_PC(1);
+/* A branch to target_pc, patched when all entrypoints are known,
+   see add_exit_stubs() */
+static void add_fixup(translator_t *t, char *field, uint32_t target_pc) {
+    t->fixups[t->nfixups].field = field;
+    t->fixups[t->nfixups++].target_pc = target_pc;
 }
 
-void sr_Dec() {
-    uint32_t tmp1 = pop(pcpu);
-    push(pcpu, tmp1-1);
-    ADVANCE_PC(1);
+/* Generate code for the segment collected so far */
+static void flush_segment(translator_t *t) {
+    if (!t->seg_open)
+        return;
+    t->seg_open = false;
+    if (ir_is_empty(t->seg))
+        return;
+    ir_finish(t->seg, NULL);
+    reg_state_t rs;
+    init_reg_state(&rs);
+    emit_nodes(t, &rs);
+    emit_write_back(&t->hot, t->seg, &t->seg->stack, &rs);
 }
 
-void sr_Drop() {
-    (void)pop(pcpu);
-    ADVANCE_PC(1);
+/* A conditional branch ends the segment, its condition is tested
+   before the stack is written back */
+static void translate_segment_branch(translator_t *t, decode_t decoded,
+                                     uint32_t target_pc) {
+    ir_segment_t *seg = t->seg;
+    ir_value_t cond = ir_pop(seg);
+    ir_finish(seg, &cond);
+    reg_state_t rs;
+    init_reg_state(&rs);
+    emit_nodes(t, &rs);
+    opnd_t c = operand(&rs, cond);
+    if (c.kind == Opnd_Imm) {
+        emit_write_back(&t->hot, seg, &seg->stack, &rs);
+        bool taken = decoded.opcode == Instr_JE ? c.x == 0 : c.x != 0;
+        if (taken)
+            add_fixup(t, emit_jmp(&t->hot, NULL), target_pc);
+    } else {
+        emit_test_zero(&t->hot, c);
+        emit_write_back(&t->hot, seg, &seg->stack, &rs);
+        bool if_zero = decoded.opcode == Instr_JE;
+        add_fixup(t, emit_branch_cond(&t->hot, if_zero, NULL), target_pc);
+    }
+    t->seg_open = false;
 }
 
-void sr_Je(int32_t immediate) {
-    uint32_t tmp1 = pop(pcpu);
-    if (tmp1 == 0)
-        pcpu->pc += immediate;
-    ADVANCE_PC(2);
-    if (tmp1 == 0) /* Non-sequential PC change */
-        exit_generated_code();
+/* Collect instructions of verified code into segments, returns false
+   for those that have to be translated one by one */
+static bool translate_to_segment(translator_t *t, int i, decode_t decoded,
+                                 int ahead) {
+    int32_t depth = t->depths[i];
+    bool branch = decoded.opcode == Instr_JE || decoded.opcode == Instr_JNE;
+    if (depth < 0 || !(branch || ir_accepts(decoded.opcode)))
+        return false;
+    if (!t->seg_open) {
+        ir_begin(t->seg, depth);
+        t->seg_open = true;
+    }
+    if (branch) {
+        uint32_t target_pc = i + decoded.length + decoded.immediate;
+        translate_segment_branch(t, decoded, target_pc);
+    } else if (!ir_add(t->seg, decoded, i, ahead)) {
+        flush_segment(t);
+        ir_begin(t->seg, depth);
+        t->seg_open = true;
+        bool added = ir_add(t->seg, decoded, i, ahead);
+        assert(added);
+        (void)added;
+    }
+    return true;
 }
 
-void sr_Jne(int32_t immediate) {
-    uint32_t tmp1 = pop(pcpu);
-    if (tmp1 != 0)
-        pcpu->pc += immediate;
-    ADVANCE_PC(2);
-    if (tmp1 != 0) /* Non-sequential PC change */
-        exit_generated_code();
+/* Generate code for the guest instruction at i. Ahead is the number of
+   steps accounted for it and the rest of its block. */
+static void translate_instruction(translator_t *t, int i, decode_t decoded,
+                                  int ahead) {
+    if (t->seg && translate_to_segment(t, i, decoded, ahead))
+        return;
+    flush_segment(t);
+    /* Stack depth if the program is verified */
+    int32_t depth = t->depths ? t->depths[i] : -1;
+    uint32_t next_pc = i + decoded.length;
+    uint32_t target_pc = next_pc + decoded.immediate;
+    /* Branches to the fallback stub, taken on unusual conditions */
+    char *fallback[2] = {NULL, NULL};
+
+    switch (decoded.opcode) {
+    case Instr_Nop:
+        break;
+    case Instr_Halt:
+    case Instr_Break: {
+        emit_set_state(&t->hot, decoded.opcode == Instr_Halt ?
+                             Cpu_Halted : Cpu_Break);
+        emit_add_steps(&t->hot, 1 - ahead);
+        emit_set_pc(&t->hot, next_pc);
+        emit_jmp(&t->hot, exit_code);
+        break;
+    }
+    case Instr_JE:
+    case Instr_JNE: {
+        fallback[0] = emit_guard_depth(&t->hot, 0, depth);
+        emit_pop_test(&t->hot);
+        /* Taken branch goes directly to the target's code,
+           not taken one falls through to the next block */
+        add_fixup(t, emit_branch_cond(&t->hot, decoded.opcode == Instr_JE,
+                                      NULL), target_pc);
+        break;
+    }
+    case Instr_Jump: {
+        add_fixup(t, emit_jmp(&t->hot, NULL), target_pc);
+        break;
+    }
+    case Instr_Print:
+    case Instr_Rand:
+    case Instr_SQRT:
+    case Instr_Pick:
+        /* Rare or complex instructions are left to service routines */
+        emit_sr_call(&t->hot, i, decoded, ahead);
+        break;
+    default:
+        emit_operation(&t->hot, decoded, depth, fallback);
+        break;
+    }
+
+    if (fallback[0] || fallback[1]) {
+        /* The service routine advances PC itself,
+           continue from the next instruction */
+        const char *stub = t->cold.cur;
+        emit_sr_call(&t->cold, i, decoded, ahead);
+        emit_jmp(&t->cold, t->hot.cur);
+        for (int f = 0; f < 2; f++)
+            if (fallback[f])
+                patch_branch(fallback[f], stub);
+    }
 }
 
-void sr_Jump(int32_t immediate) {
-    pcpu->pc += immediate;
-    ADVANCE_PC(2);
-    /* Non-sequential PC change */
-    exit_generated_code();
+/* Exit to the dispatcher for fixups starting from first that have no
+   code to go to */
+static void add_exit_stubs(translator_t *t, int first) {
+    for (int f = first; f < t->nfixups; f++) {
+        uint32_t target_pc = t->fixups[f].target_pc;
+        if (target_pc < (uint32_t)t->len && t->entrypoints[target_pc]) {
+            patch_branch(t->fixups[f].field, t->entrypoints[target_pc]);
+        } else {
+            patch_branch(t->fixups[f].field, t->cold.cur);
+            emit_set_pc(&t->cold, target_pc);
+            emit_jmp(&t->cold, exit_code);
+        }
+    }
 }
 
-void sr_And() {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    push(pcpu, tmp1 & tmp2);
-    ADVANCE_PC(1);
+static void translate_program(translator_t *t) {
+    const int len = t->len;
+    int i = 0; /* Address of current guest instruction */
+    int ahead = 0; /* Steps accounted for it and the rest of its block */
+
+    /* The program is translated as a whole, because branches are chained
+       directly to their targets. Only the code buffer and tables are
+       sized to it. */
+    while (i < len) {
+        decode_t decoded = decode_at_address(t->prog, i, len);
+        /* Generated code is only entered at the start of a basic block */
+        if (t->leaders[i]) {
+            flush_segment(t);
+            ahead = t->block_steps[i] = count_block_steps(t->prog, t->leaders,
+                                                          i, len);
+            t->entrypoints[i] = (void*) t->hot.cur;
+            emit_enter_block(&t->hot, &t->cold, i, ahead);
+        }
+        translate_instruction(t, i, decoded, ahead);
+        i += decoded.length;
+        ahead--;
+    }
+    /* Running past the end of the program */
+    flush_segment(t);
+    emit_set_pc(&t->hot, i);
+    emit_jmp(&t->hot, exit_code);
+
+    /* Chain branches to their targets now when all entrypoints are known.
+       Targets outside of the program or inside an instruction are left
+       for the dispatcher loop to deal with. */
+    add_exit_stubs(t, 0);
+    t->nfixups = 0;
 }
 
-void sr_Or() {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    push(pcpu, tmp1 | tmp2);
-    ADVANCE_PC(1);
+/* Generated code calls service routines directly, so the buffer is mapped
+   within HOST_CALL_RANGE of the host code, below it if there is room.
+   If something is mapped there already, the next hints are further away.
+   It is anonymous memory, or a part of a file at offset if fd is not -1.
+   It is mapped writable, see protect_code(). Returns NULL if a file
+   cannot be mapped. */
+static char* map_code_buffer(size_t size, int fd, off_t offset) {
+    const uintptr_t near = (uintptr_t)&translate_program & ~(uintptr_t)0xfff;
+    const uintptr_t gap = 1 << 20;
+    size = (size + 0xfff) & ~(size_t)0xfff;
+    const bool below = near > size + 2 * gap;
+    uintptr_t hint = below ? near - size - gap : near + gap;
+    while (true) {
+        void *buf = mmap((void*)hint, size, PROT_READ | PROT_WRITE,
+                         fd == -1 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_PRIVATE,
+                         fd, offset);
+        if (buf == MAP_FAILED) {
+            if (fd != -1)
+                return NULL;
+            perror("mmap");
+            exit(2);
+        }
+        intptr_t distance = (intptr_t)buf - (intptr_t)near;
+        if (distance >= -HOST_CALL_RANGE && distance <= HOST_CALL_RANGE)
+            return (char*)buf;
+        munmap(buf, size);
+        if (below && hint < size + gap)
+            hint = 0;
+        else
+            hint = below ? hint - size - gap : hint + size + gap;
+        distance = (intptr_t)hint - (intptr_t)near;
+        if (hint == 0 || distance < -HOST_CALL_RANGE
+            || distance > HOST_CALL_RANGE) {
+            fprintf(stderr, "Code buffer at %p is too far from host code\n",
+                    buf);
+            exit(2);
+        }
+    }
 }
 
-void sr_Xor() {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    push(pcpu, tmp1 ^ tmp2);
-    ADVANCE_PC(1);
+static char* allocate_code_buffer(size_t size) {
+    return map_code_buffer(size, -1, 0);
 }
 
-void sr_SHL() {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    push(pcpu, tmp1 << tmp2);
-    ADVANCE_PC(1);
+/* Code is never writable and executable at the same time. It is made
+   executable once it is generated, and writable again for patching. */
+static void protect_code(char *code, size_t size, bool writable) {
+    size = (size + 0xfff) & ~(size_t)0xfff;
+    if (!writable)
+        flush_code(code, size);
+    if (mprotect(code, size, writable ? PROT_READ | PROT_WRITE
+                                      : PROT_READ | PROT_EXEC)) {
+        perror("mprotect");
+        exit(2);
+    }
 }
 
-void sr_SHR() {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    push(pcpu, tmp1 >> tmp2);
-    ADVANCE_PC(1);
+/*** Code cache of tiered execution ***/
+
+static inline bool in_region(const code_region_t *region, const void *addr) {
+    return (const char*)addr >= region->base
+           && (const char*)addr < region->base + region->size;
 }
 
-void sr_Rot() {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    uint32_t tmp3 = pop(pcpu);
-    push(pcpu, tmp1);
-    push(pcpu, tmp3);
-    push(pcpu, tmp2);
-    ADVANCE_PC(1);
+static void make_writable(translator_t *t, uint32_t serial) {
+    for (int r = 0; r < t->nregions; r++) {
+        code_region_t *region = &t->regions[r];
+        if (region->serial == serial && !region->writable) {
+            protect_code(region->base, region->size, true);
+            region->writable = true;
+        }
+    }
 }
 
-void sr_SQRT() {
-    uint32_t tmp1 = pop(pcpu);
-    push(pcpu, sqrt(tmp1));
-    ADVANCE_PC(1);
+/* Make code written since the last call executable */
+static void seal_code(translator_t *t) {
+    for (int r = 0; r < t->nregions; r++) {
+        code_region_t *region = &t->regions[r];
+        if (region->writable) {
+            protect_code(region->base, region->size, false);
+            region->writable = false;
+        }
+    }
 }
 
-void sr_Pick() {
-    uint32_t tmp1 = pop(pcpu);
-    push(pcpu, pick(pcpu, tmp1));
-    ADVANCE_PC(1);
+/* Drop the oldest region with all its blocks. Branches to them from other
+   regions go back to their exit stubs, and the blocks have to become hot
+   again to be translated anew. */
+static void evict_region(translator_t *t) {
+    assert(t->nregions > 0);
+    const code_region_t old = t->regions[0];
+    int kept = 0;
+    for (int f = 0; f < t->nfixups; f++) {
+        branch_fixup_t fixup = t->fixups[f];
+        if (fixup.region == old.serial)
+            continue;
+        if (in_region(&old, t->entrypoints[fixup.target_pc])) {
+            make_writable(t, fixup.region);
+            patch_branch(fixup.field, fixup.stub);
+        }
+        t->fixups[kept++] = fixup;
+    }
+    t->nfixups = kept;
+    for (int pc = 0; pc < t->len; pc++) {
+        if (in_region(&old, t->entrypoints[pc])) {
+            t->entrypoints[pc] = NULL;
+            t->counters[pc] = 0;
+        }
+    }
+    munmap(old.base, old.size);
+    t->cache_size -= old.size;
+    t->nregions--;
+    memmove(t->regions, t->regions + 1, t->nregions * sizeof(code_region_t));
 }
 
-void sr_Break() {
-    pcpu->state = Cpu_Break;
-    ADVANCE_PC(1);
-    exit_generated_code();
+/* Make room for a block of steps instructions in the last region, or start
+   a new region for it. Blocks that are still hot after their region has
+   been evicted are translated again next to each other in the new ones.
+   Returns the serial of the region, which is left writable. */
+static uint32_t reserve_code(translator_t *t, int steps) {
+    const size_t need = ((size_t)steps + 16) * CODE_PER_INSTR;
+    if (t->nregions > 0 && (size_t)(t->hot.end - t->hot.cur) >= need
+        && (size_t)(t->cold.end - t->cold.cur) >= need) {
+        uint32_t serial = t->regions[t->nregions - 1].serial;
+        make_writable(t, serial);
+        return serial;
+    }
+    size_t size = 2 * need > CODE_REGION_SIZE ? 2 * need : CODE_REGION_SIZE;
+    size = (size + 0xfff) & ~(size_t)0xfff;
+    while (t->nregions > 0 && t->cache_size + size > CODE_CACHE_SIZE)
+        evict_region(t);
+    char *base = allocate_code_buffer(size);
+    t->regions[t->nregions++] =
+        (code_region_t){base, size, t->next_serial, true};
+    t->cache_size += size;
+    t->hot = (code_area_t){.cur = base, .end = base + size / 2};
+    t->cold = (code_area_t){.cur = base + size / 2, .end = base + size};
+    return t->next_serial++;
 }
 
-const service_routine_t service_routines[] = {
-        &sr_Break, &sr_Nop, &sr_Halt, &sr_Push, &sr_Print,
-        &sr_Jne, &sr_Swap, &sr_Dup, &sr_Je, &sr_Inc,
-        &sr_Add, &sr_Sub, &sr_Mul, &sr_Rand, &sr_Dec,
-        &sr_Drop, &sr_Over, &sr_Mod, &sr_Jump,
-        &sr_And, &sr_Or, &sr_Xor,
-        &sr_SHL, &sr_SHR,
-        &sr_SQRT,
-        &sr_Rot,
-        &sr_Pick
-    };
+/* Translate only the basic block starting at pc, for tiered execution.
+   Branches to blocks translated earlier are chained directly, the rest
+   of them exit to the dispatcher until their targets are translated,
+   and then they are patched. Blocks are placed into the code cache, see
+   reserve_code(). */
+static void translate_block(translator_t *t, uint32_t pc) {
+    assert(t->leaders[pc]);
+    assert(!t->entrypoints[pc]);
+    const int len = t->len;
+
+    int i = pc;
+    int ahead = t->block_steps[pc] = count_block_steps(t->prog, t->leaders,
+                                                       pc, len);
+    /* This may evict blocks and drop fixups */
+    const uint32_t region = reserve_code(t, ahead);
+    const int first_fixup = t->nfixups;
+    t->entrypoints[pc] = (void*) t->hot.cur;
+    emit_enter_block(&t->hot, &t->cold, pc, ahead);
+    decode_t decoded;
+    do {
+        decoded = decode_at_address(t->prog, i, len);
+        translate_instruction(t, i, decoded, ahead);
+        i += decoded.length;
+        ahead--;
+    } while (i < len && !t->leaders[i]);
+    flush_segment(t);
+    /* Fall through to the next block, wherever it is */
+    if (decoded.opcode != Instr_Jump) {
+        add_fixup(t, emit_jmp(&t->hot, NULL), i);
+    }
+    /* Every branch gets an exit stub, even if its target is there */
+    for (int f = first_fixup; f < t->nfixups; f++) {
+        branch_fixup_t *fixup = &t->fixups[f];
+        fixup->stub = t->cold.cur;
+        fixup->region = region;
+        emit_set_pc(&t->cold, fixup->target_pc);
+        emit_jmp(&t->cold, exit_code);
+        bool inside = fixup->target_pc < (uint32_t)len;
+        void *entry = inside ? t->entrypoints[fixup->target_pc] : NULL;
+        patch_branch(fixup->field, entry ? entry : fixup->stub);
+    }
 
-static void translate_program(const Instr_t *prog,
-                           char *out_code, void **entrypoints, int len) {
-    assert(prog);
-    assert(out_code);
-    assert(entrypoints);
+    /* Branches to this block from earlier ones do not need to exit
+       anymore. Those that never can be translated are not linked. */
+    int kept = 0;
+    for (int f = 0; f < t->nfixups; f++) {
+        uint32_t target_pc = t->fixups[f].target_pc;
+        if (target_pc >= (uint32_t)len || !t->leaders[target_pc])
+            continue;
+        if (f < first_fixup && target_pc == pc) {
+            make_writable(t, t->fixups[f].region);
+            patch_branch(t->fixups[f].field, t->entrypoints[pc]);
+        }
+        t->fixups[kept++] = t->fixups[f];
+    }
+    t->nfixups = kept;
+    seal_code(t);
+}
 
-    /* An IA-32 instruction "MOV RDI, imm32" is used to pass a parameter
-       to a function invoked by a following CALL. */
-#ifdef __CYGWIN__ /* Win64 ABI, use RCX instead of RDI */
-    const char mov_template_code[]= {0x48, 0xc7, 0xc1, 0x00, 0x00, 0x00, 0x00};
-#else
-    const char mov_template_code[]= {0x48, 0xc7, 0xc7, 0x00, 0x00, 0x00, 0x00};
+/*** Translation cache ***/
+
+/* With --translation-cache=, the code buffer of a translated program
+   is saved to a file together with its tables, and the file is mapped
+   instead of translating the program again on later runs. Files are
+   named after the build ID of the executable and a hash of the program,
+   both of which are also checked on loading, along with the program.
+   Only calls to host functions have to be relocated, and only if
+   the buffer is not mapped at the same distance from host code as it was
+   when saved. The file is laid out as:
+     cache_header_t;
+     program, plen words;
+     offsets of entrypoints in the buffer, plen words, NO_ENTRY if none;
+     block_steps, plen words;
+     relocations, nrelocs of reloc_t;
+     the code buffer, at a page-aligned code_offset. */
+
+#define CACHE_MAGIC 0x31435456 /* "VTC1" */
+#define BUILD_ID_MAX 32
+#define NO_ENTRY UINT32_MAX
+
+typedef struct {
+    uint32_t len;
+    uint8_t bytes[BUILD_ID_MAX];
+} build_id_t;
+
+typedef struct {
+    uint32_t magic;
+    build_id_t build_id;
+    uint32_t plen;
+    uint32_t nrelocs;
+    uint64_t code_size;
+    uint64_t code_offset;
+    int64_t host_distance; /* buffer address minus translate_program() */
+    /* Offsets of shared stubs in the buffer */
+    uint32_t spill_offset;
+    uint32_t reload_offset;
+    uint32_t exit_offset;
+    uint32_t enter_offset;
+} cache_header_t;
+
+#ifndef __CYGWIN__
+/* Find the GNU build ID note of the ELF object containing this code */
+static int find_build_id(struct dl_phdr_info *info, size_t size, void *data) {
+    (void)size;
+    build_id_t *id = data;
+    const uintptr_t self = (uintptr_t)&translate_program;
+    bool contains_self = false;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+        uintptr_t start = info->dlpi_addr + ph->p_vaddr;
+        if (ph->p_type == PT_LOAD && self >= start
+            && self < start + ph->p_memsz)
+            contains_self = true;
+    }
+    if (!contains_self)
+        return 0;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+        if (ph->p_type != PT_NOTE)
+            continue;
+        const char *note = (const char*)(info->dlpi_addr + ph->p_vaddr);
+        const char *end = note + ph->p_memsz;
+        while (note + sizeof(ElfW(Nhdr)) <= end) {
+            const ElfW(Nhdr) *nhdr = (const ElfW(Nhdr)*)note;
+            const char *name = note + sizeof(ElfW(Nhdr));
+            const char *desc = name + ((nhdr->n_namesz + 3) & ~3u);
+            if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4
+                && !memcmp(name, "GNU", 4)
+                && nhdr->n_descsz <= BUILD_ID_MAX) {
+                id->len = nhdr->n_descsz;
+                memcpy(id->bytes, desc, nhdr->n_descsz);
+                return 1;
+            }
+            note = desc + ((nhdr->n_descsz + 3) & ~3u);
+        }
+    }
+    return 1;
+}
 #endif
-    const int mov_template_size = sizeof(mov_template_code);
 
-    /* An IA-32 instruction "CALL rel32" is used as a trampoline to invoke
-       service routines. A template for it is "call .+0x00000005" */
-    const char call_template_code[] = { 0xe8, 0x00, 0x00, 0x00, 0x00 };
-    const int call_template_size = sizeof(call_template_code);
+/* Returns false if the executable has no build ID */
+static bool get_build_id(build_id_t *id) {
+    memset(id, 0, sizeof(*id));
+#ifndef __CYGWIN__
+    dl_iterate_phdr(find_build_id, id);
+#endif
+    return id->len > 0;
+}
 
-    int i = 0; /* Address of current guest instruction */
-    char* cur = out_code; /* Where to put new code */
+/* FNV-1a */
+static uint64_t hash_program(const Instr_t *prog, uint32_t len) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    const unsigned char *bytes = (const unsigned char*)prog;
+    for (size_t i = 0; i < (size_t)len * sizeof(Instr_t); i++)
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    return hash;
+}
 
-    /* The program is short, so we can translate it as a whole.
-       Otherwise, some sort of lazy decoding will be required */
-    while (i < len) {
-        decode_t decoded = decode_at_address(prog, i);
-        entrypoints[i] = (void*) cur;
-
-        if (decoded.length == 2) { /* Guest instruction has an immediate */
-            assert(cur + mov_template_size - out_code < JIT_CODE_SIZE);
-            memcpy(cur, mov_template_code, mov_template_size);
-            /* Patch template with correct immediate value */
-            memcpy(cur + 3, &decoded.immediate, 4);
-            cur += mov_template_size;
-        }
+/* Path of the cache file for the program, NULL if there is none */
+static char* cache_path(const build_id_t *id, const Instr_t *prog,
+                        uint32_t len) {
+    size_t size = strlen(TranslationCache) + 2 * BUILD_ID_MAX + 32;
+    char *path = malloc(size);
+    assert(path);
+    int n = snprintf(path, size, "%s/", TranslationCache);
+    for (uint32_t i = 0; i < id->len; i++)
+        n += snprintf(path + n, size - n, "%02x", id->bytes[i]);
+    snprintf(path + n, size - n, "-%016llx.tc",
+             (unsigned long long)hash_program(prog, len));
+    return path;
+}
 
-        assert(cur + call_template_size - out_code < JIT_CODE_SIZE);
-        memcpy(cur, call_template_code, call_template_size);
-        intptr_t offset = (intptr_t)service_routines[decoded.opcode]
-                            - (intptr_t)cur - call_template_size;
-        if (offset != (intptr_t)(int32_t)offset) {
-            fprintf(stderr, "Offset to service routine for opcode %d"
-            " does not fit in 32 bits. Cannot generate code for it, sorry",
-            decoded.opcode);
-            exit(2);
-        }
-        uint32_t offset32 = (uint32_t)offset;
-        /* Patch template with correct offset */
-        memcpy(cur + 1, &offset, 4);
-        i += decoded.length;
-        cur += call_template_size;
+static bool read_at(int fd, void *buf, size_t size, off_t *offset) {
+    ssize_t n = pread(fd, buf, size, *offset);
+    *offset += size;
+    return n == (ssize_t)size;
+}
+
+static bool write_all(int fd, const void *buf, size_t size) {
+    const char *p = buf;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
     }
+    return true;
 }
 
-int main(int argc, char **argv) {
-    steplimit = parse_args(argc, argv);
-    cpu_t cpu = init_cpu();
+/* Saved code is only run from regular files of the current user that
+   nobody else may write */
+static bool trusted_file(int fd, struct stat *st) {
+    return !fstat(fd, st) && S_ISREG(st->st_mode)
+           && st->st_uid == geteuid()
+           && !(st->st_mode & (S_IWGRP | S_IWOTH));
+}
 
-    pcpu = &cpu;
+/* Offsets and targets in a file may be anything, they have to point
+   into the code buffer and the tables of host functions. Patched
+   branches take a 32-bit word. */
+static bool valid_tables(const cache_header_t *header,
+                         const uint32_t *entry_offsets,
+                         const int32_t *block_steps, uint32_t len,
+                         const reloc_t *items) {
+    const uint64_t size = header->code_size;
+    if (header->spill_offset >= size || header->reload_offset >= size
+        || header->exit_offset >= size || header->enter_offset >= size)
+        return false;
+    for (uint32_t i = 0; i < len; i++) {
+        if (entry_offsets[i] != NO_ENTRY
+            && (entry_offsets[i] >= size || block_steps[i] <= 0))
+            return false;
+    }
+    for (uint32_t i = 0; i < header->nrelocs; i++) {
+        if ((uint64_t)items[i].offset + sizeof(uint32_t) > size
+            || items[i].target >= NHOST_TARGETS)
+            return false;
+    }
+    return true;
+}
 
-    /* Code section is protected from writes by default, un-protect it */
-    if (mprotect(gen_code, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC)) {
-        perror("mprotect");
-        exit(2);
+/* Map a translation of the program saved earlier and fill in its tables.
+   Returns the code buffer, or NULL if nothing suitable is saved. */
+static char* load_translation(const char *path, const build_id_t *id,
+                              const Instr_t *prog, uint32_t len,
+                              size_t code_size, void **entrypoints,
+                              int32_t *block_steps) {
+    int fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd == -1)
+        return NULL;
+    char *code = NULL;
+    cache_header_t header;
+    off_t offset = 0;
+    struct stat st;
+    Instr_t *saved_prog = malloc((size_t)len * sizeof(Instr_t) + 1);
+    uint32_t *entry_offsets = malloc((size_t)len * sizeof(uint32_t) + 1);
+    reloc_t *items = NULL;
+    assert(saved_prog && entry_offsets);
+    if (!trusted_file(fd, &st)
+        || !read_at(fd, &header, sizeof(header), &offset)
+        || header.magic != CACHE_MAGIC
+        || memcmp(&header.build_id, id, sizeof(*id))
+        || header.plen != len || header.code_size != code_size)
+        goto done;
+    /* Tables must be before the code, all of which is in the file.
+       Mapping past the end of a truncated file would fault later. */
+    uint64_t tables_end = sizeof(header)
+                          + (uint64_t)len * (sizeof(Instr_t) + sizeof(uint32_t)
+                                             + sizeof(int32_t))
+                          + (uint64_t)header.nrelocs * sizeof(reloc_t);
+    if (header.code_offset < tables_end || (header.code_offset & 0xfff)
+        || header.code_offset + code_size > (uint64_t)st.st_size)
+        goto done;
+    if (!read_at(fd, saved_prog, (size_t)len * sizeof(Instr_t), &offset)
+        || memcmp(saved_prog, prog, (size_t)len * sizeof(Instr_t))
+        || !read_at(fd, entry_offsets, (size_t)len * sizeof(uint32_t), &offset)
+        || !read_at(fd, block_steps, (size_t)len * sizeof(int32_t), &offset))
+        goto done;
+    items = malloc((size_t)header.nrelocs * sizeof(reloc_t) + 1);
+    assert(items);
+    if (!read_at(fd, items, (size_t)header.nrelocs * sizeof(reloc_t), &offset)
+        || !valid_tables(&header, entry_offsets, block_steps, len, items))
+        goto done;
+    code = map_code_buffer(code_size, fd, (off_t)header.code_offset);
+    if (!code)
+        goto done;
+
+    if ((int64_t)((intptr_t)code - (intptr_t)&translate_program)
+        != header.host_distance) {
+        for (uint32_t i = 0; i < header.nrelocs; i++)
+            patch_branch(code + items[i].offset, host_target(items[i].target));
     }
-    /* Pre-populate resulting code buffer with INT3 (machine code 0xCC).
-       This will help to catch jumps to wrong locations */
-    memset(gen_code, 0xcc, JIT_CODE_SIZE);
-    void* entrypoints[PROGRAM_SIZE] = {0}; /* a map of guest PCs to capsules */
+    for (uint32_t i = 0; i < len; i++)
+        entrypoints[i] = entry_offsets[i] == NO_ENTRY
+                         ? NULL : code + entry_offsets[i];
+    spill_code = code + header.spill_offset;
+    reload_code = code + header.reload_offset;
+    exit_code = code + header.exit_offset;
+    enter_code = (enter_code_t)(code + header.enter_offset);
+done:
+    /* block_steps may be partly read, translation starts over then */
+    if (!code)
+        memset(block_steps, 0, (size_t)len * sizeof(int32_t));
+    free(items);
+    free(entry_offsets);
+    free(saved_prog);
+    close(fd);
+    return code;
+}
 
-    translate_program(cpu.pmem, gen_code, entrypoints, PROGRAM_SIZE);
+/* Save the translated program. It is written to a temporary file first,
+   which then replaces the cache file, so that concurrent runs do not
+   see it half-written. Failures are not fatal. */
+static void save_translation(const char *path, const build_id_t *id,
+                             const Instr_t *prog, uint32_t len,
+                             const char *code, size_t code_size,
+                             void * const *entrypoints,
+                             const int32_t *block_steps,
+                             const reloc_list_t *list) {
+    char *tmp_path = malloc(strlen(path) + 8);
+    assert(tmp_path);
+    sprintf(tmp_path, "%s.XXXXXX", path);
+    int fd = mkstemp(tmp_path);
+    if (fd == -1) {
+        free(tmp_path);
+        return;
+    }
+    uint32_t *entry_offsets = malloc((size_t)len * sizeof(uint32_t) + 1);
+    assert(entry_offsets);
+    for (uint32_t i = 0; i < len; i++)
+        entry_offsets[i] = entrypoints[i]
+                           ? (uint32_t)((const char*)entrypoints[i] - code)
+                           : NO_ENTRY;
+    cache_header_t header = {
+        .magic = CACHE_MAGIC,
+        .build_id = *id,
+        .plen = len,
+        .nrelocs = list->count,
+        .code_size = code_size,
+        .host_distance = (intptr_t)code - (intptr_t)&translate_program,
+        .spill_offset = (uint32_t)(spill_code - code),
+        .reload_offset = (uint32_t)(reload_code - code),
+        .exit_offset = (uint32_t)(exit_code - code),
+        .enter_offset = (uint32_t)((const char*)enter_code - code),
+    };
+    uint64_t tables_end = sizeof(header)
+                          + (uint64_t)len * (sizeof(Instr_t) + sizeof(uint32_t)
+                                             + sizeof(int32_t))
+                          + (uint64_t)list->count * sizeof(reloc_t);
+    header.code_offset = (tables_end + 0xfff) & ~(uint64_t)0xfff;
+    static const char padding[0x1000];
+    bool ok = write_all(fd, &header, sizeof(header))
+        && write_all(fd, prog, (size_t)len * sizeof(Instr_t))
+        && write_all(fd, entry_offsets, (size_t)len * sizeof(uint32_t))
+        && write_all(fd, block_steps, (size_t)len * sizeof(int32_t))
+        && write_all(fd, list->items, (size_t)list->count * sizeof(reloc_t))
+        && write_all(fd, padding, header.code_offset - tables_end)
+        && write_all(fd, code, code_size);
+    close(fd);
+    if (!ok || rename(tmp_path, path))
+        unlink(tmp_path);
+    free(entry_offsets);
+    free(tmp_path);
+}
 
+static void enter_generated_code(void* addr) {
+    enter_code(addr, steplimit); /* Will not return */
+}
+
+/* Blocks are translated after being entered this many times
+   in tiered execution */
+#ifndef TIER_THRESHOLD
+#define TIER_THRESHOLD 16
+#endif
+
+/* Enter translated blocks while the CPU is running, and simulate code
+   that has no translation with service routines. Counters are only used
+   if tiered, to translate blocks of t. */
+static void dispatch(translator_t *t, void * const *entrypoints,
+                     const int32_t *block_steps, uint32_t *counters,
+                     bool tiered) {
     setjmp(return_buf); /* Will get here from generated code. */
 
-    while (cpu.state == Cpu_Running && cpu.steps < steplimit) {
-        if (cpu.pc > PROGRAM_SIZE) {
-            cpu.state = Cpu_Break;
+    while (pcpu->state == Cpu_Running && pcpu->steps < steplimit) {
+        if (pcpu->pc >= pcpu->plen) {
+            pcpu->state = Cpu_Break;
             break;
         }
-        enter_generated_code(entrypoints[cpu.pc]); /* Will not return */
+        if (tiered && t->leaders[pcpu->pc]
+            && !entrypoints[pcpu->pc]
+            && ++counters[pcpu->pc] >= TIER_THRESHOLD)
+            translate_block(t, pcpu->pc);
+        /* PC may point inside a block or an instruction, or the block
+           may not fit into steplimit, or it is not translated yet.
+           Go instruction by instruction then. */
+        if (entrypoints[pcpu->pc] == NULL
+            || steplimit - pcpu->steps < block_steps[pcpu->pc]) {
+            decode_t decoded = decode_at_address(pcpu->pmem, pcpu->pc,
+                                                 pcpu->plen);
+            service_routines[decoded.opcode](decoded.immediate);
+            continue;
+        }
+        enter_generated_code(entrypoints[pcpu->pc]); /* Will not return */
+    }
+}
+
+/* Code of a program and maps of guest PCs to it. Translations of whole
+   programs are read-only once made, so that many threads may run them
+   at once, each copying the stubs to its own state first. */
+typedef struct {
+    char *code;
+    size_t code_size;
+    void **entrypoints; /* of basic blocks */
+    int32_t *block_steps;
+    int32_t *depths;
+    uint32_t *counters; /* of entries to blocks not translated, if tiered */
+    const char *spill_code;
+    const char *reload_code;
+    const char *exit_code;
+    enter_code_t enter_code;
+} translation_t;
+
+/* Translate program as a whole, or, if tiered, only generate the stubs
+   and leave the blocks to translator. Guards for stack depths proven by
+   verify_program() are only dropped if verify, which must be false when
+   the program does not start with an empty stack. Whole translations of
+   verified programs go through the translation cache. */
+static void prepare(translation_t *tr, translator_t *translator,
+                    const Instr_t *prog, uint32_t len, bool tiered,
+                    bool verify) {
+    /* Some room is reserved for shared stubs. Tiered execution only
+       needs that, its blocks go to the code cache. */
+    tr->code_size = ((size_t)(tiered ? 0 : len) + 64) * CODE_PER_INSTR;
+    /* A map of guest PCs of basic blocks to capsules */
+    tr->entrypoints = calloc(len, sizeof(void*));
+    tr->block_steps = calloc(len, sizeof(int32_t));
+    tr->depths = malloc(len * sizeof(int32_t));
+    /* Number of entries to basic blocks not translated yet */
+    tr->counters = tiered ? calloc(len, sizeof(uint32_t)) : NULL;
+    if ((!tr->entrypoints || !tr->block_steps || !tr->depths
+         || (tiered && !tr->counters)) && len > 0) {
+        fprintf(stderr, "Failed to allocate memory for translation.\n");
+        exit(2);
+    }
+
+    build_id_t build_id;
+    char *path = NULL;
+    /* Saved translations do not depend on whether tracing is on */
+    bool tracing = false;
+#ifdef TRACE
+    tracing = TraceActive;
+#endif
+    tr->code = NULL;
+    if (TranslationCache && !tiered && verify && !tracing
+        && get_build_id(&build_id)) {
+        path = cache_path(&build_id, prog, len);
+        tr->code = load_translation(path, &build_id, prog, len,
+                                    tr->code_size, tr->entrypoints,
+                                    tr->block_steps);
     }
 
-    assert(cpu.state != Cpu_Running || cpu.steps == steplimit);
-    /* Print CPU state */
-    printf("CPU executed %lld steps. End state \"%s\".\n",
-            cpu.steps, cpu.state == Cpu_Halted? "Halted":
-                       cpu.state == Cpu_Running? "Running": "Break");
-    printf("PC = %#x, SP = %d\n", cpu.pc, cpu.sp);
-    printf("Stack: ");
-    for (int32_t i=cpu.sp; i >= 0 ; i--) {
-        printf("%#10x ", cpu.stack[i]);
+    if (!tr->code) {
+        tr->code = allocate_code_buffer(tr->code_size);
+        /* Pre-populate resulting code buffer with a trapping instruction,
+           such as INT3. This will help to catch jumps to wrong locations. */
+        memset(tr->code, CODE_FILL, tr->code_size);
+
+        bool verified = verify && verify_program(prog, len, tr->depths);
+
+        reloc_list_t list = {.base = tr->code};
+        relocs = path ? &list : NULL;
+        init_translator(translator, prog, tr->code, tr->code_size,
+                        tr->entrypoints, tr->block_steps,
+                        verified ? tr->depths : NULL, len);
+        translator->counters = tr->counters;
+        if (!tiered)
+            translate_program(translator);
+        relocs = NULL;
+        if (path)
+            save_translation(path, &build_id, prog, len, tr->code,
+                             tr->code_size, tr->entrypoints,
+                             tr->block_steps, &list);
+        free(list.items);
     }
-    printf("%s\n", cpu.sp == -1? "(empty)": "");
+    free(path);
+    protect_code(tr->code, tr->code_size, false);
+    tr->spill_code = spill_code;
+    tr->reload_code = reload_code;
+    tr->exit_code = exit_code;
+    tr->enter_code = enter_code;
+}
+
+/* Simulate *arg with tr until it stops or runs limit instructions */
+static void execute(const translation_t *tr, translator_t *translator,
+                    cpu_t *arg, long long limit, bool tiered) {
+    /* The register of pcpu is callee-saved for code outside of this file */
+    cpu_t *saved_pcpu = pcpu;
+    pcpu = arg;
+    steplimit = limit;
+    spill_code = tr->spill_code;
+    reload_code = tr->reload_code;
+    exit_code = tr->exit_code;
+    enter_code = tr->enter_code;
+
+    timing_mark(Timing_Execute);
+    /* Only execution is counted, not translation of the whole program
+       or loading it from the translation cache. Tiered execution
+       translates blocks in between, which is a part of it. */
+    perf_counters_start();
+    dispatch(translator, tr->entrypoints, tr->block_steps, tr->counters,
+             tiered);
+    perf_counters_stop(pcpu->steps);
+    pcpu = saved_pcpu;
+}
+
+static void free_translation(translation_t *tr) {
+    free(tr->depths);
+    free(tr->counters);
+    free(tr->block_steps);
+    free(tr->entrypoints);
+    munmap(tr->code, tr->code_size);
+}
+
+/* Simulate the CPU until it stops or runs limit instructions.
+   The program is translated as a whole before execution, or, if tiered,
+   it is interpreted by service routines and its basic blocks are
+   translated when they become hot. Either way, this is done anew on
+   every call, unless a whole translation is found in the translation
+   cache. */
+static void run(cpu_t *arg, long long limit, bool tiered) {
+    translation_t tr;
+    translator_t translator = {0};
+    prepare(&tr, &translator, arg->pmem, arg->plen, tiered, arg->sp == -1);
+    execute(&tr, &translator, arg, limit, tiered);
+
+    timing_mark(Timing_Teardown);
+    free_translator(&translator);
+    free_translation(&tr);
+}
+
+void translated_run(cpu_t *arg, long long limit) {
+    run(arg, limit, false);
+}
 
-    free(LoadedProgram);
+void tiered_run(cpu_t *arg, long long limit) {
+    run(arg, limit, true);
+}
+
+/* Translations made once to be run many times, see engine_t. They do
+   not rely on verification as runs may start with items on the stack. */
+void* translated_prepare(const Instr_t *prog, uint32_t len) {
+    translation_t *tr = malloc(sizeof(translation_t));
+    assert(tr);
+    translator_t translator = {0};
+    prepare(tr, &translator, prog, len, false, false);
+    free_translator(&translator);
+    return tr;
+}
 
-    return cpu.state == Cpu_Halted ||
-           (cpu.state == Cpu_Running &&
-            cpu.steps == steplimit)?0:1;
+void translated_run_prepared(const void *prepared, cpu_t *arg,
+                             long long limit) {
+    execute(prepared, NULL, arg, limit, false);
 }
+
+void translated_release(void *prepared) {
+    free_translation(prepared);
+    free(prepared);
+}
+
+#ifndef ENGINE_LIBRARY
+int main(int argc, char **argv) {
+    long long steplimit = parse_args(argc, argv, TRACE_ARGS);
+    cpu_t cpu = init_cpu();
+#ifdef TRACE
+    trace_start();
+#endif
+#ifdef TIERED
+    tiered_run(&cpu, steplimit);
+#else
+    translated_run(&cpu, steplimit);
+#endif
+#ifdef TRACE
+    trace_stop();
+#endif
+    bool ok = report_cpu_state(&cpu, steplimit);
+    unload_program();
+    return ok ? 0 : 1;
+}
+#endif
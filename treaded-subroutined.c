@@ -1,4 +1,5 @@
-/*  threaded-subroutined.c - a threaded interpreter for a stack virtual machine.
+/*  treaded-subroutined.c - a context-threaded interpreter for a stack virtual
+    machine: the program becomes a sequence of calls to service routines.
     Copyright (c) 2015 Grigory Rechistov. All rights reserved.
 Redistribution and use in source and binary forms, with or without
 modification, are permitted provided that the following conditions are met:
@@ -21,6 +22,12 @@ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
 OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
+#ifndef __x86_64__
+/* The program generates machine code, only specific platforms are supported */
+#error This program is designed to compile only on Intel64/AMD64 platform.
+#error Sorry.
+#endif
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -28,451 +35,330 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <stdlib.h>
 #include <errno.h>
 #include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <setjmp.h>
 #include <math.h>
 
 #include "common.h"
+#include "decode.h"
 
-static inline Instr_t fetch(const cpu_t *pcpu) {
-    assert(pcpu);
-    assert(pcpu->pc < PROGRAM_SIZE);
-    return pcpu->pmem[pcpu->pc];
-};
-
-static inline Instr_t fetch_checked(cpu_t *pcpu) {
-    if (!(pcpu->pc < PROGRAM_SIZE)) {
-        printf("PC out of bounds\n");
-        pcpu->state = Cpu_Break;
-        return Instr_Break;
-    }
-    return fetch(pcpu);
-}
+/* Guest instructions are not interpreted by a dispatch loop here. Instead,
+   every one of them becomes a real CALL of its service routine in
+   generated code, so that the return address stack of the host predicts
+   returns from service routines, and the order of calls is the one of
+   instructions in the program. Branches call their service routines too,
+   which only evaluate conditions, and are followed by native conditional
+   jumps to the code of their targets. All of the guest state stays
+   in *pcpu. */
 
-static inline decode_t decode(Instr_t raw_instr, const cpu_t *pcpu) {
-    assert(pcpu);
-    decode_t result = {0};
-    result.opcode = raw_instr;
-    switch (raw_instr) {
-    case Instr_Nop:
-    case Instr_Halt:
-    case Instr_Print:
-    case Instr_Swap:
-    case Instr_Dup:
-    case Instr_Inc:
-    case Instr_Add:
-    case Instr_Sub:
-    case Instr_Mul:
-    case Instr_Rand:
-    case Instr_Dec:
-    case Instr_Drop:
-    case Instr_Over:
-    case Instr_Mod:
-    case Instr_And:
-    case Instr_Or:
-    case Instr_Xor:
-    case Instr_SHL:
-    case Instr_SHR:
-    case Instr_Rot:
-    case Instr_SQRT:
-    case Instr_Pick:
-        result.length = 1;
-        break;
-    case Instr_Push:
-    case Instr_JNE:
-    case Instr_JE:
-    case Instr_Jump:
-        result.length = 2;
-        if (!(pcpu->pc+1 < PROGRAM_SIZE)) {
-            printf("PC+1 out of bounds\n");
-            result.length = 1;
-            result.opcode = Instr_Break;
-            break;
-        }
-        result.immediate = (int32_t)pcpu->pmem[pcpu->pc+1];
-        break;
-    case Instr_Break:
-    default: /* Undefined instructions equal to Break */
-        result.length = 1;
-        result.opcode = Instr_Break;
-        break;
-    }
-    return result;
-}
+/* setjmp/longjmp context buffer to return from generated code when
+   simulation stops, one per thread */
+static _Thread_local jmp_buf return_buf;
 
-static inline decode_t fetch_decode(cpu_t *pcpu) {
-    return decode(fetch_checked(pcpu), pcpu);
-}
+/* Global pointer to be accessible from service routines.
+   Uses GNU extension to statically occupy host R15 register,
+   generated code does not touch it. */
+register cpu_t * pcpu asm("r15");
 
-/*** Service routines ***/
-#define BAIL_ON_ERROR() if (cpu.state != Cpu_Running) break;
-
-typedef void (*service_routine_t)(cpu_t *pcpu, decode_t* pdecode);
-
-#define DISPATCH() do {\
-    goto *service_routines[decoded.opcode];   \
-   } while(0);
-
-/*
-#define DISPATCH() \
-__asm__ __volatile__("mov    (%0, %1, 8), %%rcx\n" \
-                     "jmpq   *%%rcx\n" \
-                     :: "r"(&service_routines), "r"((uint64_t)decoded.opcode): "%rcx");\
-__asm__ __volatile__("nopl 0x55667788(%%rax)":::"memory");
-*/
-
-#define ADVANCE_PC() \
-    cpu.pc += decoded.length;\
-    cpu.steps++; \
-    if (cpu.state != Cpu_Running || cpu.steps >= steplimit) break;
-
-static inline void push(cpu_t *pcpu, uint32_t v) {
-    assert(pcpu);
-    if (pcpu->sp >= STACK_CAPACITY-1) {
-        printf("Stack overflow\n");
-        pcpu->state = Cpu_Break;
-        return;
-    }
-    pcpu->stack[++pcpu->sp] = v;
-}
-
-static inline uint32_t pop(cpu_t *pcpu) {
-    assert(pcpu);
-    if (pcpu->sp < 0) {
-        printf("Stack underflow\n");
-        pcpu->state = Cpu_Break;
-        return 0;
-    }
-    return pcpu->stack[pcpu->sp--];
-}
+/* Not passed to service routines to keep their signatures short */
+static _Thread_local long long steplimit = LLONG_MAX;
 
-static inline uint32_t pick(cpu_t *pcpu, int32_t pos) {
-    assert(pcpu);
-    if (pcpu->sp - 1 < pos) {
-        printf("Out of bound picking\n");
-        pcpu->state = Cpu_Break;
-        return 0;
-    }
-    return pcpu->stack[pcpu->sp - pos];
+static void exit_generated_code() {
+    longjmp(return_buf, 1);
 }
 
-cpu_t pcpu;
-decode_t pdecoded;
-
-sr_Nop:
-void sr_Nop(cpu_t *pcpu, decode_t *pdecoded) {
-    /* Do nothing */
-    ADVANCE_PC();
-    pdecoded = fetch_decode(&pcpu);
-    DISPATCH();
-}
+/* Errors found by push() and pop() leave generated code */
+#define STACK_FAULT(result) exit_generated_code()
+#include "semantics.h"
 
-sr_Halt:
-void sr_Halt(cpu_t *pcpu, decode_t *pdecoded) {
-    pcpu->state = Cpu_Halted;
-    ADVANCE_PC();
-    return;
-}
-
-sr_Push:
-void sr_Push(cpu_t *pcpu, decode_t *pdecoded) {
-    push(pcpu, pdecoded->immediate);
-    ADVANCE_PC();
-    pdecoded = fetch_decode(&pcpu);
-    DISPATCH();
-}
+/*** Service routines ***/
 
-sr_Print:
-void sr_Print(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    printf("[%d]\n", tmp1);
-    ADVANCE_PC();
-    pdecoded = fetch_decode(&pcpu);
-    DISPATCH();
-}
+#define ADVANCE_PC(length) do {\
+    pcpu->pc += length;\
+    pcpu->steps++; \
+    if (pcpu->state != Cpu_Running || pcpu->steps >= steplimit) \
+        exit_generated_code(); \
+} while(0);
 
-sr_Swap:
-void sr_Swap(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1);
-    push(pcpu, tmp2);
-    ADVANCE_PC();
-    pdecoded = fetch_decode(&pcpu);
-    DISPATCH();
-}
+/* Service routines take the immediate operand of their instruction,
+   if it has one. Branches return whether they are taken, after setting
+   PC to their target. */
+typedef uint32_t (*service_routine_t)(int32_t immediate);
 
-sr_Dup:
-void sr_Dup(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1);
-    push(pcpu, tmp1);
-    ADVANCE_PC();
-    pdecoded = fetch_decode(&pcpu);
-    DISPATCH();
-}
+#define SEM_CPU pcpu
+#define SEM_LEAVE() exit_generated_code()
+#define SEM_IMM immediate
+#define SEM_BRANCH() {pcpu->pc += immediate; taken = 1;}
 
-sr_Over:
-void sr_Over(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp2);
-    push(pcpu, tmp1);
-    push(pcpu, tmp2);
-    ADVANCE_PC();
-    pdecoded = fetch_decode(&pcpu);
-    DISPATCH();
+/* Halt and Break leave generated code from ADVANCE_PC() */
+#define SERVICE_ROUTINE(name, opcode, imm, pops, pushes, kind, guard, results) \
+static uint32_t sr_##name(__attribute__((unused)) int32_t immediate) { \
+    uint32_t taken = 0; \
+    SEM_CHECKED(kind, pops, pushes, guard, results); \
+    ADVANCE_PC(1 + (imm)); \
+    return taken; \
 }
 
-sr_Inc:
-void sr_Inc(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1+1);
-    ADVANCE_PC();
-    pdecoded = fetch_decode(&pcpu);
-    DISPATCH();
-}
+INSTRUCTIONS(SERVICE_ROUTINE)
 
-sr_Add:
-void sr_Add(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 + tmp2);
-    ADVANCE_PC();
-    pdecoded = fetch_decode(&pcpu);
-    DISPATCH();
-}
+#define SR_ENTRY(name, opcode, imm, pops, pushes, kind, guard, results) \
+        [Instr_##name] = &sr_##name,
 
-sr_Sub:
-void sr_Sub(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 - tmp2);
-    ADVANCE_PC();
-    pdecoded = fetch_decode(&pcpu);
-    DISPATCH();
-}
+static const service_routine_t service_routines[] = {
+        INSTRUCTIONS(SR_ENTRY)
+    };
 
-sr_Mod:
-void sr_Mod(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    if (tmp2 == 0) {
-        pcpu->state = Cpu_Break;
-        return;
+/*** Code generation ***/
+
+/* "MOV EDI, imm32" passes the immediate operand to a following CALL */
+#ifdef __CYGWIN__ /* Win64 ABI, use ECX instead of EDI */
+static const char mov_template_code[] = {0xb9, 0x00, 0x00, 0x00, 0x00};
+#else
+static const char mov_template_code[] = {0xbf, 0x00, 0x00, 0x00, 0x00};
+#endif
+
+/* A part of code buffer being filled with generated code */
+typedef struct {
+    char *cur; /* Where to put new code */
+    char *end;
+} code_area_t;
+
+/* A jump to guest code which may not be generated yet */
+typedef struct {
+    char *field; /* rel32 to patch */
+    uint32_t target_pc;
+} branch_fixup_t;
+
+static char* emit(code_area_t *area, const char *code, int size) {
+    assert(area->cur + size <= area->end);
+    char *start = area->cur;
+    memcpy(start, code, size);
+    area->cur += size;
+    return start;
+}
+
+/* Fill in an offset field of a relative branch to target */
+static void patch_rel32(char *field, const void *target) {
+    intptr_t offset = (intptr_t)target - (intptr_t)field - 4;
+    if (offset != (intptr_t)(int32_t)offset) {
+        fprintf(stderr, "Offset to %p does not fit in 32 bits."
+        " Cannot generate code for it, sorry", target);
+        exit(2);
     }
-    push(pcpu, tmp1 % tmp2);
-    ADVANCE_PC();
-    pdecoded = fetch_decode(&pcpu);
-    DISPATCH();
-}
-
-sr_Mul:
-void sr_Mul(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 * tmp2);
-    ADVANCE_PC();
-    pdecoded = fetch_decode(&pcpu);
-    DISPATCH();
-}
-
-sr_Rand:
-void sr_Rand(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = rand();
-    push(pcpu, tmp1);
-    ADVANCE_PC();
-    pdecoded = fetch_decode(&pcpu);
-    DISPATCH();
-}
-
-sr_Dec:
-void sr_Dec(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1-1);
-    ADVANCE_PC();
-    pdecoded = fetch_decode(&pcpu);
-    DISPATCH();
-}
-
-sr_Drop:
-void sr_Drop(cpu_t *pcpu, decode_t *pdecoded) {
-    (void)pop(pcpu);
-    ADVANCE_PC();
-    pdecoded = fetch_decode(&pcpu);
-    DISPATCH();
-}
-
-sr_Je:
-void sr_Je(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    if (tmp1 == 0)
-        pcpu->pc += pdecoded->immediate;
-    ADVANCE_PC();
-    pdecoded = fetch_decode(&pcpu);
-    DISPATCH();
-}
-
-sr_Jne:
-void sr_Jne(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    if (tmp1 != 0)
-        pcpu->pc += pdecoded->immediate;
-    ADVANCE_PC();
-    pdecoded = fetch_decode(&pcpu);
-    DISPATCH();
-}
-
-sr_And:
-void sr_And(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 & tmp2);
-    ADVANCE_PC();
-    pdecoded = fetch_decode(&pcpu);
-    DISPATCH();
+    int32_t rel32 = (int32_t)offset;
+    memcpy(field, &rel32, 4);
 }
 
-sr_Or:
-void sr_Or(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 | tmp2);
-    ADVANCE_PC();
-    pdecoded = fetch_decode(&pcpu);
-    DISPATCH();
+/* Emit a branch with rel32 operand, return address of the operand field
+   so that it can be patched later if target is not known yet */
+static char* emit_rel32(code_area_t *area, const char *opcode, int size,
+                        const void *target) {
+    static const char zero_rel32[] = {0x00, 0x00, 0x00, 0x00};
+    emit(area, opcode, size);
+    char *field = emit(area, zero_rel32, sizeof(zero_rel32));
+    if (target)
+        patch_rel32(field, target);
+    return field;
 }
 
-sr_Xor:
-void sr_Xor(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 ^ tmp2);
-    ADVANCE_PC();
-    pdecoded = fetch_decode(&pcpu);
-    DISPATCH();
+static void emit_call(code_area_t *area, const void *target) {
+    static const char call_code[] = {0xe8};
+    emit_rel32(area, call_code, sizeof(call_code), target);
 }
 
-sr_SHL:
-void sr_SHL(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 << tmp2);
-    ADVANCE_PC();
-    pdecoded = fetch_decode(&pcpu);
-    DISPATCH();
+static char* emit_jmp(code_area_t *area, const void *target) {
+    static const char jmp_code[] = {0xe9};
+    return emit_rel32(area, jmp_code, sizeof(jmp_code), target);
 }
 
-sr_SHR:
-void sr_SHR(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 >> tmp2);
-    ADVANCE_PC();
-    pdecoded = fetch_decode(&pcpu);
-    DISPATCH();
+static char* emit_jnz(code_area_t *area, const void *target) {
+    static const char jnz_code[] = {0x0f, 0x85};
+    return emit_rel32(area, jnz_code, sizeof(jnz_code), target);
 }
 
-sr_Rot:
-void sr_Rot(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    uint32_t tmp3 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1);
-    push(pcpu, tmp3);
-    push(pcpu, tmp2);
-    ADVANCE_PC();
-    pdecoded = fetch_decode(&pcpu);
-    DISPATCH();
+/* Call the service routine of the instruction */
+static void emit_sr_call(code_area_t *area, decode_t decoded) {
+    if (decoded.length == 2) {
+        char *code = emit(area, mov_template_code, sizeof(mov_template_code));
+        memcpy(code + 1, &decoded.immediate, 4);
+    }
+    emit_call(area, (const void*)service_routines[decoded.opcode]);
+}
+
+/* Generated code is entered with enter_code(target). There is no return
+   from it, exit_generated_code() restores the host stack pointer. */
+typedef void (*enter_code_t)(const void *target);
+
+/* Shared stubs, generated before guest code */
+typedef struct {
+    enter_code_t enter;
+    const char *exit; /* leave generated code, PC is already stored */
+} stubs_t;
+
+static stubs_t generate_stubs(code_area_t *area) {
+    stubs_t stubs;
+    /* Realign host stack for calls */
+#ifdef __CYGWIN__ /* Win64 ABI, argument in RCX, shadow space */
+    const char enter_template_code[] = {
+        0x48, 0x83, 0xe4, 0xf0,               /* and rsp, -16 */
+        0x48, 0x83, 0xec, 0x20,               /* sub rsp, 32 */
+        0xff, 0xe1,                           /* jmp rcx */
+    };
+#else
+    const char enter_template_code[] = {
+        0x48, 0x83, 0xe4, 0xf0,               /* and rsp, -16 */
+        0xff, 0xe7,                           /* jmp rdi */
+    };
+#endif
+    stubs.enter = (enter_code_t)emit(area, enter_template_code,
+                                     sizeof(enter_template_code));
+    stubs.exit = area->cur;
+    emit_call(area, (const void*)exit_generated_code);
+    return stubs;
+}
+
+static inline bool is_branch(Instr_t opcode) {
+    return opcode == Instr_JE || opcode == Instr_JNE || opcode == Instr_Jump;
+}
+
+/* Generate calls for all instructions of the program decoded one after
+   another from its start. Their code is entered at any of them.
+   Branches to other addresses, inside of instructions or outside of
+   the program, leave generated code for the dispatcher loop in run(). */
+static void generate_program(const Instr_t *prog, uint32_t len,
+                             code_area_t *area, const stubs_t *stubs,
+                             void **entrypoints, branch_fixup_t *fixups) {
+    uint8_t *opcodes = malloc((size_t)len + 1);
+    uint64_t *starts = malloc(STARTS_WORDS(len) * sizeof(uint64_t) + 1);
+    if (!opcodes || !starts) {
+        fprintf(stderr, "Failed to allocate memory for decoded program.\n");
+        exit(2);
+    }
+    /* Instructions are classified and found in bulk */
+    decode_program(prog, len, opcodes, starts);
+    uint32_t nfixups = 0;
+    for (uint32_t pc = 0; pc < len; pc++) {
+        if (!is_instruction_start(starts, pc))
+            continue;
+        decode_t decoded = decoded_at(prog, opcodes, pc);
+        entrypoints[pc] = area->cur;
+        emit_sr_call(area, decoded);
+        if (!is_branch(decoded.opcode))
+            continue;
+
+        uint32_t target_pc = pc + decoded.length + decoded.immediate;
+        char *field;
+        if (decoded.opcode == Instr_Jump) {
+            field = emit_jmp(area, NULL);
+        } else {
+            static const char test_eax_code[] = {0x85, 0xc0}; /* test eax, eax */
+            emit(area, test_eax_code, sizeof(test_eax_code));
+            field = emit_jnz(area, NULL);
+        }
+        fixups[nfixups++] = (branch_fixup_t){field, target_pc};
+    }
+    /* Running past the end of the program */
+    emit_jmp(area, stubs->exit);
+
+    /* Chain branches now when all entrypoints are known */
+    for (uint32_t i = 0; i < nfixups; i++) {
+        uint32_t target_pc = fixups[i].target_pc;
+        const void *target = target_pc < len && entrypoints[target_pc]
+                             ? entrypoints[target_pc] : stubs->exit;
+        patch_rel32(fixups[i].field, target);
+    }
+    free(starts);
+    free(opcodes);
+}
+
+/* Generated code calls service routines with rel32 branches, so the
+   buffer is mapped next to the host code, below it if there is room.
+   If something is mapped there already, e.g. by another thread, the next
+   hints are further away. */
+static char* allocate_code_buffer(size_t size) {
+    const uintptr_t near = (uintptr_t)&generate_program & ~(uintptr_t)0xfff;
+    const uintptr_t gap = 1 << 20;
+    size = (size + 0xfff) & ~(size_t)0xfff;
+    const bool below = near > size + 2 * gap;
+    uintptr_t hint = below ? near - size - gap : near + gap;
+    while (true) {
+        void *buf = mmap((void*)hint, size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf == MAP_FAILED) {
+            perror("mmap");
+            exit(2);
+        }
+        intptr_t distance = (intptr_t)buf - (intptr_t)near;
+        if (distance >= INT32_MIN / 2 && distance <= INT32_MAX / 2)
+            return (char*)buf;
+        munmap(buf, size);
+        if (below && hint < size + gap)
+            hint = 0;
+        else
+            hint = below ? hint - size - gap : hint + size + gap;
+        distance = (intptr_t)hint - (intptr_t)near;
+        if (hint == 0 || distance < INT32_MIN / 2 || distance > INT32_MAX / 2) {
+            fprintf(stderr, "Code buffer at %p is too far from host code\n",
+                    buf);
+            exit(2);
+        }
+    }
 }
 
-sr_Jump:
-void sr_Jump(cpu_t *pcpu, decode_t *pdecoded) {
-    pcpu->pc += pdecoded->immediate;
-    ADVANCE_PC();
-    pdecoded = fetch_decode(&pcpu);
-    DISPATCH();
-}
+/* Simulate the CPU until it stops or runs limit instructions */
+void treaded_subroutined_run(cpu_t *arg, long long limit) {
+    /* R15 is callee-saved for code outside of this file */
+    cpu_t *saved_pcpu = pcpu;
+    pcpu = arg;
+    steplimit = limit;
+
+    size_t gen_code_size = ((size_t)pcpu->plen + 1) * JIT_CODE_PER_INSTR;
+    char *gen_code = allocate_code_buffer(gen_code_size);
+    void* *entrypoints = calloc(pcpu->plen, sizeof(void*));
+    branch_fixup_t *fixups = calloc(pcpu->plen, sizeof(branch_fixup_t));
+    if ((!entrypoints || !fixups) && pcpu->plen > 0) {
+        fprintf(stderr, "Failed to allocate memory for translation.\n");
+        exit(2);
+    }
+    code_area_t area = {.cur = gen_code, .end = gen_code + gen_code_size};
+    stubs_t stubs = generate_stubs(&area);
+    generate_program(pcpu->pmem, pcpu->plen, &area, &stubs,
+                     entrypoints, fixups);
 
-sr_SQRT:
-void sr_SQRT(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, sqrt(tmp1));
-    ADVANCE_PC();
-    pdecoded = fetch_decode(&pcpu);
-    DISPATCH();
-}
+    timing_mark(Timing_Execute);
+    setjmp(return_buf); /* Will get here from generated code. */
 
-sr_Pick:
-void sr_Pick(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, pick(pcpu, tmp1));
-    ADVANCE_PC();
-    pdecoded = fetch_decode(&pcpu);
-    DISPATCH();
-}
+    while (pcpu->state == Cpu_Running && pcpu->steps < steplimit) {
+        if (pcpu->pc >= pcpu->plen) {
+            pcpu->state = Cpu_Break;
+            break;
+        }
+        if (entrypoints[pcpu->pc])
+            stubs.enter(entrypoints[pcpu->pc]); /* Will not return */
+        /* PC points inside an instruction, go instruction by instruction
+           until code for one of them is reached */
+        decode_t decoded = decode_at_address(pcpu->pmem, pcpu->pc,
+                                             pcpu->plen);
+        service_routines[decoded.opcode](decoded.immediate);
+    }
 
-sr_Break:
-void sr_Break(cpu_t *pcpu, decode_t *pdecoded) {
-    pcpu->state = Cpu_Break;
-    ADVANCE_PC();
-    /* No need to dispatch after Break */
-    return;
+    timing_mark(Timing_Teardown);
+    free(fixups);
+    free(entrypoints);
+    munmap(gen_code, gen_code_size);
+    pcpu = saved_pcpu;
 }
 
-
+#ifndef ENGINE_LIBRARY
 int main(int argc, char **argv) {
-
-    static void* service_routines[] = {
-        &&sr_Break, &&sr_Nop, &&sr_Halt, &&sr_Push, &&sr_Print,
-        &&sr_Jne, &&sr_Swap, &&sr_Dup, &&sr_Je, &&sr_Inc,
-        &&sr_Add, &&sr_Sub, &&sr_Mul, &&sr_Rand, &&sr_Dec,
-        &&sr_Drop, &&sr_Over, &&sr_Mod, &&sr_Jump, 
-        &&sr_And, &&sr_Or, &&sr_Xor,
-        &&sr_SHL, &&sr_SHR,
-        &&sr_SQRT, &&sr_Rot, &&sr_Pick, NULL /* This NULL seems to be essential to keep GCC from over-optimizing? */
-    };
-
-    long long steplimit = parse_args(argc, argv);
-    pcpu = init_cpu();
-
-    uint32_t tmp1 = 0, tmp2 = 0, tmp3 = 0;
-    pdecoded = fetch_decode(&pcpu);
-    DISPATCH();
-    
-    assert(cpu.state != Cpu_Running || cpu.steps == steplimit);
-    /* Print CPU state */
-    printf("CPU executed %lld steps. End state \"%s\".\n",
-            cpu.steps, cpu.state == Cpu_Halted? "Halted":
-                       cpu.state == Cpu_Running? "Running": "Break");
-    printf("PC = %#x, SP = %d\n", cpu.pc, cpu.sp);
-    printf("Stack: ");
-    for (int32_t i=cpu.sp; i >= 0 ; i--) {
-        printf("%#10x ", cpu.stack[i]);
-    }
-    printf("%s\n", cpu.sp == -1? "(empty)": "");
-
-    free(LoadedProgram);
-
-    return cpu.state == Cpu_Halted ||
-           (cpu.state == Cpu_Running &&
-            cpu.steps == steplimit)?0:1;
-}
\ No newline at end of file
+    long long steplimit = parse_args(argc, argv, 0);
+    cpu_t cpu = init_cpu();
+    perf_counters_start();
+    treaded_subroutined_run(&cpu, steplimit);
+    perf_counters_stop(cpu.steps);
+    bool ok = report_cpu_state(&cpu, steplimit);
+    unload_program();
+    return ok ? 0 : 1;
+}
+#endif
@@ -0,0 +1,621 @@
+/*  vmd.c - a resident server running programs on engines of libvm.a for
+    clients of a Unix socket, without starting a process per run
+    Copyright (c) 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <assert.h>
+#include <signal.h>
+#include <limits.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "common.h"
+
+/* Requests are lines of text sent to the socket:
+     load <id> <built-in program or file>    replied with "loaded <id> <words>"
+     unload <id>                             replied with "unloaded <id>"
+     run <tag> <id> <engine> <steplimit> [<value>...]
+   A run is a job for the worker threads, which start the program on
+   a fresh CPU with the values on its stack, the last one on top. When
+   it runs, what the standalone engine would print is sent in chunks of
+   "out <tag> <bytes>" lines followed by that many bytes. When it stops,
+   "done <tag> ok|fail <bytes>" is replied with the rest of the output.
+   Jobs finish in any order, other requests are replied to at once.
+   Errors are replied with "error <message>" lines. Jobs of a client
+   that has closed its connection are stopped.
+   Programs stay resident until unloaded, with their decoding or
+   translation of each engine made by the first job using it. */
+
+/* Longest ids, tags and requests */
+#define MAX_ID 63
+#define MAX_LINE 4096
+/* Resident programs at once */
+#define MAX_PROGRAMS 1024
+/* Entries of Engines[] */
+#define MAX_ENGINES 16
+/* Jobs a worker takes from the queue at once */
+#define JOB_BATCH 16
+/* Output of a job is sent once there is this much of it */
+#define OUTPUT_CHUNK (64 * 1024)
+/* Steps run between checks whether the client is still there */
+#define JOB_SLICE (1LL << 22)
+
+static const char *socket_opt = "--socket=";
+static const char *threads_opt = "--threads=";
+static const char *client_opt = "--client";
+
+/* A loaded program, freed when it is unloaded and no job uses it */
+typedef struct {
+    char id[MAX_ID + 1];
+    program_t prog;
+    int refs; /* under programs_lock */
+    pthread_mutex_t lock; /* of prepared */
+    /* By index in Engines[], with NULL engine if not prepared yet */
+    vm_program_t prepared[MAX_ENGINES];
+} resident_t;
+
+static resident_t *programs[MAX_PROGRAMS];
+static pthread_mutex_t programs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A connection, closed when it is over and no job will reply to it */
+typedef struct {
+    int fd;
+    int refs;
+    bool closed; /* nothing can be sent to it any more */
+    pthread_mutex_t lock; /* of refs, closed and writes */
+} client_t;
+
+typedef struct job_s {
+    struct job_s *next;
+    char tag[MAX_ID + 1];
+    client_t *client;
+    resident_t *program;
+    const engine_t *engine;
+    long long steplimit;
+    int ninputs;
+    uint32_t inputs[STACK_CAPACITY];
+} job_t;
+
+/* Jobs not taken by workers yet, oldest first */
+static job_t *queue_head = NULL;
+static job_t *queue_tail = NULL;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+/* Removed at exit */
+static const char *socket_path = "vmd.sock";
+
+static void usage_and_exit(const char *exec_name, int ret_code) {
+    fprintf(stderr, "Usage: %s [%s<path>] [%s<num>] [%s]\n",
+            exec_name, socket_opt, threads_opt, client_opt);
+    fprintf(stderr, "Serves requests to %s, by default, on as many threads"
+            " as there are processors. With %s, requests are read from"
+            " stdin and replies written to stdout instead.\n",
+            socket_path, client_opt);
+    fprintf(stderr, "Engines:");
+    for (const engine_t *e = Engines; e->name; e++)
+        fprintf(stderr, " %s", e->name);
+    fprintf(stderr, "\n");
+    exit(ret_code);
+}
+
+static bool send_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+/* A line, then optionally data, with nothing of other replies between.
+   If the client went away, this and later replies are dropped. */
+static void reply(client_t *client, const char *data, size_t size,
+                  const char *format, ...)
+    __attribute__ ((format (printf, 4, 5)));
+
+static void reply(client_t *client, const char *data, size_t size,
+                  const char *format, ...) {
+    char line[MAX_LINE];
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(line, sizeof(line) - 1, format, ap);
+    va_end(ap);
+    if (len < 0)
+        return;
+    if (len > (int)sizeof(line) - 2)
+        len = sizeof(line) - 2;
+    line[len++] = '\n';
+    pthread_mutex_lock(&client->lock);
+    if (!client->closed)
+        client->closed = !send_all(client->fd, line, len)
+                         || (size > 0 && !send_all(client->fd, data, size));
+    pthread_mutex_unlock(&client->lock);
+}
+
+/* A client that closed its end only for writing still reads replies.
+   One that closed the connection gets POLLHUP, or failed to take one. */
+static bool client_gone(client_t *client) {
+    pthread_mutex_lock(&client->lock);
+    if (!client->closed) {
+        struct pollfd fds = {.fd = client->fd, .events = 0};
+        client->closed = poll(&fds, 1, 0) > 0
+                         && (fds.revents & (POLLHUP | POLLERR | POLLNVAL));
+    }
+    bool closed = client->closed;
+    pthread_mutex_unlock(&client->lock);
+    return closed;
+}
+
+static void hold_client(client_t *client) {
+    pthread_mutex_lock(&client->lock);
+    client->refs++;
+    pthread_mutex_unlock(&client->lock);
+}
+
+static void release_client(client_t *client) {
+    pthread_mutex_lock(&client->lock);
+    int refs = --client->refs;
+    pthread_mutex_unlock(&client->lock);
+    if (refs == 0) {
+        close(client->fd);
+        pthread_mutex_destroy(&client->lock);
+        free(client);
+    }
+}
+
+/* Returns the slot of the program with id, or NULL if there is none.
+   The caller holds programs_lock. */
+static resident_t** find_program(const char *id) {
+    for (int i = 0; i < MAX_PROGRAMS; i++)
+        if (programs[i] && !strcmp(programs[i]->id, id))
+            return &programs[i];
+    return NULL;
+}
+
+static resident_t* hold_program(const char *id) {
+    pthread_mutex_lock(&programs_lock);
+    resident_t **slot = find_program(id);
+    resident_t *p = slot ? *slot : NULL;
+    if (p)
+        p->refs++;
+    pthread_mutex_unlock(&programs_lock);
+    return p;
+}
+
+static void release_program(resident_t *p) {
+    pthread_mutex_lock(&programs_lock);
+    int refs = --p->refs;
+    pthread_mutex_unlock(&programs_lock);
+    if (refs > 0)
+        return;
+    for (int e = 0; e < MAX_ENGINES; e++)
+        if (p->prepared[e].engine)
+            vm_release(&p->prepared[e]);
+    unmap_program(&p->prog);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
+
+/* What the engine made of the program, prepared by the first caller */
+static const vm_program_t* prepared_program(resident_t *p,
+                                            const engine_t *engine) {
+    vm_program_t *prepared = &p->prepared[engine - Engines];
+    pthread_mutex_lock(&p->lock);
+    if (!prepared->engine)
+        vm_prepare(engine, p->prog.code, p->prog.len, prepared);
+    pthread_mutex_unlock(&p->lock);
+    return prepared;
+}
+
+static void load(client_t *client, const char *id, const char *name) {
+    resident_t *p = calloc(1, sizeof(resident_t));
+    assert(p);
+    strcpy(p->id, id);
+    p->refs = 1; /* of the table */
+    pthread_mutex_init(&p->lock, NULL);
+    const builtin_program_t *builtin = find_builtin_program(name);
+    char error[256];
+    if (builtin) {
+        p->prog = (program_t){builtin->code, builtin->len, 0};
+    } else if (!try_map_program(name, &p->prog, error, sizeof(error))) {
+        reply(client, NULL, 0, "error cannot load %s", error);
+        release_program(p);
+        return;
+    }
+
+    pthread_mutex_lock(&programs_lock);
+    resident_t **free_slot = NULL;
+    for (int i = 0; i < MAX_PROGRAMS && !free_slot; i++)
+        if (!programs[i])
+            free_slot = &programs[i];
+    bool loaded = !find_program(id) && free_slot;
+    if (loaded)
+        *free_slot = p;
+    pthread_mutex_unlock(&programs_lock);
+    if (!loaded) {
+        reply(client, NULL, 0, "error cannot load %s as %s", name, id);
+        release_program(p);
+        return;
+    }
+    reply(client, NULL, 0, "loaded %s %u", id, p->prog.len);
+}
+
+/* Jobs still running keep the program until they are done */
+static void unload(client_t *client, const char *id) {
+    pthread_mutex_lock(&programs_lock);
+    resident_t **slot = find_program(id);
+    resident_t *p = slot ? *slot : NULL;
+    if (slot)
+        *slot = NULL;
+    pthread_mutex_unlock(&programs_lock);
+    if (!p) {
+        reply(client, NULL, 0, "error no program %s", id);
+        return;
+    }
+    release_program(p);
+    reply(client, NULL, 0, "unloaded %s", id);
+}
+
+static bool parse_number(const char *arg, long long min, long long max,
+                         long long *result) {
+    char *endptr = NULL;
+    errno = 0;
+    long long n = strtoll(arg, &endptr, 10);
+    if (errno || *endptr != '\0' || endptr == arg || n < min || n > max)
+        return false;
+    *result = n;
+    return true;
+}
+
+/* Fields after "run" are in args, tokens of the request */
+static void submit(client_t *client, char **args, int nargs) {
+    if (nargs < 4 || nargs - 4 > STACK_CAPACITY) {
+        reply(client, NULL, 0, "error run needs a tag, program, engine,"
+              " steplimit and up to %d values", STACK_CAPACITY);
+        return;
+    }
+    job_t *job = calloc(1, sizeof(job_t));
+    assert(job);
+    strcpy(job->tag, args[0]);
+    job->engine = find_engine(args[2]);
+    job->ninputs = nargs - 4;
+    bool ok = job->engine
+              && parse_number(args[3], 0, LLONG_MAX, &job->steplimit);
+    for (int i = 0; ok && i < job->ninputs; i++) {
+        long long value;
+        ok = parse_number(args[4 + i], INT32_MIN, UINT32_MAX, &value);
+        job->inputs[i] = (uint32_t)value;
+    }
+    if (!ok) {
+        reply(client, NULL, 0, "error invalid job %s", job->tag);
+        free(job);
+        return;
+    }
+    job->program = hold_program(args[1]);
+    if (!job->program) {
+        reply(client, NULL, 0, "error no program %s", args[1]);
+        free(job);
+        return;
+    }
+    hold_client(client);
+    job->client = client;
+
+    pthread_mutex_lock(&queue_lock);
+    if (queue_tail)
+        queue_tail->next = job;
+    else
+        queue_head = job;
+    queue_tail = job;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+static void handle_request(client_t *client, char *line) {
+    char *args[STACK_CAPACITY + 6];
+    int nargs = 0;
+    char *save = NULL;
+    for (char *tok = strtok_r(line, " \t\r\n", &save);
+         tok && nargs < (int)(sizeof(args) / sizeof(args[0]));
+         tok = strtok_r(NULL, " \t\r\n", &save))
+        args[nargs++] = tok;
+    if (nargs == 0)
+        return;
+    /* Ids of programs and tags of jobs are copied to fixed buffers */
+    bool is_run = !strcmp(args[0], "run");
+    if ((nargs > 1 && strlen(args[1]) > MAX_ID)
+        || (is_run && nargs > 2 && strlen(args[2]) > MAX_ID)) {
+        reply(client, NULL, 0, "error id or tag is too long");
+        return;
+    }
+    if (!strcmp(args[0], "load") && nargs == 3)
+        load(client, args[1], args[2]);
+    else if (!strcmp(args[0], "unload") && nargs == 2)
+        unload(client, args[1]);
+    else if (is_run)
+        submit(client, args + 1, nargs - 1);
+    else
+        reply(client, NULL, 0, "error unknown request %s", args[0]);
+}
+
+/* Requests of a client are read by a thread of its own */
+static void* serve_client(void *arg) {
+    client_t *client = arg;
+    int fd = dup(client->fd);
+    FILE *in = fd == -1 ? NULL : fdopen(fd, "r");
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t len;
+    while (in && (len = getline(&line, &capacity, in)) > 0) {
+        if (len > MAX_LINE) {
+            reply(client, NULL, 0, "error request is too long");
+            continue;
+        }
+        handle_request(client, line);
+    }
+    free(line);
+    if (in)
+        fclose(in);
+    else if (fd != -1)
+        close(fd);
+    release_client(client);
+    return NULL;
+}
+
+/* Takes up to JOB_BATCH jobs, waiting for the first one */
+static job_t* take_jobs(void) {
+    pthread_mutex_lock(&queue_lock);
+    while (!queue_head)
+        pthread_cond_wait(&queue_cond, &queue_lock);
+    job_t *batch = queue_head;
+    job_t *last = batch;
+    for (int i = 1; i < JOB_BATCH && last->next; i++)
+        last = last->next;
+    queue_head = last->next;
+    if (!queue_head)
+        queue_tail = NULL;
+    last->next = NULL;
+    pthread_mutex_unlock(&queue_lock);
+    return batch;
+}
+
+/* Output hook of workers, sending it as the job goes */
+static void send_output(output_buffer_t *buf) {
+    const job_t *job = buf->flush_ctx;
+    reply(job->client, buf->data, buf->size, "out %s %zu",
+          job->tag, buf->size);
+}
+
+static long long slice_end(long long steps, long long steplimit) {
+    return steplimit - steps > JOB_SLICE ? steps + JOB_SLICE : steplimit;
+}
+
+/* Runs the job in slices of JOB_SLICE steps. Returns false if it was
+   stopped at the end of one because the client is gone. */
+static bool run_job(const job_t *job, cpu_t *pcpu) {
+    if (client_gone(job->client))
+        return false;
+    const vm_program_t *program = prepared_program(job->program,
+                                                   job->engine);
+    long long limit = slice_end(0, job->steplimit);
+    vm_run_prepared(program, job->inputs, job->ninputs, limit, pcpu);
+    while (pcpu->state == Cpu_Running && pcpu->steps == limit
+           && limit < job->steplimit) {
+        if (client_gone(job->client))
+            return false;
+        limit = slice_end(pcpu->steps, job->steplimit);
+        vm_continue(program, limit, pcpu);
+    }
+    return true;
+}
+
+static void* worker(void *arg) {
+    (void)arg;
+    output_buffer_t output = {.limit = OUTPUT_CHUNK, .flush = send_output};
+    set_output_buffer(&output);
+    for (;;) {
+        job_t *batch = take_jobs();
+        while (batch) {
+            job_t *job = batch;
+            batch = job->next;
+            output.size = 0;
+            output.flush_ctx = job;
+            cpu_t cpu;
+            if (run_job(job, &cpu)) {
+                bool ok = report_cpu_state(&cpu, job->steplimit);
+                reply(job->client, output.data, output.size,
+                      "done %s %s %zu", job->tag, ok ? "ok" : "fail",
+                      output.size);
+            }
+            release_program(job->program);
+            release_client(job->client);
+            free(job);
+        }
+    }
+    return NULL;
+}
+
+static void remove_socket(int sig) {
+    unlink(socket_path); /* async-signal-safe */
+    _exit(sig == SIGTERM || sig == SIGINT ? 0 : 1);
+}
+
+static int open_socket(struct sockaddr_un *addr) {
+    if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Socket path is too long: %s\n", socket_path);
+        exit(2);
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        exit(2);
+    }
+    return fd;
+}
+
+/* Relay stdin to a running server and its replies to stdout, until the
+   server is done with all of the requests */
+static int run_client(void) {
+    struct sockaddr_un addr;
+    int fd = open_socket(&addr);
+    /* The server may be starting */
+    int attempts = 50;
+    while (connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        if ((errno != ENOENT && errno != ECONNREFUSED) || --attempts == 0) {
+            perror("connect");
+            return 2;
+        }
+        nanosleep(&(struct timespec){0, 20000000}, NULL);
+    }
+    struct pollfd fds[2] = {{.fd = fd, .events = POLLIN},
+                            {.fd = STDIN_FILENO, .events = POLLIN}};
+    bool input_open = true;
+    char buf[4096];
+    for (;;) {
+        if (poll(fds, input_open ? 2 : 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            return 2;
+        }
+        if (input_open && fds[1].revents) {
+            ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+            if (n <= 0) {
+                input_open = false;
+                shutdown(fd, SHUT_WR);
+            } else if (!send_all(fd, buf, n)) {
+                perror("send");
+                return 2;
+            }
+        }
+        if (fds[0].revents) {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n <= 0)
+                break;
+            fwrite(buf, 1, n, stdout);
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int nthreads = 0;
+    bool client = false;
+    for (int i = 1; i < argc; i++) {
+        long long n;
+        if (!strcmp(argv[i], "--help"))
+            usage_and_exit(argv[0], 0);
+        else if (!strncmp(argv[i], socket_opt, strlen(socket_opt)))
+            socket_path = argv[i] + strlen(socket_opt);
+        else if (!strncmp(argv[i], threads_opt, strlen(threads_opt))) {
+            if (!parse_number(argv[i] + strlen(threads_opt), 1, 1024, &n)) {
+                fprintf(stderr, "Invalid number: %s\n", argv[i]);
+                usage_and_exit(argv[0], 2);
+            }
+            nthreads = (int)n;
+        } else if (!strcmp(argv[i], client_opt))
+            client = true;
+        else {
+            fprintf(stderr, "Unrecognized option: %s\n", argv[i]);
+            usage_and_exit(argv[0], 2);
+        }
+    }
+    if (client)
+        return run_client();
+
+    int nengines = 0;
+    while (Engines[nengines].name)
+        nengines++;
+    assert(nengines <= MAX_ENGINES);
+    if (nthreads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = online > 0 ? (int)online : 1;
+    }
+
+    struct sockaddr_un addr;
+    int listen_fd = open_socket(&addr);
+    unlink(socket_path); /* left by a server that was killed */
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr))
+        || listen(listen_fd, SOMAXCONN)) {
+        perror(socket_path);
+        return 2;
+    }
+    struct sigaction sa = {.sa_handler = remove_socket};
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    set_output_mode(Output_Text);
+    for (int i = 0; i < nthreads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker, NULL)) {
+            fprintf(stderr, "Failed to start worker threads\n");
+            remove_socket(0);
+        }
+        pthread_detach(thread);
+    }
+
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            remove_socket(0);
+        }
+        client_t *c = calloc(1, sizeof(client_t));
+        assert(c);
+        c->fd = fd;
+        c->refs = 1; /* of the reader */
+        pthread_mutex_init(&c->lock, NULL);
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_client, c)) {
+            release_client(c);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}